@@ -35,7 +35,7 @@
 
 
 static fltype recipsamp;	// inverse of sampling rate
-static Bit16s wavtable[WAVEPREC*3];	// wave form table
+static Bit16s wavtable[WAVEPREC*3+1];	// wave form table (+1: the gathers read 32 bits)
 
 // vibrato/tremolo tables
 static Bit32s vib_table[VIBTAB_SIZE];
@@ -145,16 +145,6 @@ static fltype decrelconst[4] = {
 };
 
 
-static void operator_advance(op_type* op_pt, Bit32s vib) {
-	op_pt->wfpos = op_pt->tcount;						// waveform position
-	
-	// advance waveform time
-	op_pt->tcount += op_pt->tinc;
-	op_pt->tcount += (int64_t)(op_pt->tinc)*vib/FIXEDPT;
-
-	op_pt->generator_pos += generator_add;
-}
-
 static void operator_advance_drums(op_type* op_pt1, Bit32s vib1, op_type* op_pt2, Bit32s vib2, op_type* op_pt3, Bit32s vib3) {
 	Bit32u c1 = op_pt1->tcount/FIXEDPT;
 	Bit32u c3 = op_pt3->tcount/FIXEDPT;
@@ -305,16 +295,226 @@ static void operator_attack(op_type* op_pt) {
 }
 
 
-typedef void (*optype_fptr)(op_type*);
+// envelope generator step of one sample
+static inline void operator_eg(op_type* op_pt) {
+	switch (op_pt->op_state) {
+	case OF_TYPE_ATT:
+		operator_attack(op_pt);
+		break;
+	case OF_TYPE_DEC:
+		operator_decay(op_pt);
+		break;
+	case OF_TYPE_REL:
+	case OF_TYPE_SUS_NOKEEP:	// release-style
+		operator_release(op_pt);
+		break;
+	case OF_TYPE_SUS:			// keeping level
+		operator_sustain(op_pt);
+		break;
+	default:
+		operator_off(op_pt);
+		break;
+	}
+}
 
-optype_fptr opfuncs[6] = {
-	operator_attack,
-	operator_decay,
-	operator_release,
-	operator_sustain,	// sustain phase (keeping level)
-	operator_release,	// sustain_nokeep phase (release-style)
-	operator_off
-};
+
+/*
+	Block processing: an operator is run over the whole block at a time,
+	in passes for the envelope, the phase and the output, each of which
+	gives the same numbers as stepping the operator sample by sample
+	with operator_eg() and operator_output(). Only the output of an operator
+	with feedback depends on its previous one; everything else is
+	independent between the samples, so it is done in simple loops over
+	arrays, and the output pass is vectorised. The operators of a channel
+	are run modulator first, and the carrier takes the modulator's outputs
+	of the block.
+*/
+
+// the output pass: out[i] = operator output for the phase wfpos[i],
+// modulated by the output modin[i] of another operator (if given)
+typedef void (*opwave_fptr)(const op_type* op_pt, const Bit32u* wfpos,
+		const fltype* amp, const Bit32s* trem, const Bit32s* modin,
+		Bit32s* out, Bits n);
+
+static void operator_wave(const op_type* op_pt, const Bit32u* wfpos,
+		const fltype* amp, const Bit32s* trem, const Bit32s* modin,
+		Bit32s* out, Bits n) {
+	const Bit16s* wform = op_pt->cur_wform;
+	Bit32u wmask = op_pt->cur_wmask;
+	fltype vol = op_pt->vol;
+	Bits i;
+	for (i=0;i<n;i++) {
+		Bit32s modulator = modin ? modin[i]*FIXEDPT : 0;
+		Bit32u j = (Bit32u)((wfpos[i]+modulator)/FIXEDPT);
+		out[i] = (Bit32s)(amp[i]*vol*wform[j&wmask]*trem[i]/16.0);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+// 4 samples at a time: the waveform is gathered as 32 bit words and
+// sign extended, the doubles are multiplied in the same order as above;
+// dividing by 16.0 is exact, so is multiplying by 1/16
+static AVX2 void operator_wave_avx2(const op_type* op_pt, const Bit32u* wfpos,
+		const fltype* amp, const Bit32s* trem, const Bit32s* modin,
+		Bit32s* out, Bits n) {
+	const __m256d vol = _mm256_set1_pd(op_pt->vol);
+	const __m256d div = _mm256_set1_pd(1/16.0);
+	const __m128i wmask = _mm_set1_epi32(op_pt->cur_wmask);
+	__m128i pos, w;
+	__m256d x;
+	Bits i = 0;
+
+	for (; i+4<=n; i+=4) {
+		pos = _mm_loadu_si128((const __m128i*)(wfpos+i));
+		if (modin) pos = _mm_add_epi32(pos, _mm_slli_epi32(
+				_mm_loadu_si128((const __m128i*)(modin+i)), 16));
+		pos = _mm_and_si128(_mm_srli_epi32(pos, 16), wmask);
+		w = _mm_i32gather_epi32((const int*)op_pt->cur_wform, pos, 2);
+		w = _mm_srai_epi32(_mm_slli_epi32(w, 16), 16);
+		x = _mm256_mul_pd(_mm256_loadu_pd(amp+i), vol);
+		x = _mm256_mul_pd(x, _mm256_cvtepi32_pd(w));
+		x = _mm256_mul_pd(x, _mm256_cvtepi32_pd(
+				_mm_loadu_si128((const __m128i*)(trem+i))));
+		x = _mm256_mul_pd(x, div);
+		_mm_storeu_si128((__m128i*)(out+i), _mm256_cvttpd_epi32(x));
+	}
+	operator_wave(op_pt, wfpos+i, amp+i, trem+i, modin ? modin+i : NULL,
+			out+i, n-i);
+}
+
+#endif
+
+static opwave_fptr opwave = operator_wave;
+
+static void opwave_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) opwave = operator_wave_avx2;
+#endif
+}
+
+// the envelope can't change any more, only its step counter moves
+static bool operator_settled(const op_type* op_pt) {
+	if (op_pt->step_amp != op_pt->amp) return false;
+	switch (op_pt->op_state) {
+	case OF_TYPE_SUS:
+		return true;
+	case OF_TYPE_DEC:
+		return (op_pt->amp > op_pt->sustain_level) && (op_pt->decaymul == 1.0);
+	case OF_TYPE_REL:
+	case OF_TYPE_SUS_NOKEEP:
+		// a released operator goes off when it reaches 0, one in
+		// sustain_nokeep just stays there
+		if (op_pt->amp <= 0.00000001)
+			return (op_pt->amp == 0.0) && (op_pt->op_state == OF_TYPE_SUS_NOKEEP);
+		return (op_pt->releasemul == 1.0);
+	}
+	return false;
+}
+
+/*
+	Run an operator over a block of n samples. vib_lut is NULL if the
+	vibrato is off for the block; modin are the outputs of the modulating
+	operator, or NULL if they are all 0; feedback selects the
+	self-modulation of the first operator of a channel. out[i] is the
+	output (cval) after sample i. Returns false if all the outputs are 0.
+*/
+static bool operator_block(op_type* op_pt, const Bit32s* vib_lut,
+		const Bit32s* trem, const Bit32s* modin, bool feedback,
+		Bit32s* out, Bits n) {
+	Bit32u wfpos[BLOCKBUF_SIZE];
+	fltype amp[BLOCKBUF_SIZE];
+	Bit32u tcount = op_pt->tcount, tinc = op_pt->tinc;
+	Bit32s cval = op_pt->cval, lastcval = op_pt->lastcval;
+	Bits i, live = n;
+	bool settled = false, silent;
+	fltype max_amp = 0;
+
+	// envelope; an operator that is off stays so for the block, and
+	// neither its envelope nor its output change
+	if (op_pt->op_state == OF_TYPE_OFF) {
+		op_pt->generator_pos += (Bit32u)n*generator_add;
+		live = 0;
+	} else if (operator_settled(op_pt)) {
+		// the first step may be a big one, after the operator was off
+		op_pt->generator_pos += generator_add;
+		operator_eg(op_pt);
+		op_pt->generator_pos += (Bit32u)(n-1)*generator_add;
+		Bit32u num_steps_add = op_pt->generator_pos/FIXEDPT;
+		op_pt->cur_env_step += num_steps_add;
+		op_pt->generator_pos -= num_steps_add*FIXEDPT;
+		max_amp = fabs(op_pt->step_amp);
+		settled = true;
+	} else {
+		for (i=0;i<n;i++) {
+			op_pt->generator_pos += generator_add;
+			operator_eg(op_pt);
+			if (op_pt->op_state == OF_TYPE_OFF) {
+				op_pt->generator_pos += (Bit32u)(n-1-i)*generator_add;
+				live = i;
+				break;
+			}
+			amp[i] = op_pt->step_amp;
+			if (fabs(amp[i]) > max_amp) max_amp = fabs(amp[i]);
+		}
+	}
+	// below this level every output rounds to 0 (|wform|<=32768,
+	// trem<=FIXEDPT), which is common for released operators
+	silent = (max_amp*op_pt->vol*32768.0*FIXEDPT/16.0 < 0.5);
+
+	// phase; the positions are only needed for the output
+	if (vib_lut) {
+		for (i=0;i<n;i++) {
+			Bit32s vib = (Bit32s)((vib_lut[i]*op_pt->freq_high/8)*FIXEDPT*VIBFAC);
+			wfpos[i] = tcount;
+			tcount += tinc;
+			tcount += (int64_t)(tinc)*vib/FIXEDPT;
+		}
+		op_pt->wfpos = wfpos[n-1];
+	} else {
+		if (live && !silent)
+			for (i=0;i<live;i++) wfpos[i] = tcount + (Bit32u)i*tinc;
+		op_pt->wfpos = tcount + (Bit32u)(n-1)*tinc;
+		tcount += (Bit32u)n*tinc;
+	}
+	op_pt->tcount = tcount;
+
+	// output
+	if (live && silent) {
+		memset(out, 0, live*sizeof(out[0]));
+		lastcval = (live > 1) ? 0 : cval;
+		cval = 0;
+	} else if (live && !feedback) {
+		if (settled)
+			for (i=0;i<live;i++) amp[i] = op_pt->step_amp;
+		opwave(op_pt, wfpos, amp, trem, modin, out, live);
+		lastcval = (live > 1) ? out[live-2] : cval;
+		cval = out[live-1];
+	} else if (live) {
+		const Bit16s* wform = op_pt->cur_wform;
+		Bit32u wmask = op_pt->cur_wmask;
+		fltype vol = op_pt->vol;
+		fltype a = op_pt->step_amp;
+		for (i=0;i<live;i++) {
+			Bit32s modulator = (lastcval+cval)*op_pt->mfbi/2;
+			Bit32u j = (Bit32u)((wfpos[i]+modulator)/FIXEDPT);
+			lastcval = cval;
+			cval = (Bit32s)((settled ? a : amp[i])*vol*wform[j&wmask]*trem[i]/16.0);
+			out[i] = cval;
+		}
+	}
+	op_pt->cval = cval;
+	op_pt->lastcval = lastcval;
+	if (!live && !cval) return false;
+	if (live && silent) return false;
+	for (i=live;i<n;i++) out[i] = cval;
+	return true;
+}
 
 static void change_attackrate(Bitu regbase, op_type* op_pt) {
 	Bits attackrate = adlibreg[ARC_ATTR_DECR+regbase]>>4;
@@ -518,6 +718,8 @@ void opl_init(Bit32u samplerate) {
 #endif
 	}
 
+	opwave_init();
+
 	recipsamp = 1.0 / (fltype)int_samplerate;
 	for (i=15;i>=0;i--) {
 		frqmul[i] = (fltype)(frqmul_tab[i]*INTFREQU/(fltype)WAVEPREC*(fltype)FIXEDPT*recipsamp);
@@ -953,6 +1155,41 @@ static void clipit16(Bit32s ival, Bit16s* outval) {
 	outbufl[i] += chanval;
 #endif
 
+// add the channel outputs val*mul of a block, panned as cptr
+#if defined(OPLTYPE_IS_OPL3)
+static void chan_out(Bit32s* outbufl, Bit32s* outbufr, const op_type* cptr,
+		const Bit32s* val, Bit32s mul, Bits n) {
+#else
+static void chan_out(Bit32s* outbufl, const op_type* cptr,
+		const Bit32s* val, Bit32s mul, Bits n) {
+#endif
+	Bits i;
+#if defined(OPLTYPE_IS_OPL3)
+	if (adlibreg[0x105]&1) {
+		for (i=0;i<n;i++) {
+			Bit32s chanval = val[i]*mul;
+			outbufl[i] += chanval*cptr[0].left_pan;
+			outbufr[i] += chanval*cptr[0].right_pan;
+		}
+		return;
+	}
+#endif
+	for (i=0;i<n;i++) outbufl[i] += val[i]*mul;
+}
+
+#if defined(OPLTYPE_IS_OPL3)
+#define CHAN_OUT(val, mul) chan_out(outbufl, outbufr, cptr, val, mul, endsamples)
+#else
+#define CHAN_OUT(val, mul) chan_out(outbufl, cptr, val, mul, endsamples)
+#endif
+
+// vibrato of an operator for the block: only if enabled, and for most
+// operators only if they are not off at the start of the block
+#define VIB(o)		((o).vibrato ? vib_lut : NULL)
+#define VIB_ON(o)	(((o).vibrato && (o).op_state != OF_TYPE_OFF) ? vib_lut : NULL)
+#define TREM(o)		((o).tremolo ? trem_lut : tremval_const)
+#define IS_ON(o)	((o).op_state != OF_TYPE_OFF)
+
 void opl_getsample(Bit16s* sndptr, Bits numsamples) {
 	Bits i, endsamples;
 	op_type* cptr;
@@ -967,8 +1204,14 @@ void opl_getsample(Bit16s* sndptr, Bits numsamples) {
 	Bit32s vib_lut[BLOCKBUF_SIZE];
 	Bit32s trem_lut[BLOCKBUF_SIZE];
 	// vibrato/trmolo value table pointers
-	Bit32s *vibval1, *vibval2, *vibval3, *vibval4;
-	Bit32s *tremval1, *tremval2, *tremval3, *tremval4;
+	Bit32s *vibval1, *vibval2, *vibval4;
+	Bit32s *tremval1, *tremval2, *tremval4;
+	// operator outputs of the block, and if they are not all 0
+	Bit32s out1[BLOCKBUF_SIZE], out2[BLOCKBUF_SIZE];
+	bool act1;
+#if defined(OPLTYPE_IS_OPL3)
+	bool act2;
+#endif
 
 	Bits samples_to_process = numsamples;
 	Bits cursmp;
@@ -1002,79 +1245,24 @@ void opl_getsample(Bit16s* sndptr, Bits numsamples) {
 			cptr = &op[6];
 			if (adlibreg[ARC_FEEDBACK+6]&1) {
 				// additive synthesis
-				if (cptr[9].op_state != OF_TYPE_OFF) {
-					if (cptr[9].vibrato) {
-						vibval1 = vibval_var1;
-						for (i=0;i<endsamples;i++)
-							vibval1[i] = (Bit32s)((vib_lut[i]*cptr[9].freq_high/8)*FIXEDPT*VIBFAC);
-					} else vibval1 = vibval_const;
-					if (cptr[9].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-					else tremval1 = tremval_const;
-
-					// calculate channel output
-					for (i=0;i<endsamples;i++) {
-						operator_advance(&cptr[9],vibval1[i]);
-						opfuncs[cptr[9].op_state](&cptr[9]);
-						operator_output(&cptr[9],0,tremval1[i]);
-						
-						Bit32s chanval = cptr[9].cval*2;
-						CHANVAL_OUT
-					}
+				if (IS_ON(cptr[9])) {
+					if (operator_block(&cptr[9],VIB(cptr[9]),TREM(cptr[9]),NULL,false,out1,endsamples))
+						CHAN_OUT(out1,2);
 				}
 			} else {
 				// frequency modulation
-				if ((cptr[9].op_state != OF_TYPE_OFF) || (cptr[0].op_state != OF_TYPE_OFF)) {
-					if ((cptr[0].vibrato) && (cptr[0].op_state != OF_TYPE_OFF)) {
-						vibval1 = vibval_var1;
-						for (i=0;i<endsamples;i++)
-							vibval1[i] = (Bit32s)((vib_lut[i]*cptr[0].freq_high/8)*FIXEDPT*VIBFAC);
-					} else vibval1 = vibval_const;
-					if ((cptr[9].vibrato) && (cptr[9].op_state != OF_TYPE_OFF)) {
-						vibval2 = vibval_var2;
-						for (i=0;i<endsamples;i++)
-							vibval2[i] = (Bit32s)((vib_lut[i]*cptr[9].freq_high/8)*FIXEDPT*VIBFAC);
-					} else vibval2 = vibval_const;
-					if (cptr[0].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-					else tremval1 = tremval_const;
-					if (cptr[9].tremolo) tremval2 = trem_lut;	// tremolo enabled, use table
-					else tremval2 = tremval_const;
-
-					// calculate channel output
-					for (i=0;i<endsamples;i++) {
-						operator_advance(&cptr[0],vibval1[i]);
-						opfuncs[cptr[0].op_state](&cptr[0]);
-						operator_output(&cptr[0],(cptr[0].lastcval+cptr[0].cval)*cptr[0].mfbi/2,tremval1[i]);
-
-						operator_advance(&cptr[9],vibval2[i]);
-						opfuncs[cptr[9].op_state](&cptr[9]);
-						operator_output(&cptr[9],cptr[0].cval*FIXEDPT,tremval2[i]);
-						
-						Bit32s chanval = cptr[9].cval*2;
-						CHANVAL_OUT
-					}
+				if (IS_ON(cptr[9]) || IS_ON(cptr[0])) {
+					act1 = operator_block(&cptr[0],VIB_ON(cptr[0]),TREM(cptr[0]),NULL,true,out1,endsamples);
+					if (operator_block(&cptr[9],VIB_ON(cptr[9]),TREM(cptr[9]),(act1 ? out1 : NULL),false,out2,endsamples))
+						CHAN_OUT(out2,2);
 				}
 			}
 
 			//TomTom (j=8)
-			if (op[8].op_state != OF_TYPE_OFF) {
+			if (IS_ON(op[8])) {
 				cptr = &op[8];
-				if (cptr[0].vibrato) {
-					vibval3 = vibval_var1;
-					for (i=0;i<endsamples;i++)
-						vibval3[i] = (Bit32s)((vib_lut[i]*cptr[0].freq_high/8)*FIXEDPT*VIBFAC);
-				} else vibval3 = vibval_const;
-
-				if (cptr[0].tremolo) tremval3 = trem_lut;	// tremolo enabled, use table
-				else tremval3 = tremval_const;
-
-				// calculate channel output
-				for (i=0;i<endsamples;i++) {
-					operator_advance(&cptr[0],vibval3[i]);
-					opfuncs[cptr[0].op_state](&cptr[0]);		//TomTom
-					operator_output(&cptr[0],0,tremval3[i]);
-					Bit32s chanval = cptr[0].cval*2;
-					CHANVAL_OUT
-				}
+				if (operator_block(&cptr[0],VIB(cptr[0]),TREM(cptr[0]),NULL,false,out1,endsamples))
+					CHAN_OUT(out1,2);
 			}
 
 			//Snare/Hihat (j=7), Cymbal (j=8)
@@ -1111,13 +1299,13 @@ void opl_getsample(Bit16s* sndptr, Bits numsamples) {
 				for (i=0;i<endsamples;i++) {
 					operator_advance_drums(&op[7],vibval1[i],&op[7+9],vibval2[i],&op[8+9],vibval4[i]);
 
-					opfuncs[op[7].op_state](&op[7]);			//Hihat
+					operator_eg(&op[7]);			//Hihat
 					operator_output(&op[7],0,tremval1[i]);
 
-					opfuncs[op[7+9].op_state](&op[7+9]);		//Snare
+					operator_eg(&op[7+9]);		//Snare
 					operator_output(&op[7+9],0,tremval2[i]);
 
-					opfuncs[op[8+9].op_state](&op[8+9]);		//Cymbal
+					operator_eg(&op[8+9]);		//Cymbal
 					operator_output(&op[8+9],0,tremval4[i]);
 
 					Bit32s chanval = (op[7].cval + op[7+9].cval + op[8+9].cval)*2;
@@ -1153,295 +1341,78 @@ void opl_getsample(Bit16s* sndptr, Bits numsamples) {
 			if (adlibreg[ARC_FEEDBACK+k]&1) {
 #if defined(OPLTYPE_IS_OPL3)
 				if ((adlibreg[0x105]&1) && cptr->is_4op) {
+					// op1[fb] + ...
+					if (IS_ON(cptr[0])) {
+						if (operator_block(&cptr[0],VIB(cptr[0]),TREM(cptr[0]),NULL,true,out1,endsamples))
+							CHAN_OUT(out1,1);
+					}
 					if (adlibreg[ARC_FEEDBACK+k+3]&1) {
 						// AM-AM-style synthesis (op1[fb] + (op2 * op3) + op4)
-						if (cptr[0].op_state != OF_TYPE_OFF) {
-							if (cptr[0].vibrato) {
-								vibval1 = vibval_var1;
-								for (i=0;i<endsamples;i++)
-									vibval1[i] = (Bit32s)((vib_lut[i]*cptr[0].freq_high/8)*FIXEDPT*VIBFAC);
-							} else vibval1 = vibval_const;
-							if (cptr[0].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-							else tremval1 = tremval_const;
-
-							// calculate channel output
-							for (i=0;i<endsamples;i++) {
-								operator_advance(&cptr[0],vibval1[i]);
-								opfuncs[cptr[0].op_state](&cptr[0]);
-								operator_output(&cptr[0],(cptr[0].lastcval+cptr[0].cval)*cptr[0].mfbi/2,tremval1[i]);
-
-								Bit32s chanval = cptr[0].cval;
-								CHANVAL_OUT
-							}
+						if (IS_ON(cptr[3]) || IS_ON(cptr[9])) {
+							act1 = operator_block(&cptr[9],VIB_ON(cptr[9]),TREM(cptr[9]),NULL,false,out1,endsamples);
+							if (operator_block(&cptr[3],NULL,TREM(cptr[3]),(act1 ? out1 : NULL),false,out2,endsamples))
+								CHAN_OUT(out2,1);
 						}
 
-						if ((cptr[3].op_state != OF_TYPE_OFF) || (cptr[9].op_state != OF_TYPE_OFF)) {
-							if ((cptr[9].vibrato) && (cptr[9].op_state != OF_TYPE_OFF)) {
-								vibval1 = vibval_var1;
-								for (i=0;i<endsamples;i++)
-									vibval1[i] = (Bit32s)((vib_lut[i]*cptr[9].freq_high/8)*FIXEDPT*VIBFAC);
-							} else vibval1 = vibval_const;
-							if (cptr[9].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-							else tremval1 = tremval_const;
-							if (cptr[3].tremolo) tremval2 = trem_lut;	// tremolo enabled, use table
-							else tremval2 = tremval_const;
-
-							// calculate channel output
-							for (i=0;i<endsamples;i++) {
-								operator_advance(&cptr[9],vibval1[i]);
-								opfuncs[cptr[9].op_state](&cptr[9]);
-								operator_output(&cptr[9],0,tremval1[i]);
-
-								operator_advance(&cptr[3],0);
-								opfuncs[cptr[3].op_state](&cptr[3]);
-								operator_output(&cptr[3],cptr[9].cval*FIXEDPT,tremval2[i]);
-
-								Bit32s chanval = cptr[3].cval;
-								CHANVAL_OUT
-							}
-						}
-
-						if (cptr[3+9].op_state != OF_TYPE_OFF) {
-							if (cptr[3+9].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-							else tremval1 = tremval_const;
-
-							// calculate channel output
-							for (i=0;i<endsamples;i++) {
-								operator_advance(&cptr[3+9],0);
-								opfuncs[cptr[3+9].op_state](&cptr[3+9]);
-								operator_output(&cptr[3+9],0,tremval1[i]);
-
-								Bit32s chanval = cptr[3+9].cval;
-								CHANVAL_OUT
-							}
+						if (IS_ON(cptr[3+9])) {
+							if (operator_block(&cptr[3+9],NULL,TREM(cptr[3+9]),NULL,false,out1,endsamples))
+								CHAN_OUT(out1,1);
 						}
 					} else {
 						// AM-FM-style synthesis (op1[fb] + (op2 * op3 * op4))
-						if (cptr[0].op_state != OF_TYPE_OFF) {
-							if (cptr[0].vibrato) {
-								vibval1 = vibval_var1;
-								for (i=0;i<endsamples;i++)
-									vibval1[i] = (Bit32s)((vib_lut[i]*cptr[0].freq_high/8)*FIXEDPT*VIBFAC);
-							} else vibval1 = vibval_const;
-							if (cptr[0].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-							else tremval1 = tremval_const;
-
-							// calculate channel output
-							for (i=0;i<endsamples;i++) {
-								operator_advance(&cptr[0],vibval1[i]);
-								opfuncs[cptr[0].op_state](&cptr[0]);
-								operator_output(&cptr[0],(cptr[0].lastcval+cptr[0].cval)*cptr[0].mfbi/2,tremval1[i]);
-
-								Bit32s chanval = cptr[0].cval;
-								CHANVAL_OUT
-							}
-						}
-
-						if ((cptr[9].op_state != OF_TYPE_OFF) || (cptr[3].op_state != OF_TYPE_OFF) || (cptr[3+9].op_state != OF_TYPE_OFF)) {
-							if ((cptr[9].vibrato) && (cptr[9].op_state != OF_TYPE_OFF)) {
-								vibval1 = vibval_var1;
-								for (i=0;i<endsamples;i++)
-									vibval1[i] = (Bit32s)((vib_lut[i]*cptr[9].freq_high/8)*FIXEDPT*VIBFAC);
-							} else vibval1 = vibval_const;
-							if (cptr[9].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-							else tremval1 = tremval_const;
-							if (cptr[3].tremolo) tremval2 = trem_lut;	// tremolo enabled, use table
-							else tremval2 = tremval_const;
-							if (cptr[3+9].tremolo) tremval3 = trem_lut;	// tremolo enabled, use table
-							else tremval3 = tremval_const;
-
-							// calculate channel output
-							for (i=0;i<endsamples;i++) {
-								operator_advance(&cptr[9],vibval1[i]);
-								opfuncs[cptr[9].op_state](&cptr[9]);
-								operator_output(&cptr[9],0,tremval1[i]);
-
-								operator_advance(&cptr[3],0);
-								opfuncs[cptr[3].op_state](&cptr[3]);
-								operator_output(&cptr[3],cptr[9].cval*FIXEDPT,tremval2[i]);
-
-								operator_advance(&cptr[3+9],0);
-								opfuncs[cptr[3+9].op_state](&cptr[3+9]);
-								operator_output(&cptr[3+9],cptr[3].cval*FIXEDPT,tremval3[i]);
-
-								Bit32s chanval = cptr[3+9].cval;
-								CHANVAL_OUT
-							}
+						if (IS_ON(cptr[9]) || IS_ON(cptr[3]) || IS_ON(cptr[3+9])) {
+							act1 = operator_block(&cptr[9],VIB_ON(cptr[9]),TREM(cptr[9]),NULL,false,out1,endsamples);
+							act2 = operator_block(&cptr[3],NULL,TREM(cptr[3]),(act1 ? out1 : NULL),false,out2,endsamples);
+							if (operator_block(&cptr[3+9],NULL,TREM(cptr[3+9]),(act2 ? out2 : NULL),false,out1,endsamples))
+								CHAN_OUT(out1,1);
 						}
 					}
 					continue;
 				}
 #endif
 				// 2op additive synthesis
-				if ((cptr[9].op_state == OF_TYPE_OFF) && (cptr[0].op_state == OF_TYPE_OFF)) continue;
-				if ((cptr[0].vibrato) && (cptr[0].op_state != OF_TYPE_OFF)) {
-					vibval1 = vibval_var1;
-					for (i=0;i<endsamples;i++)
-						vibval1[i] = (Bit32s)((vib_lut[i]*cptr[0].freq_high/8)*FIXEDPT*VIBFAC);
-				} else vibval1 = vibval_const;
-				if ((cptr[9].vibrato) && (cptr[9].op_state != OF_TYPE_OFF)) {
-					vibval2 = vibval_var2;
-					for (i=0;i<endsamples;i++)
-						vibval2[i] = (Bit32s)((vib_lut[i]*cptr[9].freq_high/8)*FIXEDPT*VIBFAC);
-				} else vibval2 = vibval_const;
-				if (cptr[0].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-				else tremval1 = tremval_const;
-				if (cptr[9].tremolo) tremval2 = trem_lut;	// tremolo enabled, use table
-				else tremval2 = tremval_const;
-
-				// calculate channel output
-				for (i=0;i<endsamples;i++) {
-					// carrier1
-					operator_advance(&cptr[0],vibval1[i]);
-					opfuncs[cptr[0].op_state](&cptr[0]);
-					operator_output(&cptr[0],(cptr[0].lastcval+cptr[0].cval)*cptr[0].mfbi/2,tremval1[i]);
-
-					// carrier2
-					operator_advance(&cptr[9],vibval2[i]);
-					opfuncs[cptr[9].op_state](&cptr[9]);
-					operator_output(&cptr[9],0,tremval2[i]);
-
-					Bit32s chanval = cptr[9].cval + cptr[0].cval;
-					CHANVAL_OUT
-				}
+				if (!IS_ON(cptr[9]) && !IS_ON(cptr[0])) continue;
+				if (operator_block(&cptr[0],VIB_ON(cptr[0]),TREM(cptr[0]),NULL,true,out1,endsamples))
+					CHAN_OUT(out1,1);
+				if (operator_block(&cptr[9],VIB_ON(cptr[9]),TREM(cptr[9]),NULL,false,out1,endsamples))
+					CHAN_OUT(out1,1);
 			} else {
 #if defined(OPLTYPE_IS_OPL3)
 				if ((adlibreg[0x105]&1) && cptr->is_4op) {
 					if (adlibreg[ARC_FEEDBACK+k+3]&1) {
 						// FM-AM-style synthesis ((op1[fb] * op2) + (op3 * op4))
-						if ((cptr[0].op_state != OF_TYPE_OFF) || (cptr[9].op_state != OF_TYPE_OFF)) {
-							if ((cptr[0].vibrato) && (cptr[0].op_state != OF_TYPE_OFF)) {
-								vibval1 = vibval_var1;
-								for (i=0;i<endsamples;i++)
-									vibval1[i] = (Bit32s)((vib_lut[i]*cptr[0].freq_high/8)*FIXEDPT*VIBFAC);
-							} else vibval1 = vibval_const;
-							if ((cptr[9].vibrato) && (cptr[9].op_state != OF_TYPE_OFF)) {
-								vibval2 = vibval_var2;
-								for (i=0;i<endsamples;i++)
-									vibval2[i] = (Bit32s)((vib_lut[i]*cptr[9].freq_high/8)*FIXEDPT*VIBFAC);
-							} else vibval2 = vibval_const;
-							if (cptr[0].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-							else tremval1 = tremval_const;
-							if (cptr[9].tremolo) tremval2 = trem_lut;	// tremolo enabled, use table
-							else tremval2 = tremval_const;
-
-							// calculate channel output
-							for (i=0;i<endsamples;i++) {
-								operator_advance(&cptr[0],vibval1[i]);
-								opfuncs[cptr[0].op_state](&cptr[0]);
-								operator_output(&cptr[0],(cptr[0].lastcval+cptr[0].cval)*cptr[0].mfbi/2,tremval1[i]);
-
-								operator_advance(&cptr[9],vibval2[i]);
-								opfuncs[cptr[9].op_state](&cptr[9]);
-								operator_output(&cptr[9],cptr[0].cval*FIXEDPT,tremval2[i]);
-
-								Bit32s chanval = cptr[9].cval;
-								CHANVAL_OUT
-							}
+						if (IS_ON(cptr[0]) || IS_ON(cptr[9])) {
+							act1 = operator_block(&cptr[0],VIB_ON(cptr[0]),TREM(cptr[0]),NULL,true,out1,endsamples);
+							if (operator_block(&cptr[9],VIB_ON(cptr[9]),TREM(cptr[9]),(act1 ? out1 : NULL),false,out2,endsamples))
+								CHAN_OUT(out2,1);
 						}
 
-						if ((cptr[3].op_state != OF_TYPE_OFF) || (cptr[3+9].op_state != OF_TYPE_OFF)) {
-							if (cptr[3].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-							else tremval1 = tremval_const;
-							if (cptr[3+9].tremolo) tremval2 = trem_lut;	// tremolo enabled, use table
-							else tremval2 = tremval_const;
-
-							// calculate channel output
-							for (i=0;i<endsamples;i++) {
-								operator_advance(&cptr[3],0);
-								opfuncs[cptr[3].op_state](&cptr[3]);
-								operator_output(&cptr[3],0,tremval1[i]);
-
-								operator_advance(&cptr[3+9],0);
-								opfuncs[cptr[3+9].op_state](&cptr[3+9]);
-								operator_output(&cptr[3+9],cptr[3].cval*FIXEDPT,tremval2[i]);
-
-								Bit32s chanval = cptr[3+9].cval;
-								CHANVAL_OUT
-							}
+						if (IS_ON(cptr[3]) || IS_ON(cptr[3+9])) {
+							act1 = operator_block(&cptr[3],NULL,TREM(cptr[3]),NULL,false,out1,endsamples);
+							if (operator_block(&cptr[3+9],NULL,TREM(cptr[3+9]),(act1 ? out1 : NULL),false,out2,endsamples))
+								CHAN_OUT(out2,1);
 						}
 
 					} else {
 						// FM-FM-style synthesis (op1[fb] * op2 * op3 * op4)
-						if ((cptr[0].op_state != OF_TYPE_OFF) || (cptr[9].op_state != OF_TYPE_OFF) || 
-							(cptr[3].op_state != OF_TYPE_OFF) || (cptr[3+9].op_state != OF_TYPE_OFF)) {
-							if ((cptr[0].vibrato) && (cptr[0].op_state != OF_TYPE_OFF)) {
-								vibval1 = vibval_var1;
-								for (i=0;i<endsamples;i++)
-									vibval1[i] = (Bit32s)((vib_lut[i]*cptr[0].freq_high/8)*FIXEDPT*VIBFAC);
-							} else vibval1 = vibval_const;
-							if ((cptr[9].vibrato) && (cptr[9].op_state != OF_TYPE_OFF)) {
-								vibval2 = vibval_var2;
-								for (i=0;i<endsamples;i++)
-									vibval2[i] = (Bit32s)((vib_lut[i]*cptr[9].freq_high/8)*FIXEDPT*VIBFAC);
-							} else vibval2 = vibval_const;
-							if (cptr[0].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-							else tremval1 = tremval_const;
-							if (cptr[9].tremolo) tremval2 = trem_lut;	// tremolo enabled, use table
-							else tremval2 = tremval_const;
-							if (cptr[3].tremolo) tremval3 = trem_lut;	// tremolo enabled, use table
-							else tremval3 = tremval_const;
-							if (cptr[3+9].tremolo) tremval4 = trem_lut;	// tremolo enabled, use table
-							else tremval4 = tremval_const;
-
-							// calculate channel output
-							for (i=0;i<endsamples;i++) {
-								operator_advance(&cptr[0],vibval1[i]);
-								opfuncs[cptr[0].op_state](&cptr[0]);
-								operator_output(&cptr[0],(cptr[0].lastcval+cptr[0].cval)*cptr[0].mfbi/2,tremval1[i]);
-
-								operator_advance(&cptr[9],vibval2[i]);
-								opfuncs[cptr[9].op_state](&cptr[9]);
-								operator_output(&cptr[9],cptr[0].cval*FIXEDPT,tremval2[i]);
-
-								operator_advance(&cptr[3],0);
-								opfuncs[cptr[3].op_state](&cptr[3]);
-								operator_output(&cptr[3],cptr[9].cval*FIXEDPT,tremval3[i]);
-
-								operator_advance(&cptr[3+9],0);
-								opfuncs[cptr[3+9].op_state](&cptr[3+9]);
-								operator_output(&cptr[3+9],cptr[3].cval*FIXEDPT,tremval4[i]);
-
-								Bit32s chanval = cptr[3+9].cval;
-								CHANVAL_OUT
-							}
+						if (IS_ON(cptr[0]) || IS_ON(cptr[9]) || IS_ON(cptr[3]) || IS_ON(cptr[3+9])) {
+							act1 = operator_block(&cptr[0],VIB_ON(cptr[0]),TREM(cptr[0]),NULL,true,out1,endsamples);
+							act2 = operator_block(&cptr[9],VIB_ON(cptr[9]),TREM(cptr[9]),(act1 ? out1 : NULL),false,out2,endsamples);
+							act1 = operator_block(&cptr[3],NULL,TREM(cptr[3]),(act2 ? out2 : NULL),false,out1,endsamples);
+							if (operator_block(&cptr[3+9],NULL,TREM(cptr[3+9]),(act1 ? out1 : NULL),false,out2,endsamples))
+								CHAN_OUT(out2,1);
 						}
 					}
 					continue;
 				}
 #endif
 				// 2op frequency modulation
-				if ((cptr[9].op_state == OF_TYPE_OFF) && (cptr[0].op_state == OF_TYPE_OFF)) continue;
-				if ((cptr[0].vibrato) && (cptr[0].op_state != OF_TYPE_OFF)) {
-					vibval1 = vibval_var1;
-					for (i=0;i<endsamples;i++)
-						vibval1[i] = (Bit32s)((vib_lut[i]*cptr[0].freq_high/8)*FIXEDPT*VIBFAC);
-				} else vibval1 = vibval_const;
-				if ((cptr[9].vibrato) && (cptr[9].op_state != OF_TYPE_OFF)) {
-					vibval2 = vibval_var2;
-					for (i=0;i<endsamples;i++)
-						vibval2[i] = (Bit32s)((vib_lut[i]*cptr[9].freq_high/8)*FIXEDPT*VIBFAC);
-				} else vibval2 = vibval_const;
-				if (cptr[0].tremolo) tremval1 = trem_lut;	// tremolo enabled, use table
-				else tremval1 = tremval_const;
-				if (cptr[9].tremolo) tremval2 = trem_lut;	// tremolo enabled, use table
-				else tremval2 = tremval_const;
-
-				// calculate channel output
-				for (i=0;i<endsamples;i++) {
-					// modulator
-					operator_advance(&cptr[0],vibval1[i]);
-					opfuncs[cptr[0].op_state](&cptr[0]);
-					operator_output(&cptr[0],(cptr[0].lastcval+cptr[0].cval)*cptr[0].mfbi/2,tremval1[i]);
-
-					// carrier
-					operator_advance(&cptr[9],vibval2[i]);
-					opfuncs[cptr[9].op_state](&cptr[9]);
-					operator_output(&cptr[9],cptr[0].cval*FIXEDPT,tremval2[i]);
-
-					Bit32s chanval = cptr[9].cval;
-					CHANVAL_OUT
-				}
+				if (!IS_ON(cptr[9]) && !IS_ON(cptr[0])) continue;
+				// modulator
+				act1 = operator_block(&cptr[0],VIB_ON(cptr[0]),TREM(cptr[0]),NULL,true,out1,endsamples);
+				// carrier
+				if (operator_block(&cptr[9],VIB_ON(cptr[9]),TREM(cptr[9]),(act1 ? out1 : NULL),false,out2,endsamples))
+					CHAN_OUT(out2,1);
 			}
 		}
 
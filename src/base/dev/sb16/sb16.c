@@ -656,6 +656,7 @@ static void sb_mixer_reset(void)
     sb.mixer_regs[0x45] =
     sb.mixer_regs[0x46] =
     sb.mixer_regs[0x47] = 8 << 4;	/* 0 dB */
+    pcm_volume_changed();
 }
 
 static int num_to_idx(int num, int arr[], int len)
@@ -1257,6 +1258,7 @@ static void sb_mixer_write(Bit8u value)
 	break;
     }
 
+    pcm_volume_changed();
     sb.busy = 1;
 }
 
@@ -54,6 +54,7 @@
 #include "video.h"
 #include "timers.h"  // for reset_idle()
 #include "memory.h"
+#include "render.h"
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -246,6 +247,8 @@ void CRTC_write_value(unsigned char data)
       /* this shift should really be a rotation, depending on mode control bit 5 */
       crtc_deb("CRTC_write_value: Start Address = 0x%04x, low changed\n", vga.display_start);
       vga.reconfig.mem = 1;
+      /* page flip; the high byte is written first */
+      render_frame_mark();
       break;
 
     case 0x0e:		/* Cursor Location High */
@@ -68,6 +68,7 @@
 #include "emu.h"
 #include "vgaemu.h"
 #include "timers.h"
+#include "render.h"
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -360,6 +361,8 @@ unsigned char Misc_get_input_status_1(void)
     if(tdiff > vvfreq) {
       /* We're in vertical retrace?  If so, set VR and DE flags */
       vretrace = 0x09; t_vretrace = t;
+      /* the program waits for it, so its frame is probably done */
+      render_frame_mark();
     }
     else {
       /* The timer can't be relied upon for the very short intervals necessary
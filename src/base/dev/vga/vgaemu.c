@@ -192,6 +192,28 @@
 #define NONE	VGA_PROT_NONE
 #define DEF_PROT (vga.inst_emu==EMU_ALL_INST ? NONE : RO)
 
+/* granularity of vga.mem.sub_dirty */
+#define VGA_CHUNK_SHIFT 8
+#define VGA_CHUNK_SIZE (1 << VGA_CHUNK_SHIFT)
+#define VGA_CHUNKS (PAGE_SIZE >> VGA_CHUNK_SHIFT)
+
+/*
+ * With $_X_vga_unprotect = N, a page dirty in N consecutive updates is
+ * no longer write protected after the update, saving a fault per page
+ * and frame for programs that redraw everything. Instead such pages are
+ * compared with the shadow at every refresh in _is_dirty(), and go back
+ * to write faults after VGA_QUIET_UPDATES refreshes without change.
+ */
+#define VGA_QUIET_UPDATES 16
+
+static struct {
+  unsigned update;	/* last update the page was dirty in */
+  unsigned char streak;	/* consecutive updates it was dirty in */
+  unsigned char quiet;	/* refreshes without change while unprotected */
+  unsigned char unprot;	/* left writable */
+} *page_heat;
+static unsigned vga_update_count, vga_unprot_pages;
+
 /*
  * We add PROT_EXEC just because pages should be executable. Of course
  * Intel's x86 processors do not all support non-executable pages, but anyway...
@@ -263,6 +285,10 @@
 #include <errno.h>
 #include <pthread.h>
 #include <limits.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "cpu.h"		/* root@sjoerd: for context structure */
 #include "emu.h"
 #include "int.h"
@@ -294,6 +320,7 @@ static int vga_emu_map(unsigned, unsigned);
 static int _vga_emu_adjust_protection(unsigned page, unsigned mapped_page,
 	int prot, int dirty);
 static void _vgaemu_dirty_page(int page, int dirty);
+static void _vgaemu_dirty_chunks(int page, unsigned mask);
 #if 0
 static int vgaemu_unmap(unsigned);
 #endif
@@ -837,8 +864,21 @@ void vga_mark_dirty(dosaddr_t vga_addr, int len)
 {
   unsigned vga_page;
   for (vga_page = vga_addr >> PAGE_SHIFT;
-       vga_page <= (vga_addr + len - 1) >> PAGE_SHIFT; vga_page++)
-    vgaemu_dirty_page(vga_page, 1);
+       vga_page <= (vga_addr + len - 1) >> PAGE_SHIFT; vga_page++) {
+    unsigned lo, hi;
+
+    if (!vga.mem.sub_dirty) {
+      vgaemu_dirty_page(vga_page, 1);
+      continue;
+    }
+    /* the written chunks of this page */
+    lo = _max(vga_addr, vga_page << PAGE_SHIFT) & (PAGE_SIZE - 1);
+    hi = (_min(vga_addr + len, (vga_page + 1) << PAGE_SHIFT) - 1) & (PAGE_SIZE - 1);
+    pthread_mutex_lock(&prot_mtx);
+    _vgaemu_dirty_chunks(vga_page, (2U << (hi >> VGA_CHUNK_SHIFT)) -
+			 (1U << (lo >> VGA_CHUNK_SHIFT)));
+    pthread_mutex_unlock(&prot_mtx);
+  }
 }
 
 void vga_write(dosaddr_t addr, unsigned char val)
@@ -1140,6 +1180,7 @@ int vga_emu_fault(dosaddr_t lin_addr, unsigned err, cpuctx_t *scp)
   }
 
   if(vga_page < vga.mem.pages) {
+    render_stats.faults++;
     if(!vga.inst_emu) {
       /* Normal: make the display page writeable then mark it dirty */
       vga_emu_adjust_protection(vga_page, page_fault, RW, 1);
@@ -1414,10 +1455,23 @@ int vga_emu_adjust_protection(unsigned page, unsigned mapped_page, int prot,
   return ret;
 }
 
+/* CPU time spent collecting KVM dirty pages, per method */
+static struct {
+  unsigned long long calls, ns;
+} kvm_sync_stats[2];
+
+static void vga_kvm_dirty_page(unsigned page, void *arg)
+{
+  vga_mapping_type *vmt = arg;
+  _vgaemu_dirty_page(vmt->first_page + page, 1);
+}
+
 static void _vga_kvm_sync_dirty_map(unsigned mapping)
 {
   unsigned i;
+  int ring;
   dosaddr_t base;
+  struct timespec t0, t1;
 
   if (config.cpu_vm_dpmi != CPUVM_KVM) {
     if (config.cpu_vm != CPUVM_KVM)
@@ -1434,10 +1488,21 @@ static void _vga_kvm_sync_dirty_map(unsigned mapping)
   if (base == 0)
     return;
 
-  kvm_get_dirty_map(base, vga.mem.dirty_bitmap);
-  for (i = 0; i < vga.mem.map[mapping].pages; i++)
-    if (test_bit(i, vga.mem.dirty_bitmap))
-       _vgaemu_dirty_page(vga.mem.map[mapping].first_page + i, 1);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+  ring = kvm_for_each_dirty_page(base, vga.mem.map[mapping].pages,
+				 vga_kvm_dirty_page, &vga.mem.map[mapping]);
+  if (!ring) {
+    kvm_get_dirty_map(base, vga.mem.dirty_bitmap);
+    for (i = 0; i < vga.mem.map[mapping].pages; i++)
+      if (test_bit(i, vga.mem.dirty_bitmap))
+         _vgaemu_dirty_page(vga.mem.map[mapping].first_page + i, 1);
+  }
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+  /* -1: the ring broke, the main thread will stop on it */
+  ring = ring != 0;
+  kvm_sync_stats[ring].calls++;
+  kvm_sync_stats[ring].ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+    (t1.tv_nsec - t0.tv_nsec);
 }
 
 /*
@@ -1707,6 +1772,18 @@ int vga_emu_pre_init(void)
     config.exitearly = 1;
     return 1;
   }
+  if (config.vga_subpage || config.vga_unprotect) {
+    vga.mem.sub_dirty = calloc(vga.mem.pages, sizeof(*vga.mem.sub_dirty));
+    vga.mem.shadow = malloc(vga.mem.size);
+    if (!vga.mem.sub_dirty || !vga.mem.shadow) {
+      error("vga_emu_init: not enough memory for sub-page dirty tracking\n");
+      free(vga.mem.sub_dirty);
+      free(vga.mem.shadow);
+      vga.mem.sub_dirty = NULL;
+      vga.mem.shadow = NULL;
+    } else if (config.vga_unprotect)
+      page_heat = calloc(vga.mem.pages, sizeof(*page_heat));
+  }
   dirty_all_video_pages();		/* all need an update */
 
   if(
@@ -1798,6 +1875,13 @@ static int vga_emu_post_init(void)
 
 void vga_emu_done(void)
 {
+  int i;
+
+  for (i = 0; i < 2; i++)
+    if (kvm_sync_stats[i].calls)
+      vga_msg("vga_emu_done: KVM dirty %s: %llu syncs, %.2f us CPU each\n",
+	      i ? "ring" : "bitmap", kvm_sync_stats[i].calls,
+	      kvm_sync_stats[i].ns / 1000.0 / kvm_sync_stats[i].calls);
   if (vga.mem.lfb_base) {
     unalias_mapping_pa(MAPPING_DPMI, VGAEMU_PHYS_LFB_BASE, vga.mem.size);
     smfree(&main_pool, MEM_BASE32(vga.mem.lfb_base));
@@ -1978,12 +2062,216 @@ static int __vga_emu_update(vga_emu_update_type *veut, unsigned display_start,
   return j;
 }
 
+/*
+ * Sub-page variant of __vga_emu_update() for the packed pixel modes,
+ * used with $_X_vga_subpage. vga.mem.sub_dirty[] holds a mask of
+ * written 256 byte chunks for every dirty page; 0 means unknown (the
+ * page faulted or was reported by KVM) and is resolved by comparing
+ * the page with vga.mem.shadow, 0xffff means the whole page. Returned
+ * areas are runs of dirty chunks, and `pos' counts chunks.
+ */
+static int shadow_stale = 1;
+/* page last resolved in this update and not written since, so that the
+   runs after the first one in a page don't protect and compare it again */
+static int sub_resolved_page = -1;
+
+static int vga_subpage_active(void)
+{
+  return vga.mem.sub_dirty && vga.mem.planes == 1 &&
+    (vga.mode_type == P8 || (vga.mode_type >= P15 && vga.mode_type <= P32));
+}
+
+/* writes fault only without instremu, and KVM doesn't use the protection */
+static int vga_unprotect_active(void)
+{
+  return page_heat && !vga.inst_emu && config.cpu_vm != CPUVM_KVM &&
+    config.cpu_vm_dpmi != CPUVM_KVM;
+}
+
+/* mask of the chunks of page that differ from the shadow */
+static unsigned vga_shadow_diff(unsigned page)
+{
+  const unsigned char *p = vga.mem.base + (page << PAGE_SHIFT);
+  const unsigned char *s = vga.mem.shadow + (page << PAGE_SHIFT);
+  unsigned mask = 0;
+  int k;
+
+#ifdef __SSE2__
+  for (k = 0; k < VGA_CHUNKS; k++) {
+    const __m128i *a = (const __m128i *)(p + (k << VGA_CHUNK_SHIFT));
+    const __m128i *b = (const __m128i *)(s + (k << VGA_CHUNK_SHIFT));
+    __m128i d = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i < VGA_CHUNK_SIZE / sizeof(__m128i); i++)
+      d = _mm_or_si128(d, _mm_xor_si128(_mm_load_si128(a + i),
+					_mm_loadu_si128(b + i)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_setzero_si128())) != 0xffff)
+      mask |= 1 << k;
+  }
+#else
+  for (k = 0; k < VGA_CHUNKS; k++)
+    if (memcmp(p + (k << VGA_CHUNK_SHIFT), s + (k << VGA_CHUNK_SHIFT),
+	       VGA_CHUNK_SIZE))
+      mask |= 1 << k;
+#endif
+  return mask;
+}
+
+/* count the page as dirty in this update; returns 1 if it is to stay
+   writable */
+static int vga_page_heat(unsigned page)
+{
+  if (!vga_unprotect_active())
+    return 0;
+  if (page_heat[page].update != vga_update_count) {
+    if (page_heat[page].update == vga_update_count - 1) {
+      if (page_heat[page].streak < 255)
+	page_heat[page].streak++;
+    } else
+      page_heat[page].streak = 1;
+    page_heat[page].update = vga_update_count;
+  }
+  page_heat[page].quiet = 0;
+  if (!page_heat[page].unprot && page_heat[page].streak >= config.vga_unprotect) {
+    page_heat[page].unprot = 1;
+    vga_unprot_pages++;
+  }
+  return page_heat[page].unprot;
+}
+
+/* compare the writable pages with the shadow, once per refresh */
+static void vga_scan_unprotected(void)
+{
+  unsigned page;
+  int active;
+
+  vga_update_count++;
+  if (!vga_unprot_pages)
+    return;
+  active = vga_subpage_active() && vga_unprotect_active();
+  for (page = 0; page < vga.mem.pages; page++) {
+    if (!page_heat[page].unprot || vga.mem.dirty_map[page])
+      continue;
+    if (active && vga_shadow_diff(page)) {
+      _vgaemu_dirty_page(page, 1);
+      continue;
+    }
+    if (++page_heat[page].quiet >= VGA_QUIET_UPDATES || !active) {
+      _vga_emu_adjust_protection(page, 0, DEF_PROT, 0);
+      page_heat[page].unprot = 0;
+      page_heat[page].streak = 0;
+      vga_unprot_pages--;
+      /* catch what was written since the compare above */
+      if (vga_shadow_diff(page))
+	_vgaemu_dirty_page(page, 1);
+    }
+  }
+}
+
+/* write protect a dirty page again, unless it is hot, and return its
+   dirty chunk mask */
+static unsigned vga_sub_resolve(unsigned page)
+{
+  unsigned mask = vga.mem.sub_dirty[page];
+
+  if (page == sub_resolved_page)
+    return mask;
+  if (vga_page_heat(page))
+    _vgaemu_dirty_page(page, 0);
+  else
+    _vga_emu_adjust_protection(page, 0, DEF_PROT, 0);
+  /* later writes fault again and set the page unknown, or are found by
+     vga_scan_unprotected(), so they can't be lost between the compare
+     below and the update */
+  if (!mask)
+    mask = vga_shadow_diff(page);
+  vga.mem.dirty_map[page] = mask != 0;
+  vga.mem.sub_dirty[page] = mask;
+  sub_resolved_page = page;
+  return mask;
+}
+
+static int __vga_emu_update_sub(vga_emu_update_type *veut, unsigned display_start,
+    unsigned display_end, int pos)
+{
+  unsigned c, e, end, page, mask, max_len;
+
+  if (shadow_stale) {
+    /* the clean pages were last shown as they are now */
+    memcpy(vga.mem.shadow, vga.mem.base, vga.mem.size);
+    for (page = 0; page < vga.mem.pages; page++)
+      if (vga.mem.dirty_map[page])
+	vga.mem.sub_dirty[page] = 0xffff;
+    shadow_stale = 0;
+  }
+
+  if (pos == -1) {
+    pos = display_start >> VGA_CHUNK_SHIFT;
+    sub_resolved_page = -1;
+  }
+  end = ((display_end - 1) >> VGA_CHUNK_SHIFT) + 1;
+
+  /* first dirty chunk */
+  for (c = pos; c < end; c = (page + 1) * VGA_CHUNKS) {
+    page = c / VGA_CHUNKS;
+    if (!vga.mem.dirty_map[page])
+      continue;
+    mask = vga_sub_resolve(page) >> (c % VGA_CHUNKS);
+    if (mask) {
+      c += __builtin_ctz(mask);
+      break;
+    }
+  }
+  if (c >= end)
+    return -1;
+
+  /* up to the next clean one, updating the shadow as we go */
+  for (e = c; e < end; e++) {
+    page = e / VGA_CHUNKS;
+    if (e % VGA_CHUNKS == 0 && e != c &&
+	(!vga.mem.dirty_map[page] || !vga_sub_resolve(page)))
+      break;
+    mask = 1 << (e % VGA_CHUNKS);
+    if (!(vga.mem.sub_dirty[page] & mask))
+      break;
+    memcpy(vga.mem.shadow + (e << VGA_CHUNK_SHIFT),
+	   vga.mem.base + (e << VGA_CHUNK_SHIFT), VGA_CHUNK_SIZE);
+    vga.mem.sub_dirty[page] &= ~mask;
+    if (!vga.mem.sub_dirty[page])
+      vga.mem.dirty_map[page] = 0;
+  }
+
+  veut->update_start = c << VGA_CHUNK_SHIFT;
+  veut->update_len = (e - c) << VGA_CHUNK_SHIFT;
+  if (veut->update_start < display_start) {
+    veut->update_len -= display_start - veut->update_start;
+    veut->update_start = display_start;
+  }
+  max_len = display_end - veut->update_start;
+  if (veut->update_len > max_len)
+    veut->update_len = max_len;
+
+  vga_deb_update("vga_emu_update: update_start = %d, update_len = %d, update_pos = %d\n",
+    veut->update_start,
+    veut->update_len,
+    pos << VGA_CHUNK_SHIFT
+  );
+
+  return e;
+}
+
 int vga_emu_update(vga_emu_update_type *veut, unsigned display_start,
     unsigned display_end, int pos)
 {
   int ret;
   pthread_mutex_lock(&prot_mtx);
-  ret = __vga_emu_update(veut, display_start, display_end, pos);
+  if (vga_subpage_active())
+    ret = __vga_emu_update_sub(veut, display_start, display_end, pos);
+  else {
+    ret = __vga_emu_update(veut, display_start, display_end, pos);
+    shadow_stale = 1;
+  }
   pthread_mutex_unlock(&prot_mtx);
   return ret;
 }
@@ -2524,6 +2812,8 @@ static int _is_dirty(void)
 
   for(i = 0; i < VGAEMU_MAX_MAPPINGS; i++)
     _vga_kvm_sync_dirty_map(i);
+  if (page_heat)
+    vga_scan_unprotected();
 
   if (vga.mem.dirty_map) {
     for (i = 0; i < vga.mem.pages; i++) {
@@ -2660,6 +2950,8 @@ void dirty_all_video_pages(void)
   pthread_mutex_lock(&prot_mtx);
   if (vga.mem.dirty_map)
     memset(vga.mem.dirty_map, 1, vga.mem.pages);
+  if (vga.mem.sub_dirty)
+    memset(vga.mem.sub_dirty, 0xff, vga.mem.pages * sizeof(*vga.mem.sub_dirty));
   pthread_mutex_unlock(&prot_mtx);
 }
 
@@ -2674,6 +2966,15 @@ static void _vgaemu_dirty_page(int page, int dirty)
   v_printf("vgaemu: set page %i %s (%i)\n", page, dirty ? "dirty" : "clean",
       vga.mem.dirty_map[page]);
   /* prot_mtx should be locked by caller */
+  if (page == sub_resolved_page)
+    sub_resolved_page = -1;
+  /* written through the mapping: which chunks is unknown, unless the
+     whole page is to be updated anyway */
+  if (vga.mem.sub_dirty &&
+      (!vga.mem.dirty_map[page] || vga.mem.sub_dirty[page] != 0xffff))
+    vga.mem.sub_dirty[page] = 0;
+  if (dirty && !vga.mem.dirty_map[page])
+    render_stats.pages++;
   vga.mem.dirty_map[page] = dirty;
 
   if(vga.mem.planes == 4) {	/* MODE_X or PL4 */
@@ -2711,6 +3012,25 @@ static void _vgaemu_dirty_page(int page, int dirty)
   }
 }
 
+/* dirty page with only the chunks in mask written */
+static void _vgaemu_dirty_chunks(int page, unsigned mask)
+{
+  int was_dirty;
+  unsigned old;
+
+  if (page >= vga.mem.pages) {
+    _vgaemu_dirty_page(page, 1);	/* complains */
+    return;
+  }
+  was_dirty = vga.mem.dirty_map[page];
+  old = vga.mem.sub_dirty[page];
+  _vgaemu_dirty_page(page, 1);
+  if (!was_dirty)
+    vga.mem.sub_dirty[page] = mask;
+  else if (old)
+    vga.mem.sub_dirty[page] = old | mask;
+}
+
 void vgaemu_dirty_page(int page, int dirty)
 {
   pthread_mutex_lock(&prot_mtx);
@@ -28,6 +28,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <linux/kvm.h>
@@ -156,6 +158,73 @@ static struct kvm_sregs sregs;
 #define MAXSLOT 400
 static struct kvm_userspace_memory_region maps[MAXSLOT];
 
+/* registers are passed in the shared kvm_run area instead of through
+   KVM_[GS]ET_[S]REGS ioctls */
+#ifdef KVM_SYNC_X86_REGS
+#define KVM_SYNC_MASK (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS)
+static int kvm_sync_regs;
+#else
+#define kvm_sync_regs 0
+#endif
+
+/* exits by reason, with the time spent outside the guest for them */
+enum { KX_HLT, KX_SIGNAL, KX_MMIO, KX_IRQWIN, KX_RINGFULL, KX_MAX };
+static const char *kx_names[KX_MAX] = { "hlt", "signal", "mmio", "irq window",
+					"ring full" };
+static struct {
+  unsigned long long count, ns;
+} kx_stats[KX_MAX];
+static unsigned long long kx_regsets, kx_regioctls;
+static int kx_last = -1;
+static unsigned long long kx_time;
+
+static unsigned long long kx_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* charge the time since the last exit to its reason, just before
+   re-entering the guest; the exits are only timed if kvm_done() is
+   going to print the stats */
+static inline void kx_enter(void)
+{
+  if (kx_last >= 0)
+    kx_stats[kx_last].ns += kx_now() - kx_time;
+  kx_last = -1;
+}
+
+static inline void kx_exit(int reason)
+{
+  kx_stats[reason].count++;
+  if (!debug_level('Q'))
+    return;
+  kx_last = reason;
+  kx_time = kx_now();
+}
+
+/* Per-vCPU dirty ring: the kernel appends the pages written in slots with
+   KVM_MEM_LOG_DIRTY_PAGES to a ring mapped after kvm_run, instead of
+   setting bits in a per-slot bitmap. The entries are collected into
+   dirty_list (guest page frames, deduplicated by dirty_pending), and
+   handed out per address range by kvm_for_each_dirty_page(), so the cost
+   follows the number of written pages rather than the slot size.
+   That can run in the render thread, so dirty_mtx also covers the
+   changes to maps[] the entries are resolved against. */
+#ifdef KVM_CAP_DIRTY_LOG_RING
+#define DIRTY_RING_ENTRIES 4096
+static struct kvm_dirty_gfn *dirty_gfns;
+static unsigned dirty_ring_size, dirty_ring_next;
+static int dirty_ring;
+#else
+#define dirty_ring 0
+#endif
+static unsigned char *dirty_pending;
+static unsigned *dirty_list;
+static unsigned dirty_list_len, dirty_list_size;
+static pthread_mutex_t dirty_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 static int init_kvm_vcpu(void);
 
 #if !defined(DISABLE_SYSTEM_WA) || !defined(KVM_CAP_IMMEDIATE_EXIT)
@@ -484,6 +553,26 @@ static int init_kvm_vcpu(void)
     return 0;
   }
   run->exit_reason = KVM_EXIT_INTR;
+#ifdef KVM_SYNC_X86_REGS
+  ret = ioctl(kvmfd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+  kvm_sync_regs = ret > 0 && (ret & KVM_SYNC_MASK) == KVM_SYNC_MASK;
+  if (kvm_sync_regs)
+    run->kvm_valid_regs = KVM_SYNC_MASK;
+  Q_printf("KVM: register sync through kvm_run %s\n",
+	   kvm_sync_regs ? "enabled" : "unsupported");
+#endif
+#ifdef KVM_CAP_DIRTY_LOG_RING
+  if (dirty_ring) {
+    dirty_ring_size = DIRTY_RING_ENTRIES;
+    dirty_gfns = mmap(NULL, dirty_ring_size * sizeof(struct kvm_dirty_gfn),
+		      PROT_READ | PROT_WRITE, MAP_SHARED, vcpufd,
+		      KVM_DIRTY_LOG_PAGE_OFFSET * PAGE_SIZE);
+    if (dirty_gfns == MAP_FAILED) {
+      perror("KVM: mmap dirty ring");
+      return 0;
+    }
+  }
+#endif
   return 1;
 }
 
@@ -539,6 +628,27 @@ int init_kvm_cpu(void)
     return 0;
   }
 
+#ifdef KVM_CAP_DIRTY_LOG_RING
+  /* must be enabled before the vCPU is created; the bitmap interface
+     (KVM_GET_DIRTY_LOG) is unavailable once it is */
+  ret = ioctl(vmfd, KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING);
+  if (ret >= (int)(DIRTY_RING_ENTRIES * sizeof(struct kvm_dirty_gfn))) {
+    struct kvm_enable_cap cap = {0};
+    cap.cap = KVM_CAP_DIRTY_LOG_RING;
+    cap.args[0] = DIRTY_RING_ENTRIES * sizeof(struct kvm_dirty_gfn);
+    /* one bit per guest page frame of the 4GB physical space;
+       without it stay with the bitmap interface */
+    dirty_pending = calloc(1, (1UL << (32 - PAGE_SHIFT)) / CHAR_BIT);
+    if (dirty_pending)
+      dirty_ring = ioctl(vmfd, KVM_ENABLE_CAP, &cap) == 0;
+    if (!dirty_ring) {
+      free(dirty_pending);
+      dirty_pending = NULL;
+    }
+  }
+  Q_printf("KVM: dirty ring %s\n", dirty_ring ? "enabled" : "unsupported");
+#endif
+
   cpuid = malloc(sizeof(*cpuid) + nent * sizeof(cpuid->entries[0]));
   memset(cpuid, 0, sizeof(*cpuid) + nent * sizeof(cpuid->entries[0]));	// valgrind
   cpuid->nent = nent;
@@ -647,11 +757,97 @@ static void mmap_kvm_no_overlap(unsigned targ, void *addr, size_t mapsize, int f
   /* NOTE: the actual EPT update is delayed to set_kvm_memory_regions */
 }
 
+/* move the entries the vCPU pushed to the dirty ring into dirty_list;
+   must be called before maps[] changes, as the entries are slot relative.
+   dirty_mtx must be held. Returns -1 if the ring could not be reset. */
+static int kvm_collect_dirty_ring(void)
+{
+#ifdef KVM_CAP_DIRTY_LOG_RING
+  int n = 0;
+
+  if (!dirty_gfns)
+    return 0;
+  for (;;) {
+    struct kvm_dirty_gfn *e = &dirty_gfns[dirty_ring_next & (dirty_ring_size - 1)];
+    unsigned slot, gfn;
+
+    if (!(__atomic_load_n(&e->flags, __ATOMIC_ACQUIRE) & KVM_DIRTY_GFN_F_DIRTY))
+      break;
+    slot = e->slot & 0xffff;
+    if (slot < MAXSLOT && e->offset < (maps[slot].memory_size >> PAGE_SHIFT)) {
+      gfn = (maps[slot].guest_phys_addr >> PAGE_SHIFT) + e->offset;
+      if (!test_bit(gfn, dirty_pending)) {
+	set_bit(gfn, dirty_pending);
+	if (dirty_list_len == dirty_list_size) {
+	  dirty_list_size = dirty_list_size ? 2 * dirty_list_size : 256;
+	  dirty_list = realloc(dirty_list, dirty_list_size * sizeof(*dirty_list));
+	}
+	dirty_list[dirty_list_len++] = gfn;
+      }
+    }
+    __atomic_store_n(&e->flags, KVM_DIRTY_GFN_F_RESET, __ATOMIC_RELEASE);
+    dirty_ring_next++;
+    n++;
+  }
+  if (n && ioctl(vmfd, KVM_RESET_DIRTY_RINGS, 0) == -1) {
+    perror("KVM: KVM_RESET_DIRTY_RINGS");
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/* main thread, around changes to maps[] */
+static void kvm_maps_lock(void)
+{
+  pthread_mutex_lock(&dirty_mtx);
+  if (kvm_collect_dirty_ring() == -1) {
+    pthread_mutex_unlock(&dirty_mtx);
+    leavedos_main(99);
+  }
+}
+
+static void kvm_maps_unlock(void)
+{
+  pthread_mutex_unlock(&dirty_mtx);
+}
+
+/* Call fn(page, arg) for every page in [base, base + npages pages) written
+ * by the guest since the last call covering it; page is relative to base.
+ * Returns 0 if the dirty ring is unavailable, in which case the caller
+ * must use kvm_get_dirty_map(), and -1 if the ring could not be reset;
+ * the pages collected before that are still passed to fn.
+ */
+int kvm_for_each_dirty_page(dosaddr_t base, unsigned npages,
+			    void (*fn)(unsigned page, void *arg), void *arg)
+{
+  unsigned i, j, first = base >> PAGE_SHIFT;
+  int ret;
+
+  if (!dirty_ring)
+    return 0;
+  pthread_mutex_lock(&dirty_mtx);
+  ret = kvm_collect_dirty_ring() == -1 ? -1 : 1;
+  for (i = j = 0; i < dirty_list_len; i++) {
+    unsigned gfn = dirty_list[i];
+    if (gfn - first < npages) {
+      clear_bit(gfn, dirty_pending);
+      fn(gfn - first, arg);
+    } else
+      dirty_list[j++] = gfn;
+  }
+  dirty_list_len = j;
+  pthread_mutex_unlock(&dirty_mtx);
+  return ret;
+}
+
 static void do_munmap_kvm(dosaddr_t targ, size_t mapsize)
 {
   /* unmaps KVM regions from targ to targ+mapsize, taking care of overlaps
-     NOTE: the actual EPT update is delayed to set_kvm_memory_regions */
+     NOTE: the actual EPT update is delayed to set_kvm_memory_regions
+     Call between kvm_maps_lock() and kvm_maps_unlock(). */
   int slot;
+
   for (slot = 0; slot < MAXSLOT; slot++) {
     struct kvm_userspace_memory_region *region = &maps[slot];
     size_t sz = region->memory_size;
@@ -682,8 +878,10 @@ void mmap_kvm(int cap, unsigned phys_addr, size_t mapsize, void *addr, dosaddr_t
 
   assert(cap & (MAPPING_INIT_LOWRAM|MAPPING_LOWMEM|MAPPING_KVM|MAPPING_VGAEMU));
   /* with KVM we need to manually remove/shrink existing mappings */
+  kvm_maps_lock();
   do_munmap_kvm(phys_addr, mapsize);
   mmap_kvm_no_overlap(phys_addr, addr, mapsize, 0);
+  kvm_maps_unlock();
   /* monitor dirty pages on regular low ram for JIT */
   if ((cap & MAPPING_LOWMEM) && IS_EMU_JIT())
     kvm_set_dirty_log(phys_addr, mapsize);
@@ -738,8 +936,10 @@ void kvm_set_readonly(dosaddr_t base, dosaddr_t size)
   struct kvm_userspace_memory_region *p = kvm_get_memory_region(base, size);
   void *addr = (void *)((uintptr_t)(p->userspace_addr +
 				    (base - p->guest_phys_addr)));
+  kvm_maps_lock();
   do_munmap_kvm(base, size);
   mmap_kvm_no_overlap(base, addr, size, KVM_MEM_READONLY);
+  kvm_maps_unlock();
 }
 
 void kvm_set_mmio(dosaddr_t base, dosaddr_t size, int on)
@@ -747,14 +947,17 @@ void kvm_set_mmio(dosaddr_t base, dosaddr_t size, int on)
   struct kvm_userspace_memory_region *p = kvm_get_memory_region(base, size);
   assert(p->flags & KVM_MEM_LOG_DIRTY_PAGES);
   if (on == (p->flags == KVM_MEM_LOG_DIRTY_PAGES)) {
-    uint64_t region_size = p->memory_size;
+    struct kvm_userspace_memory_region region;
+    kvm_maps_lock();
     p->flags = KVM_MEM_LOG_DIRTY_PAGES;
-    if (on) {
-      p->memory_size = 0;
+    if (on)
       p->flags |= KVM_MEM_READONLY;
-    }
-    set_kvm_memory_region(p);
-    p->memory_size = region_size;
+    region = *p;
+    kvm_maps_unlock();
+    /* the slot is deleted for now, maps[] keeps its size */
+    if (on)
+      region.memory_size = 0;
+    set_kvm_memory_region(&region);
   }
 }
 
@@ -768,8 +971,15 @@ void kvm_set_dirty_log(dosaddr_t base, dosaddr_t size)
   struct kvm_userspace_memory_region *p = kvm_get_memory_region(base, size);
   void *addr = (void *)((uintptr_t)(p->userspace_addr +
 				    (base - p->guest_phys_addr)));
+  kvm_maps_lock();
   do_munmap_kvm(base, size);
   mmap_kvm_no_overlap(base, addr, size, KVM_MEM_LOG_DIRTY_PAGES);
+  kvm_maps_unlock();
+}
+
+static void kvm_dirty_bit(unsigned page, void *arg)
+{
+  set_bit(page, arg);
 }
 
 /* get dirty bitmap for memory region containing base.
@@ -783,6 +993,13 @@ void kvm_get_dirty_map(dosaddr_t base, unsigned char *bitmap)
     kvm_get_memory_region(base, PAGE_SIZE);
 
   assert(p->flags & KVM_MEM_LOG_DIRTY_PAGES);
+  if (dirty_ring) {
+    /* same layout as below, built from the ring */
+    unsigned npages = (p->memory_size - (base - p->guest_phys_addr)) >> PAGE_SHIFT;
+    memset(bitmap, 0, (npages + CHAR_BIT - 1) / CHAR_BIT);
+    kvm_for_each_dirty_page(base, npages, kvm_dirty_bit, bitmap);
+    return;
+  }
   dirty_log.slot = p->slot;
   dirty_log.dirty_bitmap = bitmap;
   ioctl(vmfd, KVM_GET_DIRTY_LOG, &dirty_log);
@@ -970,6 +1187,12 @@ void kvm_enter(int pm)
   kvm_update_fpu();
 }
 
+static void kvm_invalidate_dirty(unsigned page, void *arg)
+{
+  struct kvm_userspace_memory_region *p = arg;
+  e_invalidate_page_full(p->guest_phys_addr + (page << PAGE_SHIFT));
+}
+
 void kvm_leave(int pm)
 {
   struct kvm_fpu fpu;
@@ -1000,7 +1223,14 @@ void kvm_leave(int pm)
 	  (p->flags & KVM_MEM_LOG_DIRTY_PAGES) &&
 	  memcheck_is_system_ram(p->guest_phys_addr)) {
 	unsigned char bitmap[(LOWMEM_SIZE+HMASIZE)/CHAR_BIT];
-	int i;
+	int i, ring;
+	ring = kvm_for_each_dirty_page(p->guest_phys_addr,
+				       p->memory_size >> PAGE_SHIFT,
+				       kvm_invalidate_dirty, p);
+	if (ring == -1)
+	  leavedos_main(99);
+	if (ring)
+	  continue;
 	kvm_get_dirty_map(p->guest_phys_addr, bitmap);
 	for (i = 0; i < p->memory_size >> PAGE_SHIFT; i++)
 	  if (test_bit(i, bitmap))
@@ -1011,15 +1241,25 @@ void kvm_leave(int pm)
 
 static int kvm_post_run(struct vm86_regs *regs, struct kvm_regs *kregs)
 {
-  int ret = ioctl(vcpufd, KVM_GET_REGS, kregs);
-  if (ret == -1) {
-    perror("KVM: KVM_GET_REGS");
-    leavedos_main(99);
-  }
-  ret = ioctl(vcpufd, KVM_GET_SREGS, &sregs);
-  if (ret == -1) {
-    perror("KVM: KVM_GET_SREGS");
-    leavedos_main(99);
+#ifdef KVM_SYNC_X86_REGS
+  if (kvm_sync_regs) {
+    /* stored by KVM_RUN on exit, as requested by kvm_valid_regs */
+    *kregs = run->s.regs.regs;
+    sregs = run->s.regs.sregs;
+  } else
+#endif
+  {
+    int ret = ioctl(vcpufd, KVM_GET_REGS, kregs);
+    if (ret == -1) {
+      perror("KVM: KVM_GET_REGS");
+      leavedos_main(99);
+    }
+    ret = ioctl(vcpufd, KVM_GET_SREGS, &sregs);
+    if (ret == -1) {
+      perror("KVM: KVM_GET_SREGS");
+      leavedos_main(99);
+    }
+    kx_regioctls += 2;
   }
   /* don't interrupt GDT code */
   if (!(kregs->rflags & X86_EFLAGS_VM) && !(sregs.cs.selector & 4)) {
@@ -1084,11 +1324,7 @@ static unsigned int kvm_run(void)
     kregs.rsp = regs->esp;
     kregs.rip = regs->eip;
     kregs.rflags = regs->eflags;
-    ret = ioctl(vcpufd, KVM_SET_REGS, &kregs);
-    if (ret == -1) {
-      perror("KVM: KVM_SET_REGS");
-      leavedos_main(99);
-    }
+    kx_regsets++;
 
     if (regs->eflags & X86_EFLAGS_VM) {
       set_vm86_seg(&sregs.cs, regs->cs);
@@ -1105,16 +1341,35 @@ static unsigned int kvm_run(void)
       set_ldt_seg(&sregs.gs, regs->__null_gs);
       set_ldt_seg(&sregs.ss, regs->ss);
     }
-    ret = ioctl(vcpufd, KVM_SET_SREGS, &sregs);
-    if (ret == -1) {
-      perror("KVM: KVM_SET_SREGS");
-      leavedos_main(99);
+#ifdef KVM_SYNC_X86_REGS
+    if (kvm_sync_regs) {
+      /* picked up by the next KVM_RUN */
+      run->s.regs.regs = kregs;
+      run->s.regs.sregs = sregs;
+      run->kvm_dirty_regs = KVM_SYNC_MASK;
+    } else
+#endif
+    {
+      ret = ioctl(vcpufd, KVM_SET_REGS, &kregs);
+      if (ret == -1) {
+	perror("KVM: KVM_SET_REGS");
+	leavedos_main(99);
+      }
+      ret = ioctl(vcpufd, KVM_SET_SREGS, &sregs);
+      if (ret == -1) {
+	perror("KVM: KVM_SET_SREGS");
+	leavedos_main(99);
+      }
+      kx_regioctls += 2;
     }
   }
 
   while (!exit_reason) {
-    int ret = ioctl(vcpufd, KVM_RUN, NULL);
-    int errn = errno;
+    int ret, errn;
+
+    kx_enter();
+    ret = ioctl(vcpufd, KVM_RUN, NULL);
+    errn = errno;
 
     /* KVM should only exit for four reasons:
        1. KVM_EXIT_HLT: at the hlt in kvmmon.S following an exception.
@@ -1131,6 +1386,7 @@ static unsigned int kvm_run(void)
     if (ret != 0 && ret != -1)
       error("KVM: strange return %i, errno=%i\n", ret, errn);
     if (ret == -1 && errn == EINTR) {
+      kx_exit(KX_SIGNAL);
       if (!kvm_post_run(regs, &kregs))
         continue;
       saved_regs = *regs;
@@ -1143,9 +1399,11 @@ static unsigned int kvm_run(void)
 
     switch (run->exit_reason) {
     case KVM_EXIT_HLT:
+      kx_exit(KX_HLT);
       exit_reason = KVM_EXIT_HLT;
       break;
     case KVM_EXIT_MMIO:
+      kx_exit(KX_MMIO);
       /* for ROM: simply ignore the write and continue */
       if (memcheck_is_rom(run->mmio.phys_addr))
 	break;
@@ -1173,7 +1431,10 @@ static unsigned int kvm_run(void)
 	  case 8: *(uint64_t*)data = read_qword(addr); break;
 	  }
 	}
+	kx_enter();
 	ret = ioctl(vcpufd, KVM_RUN, NULL);
+	if (ret == 0 && run->exit_reason == KVM_EXIT_MMIO)
+	  kx_exit(KX_MMIO);
 	/* read-modify-write instructions give two KVM_EXIT_MMIO
 	   exits in a row before the signal exit */
       } while (ret == 0 && run->exit_reason == KVM_EXIT_MMIO);
@@ -1186,6 +1447,7 @@ static unsigned int kvm_run(void)
       exit_reason = KVM_EXIT_MMIO;
       break;
     case KVM_EXIT_IRQ_WINDOW_OPEN:
+      kx_exit(KX_IRQWIN);
       run->request_interrupt_window = !run->ready_for_interrupt_injection;
       if (run->request_interrupt_window || !run->if_flag) break;
       if (!kvm_post_run(regs, &kregs))
@@ -1194,6 +1456,17 @@ static unsigned int kvm_run(void)
       saved_regs = *regs;
       exit_reason = KVM_EXIT_IRQ_WINDOW_OPEN;
       break;
+#ifdef KVM_CAP_DIRTY_LOG_RING
+    case KVM_EXIT_DIRTY_RING_FULL:
+      /* make room and go on; the pages stay pending for their users */
+      kx_exit(KX_RINGFULL);
+      pthread_mutex_lock(&dirty_mtx);
+      ret = kvm_collect_dirty_ring();
+      pthread_mutex_unlock(&dirty_mtx);
+      if (ret == -1)
+        leavedos_main(99);
+      break;
+#endif
     case KVM_EXIT_FAIL_ENTRY:
       error("KVM_EXIT_FAIL_ENTRY: hardware_entry_failure_reason = 0x%llx\n",
 	      (unsigned long long)run->fail_entry.hardware_entry_failure_reason);
@@ -1403,6 +1676,21 @@ int kvm_dpmi(cpuctx_t *scp)
 
 void kvm_done(void)
 {
+  int i;
+
+  if (debug_level('Q')) {
+    Q_printf("KVM: exits      count   avg us  total ms\n");
+    for (i = 0; i < KX_MAX; i++) {
+      if (!kx_stats[i].count)
+	continue;
+      Q_printf("KVM: %-10s %9llu %8.2f %9.1f\n", kx_names[i],
+	       kx_stats[i].count,
+	       kx_stats[i].ns / 1000.0 / kx_stats[i].count,
+	       kx_stats[i].ns / 1000000.0);
+    }
+    Q_printf("KVM: %llu register loads, %llu register ioctls\n",
+	     kx_regsets, kx_regioctls);
+  }
   close(vcpufd);
   close(vmfd);
   close(kvmfd);
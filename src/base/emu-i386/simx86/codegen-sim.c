@@ -339,6 +339,49 @@ void FlagSync_All (void)
 }
 
 
+#ifdef BULK_STRINGS
+/*
+ * String ops walk their range in runs which stay within one page. When
+ * dosaddr_to_unixaddr_run() allows it a run is done on host memory in one
+ * go; otherwise (VGA, MMIO, faulting pages) its elements go through
+ * read_xxx/write_xxx as before.
+ */
+
+/* number of elements of size sz from addr in direction df within the page */
+static inline unsigned int PageRun(dosaddr_t addr, int df, int sz)
+{
+	unsigned int ofs = addr & (PAGE_SIZE-1);
+	if (ofs + sz > PAGE_SIZE)
+		return 0;
+	return (df > 0 ? PAGE_SIZE - ofs : ofs + sz) / sz;
+}
+
+/* host address of the lowest element of an n-element run, or NULL */
+static inline unsigned char *RunBase(dosaddr_t addr, int df, unsigned int n,
+				     int sz, int write)
+{
+	unsigned char *p;
+
+	/* lockstep check: stores must go through the undo log */
+	if (write && !SIM_BULK_STORE())
+		return NULL;
+	if (df < 0)
+		addr -= (n-1)*sz;
+	p = dosaddr_to_unixaddr_run(addr, n*sz, write);
+	/* the run bypasses write_xxx, so drop the code it overwrites here,
+	   once for the whole run */
+	if (p && write)
+		e_invalidate(addr, n*sz);
+	return p;
+}
+
+static inline unsigned int HostRead(unsigned char *p, int sz)
+{
+	return sz==1? *p : sz==2? UNIX_READ_WORD(p) : UNIX_READ_DWORD(p);
+}
+#endif
+
+
 /////////////////////////////////////////////////////////////////////////////
 
 void InitGen_sim(void)
@@ -2339,6 +2382,43 @@ void Gen_sim(int op, int mode, ...)
 		}
 		dest = AR1.d;
 		src = AR2.d;
+#ifdef BULK_STRINGS
+		while (i) {
+		    int sz = OPSIZE(mode);
+		    unsigned int n = min(i, min(PageRun(dest,df,sz), PageRun(src,df,sz)));
+		    unsigned char *s, *d;
+		    if (n == 0)
+			n = 1;
+		    i -= n;
+		    if ((s = RunBase(src,df,n,sz,0)) && (d = RunBase(dest,df,n,sz,1))) {
+			unsigned int k, len = n*sz;
+			if (d + len <= s || s + len <= d)
+			    memcpy(d, s, len);
+			else if (df > 0) {	/* overlap: keep the element order */
+			    for (k = 0; k < len; k += sz)
+				memmove(d + k, s + k, sz);
+			}
+			else {
+			    for (k = len; k; ) {
+				k -= sz;
+				memmove(d + k, s + k, sz);
+			    }
+			}
+			dest += df*len;
+			src += df*len;
+			continue;
+		    }
+		    while (n--) {
+			if (mode&MBYTE)
+			    write_byte(dest, read_byte(src));
+			else if (mode&DATA16)
+			    write_word(dest, read_word(src));
+			else
+			    write_dword(dest, read_dword(src));
+			dest += df*sz; src += df*sz;
+		    }
+		}
+#else
 		if (df<0) {
 		    if (mode&MBYTE) {
 			while (i--) write_byte(dest--, read_byte(src--));
@@ -2365,6 +2445,7 @@ void Gen_sim(int op, int mode, ...)
 			    dest += 4; src += 4; }
 		    }
 		}
+#endif
 		TR1.d = 0;
 		AR1.d = dest;
 		AR2.d = src;
@@ -2431,6 +2512,36 @@ void Gen_sim(int op, int mode, ...)
 		    }
 		}
 		addr = AR1.d;
+#ifdef BULK_STRINGS
+		while (i) {
+		    int sz = OPSIZE(mode);
+		    unsigned int n = min(i, PageRun(addr,df,sz));
+		    unsigned char *d;
+		    if (n == 0)
+			n = 1;
+		    i -= n;
+		    if ((d = RunBase(addr,df,n,sz,1))) {
+			unsigned char *e = d + n*sz;
+			if (sz == 1)
+			    memset(d, DR1.b.bl, n);
+			else if (sz == 2)
+			    for (; d < e; d += 2) UNIX_WRITE_WORD(d, DR1.w.l);
+			else
+			    for (; d < e; d += 4) UNIX_WRITE_DWORD(d, DR1.d);
+			addr += df*n*sz;
+			continue;
+		    }
+		    while (n--) {
+			if (mode&MBYTE)
+			    write_byte(addr, DR1.b.bl);
+			else if (mode&DATA16)
+			    write_word(addr, DR1.w.l);
+			else
+			    write_dword(addr, DR1.d);
+			addr += df*sz;
+		    }
+		}
+#else
 		if (mode&MBYTE) {
 		    while (i--) { write_byte(addr, DR1.b.bl); addr += df; }
 		}
@@ -2440,6 +2551,7 @@ void Gen_sim(int op, int mode, ...)
 		else {
 		    while (i--) { write_dword(addr, DR1.d); addr += 4*df; }
 		}
+#endif
 		AR1.d = addr;
 		TR1.d = 0;
 		}
@@ -2457,6 +2569,32 @@ void Gen_sim(int op, int mode, ...)
 		z = k = (mode&MREP? 1:0);
 		addr = AR1.d;
 		while (i && (z==k)) {
+#ifdef BULK_STRINGS
+		    int sz = OPSIZE(mode);
+		    unsigned int n = min(i, PageRun(addr,df,sz));
+		    unsigned char *p, *q;
+		    if (n && (p = RunBase(addr,df,n,sz,0))) {
+			unsigned int j = 1;
+			S1 = (sz==1? DR1.b.bl : sz==2? DR1.w.l : DR1.d);
+			if (df < 0)
+			    p += (n-1)*sz;
+			q = p;
+			if (sz == 1 && df > 0 && !k) {	/* repne scasb */
+			    q = memchr(p, S1, n);
+			    j = (q? q - p + 1 : n);
+			    q = p + j - 1;
+			}
+			else while (j < n && (HostRead(q,sz) == S1) == k) {
+			    q += df*sz; j++;
+			}
+			RFL.RES.d = S1 - (S2=HostRead(q,sz));
+			FlagHandleSub(S1, S2, RFL.RES.d, sz*8);
+			z = (S1 == S2);
+			addr += df*j*sz;
+			i -= j;
+			continue;
+		    }
+#endif
 		    if (mode&MBYTE) {
 			RFL.RES.d = (S1=DR1.b.bl) - (S2=read_byte(addr));
 			FlagHandleSub(S1, S2, RFL.RES.d, 8);
@@ -2512,6 +2650,31 @@ void Gen_sim(int op, int mode, ...)
 		z = k = (mode&MREP? 1:0);
 		addr2 = AR2.d;
 		while (i && (z==k)) {
+#ifdef BULK_STRINGS
+		    int sz = OPSIZE(mode);
+		    unsigned int n = min(i, min(PageRun(addr1,df,sz), PageRun(addr2,df,sz)));
+		    unsigned char *p1, *p2;
+		    if (n && (p2 = RunBase(addr2,df,n,sz,0)) &&
+			(p1 = RunBase(addr1,df,n,sz,0))) {
+			unsigned int j = 1;
+			if (df < 0) {
+			    p1 += (n-1)*sz; p2 += (n-1)*sz;
+			}
+			if (k && df > 0 && memcmp(p1, p2, n*sz) == 0) {	/* repe cmps */
+			    j = n;
+			    p1 += (n-1)*sz; p2 += (n-1)*sz;
+			}
+			else while (j < n && (HostRead(p2,sz) == HostRead(p1,sz)) == k) {
+			    p1 += df*sz; p2 += df*sz; j++;
+			}
+			RFL.RES.d = (S1=HostRead(p2,sz)) - (S2=HostRead(p1,sz));
+			FlagHandleSub(S1, S2, RFL.RES.d, sz*8);
+			z = (S1 == S2);
+			addr1 += df*j*sz; addr2 += df*j*sz;
+			i -= j;
+			continue;
+		    }
+#endif
 		    if (mode&MBYTE) {
 			RFL.RES.d = (S1=read_byte(addr2)) - (S2=read_byte(addr1));
 			FlagHandleSub(S1, S2, RFL.RES.d, 8);
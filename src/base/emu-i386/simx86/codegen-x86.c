@@ -116,6 +116,7 @@
 #include "mapping.h"
 #ifdef HOST_ARCH_X86
 #include "codegen-x86.h"
+#include "codegen-sim.h"
 #include "cpatch.h"
 
 static void Gen_x86(int op, int mode, ...);
@@ -124,6 +125,11 @@ static unsigned int CloseAndExec_x86(unsigned int PC, int mode);
 
 hitimer_u TimeStartExec;
 static TNode *LastXNode = NULL;
+/* last inline cache miss, by key of the missing node and target PC */
+static unsigned int LastICKey = IC_NOTARGET;
+static unsigned int LastICTarget;
+/* code segment and mode the RAS was filled in */
+static unsigned int RasCS, RasMode;
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -168,18 +174,341 @@ static int goodmemref(dosaddr_t m)
 
 /////////////////////////////////////////////////////////////////////////////
 
+/*
+ * Write barrier (SmcBarrier): low memory pages with code are not write
+ * protected, instead every store through %%edi looks the page(s) it
+ * writes up in TheCPU.smc_map first. Stores to pages without code, or
+ * above LOWMEM+HMA where mprotect is still used, fall through to the
+ * plain store; the others are sent to a patch stub, which invalidates
+ * only the code really hit:
+ *
+ *	push %%ecx
+ *	cmpl $LOWMEM_SIZE+HMASIZE,%%edi; jae 1f
+ *	movl %%edi,%%ecx; shrl $12,%%ecx; btl %%ecx,smc_map(%%ebx); jc 2f
+ *	leal len-1(%%edi),%%ecx; shrl $12,%%ecx; btl %%ecx,smc_map(%%ebx)
+ *	jnc 1f
+ * 2:	pop %%ecx; incl smc_hits(%%ebx); call *stub(%%ebx); jmp 3f
+ * 1:	pop %%ecx
+ *
+ * The jmp displacement is passed back in *skip and must be fixed up
+ * by the caller: past the store for the stub_wri stubs, which write
+ * themselves, or right here for stubs which only invalidate.
+ */
+unsigned char *GenWriteBarrier(unsigned char *Cp, int len, unsigned int stub,
+			       unsigned char **skip)
+{
+	unsigned char *j1, *j2, *j3 = NULL;
+
+	// push %%ecx
+	G1(0x51,Cp);
+	// cmpl $LOWMEM_SIZE+HMASIZE,%%edi
+	G2M(0x81,0xff,Cp); G4(LOWMEM_SIZE+HMASIZE,Cp);
+	// jae 1f
+	G2M(0x73,0x00,Cp); j1 = Cp;
+	// movl %%edi,%%ecx
+	G2M(0x89,0xf9,Cp);
+	// shrl $12,%%ecx
+	G3M(0xc1,0xe9,PAGE_SHIFT,Cp);
+	// btl %%ecx,smc_map(%%ebx)
+	G3M(0x0f,0xa3,0x8b,Cp); G4(Ofs_SMCMAP,Cp);
+	if (len > 1) {
+		// jc 2f
+		G2M(0x72,0x00,Cp); j3 = Cp;
+		// leal len-1(%%edi),%%ecx
+		G3M(0x8d,0x4f,len-1,Cp);
+		// shrl $12,%%ecx
+		G3M(0xc1,0xe9,PAGE_SHIFT,Cp);
+		// btl %%ecx,smc_map(%%ebx)
+		G3M(0x0f,0xa3,0x8b,Cp); G4(Ofs_SMCMAP,Cp);
+	}
+	// jnc 1f
+	G2M(0x73,0x00,Cp); j2 = Cp;
+	if (j3) j3[-1] = Cp - j3;
+	// pop %%ecx
+	G1(0x59,Cp);
+	// incl smc_hits(%%ebx)
+	G2M(0xff,0x83,Cp); G4(Ofs_SMCHITS,Cp);
+	if (stub < 0x100) {
+		// call *stub(%%ebx)
+		G3M(0xff,0x53,stub,Cp);
+	}
+	else {
+		// call *stub(%%ebx) (long displacement)
+		G2M(0xff,0x93,Cp); G4(stub,Cp);
+	}
+	// jmp 3f
+	G2M(0xeb,0x00,Cp); *skip = Cp-1;
+	j1[-1] = Cp - j1;
+	j2[-1] = Cp - j2;
+	// pop %%ecx
+	G1(0x59,Cp);
+	return Cp;
+}
+
+/* barrier version of STD_WRITE_B/STD_WRITE_WL */
+static unsigned char *GenBarrierStore(unsigned char *Cp, int mode)
+{
+	unsigned char *skip;
+
+	if (mode&MBYTE) {
+		Cp = GenWriteBarrier(Cp, 1, Ofs_stub_wri_8, &skip);
+		// movb %%al,(%%edi,%%ebp,1)
+		G3M(0x88,0x04,0x2f,Cp);
+	}
+	else if (mode&DATA16) {
+		Cp = GenWriteBarrier(Cp, 2, Ofs_stub_wri_16, &skip);
+		// movw %%ax,(%%edi,%%ebp,1)
+		G4M(0x66,0x89,0x04,0x2f,Cp);
+	}
+	else {
+		Cp = GenWriteBarrier(Cp, 4, Ofs_stub_wri_32, &skip);
+		// movl %%eax,(%%edi,%%ebp,1)
+		G3M(0x89,0x04,0x2f,Cp);
+	}
+	*skip = Cp - (skip+1);
+	return Cp;
+}
+
+/*
+ * Stack stores are never faulted in write barrier mode, so they are
+ * sent to the stack stubs right away, exactly as Cpatch() would do it:
+ * the stubs check the code pages themselves.
+ *	leal (%%esi,%%ecx,1),%%edx; [andl $imm,%%eax]; [66] 89 04 2a
+ */
+static void BarrierPatchStk(unsigned char *p, unsigned char *end)
+{
+	while (p < end - 6) {
+		if (p[0]!=0x8d || p[1]!=0x14 || p[2]!=0x0e) {
+			p++;
+			continue;
+		}
+		p += 3;
+		if (p[0]==0x25) p += 5;	/* PUSHF flag mask */
+		if (p[0]==0x66 && p[1]==0x89 && p[2]==0x04 && p[3]==0x2a) {
+			JSRPATCH(p,Ofs_stub_stk_16); p[3] = 0x90; p += 4;
+		}
+		else if (p[0]==0x89 && p[1]==0x04 && p[2]==0x2a) {
+			JSRPATCH(p,Ofs_stub_stk_32); p += 3;
+		}
+	}
+}
+
 
 void InitGen_x86(void)
 {
 	Gen = Gen_x86;
 	AddrGen = AddrGen_x86;
 	CloseAndExec = CloseAndExec_x86;
-	UseLinker = USE_LINKER;
+	CEmuStat &= ~CeS_COLD;
+	/* the lockstep check compares one node at a time */
+	UseLinker = config.cpucheck ? 0 : USE_LINKER;
+	/* native or KVM code writes low memory unchecked, so the
+	 * write barrier can only replace page protection for a
+	 * fully emulated CPU */
+	SmcBarrier = config.cpusmc && EMU_FULL();
+	LastICKey = IC_NOTARGET;
+	TheCPU.ic_miss = IC_NOTARGET;
+	RasFlush();
+}
+
+/*
+ * Compile threshold (config.cpuhot): a sequence starting at an entry
+ * point which has not been entered cpuhot times yet is run by the
+ * simulator (CeS_COLD), and only compiled after that. Entry points are
+ * counted in a small direct-mapped table; a collision just restarts
+ * the count, and so does invalidating the code (HotTabClear). The FPU
+ * state is kept differently by the two backends, so once the JIT has
+ * loaded it into the real FPU everything is compiled until the next
+ * exit, and the simulator hands any FPU instruction over to the JIT
+ * (ColdToJit).
+ */
+#define HOTTAB_SIZE	4096
+static struct {
+	unsigned int pc, cnt;
+} HotTab[HOTTAB_SIZE];
+
+int SeqsCold, SeqsCompiled;
+
+#define HOTTAB_ENTRY(pc)	(&HotTab[((pc) ^ ((pc) >> 12)) & (HOTTAB_SIZE-1)])
+
+void ColdSelect(unsigned int PC)
+{
+	int cold = 0;
+
+	if (TheCPU.fpstate && !e_querymark(PC, 1)) {
+		typeof(&HotTab[0]) h = HOTTAB_ENTRY(PC);
+		if (h->pc != PC) {
+			h->pc = PC;
+			h->cnt = 0;
+		}
+		if (h->cnt < config.cpuhot) {
+			h->cnt++;
+			cold = 1;
+		}
+		else if (h->cnt == config.cpuhot) {
+			h->cnt++;
+			SeqsCompiled++;
+		}
+	}
+	if (cold) {
+		SeqsCold++;
+		if (!(CEmuStat & CeS_COLD)) {
+			InitGen_sim();
+			CEmuStat |= CeS_COLD;
+		}
+	}
+	else if (CEmuStat & CeS_COLD) {
+		FlagSync_All();
+		Gen = Gen_x86;
+		AddrGen = AddrGen_x86;
+		CloseAndExec = CloseAndExec_x86;
+		CEmuStat &= ~CeS_COLD;
+	}
+}
+
+/* compile from PC on at the next ColdSelect */
+void ColdToJit(unsigned int PC)
+{
+	typeof(&HotTab[0]) h = HOTTAB_ENTRY(PC);
+
+	if (h->pc != PC || h->cnt <= config.cpuhot)
+		SeqsCompiled++;
+	h->pc = PC;
+	h->cnt = config.cpuhot + 1;
+}
+
+/* restart the entry counts of [addr, addr+len), whose code is gone */
+void HotTabClear(unsigned int addr, unsigned int len)
+{
+	unsigned int pc;
+	int i;
+
+	if (!config.cpuhot)
+		return;
+	if (len >= HOTTAB_SIZE) {
+		for (i = 0; i < HOTTAB_SIZE; i++)
+			if (HotTab[i].pc - addr < len)
+				HotTab[i].cnt = 0;
+		return;
+	}
+	for (pc = addr; pc - addr < len; pc++) {
+		typeof(&HotTab[0]) h = HOTTAB_ENTRY(pc);
+		if (h->pc == pc)
+			h->cnt = 0;
+	}
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
 
+/*
+ * Lazy flags: an op which sets the condition flags normally pops the
+ * flags of the previous op from the stack and pushes its own, where
+ * the next op, the tail code or the fault handler pick them up. If a
+ * later op of the same sequence sets all of them again and the ops in
+ * between can neither read them nor fault nor leave the sequence, the
+ * flags are dead: the pop/pushf pair is omitted, and the stale flags
+ * below stay on the stack until they are overwritten.
+ */
+static int FlagsDead(IMeta *I, int j)
+{
+#ifdef LAZY_FLAGS
+	IMeta *end = &InstrMeta[CurrIMeta];
+
+	switch (I->gen[j].op) {
+	case O_ADD_R: case O_OR_R: case O_ADC_R: case O_SBB_R:
+	case O_AND_R: case O_SUB_R: case O_XOR_R: case O_CMP_R:
+	case O_INC_R: case O_DEC_R:
+	case O_ADD_FR: case O_OR_FR: case O_ADC_FR: case O_SBB_FR:
+	case O_AND_FR: case O_SUB_FR: case O_XOR_FR: case O_CMP_FR:
+	case O_CLEAR: case O_TEST: case O_SBSELF: case O_NEG:
+	case O_INC: case O_DEC:
+		break;
+	default:
+		return 0;
+	}
+	for (j++; I < end; I++, j = 0) {
+		for (; j < I->ngen; j++) {
+			switch (I->gen[j].op) {
+			/* register and address ops, no flags, no faults */
+			case L_NOP: case L_REG: case S_REG: case L_REG2REG:
+			case L_IMM: case L_IMM_R1: case L_MOVZS: case S_DI_R:
+			case A_DI_0: case A_DI_1: case A_DI_2: case A_DI_2D:
+			case A_SR_SH4: case O_NOT:
+				break;
+			/* all flags set, none read */
+			case O_ADD_R: case O_OR_R: case O_AND_R: case O_SUB_R:
+			case O_XOR_R: case O_CMP_R:
+			case O_ADD_FR: case O_OR_FR: case O_AND_FR:
+			case O_SUB_FR: case O_XOR_FR: case O_CMP_FR:
+			case O_CLEAR: case O_TEST: case O_NEG:
+				return 1;
+			default:
+				return 0;
+			}
+		}
+	}
+#endif
+	return 0;
+}
+
+/* flags of the previous op: discard them, or load CF from them */
+#define FLAGS_IN(Cp)	{ if (!fdead) G1(POPdx,Cp); }
+#define FLAGS_IN_CF(Cp)	{ if (!fdead) { G1(POPdx,Cp); }\
+			  /* movl (%%esp),%%edx */\
+			  else { G3M(0x8b,0x14,0x24,Cp); }\
+			  /* shr $1,%%edx */\
+			  G2M(0xd1,0xea,Cp); }
+#define FLAGS_OUT(Cp)	{ if (!fdead) G1(PUSHF,Cp); }
+
+/*
+ * Accumulator tracking: every op loads its guest register operand from
+ * TheCPU into %%eax and stores the result back, so %%eax often still
+ * holds a register when the next instruction loads it again (e.g.
+ * "inc ax; cmp ax,bx"). Such reloads are omitted. AccOfs is the TheCPU
+ * offset %%eax mirrors, -1 if none; it is dropped by any op which is
+ * not known to leave both %%eax and that register alone. Code is only
+ * entered at the start of a sequence, so this is exact.
+ */
+static int AccOfs = -1, AccSize;
+
+static inline int AccOpSize(IGen *IG)
+{
+	if (IG->mode & (MBYTE|MBYTX)) return 1;
+	return (IG->mode & DATA16) ? 2 : 4;
+}
+
+/* returns 1 if the op needs no code */
+static int AccTrack(IGen *IG)
+{
+#ifdef ACC_CACHE
+	int sz = AccOpSize(IG);
+
+	switch (IG->op) {
+	case L_REG:
+		if (IG->p0 == AccOfs && sz <= AccSize)
+			return 1;
+		AccOfs = IG->p0; AccSize = sz;
+		return 0;
+	case S_REG:
+		AccOfs = IG->p0;
+		AccSize = (IG->mode & MBYTE) ? 1 : (IG->mode & DATA16) ? 2 : 4;
+		return 0;
+	case L_IMM:
+	case S_DI_R:
+		/* other writes to TheCPU, of at most 4 bytes */
+		if ((int)IG->p0 < AccOfs + AccSize && AccOfs < (int)IG->p0 + 4)
+			AccOfs = -1;
+		return 0;
+	case L_NOP:
+	case A_DI_0: case A_DI_1: case A_DI_2: case A_DI_2D:
+		return 0;
+	}
+#endif
+	AccOfs = -1;
+	return 0;
+}
+
 /* NOTE: parameters IG->px must be the last argument in a Gn() macro
  * because of the OR operator, which would cause trouble if the parameter
  * is negative */
@@ -195,11 +524,18 @@ static unsigned char *CodeGen(unsigned char *CodePtr, unsigned char *BaseGenBuf,
 	unsigned char * CpTemp;
 	int mode = IG->mode;
 	int rcod;
+	int fdead = FlagsDead(I, j);
 #ifdef PROFILE
 	hitimer_t t0 = 0;
 	if (debug_level('e')) t0 = GETTSC();
 #endif
 
+	if (AccTrack(IG)) {
+		if (debug_level('e')>3)
+			e_printf("L_REG %02x: still in eax\n", IG->p0);
+		return Cp;
+	}
+
 	switch(IG->op) {
 	case A_DI_0:			// base(32), imm
 		// movl $imm,%%edi
@@ -487,14 +823,15 @@ static unsigned char *CodeGen(unsigned char *CodePtr, unsigned char *BaseGenBuf,
 	case O_DEC_R:
 		rcod = 0x08fe;
 arith0:		{
-		G1(POPdx,Cp);	// get flags from stack into %%edx
 		switch (IG->op) {
 		case O_ADC_R: // tests carry
 		case O_SBB_R: // tests carry
 		case O_INC_R: // preserves carry
 		case O_DEC_R: // preserves carry
-			// shr $1,%%edx to get carry flag from stack
-			G2M(0xd1,0xea,Cp);
+			FLAGS_IN_CF(Cp);
+			break;
+		default:
+			FLAGS_IN(Cp);	// get flags from stack into %%edx
 		}
 		if (mode & MBYTE) {
 			if (mode & IMMED) {
@@ -518,11 +855,12 @@ arith0:		{
 				G2(0x4301|rcod,Cp); G1(IG->p0,Cp);
 			}
 		}
-		G1(PUSHF,Cp);	// flags back on stack
+		FLAGS_OUT(Cp);	// flags back on stack
 		}
 		break;
 	case O_CLEAR:
-		G3M(POPdx,0x31,0xc0,Cp);	//ignore flags; xorl %%eax,%%eax
+		FLAGS_IN(Cp);	// ignore flags
+		G2M(0x31,0xc0,Cp);	// xorl %%eax,%%eax
 		if (mode & MBYTE) {
 			// movb %%al,offs(%%ebx)
 			G3M(0x88,0x43,IG->p0,Cp);
@@ -531,10 +869,10 @@ arith0:		{
 			// mov{wl} %%{e}ax,offs(%%ebx)
 			Gen66(mode,Cp); G3M(0x89,0x43,IG->p0,Cp);
 		}
-		G1(PUSHF,Cp);	// new flags on stack
+		FLAGS_OUT(Cp);	// new flags on stack
 		break;
 	case O_TEST:
-		G1(POPdx,Cp);			// ignore flags
+		FLAGS_IN(Cp);			// ignore flags
 		if (mode & MBYTE) {
 			// testb $0xff,offs(%%ebx)
 			G4M(0xf6,0x43,IG->p0,0xffu,Cp);
@@ -547,13 +885,12 @@ arith0:		{
 			// test $0xffffffff,offs(%%ebx)
 			G3M(0xf7,0x43,IG->p0,Cp); G4(0xffffffff,Cp);
 		}
-		G1(PUSHF,Cp);	// new flags on stack
+		FLAGS_OUT(Cp);	// new flags on stack
 		break;
 	case O_SBSELF:
 		// if CY=0 -> reg=0,  flag=xx46
 		// if CY=1 -> reg=-1, flag=xx97
-		// pop %%edx; shr $1,%%edx to get carry flag from stack
-		G3M(POPdx,0xd1,0xea,Cp);
+		FLAGS_IN_CF(Cp);
 		// sbbl %%eax,%%eax
 		G2M(0x19,0xc0,Cp);
 		if (mode & MBYTE) {
@@ -564,7 +901,7 @@ arith0:		{
 			// mov{wl} %%{e}ax,offs(%%ebx)
 			Gen66(mode,Cp); G3M(0x89,0x43,IG->p0,Cp);
 		}
-		G1(PUSHF,Cp);	// flags back on stack
+		FLAGS_OUT(Cp);	// flags back on stack
 		break;
 	case O_ADD_FR:
 		rcod = ADDbfrm; /* 0x00 */ goto arith1;
@@ -583,10 +920,11 @@ arith0:		{
 	case O_CMP_FR:
 		rcod = CMPbfrm; /* 0x38 */
 arith1:
-		G1(POPdx,Cp);	// get flags from stack into %%edx
 		if (IG->op == O_ADC_FR || IG->op == O_SBB_FR) {
-			// shr $1,%%edx to get carry flag from stack
-			G2M(0xd1,0xea,Cp);
+			FLAGS_IN_CF(Cp);
+		}
+		else {
+			FLAGS_IN(Cp);	// get flags from stack into %%edx
 		}
 		if (mode & MBYTE) {
 			if (mode & IMMED) {
@@ -611,7 +949,7 @@ arith1:
 				G2(0x4301|rcod,Cp); G1(IG->p0,Cp);
 			}
 		}
-		G1(PUSHF,Cp);	// flags back on stack
+		FLAGS_OUT(Cp);	// flags back on stack
 		break;
 	case O_NOT:
 		if (mode & MBYTE) {
@@ -625,7 +963,7 @@ arith1:
 		}
 		break;
 	case O_NEG:
-		G1(POPdx,Cp);	// ignore flags from stack
+		FLAGS_IN(Cp);	// ignore flags from stack
 		if (mode & MBYTE) {
 			// negb %%al
 			G2M(0xf6,0xd8,Cp);
@@ -635,12 +973,10 @@ arith1:
 			Gen66(mode,Cp);
 			G2M(0xf7,0xd8,Cp);
 		}
-		G1(PUSHF,Cp);	// new flags on stack
+		FLAGS_OUT(Cp);	// new flags on stack
 		break;
 	case O_INC:
-		G1(POPdx,Cp);	// get flags from stack into %%edx
-		// shr $1,%%edx to get preserved carry flag from stack
-		G2M(0xd1,0xea,Cp);
+		FLAGS_IN_CF(Cp);	// get preserved carry flag from stack
 		if (mode & MBYTE) {
 			// incb %%al
 			G2M(0xfe,0xc0,Cp);
@@ -661,12 +997,10 @@ arith1:
 			G1(0x40,Cp);
 #endif
 		}
-		G1(PUSHF,Cp);	// flags back on stack before writing
+		FLAGS_OUT(Cp);	// flags back on stack before writing
 		break;
 	case O_DEC:
-		G1(POPdx,Cp);	// get flags from stack into %%edx
-		// shr $1,%%edx to get preserved carry flag from stack
-		G2M(0xd1,0xea,Cp);
+		FLAGS_IN_CF(Cp);	// get preserved carry flag from stack
 		if (mode & MBYTE) {
 			// decb %%al
 			G2M(0xfe,0xc8,Cp);
@@ -687,7 +1021,7 @@ arith1:
 			G1(0x48,Cp);
 #endif
 		}
-		G1(PUSHF,Cp);	// flags back on stack
+		FLAGS_OUT(Cp);	// flags back on stack
 		break;
 	case O_CMPXCHG: {
 		G1(POPdx,Cp);	// ignore flags from stack
@@ -1818,7 +2152,7 @@ shrot0:
 
 	case O_MOVS_MovD:
 		GetDF(Cp);
-		G3M(NOP,NOP,REP,Cp);
+		REP_WRITE;
 		if (mode&MBYTE)	{ G1(MOVSb,Cp); }
 		else {
 			Gen66(mode,Cp);
@@ -1838,7 +2172,7 @@ shrot0:
 		break;
 	case O_MOVS_StoD:
 		GetDF(Cp);
-		G3M(NOP,NOP,REP,Cp);
+		REP_WRITE;
 		if (mode&MBYTE)	{ G1(STOSb,Cp); }
 		else {
 			Gen66(mode,Cp);
@@ -2209,12 +2543,64 @@ shrot0:
 
 	case JMP_INDIRECT: {	// input: %%{e}ax = %%{e}ip
 		linkdesc *lt = IG->lt;
+		int i;
 		lt->t_type = JMP_INDIRECT;
 		if (mode&DATA16)
 			// movz{wl} %%ax,%%eax
 			G3M(0x0f,0xb7,0xc0,Cp);
 		// addl Ofs_XCS(%%ebx),%%eax
 		G3M(0x03,0x43,Ofs_XCS,Cp);
+		if (!UseLinker || (IG->p0 != RET && IG->p0 != RETisp &&
+		    IG->p0 != JMPi && IG->p0 != CALLi)) {
+			/* far transfers change CS, always go back */
+			// pop %%edx; ret
+			G2M(0x5a,0xc3,Cp);
+			break;
+		}
+		// movzwl Ofs_SIGAPEND(%%ebx),%%ecx
+		G4M(0x0f,0xb7,0x4b,Ofs_SIGAPEND,Cp);
+		// jecxz {continue}; pop %%edx; ret
+		G4M(0xe3,0x02,0x5a,0xc3,Cp);
+		// incl Ofs_ICEXEC(%%ebx)
+		G3M(0xff,0x43,Ofs_ICEXEC,Cp);
+		if (IG->p0 == RET || IG->p0 == RETisp) {
+			unsigned char *q;
+			// movl Ofs_RASTOP(%%ebx),%%ecx
+			G2M(0x8b,0x8b,Cp); G4(Ofs_RASTOP,Cp);
+			// cmpl %%eax,Ofs_RASPC(%%ebx,%%ecx,4)
+			G3M(0x39,0x84,0x8b,Cp); G4(Ofs_RASPC,Cp);
+			// jne {cache}
+			G2M(0x75,0,Cp); q = Cp;
+#ifdef __x86_64__
+			// movq Ofs_RASADDR(%%rbx,%%rcx,8),%%rsi
+			G4M(0x48,0x8b,0xb4,0xcb,Cp); G4(Ofs_RASADDR,Cp);
+#else
+			// movl Ofs_RASADDR(%%ebx,%%ecx,4),%%esi
+			G3M(0x8b,0xb4,0x8b,Cp); G4(Ofs_RASADDR,Cp);
+#endif
+			// decl %%ecx; andl $RAS_SIZE-1,%%ecx
+			G4M(0xff,0xc9,0x83,0xe1,Cp); G1(RAS_SIZE-1,Cp);
+			// movl %%ecx,Ofs_RASTOP(%%ebx)
+			G2M(0x89,0x8b,Cp); G4(Ofs_RASTOP,Cp);
+			// incl Ofs_RASHITS(%%ebx)
+			G2M(0xff,0x83,Cp); G4(Ofs_RASHITS,Cp);
+			// jmp *%%esi
+			G2M(0xff,0xe6,Cp);
+			q[-1] = Cp - q;
+		}
+		/* inline cache, entries are filled by NodeLinkIC; an
+		 * empty entry jumps to the miss exit */
+		for (i = 0; i < IC_WAYS; i++) {
+			// cmpl $target,%%eax
+			G1(0x3d,Cp);
+			lt->ic_link[i].rel = Cp-BaseGenBuf;
+			G4(IC_NOTARGET,Cp);
+			// jne {next}; jmp {target}
+			G3M(0x75,0x05,0xe9,Cp); G4((IC_WAYS-1-i)*IC_ENTRYSIZE,Cp);
+		}
+		lt->ic_ways = IC_WAYS;
+		// movl $key,Ofs_ICMISS(%%ebx)
+		G2M(0xc7,0x83,Cp); G4(Ofs_ICMISS,Cp); G4(InstrMeta[0].npc,Cp);
 		// pop %%edx; ret
 		G2M(0x5a,0xc3,Cp);
 		}
@@ -2281,6 +2667,7 @@ shrot0:
 		int dspt = IG->p1;
 		int dspnt = IG->p2;
 		linkdesc *lt = IG->lt;
+		unsigned char *ras = NULL;
 		if (opc == CALLd || opc == CALLl) {
 			const unsigned char *p;
 			unsigned char *q;
@@ -2294,6 +2681,31 @@ shrot0:
 			q = Cp; GNX(Cp, p, sz);
 			*((int *)(q+1)) = dspnt;
 			if (debug_level('e')>1) e_printf("CALL: ret=%08x\n",dspnt);
+			if (opc == CALLd && UseLinker) {
+			    /* push the return address and the return stub
+			     * on the RAS, for the matching near RET */
+			    // movl Ofs_RASTOP(%%ebx),%%ecx
+			    G2M(0x8b,0x8b,Cp); G4(Ofs_RASTOP,Cp);
+			    // incl %%ecx; andl $RAS_SIZE-1,%%ecx
+			    G4M(0xff,0xc1,0x83,0xe1,Cp); G1(RAS_SIZE-1,Cp);
+			    // movl %%ecx,Ofs_RASTOP(%%ebx)
+			    G2M(0x89,0x8b,Cp); G4(Ofs_RASTOP,Cp);
+			    // movl $RA,Ofs_RASPC(%%ebx,%%ecx,4)
+			    G3M(0xc7,0x84,0x8b,Cp); G4(Ofs_RASPC,Cp);
+			    G4(dspnt+LONG_CS,Cp);
+#ifdef __x86_64__
+			    // leaq {stub}(%%rip),%%rsi
+			    G3M(0x48,0x8d,0x35,Cp); G4(0,Cp); ras = Cp;
+			    // movq %%rsi,Ofs_RASADDR(%%rbx,%%rcx,8)
+			    G4M(0x48,0x89,0xb4,0xcb,Cp); G4(Ofs_RASADDR,Cp);
+#else
+			    // call 1f; 1: popl %%esi; addl ${stub}-1b,%%esi
+			    G1(0xe8,Cp); G4(0,Cp); ras = Cp;
+			    G3M(0x5e,0x81,0xc6,Cp); G4(0,Cp);
+			    // movl %%esi,Ofs_RASADDR(%%ebx,%%ecx,4)
+			    G3M(0x89,0xb4,0x8b,Cp); G4(Ofs_RASADDR,Cp);
+#endif
+			}
 		} else if (mode & CKSIGN) {
 		    // check signal on TAKEN branch
 		    // for backjmp-after-jcc:
@@ -2311,6 +2723,18 @@ shrot0:
 		lt->t_link.rel = Cp-BaseGenBuf;
 		lt->nt_link.abs = 0;
 		G4(dspt,Cp); G2(0xc35a,Cp);
+		if (ras) {
+#ifdef __x86_64__
+			*((int *)(ras-4)) = Cp - ras;
+#else
+			*((int *)(ras+3)) = Cp - ras;
+#endif
+			/* return stub, linked like a 'not taken' branch */
+			// n:	b8 [return_pc] 5a c3
+			G1(0xb8,Cp);
+			lt->nt_link.rel = Cp-BaseGenBuf;
+			G4(dspnt+LONG_CS,Cp); G2(0xc35a,Cp);
+		}
 		if (debug_level('e')>2) e_printf("JMP_Link %08x:%08x lk=%d:%08x:%p\n",
 			dspt,dspnt,lt->t_type,lt->t_link.rel,lt->nt_link.abs);
 		}
@@ -2446,6 +2870,15 @@ shrot0:
 		break;
 
 	}
+	if (SmcBarrier) switch(IG->op) {
+	case O_PUSH:
+	case O_PUSH2:
+	case O_PUSH2F:
+	case O_PUSHI:
+	case JMP_LINK:
+		BarrierPatchStk(CodePtr, Cp);
+		break;
+	}
 #ifdef PROFILE
 	if (debug_level('e')) GenTime += (GETTSC() - t0);
 #endif
@@ -2476,6 +2909,9 @@ static void AddrGen_x86(int op, int mode, ...)
 	if (debug_level('e')>6) dbug_printf("AGEN: %3d %6x\n",op,mode);
 
 	va_start(ap, mode);
+	/* unused parameters must not keep stale values, the code
+	 * cache hashes the whole entry (JitCacheLookup) */
+	memset(IG, 0, sizeof(*IG));
 	IG->op = op;
 	IG->mode = mode;
 	IG->ovds = OVERR_DS;
@@ -2554,6 +2990,7 @@ static void Gen_x86(int op, int mode, ...)
 	if (debug_level('e')>6) dbug_printf("CGEN: %3d %6x\n",op,mode);
 
 	va_start(ap, mode);
+	memset(IG, 0, sizeof(*IG));
 	IG->op = op;
 	IG->mode = mode;
 	IG->ovds = OVERR_DS;
@@ -2756,7 +3193,8 @@ static void Gen_x86(int op, int mode, ...)
 		}
 		} break;
 
-	case JMP_INDIRECT:
+	case JMP_INDIRECT:	// opc, link
+		IG->p0 = va_arg(ap,int);	// opc
 		IG->lt = va_arg(ap,linkdesc *);	// lt
 		break;
 
@@ -2833,6 +3271,7 @@ static CodeBuf *ProduceCode(unsigned int PC, IMeta *I0)
 	/* actual code buffer starts from here */
 	BaseGenBuf = CodePtr = (unsigned char *)&GenCodeBuf->meta[nap];
 	I0->daddr = 0;
+	AccOfs = -1;
 	if (debug_level('e')>1)
 	    e_printf("CodeBuf=%p siz %zd CodePtr=%p\n",GenCodeBuf,GenBufSize,CodePtr);
 
@@ -2951,13 +3390,30 @@ static void _nodeflagbackrefs(TNode *LG, unsigned short flags)
 	   if the current node uses FP then all nodes that link to
 	   it must be flagged as such, which is a recursive procedure
 	*/
-	backref *B;
+	backref *B, *Bq;
 
 	if ((LG->flags & flags) != flags) {
 	    /* only go as far back as long as flags change */
 	    LG->flags |= flags;
-	    for (B=LG->clink.bkr.next; B; B=B->next)
-		_nodeflagbackrefs(*B->ref, flags);
+	    Bq = &LG->clink.bkr;
+	    while ((B = Bq->next) != NULL) {
+		TNode *H = *B->ref;
+		linkdesc *L = &H->clink;
+		/* a return stub is also entered from any near RET through
+		   the RAS, which carries no flags: unlink it instead */
+		if (B->branch=='N' && L->t_type==JMP_LINK &&
+		    (flags & (F_FPOP|F_INHI))) {
+		    ((char *)L->nt_link.abs)[-1] = 0xb8;
+		    *L->nt_link.abs = L->nt_target;
+		    L->nt_ref = NULL; L->unlinked_jmp_targets |= TARGET_NT;
+		    Bq->next = B->next;
+		    LG->clink.nrefs--;
+		    free(B);
+		    continue;
+		}
+		_nodeflagbackrefs(H, flags);
+		Bq = B;
+	    }
 	}
 }
 
@@ -3036,7 +3492,9 @@ static void NodeLinker(TNode *LG, TNode *G)
 		}
 		if (L->unlinked_jmp_targets & TARGET_NT) {  // if it has a 'not taken' link
 		    lp = L->nt_link.abs;	// check 'not taken' branch
-		    if (L->nt_target==G->key) {	// points to current node?
+		    if (L->nt_target==G->key &&	// points to current node?
+			/* see _nodeflagbackrefs for return stubs */
+			!(L->t_type==JMP_LINK && (G->flags & (F_FPOP|F_INHI)))) {
 			if (L->nt_ref!=0) {
 			    dbug_printf("Linker: nt_ref at %08x busy\n",LG->key);
 			    leavedos_main(0x8103);
@@ -3093,12 +3551,93 @@ static void NodeLinker(TNode *LG, TNode *G)
 #endif
 }
 
+/*
+ * The inline cache of an indirect jump is linked the same way, but
+ * after the fact: a node leaving through a cache miss stores its key
+ * in TheCPU.ic_miss, and if the next node executed starts at the miss
+ * target one of the cache entries is patched to jump there.
+ */
+static void NodeUnlinkIC(TNode *LG, int w)
+{
+	linkdesc *L = &LG->clink;
+	TNode *G = *L->ic_ref[w];
+	backref *Bq = &G->clink.bkr;
+	backref *B = Bq->next;
+	unsigned int *lp = L->ic_link[w].abs;
+
+	if (debug_level('e')>2) e_printf("Unlink fwd I%d ref to node %p(%08x)\n",
+		w,G,G->key);
+	// cmpl $-1,%%eax; jne; jmp {miss}
+	*lp = IC_NOTARGET;
+	*((int *)((char *)lp+7)) = (L->ic_ways-1-w)*IC_ENTRYSIZE;
+	L->ic_ref[w] = NULL;
+	while (B) {
+		if (*B->ref==LG && B->branch=='I' && B->way==w) {
+			Bq->next = B->next;
+			G->clink.nrefs--;
+			free(B);
+			return;
+		}
+		Bq = B;
+		B = B->next;
+	}
+	dbug_printf("Unlinker: FW I ref error\n");
+	leavedos_main(0x8113);
+}
+
+static void NodeLinkIC(TNode *LG, TNode *G)
+{
+	unsigned int *lp;
+	linkdesc *L = &LG->clink;
+	linkdesc *T = &G->clink;
+	backref *B;
+	int w;
+
+#if !defined(SINGLESTEP)
+	if (!UseLinker)
+#endif
+	    return;
+
+	/* a near jump keeps CS and mode */
+	if (!L->ic_ways || G->cs != LG->cs || G->mode != LG->mode)
+	    return;
+	for (w = 0; w < L->ic_ways; w++)
+	    if (L->ic_ref[w] && *L->ic_ref[w] == G)
+		return;
+	/* round-robin replacement */
+	w = L->ic_next;
+	L->ic_next = (w + 1) % L->ic_ways;
+	if (L->ic_ref[w])
+	    NodeUnlinkIC(LG, w);
+
+	// cmpl $key,%%eax; jne; jmp {node}
+	lp = L->ic_link[w].abs;
+	*lp = G->key;
+	*((int *)((char *)lp+7)) = G->addr - ((unsigned char *)lp+11);
+	L->ic_ref[w] = &G->mblock->bkptr;
+	B = calloc(1,sizeof(backref));
+	// head insertion
+	B->next = T->bkr.next;
+	T->bkr.next = B;
+	B->ref = &LG->mblock->bkptr;
+	B->branch = 'I';
+	B->way = w;
+	T->nrefs++;
+	if (G==LG)
+	    G->flags |= F_SLFL;
+	if (debug_level('e')>1)
+	    e_printf("Linker: node (%p:%08x:%p) cached I%d to (%p:%08x:%p)\n",
+		LG,LG->key,LG->addr,w,G,G->key,G->addr);
+	_nodeflagbackrefs(LG, G->flags);
+}
+
 
 void NodeUnlinker(TNode *G)
 {
 	unsigned int *lp;
 	linkdesc *T = &G->clink;
 	backref *B = T->bkr.next;
+	int w;
 #ifdef PROFILE
 	hitimer_t t0 = 0;
 #endif
@@ -3148,6 +3687,23 @@ void NodeUnlinker(TNode *G)
 		L->nt_ref = NULL; L->unlinked_jmp_targets |= TARGET_NT;
 		T->nrefs--;
 	    }
+	    else if (B->branch=='I') {
+		TNode *H = *B->ref;
+		linkdesc *L = &H->clink;
+		w = B->way;
+		if (debug_level('e')>2) e_printf("Unlinking I%d ref from node %p to %08x\n",
+			w, H, G->key);
+		if (L->ic_ref[w] != &G->mblock->bkptr) {
+		    dbug_printf("Unlinker: BK ref error i=%08x k=%08x\n",
+			*L->ic_link[w].abs, G->key);
+		    leavedos_main(0x8110);
+		}
+		lp = L->ic_link[w].abs;
+		*lp = IC_NOTARGET;
+		*((int *)((char *)lp+7)) = (L->ic_ways-1-w)*IC_ENTRYSIZE;
+		L->ic_ref[w] = NULL;
+		T->nrefs--;
+	    }
 	    else {
 		e_printf("Invalid unlink [%c] ref %p from node ?(?) to %08x\n",
 			B->branch, B->ref, G->key);
@@ -3173,7 +3729,7 @@ void NodeUnlinker(TNode *G)
 	    if (debug_level('e')>2) e_printf("Unlink fwd T ref to node %p(%08x)\n",Gt,
 		Gt->key);
 	    while (Bt) {
-		if (*Bt->ref==G) {
+		if (*Bt->ref==G && Bt->branch=='T') {
 			Btq->next = Bt->next;
 			Gt->clink.nrefs--;
 			free(Bt);
@@ -3195,7 +3751,7 @@ void NodeUnlinker(TNode *G)
 	    if (debug_level('e')>2) e_printf("Unlink fwd N ref to node %p(%08x)\n",Gn,
 		Gn->key);
 	    while (Bn) {
-		if (*Bn->ref==G) {
+		if (*Bn->ref==G && Bn->branch=='N') {
 			Bnq->next = Bn->next;
 			Gn->clink.nrefs--;
 			free(Bn);
@@ -3210,6 +3766,9 @@ void NodeUnlinker(TNode *G)
 	    }
 	    T->nt_ref = NULL;
 	}
+	for (w = 0; w < T->ic_ways; w++)
+	    if (T->ic_ref[w])
+		NodeUnlinkIC(G, w);
 	memset(T, 0, sizeof(linkdesc));
 #ifdef PROFILE
 	if (debug_level('e')) LinkTime += (GETTSC() - t0);
@@ -3258,10 +3817,13 @@ static unsigned int CloseAndExec_x86(unsigned int PC, int mode)
 		e_printf("==== Closing sequence at %08x\n", PC);
 	}
 
-	GenCodeBuf = ProduceCode(PC, I0);
-	/* check for fatal error */
-	if (TheCPU.err < 0)
-		return I0->npc;
+	GenCodeBuf = JitCacheLookup(PC, mode, I0);
+	if (GenCodeBuf == NULL) {
+		GenCodeBuf = ProduceCode(PC, I0);
+		/* check for fatal error */
+		if (TheCPU.err < 0)
+			return I0->npc;
+	}
 
 	NodesParsed++;
 #ifdef PROFILE
@@ -3276,6 +3838,8 @@ static unsigned int CloseAndExec_x86(unsigned int PC, int mode)
 	e_mprotect(G->seqbase, G->seqlen);
 	G->cs = LONG_CS;
 	G->mode = mode;
+	/* save it while it is still unlinked */
+	JitCacheStore(G);
 	/* check links INSIDE current node */
 	NodeLinker(G, G);
 	return Exec_x86(G);
@@ -3331,6 +3895,68 @@ asm(".text\n"
     "push "R_REG(dx)"\n"
     "jmp *"R_REG(ax)"\n");
 ASMLINKAGE(void,do_seq_start,(void));
+/* target of an empty RAS entry: leave with the return PC in eax */
+asm(".text\n"
+    ".global do_ras_miss\n"
+    "do_ras_miss:\n"
+    "pop "R_REG(dx)"\n"
+    "ret\n");
+ASMLINKAGE(void,do_ras_miss,(void));
+
+/* invalidate the RAS; it must not point to code which was compiled
+ * for another code segment */
+void RasFlush(void)
+{
+	int i;
+
+	for (i = 0; i < RAS_SIZE; i++) {
+		TheCPU.ras_pc[i] = IC_NOTARGET;
+		TheCPU.ras_addr[i] = (unsigned char *)do_ras_miss;
+	}
+}
+
+/* drop the RAS entries pointing into a code block about to be freed */
+void RasFlushCode(unsigned char *addr, int len)
+{
+	int i;
+
+	for (i = 0; i < RAS_SIZE; i++) {
+		if (TheCPU.ras_addr[i] >= addr && TheCPU.ras_addr[i] < addr+len) {
+			TheCPU.ras_pc[i] = IC_NOTARGET;
+			TheCPU.ras_addr[i] = (unsigned char *)do_ras_miss;
+		}
+	}
+}
+
+static inline void RasCheck(TNode *G)
+{
+	if (G->cs != RasCS || G->mode != RasMode) {
+		RasCS = G->cs;
+		RasMode = G->mode;
+		RasFlush();
+	}
+}
+
+/* link the inline cache which missed in the previous run to the node
+ * just executed, then remember the miss of this run, if any */
+static void NodeLinkICMiss(TNode *G, unsigned int ePC)
+{
+	if (LastICKey != IC_NOTARGET) {
+		if (G->key == LastICTarget && G->alive > 0) {
+			TNode *H = LookupNode(LastICKey);
+			if (H && H->alive > 0)
+				NodeLinkIC(H, G);
+		}
+		LastICKey = IC_NOTARGET;
+	}
+	if (TheCPU.ic_miss != IC_NOTARGET) {
+		LastICKey = TheCPU.ic_miss;
+		LastICTarget = ePC;
+		TheCPU.ic_miss = IC_NOTARGET;
+		NodesIcMissed++;
+	}
+}
+
 static unsigned Exec_x86_asm(unsigned *mem_ref, unsigned long *flg,
 		unsigned char *ecpu, unsigned char *SeqStart)
 {
@@ -3370,6 +3996,7 @@ unsigned int Exec_x86(TNode *G)
 	unsigned int ePC;
 	unsigned short seqflg = G->flags;
 	unsigned char *SeqStart = G->addr;
+	int check = config.cpucheck && LockstepSim(G);
 
 	ecpu = CPUOFFS(0);
 	if (debug_level('e')>1) {
@@ -3392,9 +4019,12 @@ unsigned int Exec_x86(TNode *G)
 		asm ("fldcw	%0" :: "m"(fpuc));
 	}
 
+	RasCheck(G);
 	flg = Exec_x86_pre(ecpu);
 	ePC = Exec_x86_asm(&mem_ref, &flg, ecpu, SeqStart);
 	Exec_x86_post(flg, mem_ref);
+	if (check)
+		LockstepCheck(G, ePC);
 
 	/* was there at least one FP op in the sequence? */
 	if (seqflg & F_FPOP) {
@@ -3447,7 +4077,7 @@ unsigned int Exec_x86(TNode *G)
 
 #if defined(SINGLESTEP)
 	InvalidateNodeRange(G->key, 1, NULL);
-	avltr_delete(G->key);
+	DeleteNode(G->key);
 	if (debug_level('e')>1) e_printf("\n%s",e_print_regs());
 #else
 	/*
@@ -3470,6 +4100,7 @@ unsigned int Exec_x86(TNode *G)
 			e_printf("New LastXNode=%08x\n",G->key);
 		LastXNode = G;
 	}
+	NodeLinkICMiss(G, ePC);
 #endif
 
 	return ePC;
@@ -3484,6 +4115,7 @@ unsigned int Exec_x86_fast(TNode *G)
 	unsigned int ePC, mem_ref;
 	unsigned mode = G->mode;
 
+	RasCheck(G);
 	do {
 		ePC = Exec_x86_asm(&mem_ref, &flg, ecpu, G->addr);
 		if (G->alive > 0) {
@@ -3493,6 +4125,7 @@ unsigned int Exec_x86_fast(TNode *G)
 				NodeLinker(LastXNode, G);
 			LastXNode = G;
 		}
+		NodeLinkICMiss(G, ePC);
 		if (TheCPU.sigalrm_pending) {
 			CEmuStat|=CeS_SIGPEND;
 			break;
@@ -41,6 +41,8 @@
 
 #define TAILSIZE	7
 #define TAILFIX		1
+/* inline cache entry: cmp $imm,%eax; jne; jmp rel32 */
+#define IC_ENTRYSIZE	12
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -50,8 +52,13 @@ extern unsigned int Exec_x86_fast(TNode *G);
 
 /////////////////////////////////////////////////////////////////////////////
 
-#define STD_WRITE_B	G3M(0x88,0x04,0x2f,Cp);
-#define STD_WRITE_WL(m)	Gen66(m,Cp); G3M(0x89,0x04,0x2f,Cp)
+#define STD_WRITE_B	if (SmcBarrier) Cp = GenBarrierStore(Cp, MBYTE); \
+			else G3M(0x88,0x04,0x2f,Cp);
+#define STD_WRITE_WL(m)	if (SmcBarrier) Cp = GenBarrierStore(Cp, m); \
+			else { Gen66(m,Cp); G3M(0x89,0x04,0x2f,Cp); }
+/* rep movs/stos: nop;nop, or call (%%ebx) as patched by Cpatch() */
+#define REP_WRITE	if (SmcBarrier) G3M(0xff,0x13,REP,Cp) \
+			else G3M(NOP,NOP,REP,Cp)
 
 #define GenAddECX(o)	if (((o) > -128) && ((o) < 128)) {\
 			G2(0xc183,Cp); G1((o),Cp); } else {\
@@ -118,8 +125,24 @@ extern unsigned int Exec_x86_fast(TNode *G);
 /////////////////////////////////////////////////////////////////////////////
 //
 unsigned char *Fp87_op_x86(unsigned char *CodePtr, int exop, int reg);
+unsigned char *GenWriteBarrier(unsigned char *Cp, int len, unsigned int stub,
+			       unsigned char **skip);
 void InitGen_x86(void);
 void NodeUnlinker(TNode *G);
+void RasFlush(void);
+void RasFlushCode(unsigned char *addr, int len);
+void ColdSelect(unsigned int PC);
+void ColdToJit(unsigned int PC);
+void HotTabClear(unsigned int addr, unsigned int len);
+extern int SeqsCold, SeqsCompiled;
+int LockstepSim(TNode *G);
+void LockstepCheck(TNode *G, unsigned int ePC);
+extern int LsNodes, LsSkipped, LsErrors;
+void JitCacheOpen(void);
+void JitCacheClose(void);
+CodeBuf *JitCacheLookup(unsigned int PC, int mode, IMeta *I0);
+void JitCacheStore(TNode *G);
+extern int JitCacheHits, JitCacheMisses;
 
 extern unsigned char TailCode[];
 
@@ -302,6 +302,7 @@ void stub_wri_32(void) asm ("stub_wri_32__");
 void stub_read_8 (void) asm ("stub_read_8__" );
 void stub_read_16(void) asm ("stub_read_16__");
 void stub_read_32(void) asm ("stub_read_32__");
+void stub_inv_87(void) asm ("stub_inv_87__");
 #endif
 
 #endif
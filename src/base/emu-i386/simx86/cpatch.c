@@ -60,6 +60,10 @@ void m_munprotect(unsigned int addr, unsigned int len, unsigned char *eip)
 			InvalidateNodeRange(addr,len,eip);
 		return;
 	}
+	/* no code in these pages: in write barrier mode all rep
+	 * stores come here, so avoid walking the nodes for nothing */
+	if (!e_querymprotrange(addr, len))
+		return;
 	/* Always unprotect and clear all code in the pages
 	 * for DPMI data and code
 	 * Maybe the stub was set up before that code was parsed.
@@ -287,6 +291,18 @@ void wri_32(dosaddr_t addr, Bit32u value, unsigned char *eip)
 	in_cpatch--;
 }
 
+/* write barrier hit by a FPU store; the store itself is done by the
+ * compiled code after return, value is unused */
+void inv_87(dosaddr_t addr, Bit32u value, unsigned char *eip)
+{
+	in_cpatch++;
+	assert(InCompiledCode);
+	InCompiledCode--;
+	m_munprotect(addr, 10, eip);
+	InCompiledCode++;
+	in_cpatch--;
+}
+
 Bit8u read_8(dosaddr_t addr)
 {
 	return vga_read_access(addr) ? vga_read(addr) : READ_BYTE(addr);
@@ -430,15 +446,12 @@ asm (
 "stub_wri_8__: .globl stub_wri_8__\n "STUB_WRI(wri_8)
 "stub_wri_16__:.globl stub_wri_16__\n"STUB_WRI(wri_16)
 "stub_wri_32__:.globl stub_wri_32__\n"STUB_WRI(wri_32)
+"stub_inv_87__:.globl stub_inv_87__\n"STUB_WRI(inv_87)
 "stub_read_8__: .globl stub_read_8__\n "STUB_READ(read_8)
 "stub_read_16__:.globl stub_read_16__\n"STUB_READ(read_16)
 "stub_read_32__:.globl stub_read_32__\n"STUB_READ(read_32)
 );
 
-/* call N(%ebx) */
-#define JSRPATCH(p,N) *((short *)(p))=0x53ff;p[2]=N;
-#define JSRPATCHL(p,N) *((short *)(p))=0x93ff; *((int *)((p)+2))=N;
-
 /*
  * enters here only from a fault
  */
@@ -9,6 +9,10 @@
 #define ASMLINKAGE(x,y,z) EXTERN x y z asm(#y)
 #endif
 
+/* call N(%ebx) */
+#define JSRPATCH(p,N) *((short *)(p))=0x53ff;p[2]=N;
+#define JSRPATCHL(p,N) *((short *)(p))=0x93ff; *((int *)((p)+2))=N;
+
 struct rep_stack;
 
 ASMLINKAGE(void,rep_movs_stos,(struct rep_stack *stack));
@@ -17,6 +21,7 @@ ASMLINKAGE(void,stk_32,(dosaddr_t addr, Bit32u value));
 ASMLINKAGE(void,wri_8,(dosaddr_t addr, Bit8u value, unsigned char *eip));
 ASMLINKAGE(void,wri_16,(dosaddr_t addr, Bit16u value, unsigned char *eip));
 ASMLINKAGE(void,wri_32,(dosaddr_t addr, Bit32u value, unsigned char *eip));
+ASMLINKAGE(void,inv_87,(dosaddr_t addr, Bit32u value, unsigned char *eip));
 ASMLINKAGE(Bit8u,read_8,(dosaddr_t addr));
 ASMLINKAGE(Bit16u,read_16,(dosaddr_t addr));
 ASMLINKAGE(Bit32u,read_32,(dosaddr_t addr));
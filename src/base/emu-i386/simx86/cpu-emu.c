@@ -771,6 +771,7 @@ void init_emu_cpu(void)
   else {
     InitGen_x86();
     InitTrees();
+    JitCacheOpen();
   }
 #else
   InitGen_sim();
@@ -799,6 +800,7 @@ void init_emu_cpu(void)
   TheCPU.stub_read_8 = stub_read_8;
   TheCPU.stub_read_16 = stub_read_16;
   TheCPU.stub_read_32 = stub_read_32;
+  TheCPU.stub_inv_87 = stub_inv_87;
 #endif
 
   Running = 1;
@@ -865,8 +867,13 @@ static void print_statistics(void)
 		    (long long)CleanupTime/config.CPUSpeedInMhz);
 	dbug_printf("Max tree nodes    %16d\n",MaxNodes);
 	dbug_printf("Max node size     %16d\n",MaxNodeSize);
-	dbug_printf("Max tree depth    %16d\n",MaxDepth);
+	dbug_printf("Max hash probes   %16d\n",MaxProbes);
 	dbug_printf("Nodes parsed      %16d\n",TotalNodesParsed);
+#ifdef HOST_ARCH_X86
+	if (config.cpuhot)
+		dbug_printf("Seqs simulated    %16d (%d compiled)\n",
+			    SeqsCold, SeqsCompiled);
+#endif
 	dbug_printf("Find misses       %16d\n",NodesNotFound);
 	dbug_printf("Nodes executed    %16d\n",TotalNodesExecd);
 	if (TotalNodesExecd) {
@@ -880,6 +887,14 @@ static void print_statistics(void)
 			    NodesFastFound,k);
 	}
 	dbug_printf("Page faults       %16d\n",PageFaults);
+	dbug_printf("Barrier hits      %16d (%s)\n",
+		    BarrierHits + TheCPU.smc_hits,
+		    SmcBarrier ? "barrier" : "mprotect");
+#ifdef HOST_ARCH_X86
+	if (config.cpucache)
+		dbug_printf("Code cache hits   %16d (%d misses)\n",
+			    JitCacheHits, JitCacheMisses);
+#endif
 	dbug_printf("Signals received  %16d\n",EmuSignals);
 	dbug_printf("Tree cleanups     %16d\n",TreeCleanups);
 #endif
@@ -894,6 +909,11 @@ void leave_cpu_emu(void)
 			IOFF(0x10)=INT10_WATCHER_OFF;
 #endif
 #ifdef HOST_ARCH_X86
+		if (config.cpucheck)
+			dbug_printf("simx86: lockstep checked %d nodes, "
+				    "%d skipped, %d mismatches\n",
+				    LsNodes, LsSkipped, LsErrors);
+		JitCacheClose();
 		EndGen();
 #endif
 #ifdef DEBUG_TREE
@@ -46,17 +46,21 @@
 #define	FAKE_INS_TIME	20
 
 #define MAXINODES	4096
-#define MAX_GEND_BYTES_PER_OP 76
+#define MAX_GEND_BYTES_PER_OP 112
 /* NUMGENS must be large enough in !SINGLESTEP mode */
 #define NUMGENS		128
 #undef	ASM_DUMP
 #define ASM_DUMP_FILE	"/DOS/asmdump.log"
 
-#define AVL_MAX_HEIGHT	20
+#define CPTAB_MINSIZE	8
 #undef	DEBUG_TREE
 #define DEBUG_TREE_FILE	"/DOS/treedump.log"
 
 #define	USE_LINKER	1	// 0 or 1
+#define IC_WAYS		2	// inline cache entries per indirect jump
+#define	LAZY_FLAGS		// skip flag pushes overwritten later in a sequence
+#define	ACC_CACHE		// skip reloads of a register still in %eax
+#define	BULK_STRINGS		// rep string ops on whole page runs in the sim
 #undef	DEBUG_LINKER
 #undef	SHOW_STAT
 
@@ -51,7 +51,7 @@ extern hitimer_t GenTime, LinkTime;
 #endif
 
 #ifdef X86_JIT
-#define CONFIG_CPUSIM (config.cpusim || (CEmuStat & CeS_INSTREMU))
+#define CONFIG_CPUSIM (config.cpusim || (CEmuStat & (CeS_INSTREMU|CeS_COLD)))
 #else
 #define CONFIG_CPUSIM 1
 #endif
@@ -691,6 +691,8 @@ extern int Running;		/* into interpreter loop */
 extern unsigned int mMaxMem;
 extern int UseLinker;
 extern int PageFaults;
+extern int SmcFaults;
+extern int SmcBarrier;
 
 extern volatile int CEmuStat;
 extern volatile int InCompiledCode;
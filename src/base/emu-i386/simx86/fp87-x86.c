@@ -194,6 +194,14 @@ unsigned char *Fp87_op_x86(unsigned char *CodePtr, int exop, int reg)
 //	3B	DB xx111nnn	FSTP	ext
 //	3F	DF xx111nnn	FISTP	qw
 fp_mem:
+		/* FST(P)/FIST(P)/FBSTP/FSTSW to memory: the write barrier
+		 * only invalidates, the store is done here */
+		if (SmcBarrier && ((exop&0x31)==0x11 || exop==0x37 ||
+				   exop==0x3b || exop==0x3d || exop==0x3f)) {
+			unsigned char *skip;
+			Cp = GenWriteBarrier(Cp, 10, Ofs_stub_inv_87, &skip);
+			*skip = Cp - (skip+1);
+		}
 		G3M(0xd8+(exop&7),(exop&0x38)|4,0x2f,Cp);	// Fop (edi,ebp,1)
 		break;
 
@@ -228,6 +236,14 @@ fp_mem:
 		G2(0xc808,Cp);
 		// movw	ax,FPUC(ebx)
 		G3(0x438966,Cp); G1(Ofs_FPUC,Cp);
+		if (SmcBarrier) {
+			unsigned char *skip;
+			Cp = GenWriteBarrier(Cp, 2, Ofs_stub_wri_16, &skip);
+			// movw ax,(edi,ebp,1)
+			G4(0x2f048966,Cp);
+			*skip = Cp - (skip+1);
+			break;
+		}
 		// movw ax,(edi,ebp,1)
 		G4(0x2f048966,Cp);
 		break;
@@ -500,6 +516,9 @@ static int Fp87_op_x86_sim(int exop, int reg)
 			p->fpuc = (p->fpuc & ~0x3f) | (TheCPU.fpuc & 0x3f);
 		    }
 		    TheCPU.fpuc |= 0x3f;
+		    /* not trapped by the write barrier */
+		    e_invalidate(TheCPU.mem_ref, exop==0x31 ?
+				 (reg&DATA16 ? 14 : 28) : (reg&DATA16 ? 94 : 108));
 		    if (exop==0x35) {
 			TheCPU.fpuc = 0x37f;
 			__asm__ __volatile__ ("fninit");
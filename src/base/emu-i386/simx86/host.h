@@ -40,10 +40,22 @@
 #define read_word(x) do_read_word((x), emu_pagefault_handler)
 #define read_dword(x) do_read_dword((x), emu_pagefault_handler)
 #define read_qword(x) do_read_qword((x), emu_pagefault_handler)
-#define write_byte(x,y) do_write_byte((x), (y), emu_pagefault_handler)
-#define write_word(x,y) do_write_word((x), (y), emu_pagefault_handler)
-#define write_dword(x,y) do_write_dword((x), (y), emu_pagefault_handler)
-#define write_qword(x,y) do_write_qword((x), (y), emu_pagefault_handler)
+#ifdef HOST_ARCH_X86
+/* in lockstep check mode stores are logged, and may be dropped */
+int LockstepLog(dosaddr_t addr, int len);
+#define SIM_STORE(a,n) (!(CEmuStat & CeS_CHECK) || LockstepLog((a),(n)))
+/* stores which bypass write_xxx (bulk string ops) can't be logged */
+#define SIM_BULK_STORE() (!(CEmuStat & CeS_CHECK))
+#else
+#define SIM_STORE(a,n) 1
+#define SIM_BULK_STORE() 1
+#endif
+#define SIM_WRITE(op,t,n,x,y) ({ dosaddr_t _a = (x); t _v = (y); \
+	if (SIM_STORE(_a, n)) op(_a, _v, emu_pagefault_handler); })
+#define write_byte(x,y) SIM_WRITE(do_write_byte, uint8_t, 1, x, y)
+#define write_word(x,y) SIM_WRITE(do_write_word, uint16_t, 2, x, y)
+#define write_dword(x,y) SIM_WRITE(do_write_dword, uint32_t, 4, x, y)
+#define write_qword(x,y) SIM_WRITE(do_write_qword, uint64_t, 8, x, y)
 
 #if defined(ppc)||defined(__ppc)||defined(__ppc__)
 /* NO PAGING! */
@@ -160,9 +172,19 @@ static __inline__ void ppc_dswap8(long addr, unsigned long long val)
 	__asm__ ("boundl %0,%1" : : "r"(p),"m"(CS_DTR) : "memory" );\
 	(f&2? *((int *)(a)):*((short *)(a))); })
 #else
-#define Fetch(a)	read_byte(a)
-#define FetchW(a)	read_word(a)
-#define FetchL(a)	read_dword(a)
+/* instruction fetch window: host address of the code page being decoded,
+ * set up by FetchWindow() in interp.c. Code reads within it are plain
+ * loads, anything else goes through read_xxx. */
+extern dosaddr_t FetchBase;
+extern unsigned int FetchLen;
+extern unsigned char *FetchHost;
+#define FETCH_WIN(a,n,rd,slow)	({ \
+	dosaddr_t _fa = (a), _fo = _fa - FetchBase; \
+	(_fo < FetchLen && _fo + (n) <= FetchLen) ? \
+		rd(FetchHost + _fo) : slow(_fa); })
+#define Fetch(a)	FETCH_WIN(a, 1, UNIX_READ_BYTE, read_byte)
+#define FetchW(a)	FETCH_WIN(a, 2, UNIX_READ_WORD, read_word)
+#define FetchL(a)	FETCH_WIN(a, 4, UNIX_READ_DWORD, read_dword)
 #define DataFetchWL_U(m,a) ((m)&DATA16? FetchW(a):FetchL(a))
 #define DataFetchWL_S(m,a) ((m)&DATA16? (short)FetchW(a):(int)FetchL(a))
 #define AddrFetchWL_U(m,a) ((m)&ADDR16? FetchW(a):FetchL(a))
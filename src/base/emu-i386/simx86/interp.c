@@ -355,7 +355,7 @@ static unsigned int _JumpGen(unsigned int P2, int mode, int opc,
 			Gen(JMP_INDIRECT, mode);
 #ifdef HOST_ARCH_X86
 		else
-			Gen(JMP_INDIRECT, mode, &InstrMeta[0].clink);
+			Gen(JMP_INDIRECT, mode, opc, &InstrMeta[0].clink);
 #endif
 		break;
 	default: dbug_printf("JumpGen: unknown condition\n");
@@ -425,7 +425,7 @@ static unsigned int FindExecCode(unsigned int PC)
 #elif !defined(ASM_DUMP)
 		/* try fast inner loop if nothing special is going on */
 		if (!(CEmuStat & (CeS_INHI|CeS_MOVSS)) &&
-		    !debug_level('e') &&
+		    !debug_level('e') && !config.cpucheck &&
 		    GoodNode(G, mode) && !(G->flags & (F_FPOP|F_INHI)))
 			PC = Exec_x86_fast(G);
 		else
@@ -479,6 +479,31 @@ static void HandleEmuSignals(void)
 
 static unsigned int _Interp86(unsigned int PC, int mod0);
 
+dosaddr_t FetchBase;
+unsigned int FetchLen;
+unsigned char *FetchHost;
+
+/* point the fetch window at the code page of PC, if it can be read
+ * directly. The window is dropped on each entry, when the page is
+ * remapped or reprotected (e_invalidate_fetch) and after port I/O,
+ * which can switch A20, EMS or VGA bank mappings from inside the
+ * interpreter loop. */
+static void FetchWindow(unsigned int PC)
+{
+	FetchBase = PC & _PAGE_MASK;
+	FetchHost = dosaddr_to_unixaddr_run(FetchBase, PAGE_SIZE, 0);
+	FetchLen = FetchHost ? PAGE_SIZE : 0;
+}
+
+#define FetchDrop()	(FetchLen = 0)
+
+/* called from dos2linux.c when a range changes mapping or protection */
+void e_invalidate_fetch(unsigned int addr, int len)
+{
+	if (addr - FetchBase < FetchLen || FetchBase - addr < (unsigned)len)
+		FetchDrop();
+}
+
 unsigned int Interp86(unsigned int PC, int mod0)
 {
     unsigned int ret;
@@ -508,6 +533,7 @@ static unsigned int _Interp86(unsigned int PC, int basemode)
 	NewNode = 0;
 	TheCPU.err = 0;
 	CEmuStat &= ~CeS_TRAP;
+	FetchLen = 0;
 
 	while (Running) {
 		OVERR_DS = Ofs_XDS;
@@ -521,6 +547,12 @@ static unsigned int _Interp86(unsigned int PC, int basemode)
 			}
 			if (EFLAGS & TF)
 				CEmuStat |= CeS_TRAP;
+#ifdef HOST_ARCH_X86
+			/* a new sequence starts here: simulate or compile? */
+			if (config.cpuhot && !config.cpusim &&
+			    !(CEmuStat & CeS_INSTREMU))
+				ColdSelect(PC);
+#endif
 		}
 #ifdef HOST_ARCH_X86
 		if (!CONFIG_CPUSIM && e_querymark(PC, 1)) {
@@ -555,6 +587,8 @@ static unsigned int _Interp86(unsigned int PC, int basemode)
 #endif
 #endif
 		P0 = PC;	// P0 changes on instruction boundaries
+		if (PC - FetchBase >= FetchLen)
+			FetchWindow(PC);
 		if (!NewNode) {
 			NewNode = 1;
 			/* if NewNode was already 1, the registers are outdated */
@@ -2534,6 +2568,7 @@ repag0:
 			if (!test_ioperm(a)) goto not_permitted;
 			rd = (mode&ADDR16? rDI:rEDI);
 			WRITE_BYTE(LONG_ES+rd, port_inb(a));
+			FetchDrop();
 			if (EFLAGS & EFLAGS_DF) rd--; else rd++;
 			if (mode&ADDR16) rDI=rd; else rEDI=rd;
 			PC++; } break;
@@ -2610,6 +2645,7 @@ repag0:
 			Gen(O_INPDX, mode|MBYTE); NewNode=1;
 #else
 			rAL = port_inb(a);
+			FetchDrop();
 #endif
 			}
 			PC++; break;
@@ -2621,6 +2657,7 @@ repag0:
 			a = Fetch(PC+1);
 			if (!test_ioperm(a)) goto not_permitted;
 			rAL = port_inb(a);
+			FetchDrop();
 			PC += 2; } break;
 /*6d*/	case INSw: {
 			unsigned int rd;
@@ -2634,6 +2671,7 @@ repag0:
 			else {
 				WRITE_DWORD(LONG_ES+rd, port_ind(rDX)); dp=4;
 			}
+			FetchDrop();
 			if (EFLAGS & EFLAGS_DF) rd-=dp; else rd+=dp;
 			if (mode&ADDR16) rDI=rd; else rEDI=rd;
 			PC++; } break;
@@ -2642,6 +2680,7 @@ repag0:
 			if (!test_ioperm(rDX)) goto not_permitted;
 			if (mode&DATA16) rAX = port_inw(rDX);
 			else rEAX = port_ind(rDX);
+			FetchDrop();
 			} PC++; break;
 /*e5*/	case INw: {
 			unsigned short a;
@@ -2650,6 +2689,7 @@ repag0:
 			if (!test_ioperm(a)) goto not_permitted;
 			if (mode&DATA16) rAX = port_inw(a);
 			else rEAX = port_ind(a);
+			FetchDrop();
 			PC += 2; } break;
 
 /*6e*/	case OUTSb: {
@@ -2661,6 +2701,7 @@ repag0:
 			rs = (mode&ADDR16? rSI:rESI);
 			do {
 			    port_outb(a,Fetch(LONG_DS+rs));
+			    FetchDrop();
 			    if (EFLAGS & EFLAGS_DF) rs--; else rs++;
 			    PC++;
 			} while (Fetch(PC)==OUTSb);
@@ -2681,6 +2722,7 @@ repag0:
 			Gen(O_OUTPDX, mode|MBYTE); NewNode=1;
 #else
 			port_outb(a,rAL);
+			FetchDrop();
 #endif
 			}
 			PC++; break;
@@ -2692,6 +2734,7 @@ repag0:
 			 * the ports under 0x100 are emulated by dosemu */
 			if (!test_ioperm(a)) goto not_permitted;
 			port_outb(a,rAL);
+			FetchDrop();
 			PC += 2; } break;
 /*6f*/	case OUTSw:
 			CODE_FLUSH();
@@ -2711,6 +2754,7 @@ repag0:
 			Gen(O_OUTPDX, mode); NewNode=1;
 #else
 			if (mode&DATA16) port_outw(a,rAX); else port_outd(a,rEAX);
+			FetchDrop();
 #endif
 			}
 			PC++; break;
@@ -2721,6 +2765,7 @@ repag0:
 			a = Fetch(PC+1);
 			if (!test_ioperm(a)) goto not_permitted;
 			if (mode&DATA16) port_outw(a,rAX); else port_outd(a,rEAX);
+			FetchDrop();
 			PC += 2; } break;
 
 /*d8*/	case ESC0:
@@ -2738,6 +2783,15 @@ repag0:
 			// DF -> 07,0f,17,1f...3f
 			int exop = (b & 0x38) | (opc & 7);
 			int sim = 0;
+#ifdef HOST_ARCH_X86
+			if (CEmuStat & CeS_COLD) {
+				/* the FPU state belongs to the JIT */
+				CODE_FLUSH();
+				ColdToJit(P0);
+				PC = P0;
+				continue;
+			}
+#endif
 			if ((b&0xc0)==0xc0) {
 				exop |= 0x40;
 				PC += 2;
@@ -0,0 +1,431 @@
+/*
+ * (C) Copyright 1992, ..., 2014 the "DOSEMU-Development-Team".
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+/*
+ * Persistent translation cache for the x86 JIT.
+ *
+ * Code sequences produced by ProduceCode() are saved, still unlinked,
+ * into a memory-mapped file under the local dosemu directory; a later
+ * run which compiles the same sequence picks the code up from there
+ * and only has to relocate it into a fresh CodeBuf.
+ *
+ * The parser still runs (it executes part of the instructions while
+ * decoding them), so a hit only saves the code generation. Entries are
+ * found by a hash of the guest code bytes, the source range, the
+ * start PC and the mode, and then validated against a hash of the IGen
+ * stream the parser produced, which is all CodeGen() depends on. As
+ * generated code refers to TheCPU and to other globals by offset, the
+ * file is only valid for the same binary; it is discarded when the ELF
+ * build-id differs.
+ *
+ * File layout:
+ *	jc_header, with the bucket table
+ *	jc_entry, Addr2Pc meta[seqnum+1], code[len]	(8-aligned)
+ *	...
+ * Entries are only appended; when the file is full it is reset.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <link.h>
+#undef DT_FLAGS		/* clashes with emu-ldt.h */
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "emu.h"
+#include "utilities.h"
+#include "dosemu_config.h"
+#include "emu86.h"
+#include "dlmalloc.h"
+#include "codegen-arch.h"
+
+#define JC_MAGIC	0x58364a53	/* "SJ6X" */
+#define JC_VERSION	1
+#define JC_NBUCKETS	8192
+#define JC_BUILDID	20
+#define JC_NOLINK	0xffffffffU
+#define JC_MAXSIZE	1024		/* MB */
+
+struct jc_header {
+	unsigned int magic, version;
+	unsigned char buildid[JC_BUILDID];
+	unsigned int cpusize;		/* sizeof(SynCPU) */
+	unsigned int size;		/* of the whole file */
+	unsigned int top;		/* first free byte */
+	unsigned int entries;
+	unsigned int buckets[JC_NBUCKETS];	/* 0 = empty */
+};
+
+struct jc_entry {
+	unsigned int next;		/* offset of next entry in chain */
+	unsigned int pc, mode, seqbase;
+	uint64_t bhash, ghash;
+	unsigned int csum;		/* of meta+code */
+	unsigned short seqlen, seqnum, len;
+	unsigned char t_type, ic_ways;
+	unsigned int t_link, nt_link, ic_link[IC_WAYS];	/* code offsets */
+	Addr2Pc meta[0];
+};
+
+int JitCacheHits, JitCacheMisses;
+
+static struct jc_header *jc;
+static int jc_fd = -1;
+static unsigned char jc_buildid[JC_BUILDID];
+
+/* hashes of the last lookup, for storing the sequence on a miss */
+static struct {
+	int valid;
+	unsigned int pc, mode, seqbase, seqlen;
+	uint64_t bhash, ghash;
+} jc_pend;
+
+/////////////////////////////////////////////////////////////////////////////
+
+/* FNV-1a */
+#define JC_HASH_INIT	0xcbf29ce484222325ULL
+
+static uint64_t jc_hash(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *s = p;
+
+	while (len--) {
+		h ^= *s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t jc_hash32(uint64_t h, unsigned int v)
+{
+	return jc_hash(h, &v, sizeof(v));
+}
+
+static int jc_note_buildid(struct dl_phdr_info *info, size_t size, void *data)
+{
+	ElfW(Addr) self = (ElfW(Addr))data;
+	int i, found = 0;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		ElfW(Addr) start = info->dlpi_addr + ph->p_vaddr;
+		if (ph->p_type == PT_LOAD && self >= start &&
+		    self < start + ph->p_memsz)
+			found = 1;
+	}
+	if (!found)
+		return 0;
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		const unsigned char *p, *end;
+		if (ph->p_type != PT_NOTE)
+			continue;
+		p = (const unsigned char *)(info->dlpi_addr + ph->p_vaddr);
+		end = p + ph->p_memsz;
+		while (p + sizeof(ElfW(Nhdr)) <= end) {
+			const ElfW(Nhdr) *nh = (const ElfW(Nhdr) *)p;
+			const unsigned char *name = p + sizeof(*nh);
+			const unsigned char *desc = name + ((nh->n_namesz + 3) & ~3);
+			if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 &&
+			    memcmp(name, "GNU", 4) == 0) {
+				memcpy(jc_buildid, desc, nh->n_descsz < JC_BUILDID ?
+					nh->n_descsz : JC_BUILDID);
+				return 2;
+			}
+			p = desc + ((nh->n_descsz + 3) & ~3);
+		}
+	}
+	return 1;
+}
+
+static void jc_reset(void)
+{
+	memset(jc->buckets, 0, sizeof(jc->buckets));
+	jc->top = sizeof(struct jc_header);
+	jc->entries = 0;
+}
+
+static size_t jc_entry_size(int seqnum, int len)
+{
+	size_t sz = sizeof(struct jc_entry) + sizeof(Addr2Pc) * (seqnum + 1) + len;
+	return (sz + 7) & ~7;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+void JitCacheOpen(void)
+{
+	struct stat st;
+	char *path;
+	size_t size;
+	void *p;
+
+	JitCacheHits = JitCacheMisses = 0;
+	jc_pend.valid = 0;
+	if (jc || config.cpucache <= 0)
+		return;
+	if (dl_iterate_phdr(jc_note_buildid, (void *)JitCacheOpen) != 2) {
+		error("CPUEMU: no build-id, code cache disabled\n");
+		return;
+	}
+	size = (size_t)(config.cpucache > JC_MAXSIZE ? JC_MAXSIZE :
+		config.cpucache) << 20;
+	path = assemble_path(dosemu_localdir_path, "simx86.cache");
+	jc_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (jc_fd == -1) {
+		error("CPUEMU: cannot open code cache %s\n", path);
+		free(path);
+		return;
+	}
+	if (flock(jc_fd, LOCK_EX | LOCK_NB) == -1) {
+		/* another dosemu is using it */
+		e_printf("CPUEMU: code cache %s busy, disabled\n", path);
+		goto err;
+	}
+	if (fstat(jc_fd, &st) == -1)
+		goto err;
+	if (st.st_size != size && ftruncate(jc_fd, size) == -1)
+		goto err;
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, jc_fd, 0);
+	if (p == MAP_FAILED)
+		goto err;
+	jc = p;
+	if (st.st_size != size || jc->magic != JC_MAGIC ||
+	    jc->version != JC_VERSION || jc->cpusize != sizeof(SynCPU) ||
+	    jc->size != size || jc->top < sizeof(struct jc_header) ||
+	    jc->top > size ||
+	    memcmp(jc->buildid, jc_buildid, JC_BUILDID) != 0) {
+		e_printf("CPUEMU: code cache %s reset\n", path);
+		memset(jc, 0, sizeof(*jc));
+		jc->magic = JC_MAGIC;
+		jc->version = JC_VERSION;
+		memcpy(jc->buildid, jc_buildid, JC_BUILDID);
+		jc->cpusize = sizeof(SynCPU);
+		jc->size = size;
+		jc_reset();
+	}
+	e_printf("CPUEMU: code cache %s, %d entries, %u/%u bytes used\n",
+		 path, jc->entries, jc->top, jc->size);
+	free(path);
+	return;
+
+err:
+	free(path);
+	close(jc_fd);
+	jc_fd = -1;
+}
+
+void JitCacheClose(void)
+{
+	if (!jc)
+		return;
+	e_printf("CPUEMU: code cache hits %d misses %d entries %d\n",
+		 JitCacheHits, JitCacheMisses, jc->entries);
+	munmap(jc, jc->size);
+	jc = NULL;
+	close(jc_fd);
+	jc_fd = -1;
+}
+
+/*
+ * Called by CloseAndExec after the parse, in place of ProduceCode().
+ * Returns a CodeBuf with the code and I0 filled as ProduceCode()
+ * would do, or NULL if the sequence has to be compiled.
+ */
+CodeBuf *JitCacheLookup(unsigned int PC, int mode, IMeta *I0)
+{
+	unsigned int adr_lo, adr_hi, off, nap;
+	uint64_t bhash, ghash;
+	struct jc_entry *e;
+	unsigned char *code, *BaseGenBuf;
+	CodeBuf *GenCodeBuf;
+	linkdesc *L;
+	int i, j;
+
+	jc_pend.valid = 0;
+	if (!jc || CurrIMeta <= 0)
+		return NULL;
+
+	/* source range, as computed by ProduceCode */
+	adr_lo = adr_hi = I0->npc;
+	for (i = 1; i < CurrIMeta; i++) {
+		if (I0[i].npc < adr_lo) adr_lo = I0[i].npc;
+		else if (I0[i].npc > adr_hi) adr_hi = I0[i].npc;
+	}
+	if (PC < adr_lo) adr_lo = PC;
+	else if (PC > adr_hi) adr_hi = PC;
+	if (adr_hi - adr_lo > 0xffff)
+		return NULL;
+
+	bhash = jc_hash32(JC_HASH_INIT, I0->npc);
+	bhash = jc_hash32(bhash, PC);
+	bhash = jc_hash32(bhash, mode);
+	bhash = jc_hash32(bhash, adr_lo);
+	bhash = jc_hash32(bhash, adr_hi - adr_lo);
+	for (off = adr_lo; off < adr_hi; off++) {
+		unsigned char c = Fetch(off);
+		bhash = jc_hash(bhash, &c, 1);
+	}
+
+	ghash = jc_hash32(JC_HASH_INIT, CurrIMeta);
+	ghash = jc_hash32(ghash, UseLinker | (SmcBarrier << 1));
+	for (i = 0; i < CurrIMeta; i++) {
+		IMeta *I = &I0[i];
+		ghash = jc_hash32(ghash, I->npc - I0->npc);
+		ghash = jc_hash32(ghash, I->ngen);
+		for (j = 0; j < I->ngen; j++)
+			ghash = jc_hash(ghash, &I->gen[j], offsetof(IGen, lt));
+	}
+
+	jc_pend.valid = 1;
+	jc_pend.pc = I0->npc;
+	jc_pend.mode = mode;
+	jc_pend.seqbase = adr_lo;
+	jc_pend.seqlen = adr_hi - adr_lo;
+	jc_pend.bhash = bhash;
+	jc_pend.ghash = ghash;
+
+	e = NULL;
+	off = jc->buckets[bhash & (JC_NBUCKETS - 1)];
+	while (off >= sizeof(struct jc_header) &&
+	       off + sizeof(struct jc_entry) <= jc->top) {
+		struct jc_entry *n = (struct jc_entry *)((char *)jc + off);
+		if (n->bhash == bhash && n->ghash == ghash &&
+		    n->pc == I0->npc && n->mode == mode &&
+		    n->seqbase == adr_lo && n->seqlen == adr_hi - adr_lo &&
+		    n->seqnum == CurrIMeta &&
+		    off + jc_entry_size(n->seqnum, n->len) <= jc->top) {
+			e = n;
+			break;
+		}
+		/* entries are prepended, so a chain always goes down
+		 * the file; anything else is garbage */
+		if (n->next >= off)
+			break;
+		off = n->next;
+	}
+	if (e == NULL) {
+		JitCacheMisses++;
+		return NULL;
+	}
+
+	/* validate the entry against the parse and itself */
+	nap = e->seqnum + 1;
+	code = (unsigned char *)&e->meta[nap];
+	if ((unsigned int)jc_hash(JC_HASH_INIT, e->meta,
+	    sizeof(Addr2Pc) * nap + e->len) != e->csum)
+		goto bad;
+	for (i = 0; i < CurrIMeta; i++) {
+		if (e->meta[i].dnpc != (signed short)(I0[i].npc - I0->npc) ||
+		    e->meta[i].daddr > e->meta[i+1].daddr)
+			goto bad;
+	}
+	if (e->meta[CurrIMeta].daddr > e->len || e->ic_ways > IC_WAYS)
+		goto bad;
+	if (e->t_link != JC_NOLINK && e->t_link + 4 > e->len)
+		goto bad;
+	if (e->nt_link != JC_NOLINK && e->nt_link + 4 > e->len)
+		goto bad;
+	for (i = 0; i < e->ic_ways; i++)
+		if (e->ic_link[i] + 4 > e->len)
+			goto bad;
+
+	GenCodeBuf = dlmalloc(e->len + offsetof(CodeBuf, meta) +
+			      sizeof(Addr2Pc) * nap);
+	BaseGenBuf = (unsigned char *)&GenCodeBuf->meta[nap];
+	memcpy(BaseGenBuf, code, e->len);
+	for (i = 0; i < CurrIMeta; i++) {
+		I0[i].daddr = e->meta[i].daddr;
+		I0[i].len = e->meta[i+1].daddr - e->meta[i].daddr;
+	}
+	I0->seqbase = adr_lo;
+	I0->seqlen = adr_hi - adr_lo;
+	I0->totlen = e->len;
+
+	/* linker info, as left by CodeGen: offsets for links to other
+	 * nodes, a pointer for the tail code */
+	L = &I0->clink;
+	L->t_type = e->t_type;
+	if (e->t_type >= JMP_LINK) {
+		L->t_link.rel = e->t_link;
+		L->nt_link.rel = e->nt_link == JC_NOLINK ? 0 : e->nt_link;
+	} else {
+		L->t_link.abs = e->t_link == JC_NOLINK ? NULL :
+			(unsigned int *)(BaseGenBuf + e->t_link);
+		L->nt_link.abs = NULL;
+	}
+	L->ic_ways = e->ic_ways;
+	for (i = 0; i < e->ic_ways; i++)
+		L->ic_link[i].rel = e->ic_link[i];
+
+	jc_pend.valid = 0;
+	JitCacheHits++;
+	if (debug_level('e')>2)
+		e_printf("Code cache hit at %08x len=%d\n", I0->npc, e->len);
+	return GenCodeBuf;
+
+bad:
+	e_printf("CPUEMU: bad code cache entry at %08x, reset\n", I0->npc);
+	jc_reset();
+	JitCacheMisses++;
+	return NULL;
+}
+
+/*
+ * Called with a node freshly compiled after a lookup miss, before it
+ * is linked to other nodes.
+ */
+void JitCacheStore(TNode *G)
+{
+	struct jc_entry *e;
+	unsigned int nap, slot;
+	size_t sz;
+	int i;
+
+	if (!jc || !jc_pend.valid || G->key != jc_pend.pc)
+		return;
+	jc_pend.valid = 0;
+
+	nap = G->seqnum + 1;
+	sz = jc_entry_size(G->seqnum, G->len);
+	if (sz > jc->size - sizeof(struct jc_header))
+		return;
+	if (jc->top + sz > jc->size) {
+		e_printf("CPUEMU: code cache full, reset\n");
+		jc_reset();
+	}
+
+	e = (struct jc_entry *)((char *)jc + jc->top);
+	e->pc = G->key;
+	e->mode = jc_pend.mode;
+	e->seqbase = jc_pend.seqbase;
+	e->seqlen = jc_pend.seqlen;
+	e->bhash = jc_pend.bhash;
+	e->ghash = jc_pend.ghash;
+	e->seqnum = G->seqnum;
+	e->len = G->len;
+	e->t_type = G->clink.t_type;
+	e->t_link = G->clink.t_link.abs ?
+		(unsigned char *)G->clink.t_link.abs - G->addr : JC_NOLINK;
+	e->nt_link = G->clink.nt_link.abs ?
+		(unsigned char *)G->clink.nt_link.abs - G->addr : JC_NOLINK;
+	e->ic_ways = G->clink.ic_ways;
+	for (i = 0; i < G->clink.ic_ways; i++)
+		e->ic_link[i] = (unsigned char *)G->clink.ic_link[i].abs - G->addr;
+	memcpy(e->meta, G->pmeta, sizeof(Addr2Pc) * nap);
+	memcpy(&e->meta[nap], G->addr, G->len);
+	e->csum = jc_hash(JC_HASH_INIT, e->meta, sizeof(Addr2Pc) * nap + G->len);
+
+	slot = e->bhash & (JC_NBUCKETS - 1);
+	e->next = jc->buckets[slot];
+	jc->buckets[slot] = jc->top;
+	jc->top += sz;
+	jc->entries++;
+}
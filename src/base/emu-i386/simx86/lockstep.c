@@ -0,0 +1,178 @@
+/*
+ * (C) Copyright 1992, ..., 2014 the "DOSEMU-Development-Team".
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+/*
+ * Lockstep check of a native code generator against the simulator.
+ *
+ * With config.cpucheck every compiled node is run twice: first by the
+ * simulator backend, for as many instructions as the node holds, then,
+ * after the simulator's stores and CPU state have been rolled back, by
+ * the compiled code itself. The registers, flags, next PC and the
+ * memory written by the simulator are then compared, and mismatches
+ * are reported with the node address.
+ *
+ * The simulator's stores go through write_xxx (host.h), which call
+ * LockstepLog() while CeS_CHECK is set; it saves the old contents
+ * so the stores can be undone. The bulk rep movs/stos paths of
+ * codegen-sim.c store with memcpy/memset instead, so they are off
+ * while checking (SIM_BULK_STORE) and those ops go element by element
+ * through write_xxx. Stores which can't be undone (VGA, traced MMIO,
+ * translated code, DPMI pages the node can't write) are dropped and
+ * the node is skipped. Nodes with FPU ops are also skipped, as the JIT
+ * keeps the FPU state in the real FPU and the simulator in TheCPU.
+ * The linker is off while checking, so that one execution covers
+ * exactly one node.
+ *
+ * This is a debugging aid for backend work; it slows everything down.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu.h"
+#include "emudpmi.h"
+#include "vgaemu.h"
+#include "mmio_tracing.h"
+#include "emu86.h"
+#include "codegen-arch.h"
+
+typedef struct {
+	dosaddr_t addr;
+	int len;
+	uint64_t old, sim;
+} LsEntry;
+
+static LsEntry *LsLog;
+static int LsLogLen, LsLogSize, LsAbort;
+static SynCPU LsSim;
+static unsigned int LsSimPC;
+
+int LsNodes, LsSkipped, LsErrors;
+
+/* called for every simulator store in check mode; returns 0 to drop it */
+int LockstepLog(dosaddr_t addr, int len)
+{
+	LsEntry *e;
+
+	if (LsAbort)
+		return 0;
+	if (vga_write_access(addr) || vga_write_access(addr + len - 1) ||
+	    (config.mmio_tracing && mmio_check(addr)) ||
+	    e_querymark(addr, len) ||
+	    (addr + len > LOWMEM_SIZE + HMASIZE &&
+	     !(dpmi_write_access(addr) && dpmi_write_access(addr + len - 1)))) {
+		LsAbort = 1;
+		return 0;
+	}
+	if (LsLogLen == LsLogSize) {
+		LsLogSize = LsLogSize ? 2*LsLogSize : 256;
+		LsLog = realloc(LsLog, LsLogSize * sizeof(LsEntry));
+	}
+	e = &LsLog[LsLogLen++];
+	e->addr = addr;
+	e->len = len;
+	e->old = 0;
+	memcpy(&e->old, MEM_BASE32(addr), len);
+	return 1;
+}
+
+/* run node G in the simulator and undo its effects; returns 1 if the
+ * result is to be compared by LockstepCheck() after the real execution */
+int LockstepSim(TNode *G)
+{
+	SynCPU pre;
+	jmp_buf env;
+	int stat = CEmuStat;
+	LsEntry *e;
+
+	if ((G->flags & (F_FPOP|F_INHI)) || (EFLAGS & TF)) {
+		LsSkipped++;
+		return 0;
+	}
+	pre = TheCPU;
+	/* the simulator sets up its own fault return */
+	memcpy(env, jmp_env, sizeof(jmp_buf));
+	CEmuStat = (stat & ~(CeS_SIGPEND|CeS_RPIC|CeS_STI|CeS_MOVSS|CeS_INHI|
+			     CeS_TRAP|CeS_DRTRAP)) | CeS_INSTREMU | CeS_CHECK;
+	LsLogLen = LsAbort = 0;
+	InitGen_sim();
+	instr_emu_sim_reset_count(G->seqnum - 1);
+	LsSimPC = Interp86(G->key, G->mode);
+	FlagSync_All();
+	LsSim = TheCPU;
+
+	for (e = LsLog; e < &LsLog[LsLogLen]; e++) {
+		e->sim = 0;
+		memcpy(&e->sim, MEM_BASE32(e->addr), e->len);
+	}
+	for (e = &LsLog[LsLogLen]; e-- > LsLog; )
+		memcpy(dosaddr_to_unixaddr(e->addr), &e->old, e->len);
+
+	TheCPU = pre;
+	memcpy(jmp_env, env, sizeof(jmp_buf));
+	InitGen_x86();
+	CEmuStat = stat;
+
+	if (LsAbort || LsSim.err != EXCP_GOBACK) {
+		LsSkipped++;
+		return 0;
+	}
+	LsNodes++;
+	return 1;
+}
+
+#define LS_BAD() \
+	if (!bad++) \
+		dbug_printf("simx86: lockstep mismatch in node %08x (%d instr)\n", \
+			    G->key, G->seqnum)
+
+#define LS_CMP(r) \
+	if (LsSim.r != TheCPU.r) { \
+		LS_BAD(); \
+		dbug_printf("  %-6s sim=%08x jit=%08x\n", #r, \
+			    (unsigned)LsSim.r, (unsigned)TheCPU.r); \
+	}
+
+/* compare the state left by the compiled node with the simulator's */
+void LockstepCheck(TNode *G, unsigned int ePC)
+{
+	int bad = 0;
+	LsEntry *e;
+
+	if (TheCPU.err) {
+		/* the node faulted; the simulator result can't be compared */
+		LsNodes--;
+		LsSkipped++;
+		return;
+	}
+	if (LsSimPC != ePC) {
+		LS_BAD();
+		dbug_printf("  PC     sim=%08x jit=%08x\n", LsSimPC, ePC);
+	}
+	LS_CMP(eax); LS_CMP(ebx); LS_CMP(ecx); LS_CMP(edx);
+	LS_CMP(esi); LS_CMP(edi); LS_CMP(ebp); LS_CMP(esp);
+	LS_CMP(cs); LS_CMP(ds); LS_CMP(es); LS_CMP(ss);
+	LS_CMP(fs); LS_CMP(gs);
+	/* AF is undefined after the logic ops, and the simulator leaves it */
+	if ((LsSim.eflags ^ TheCPU.eflags) & EFLAGS_CC & ~EFLAGS_AF) {
+		LS_BAD();
+		dbug_printf("  eflags sim=%08x jit=%08x\n",
+			    LsSim.eflags & EFLAGS_CC, TheCPU.eflags & EFLAGS_CC);
+	}
+	for (e = LsLog; e < &LsLog[LsLogLen]; e++) {
+		uint64_t v = 0;
+		memcpy(&v, MEM_BASE32(e->addr), e->len);
+		if (v != e->sim) {
+			LS_BAD();
+			dbug_printf("  [%08x] sim=%0*llx jit=%0*llx\n", e->addr,
+				    2*e->len, (unsigned long long)e->sim,
+				    2*e->len, (unsigned long long)v);
+		}
+	}
+	if (bad)
+		LsErrors++;
+}
@@ -64,6 +64,8 @@ typedef struct _mpmap {
 static tMpMap *MpH = NULL;
 unsigned int mMaxMem = 0;
 int PageFaults = 0;
+int SmcFaults = 0;
+int SmcBarrier = 0;
 static tMpMap *LastMp = NULL;
 
 static int e_munprotect(unsigned int addr, size_t len);
@@ -110,6 +112,13 @@ static int AddMpMap(unsigned int addr, unsigned int aend, int onoff)
 			    test_and_clear_bit(page&255, M->pagemap)) & 1) << bp);
 		bp++;
 	    }
+	    /* low memory pages are mirrored for the JIT write barrier */
+	    if (addr < LOWMEM_SIZE + HMASIZE) {
+		if (onoff)
+		    TheCPU.smc_map[page >> 5] |= 1u << (page & 31);
+		else
+		    TheCPU.smc_map[page >> 5] &= ~(1u << (page & 31));
+	    }
 	    if (debug_level('e')>1) {
 		if (addr > mMaxMem) mMaxMem = addr;
 		if (onoff)
@@ -310,6 +319,17 @@ int e_mprotect(unsigned int addr, size_t len)
 	/* only protect ranges that were not already protected by e_mprotect */
 	for (a = abeg; a <= aend; a += PAGE_SIZE) {
 	    int qp = e_querymprot(a);
+	    /* in write barrier mode low memory is checked by the
+	     * compiled stores themselves: only keep the page map, and
+	     * drop the page from the soft TLB so that the stores from
+	     * C code (do_write_*) see it as protected again */
+	    if (SmcBarrier && a < LOWMEM_SIZE + HMASIZE) {
+		if (!qp) {
+		    ret = AddMpMap(a, a+PAGE_SIZE-1, 1);
+		    invalidate_unprotected_page_cache(a, PAGE_SIZE);
+		}
+		continue;
+	    }
 	    if (!qp) {
 		if (abeg1 == (unsigned)-1)
 		    abeg1 = a;
@@ -347,6 +367,13 @@ static int e_munprotect(unsigned int addr, size_t len)
 	/* only unprotect ranges that were protected by e_mprotect */
 	for (a = abeg; a <= aend; a += PAGE_SIZE) {
 	    int qp = e_querymprot(a);
+	    if (SmcBarrier && a < LOWMEM_SIZE + HMASIZE) {
+		if (qp) {
+		    ret = AddMpMap(a, a+PAGE_SIZE-1, 0);
+		    invalidate_unprotected_page_cache(a, PAGE_SIZE);
+		}
+		continue;
+	    }
 	    if (qp) {
 		if (abeg1 == (unsigned)-1)
 		    abeg1 = a;
@@ -413,7 +440,10 @@ int e_handle_pagefault(dosaddr_t addr, unsigned err, sigcontext_t *scp)
 	 *	(f3)(66)aa,ab	stos
 	 */
 #ifdef PROFILE
-	if (debug_level('e')) PageFaults++;
+	if (debug_level('e')) {
+		PageFaults++;
+		SmcFaults++;
+	}
 #endif
 	in_dosemu = !(InCompiledCode || in_vm86 || DPMIValidSelector(_scp_cs));
 	if (in_vm86)
@@ -509,6 +539,7 @@ void mprot_end(void)
 	    free(M2);
 	}
 	MpH = LastMp = NULL;
+	memset(TheCPU.smc_map, 0, sizeof(TheCPU.smc_map));
 }
 
 /////////////////////////////////////////////////////////////////////////////
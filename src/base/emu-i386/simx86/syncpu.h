@@ -48,6 +48,9 @@
 #define PADDING32BIT(n) unsigned int padding##n;
 #endif
 
+#define RAS_SIZE	16	/* return address stack, power of 2 */
+#define SMC_MAPSIZE	10	/* words of code page bitmap, covers LOWMEM+HMA */
+
 typedef struct {
 /* offsets are 8-bit signed */
 #define FIELD0		unprotect_stub	/* field of SynCPU at offset 00 */
@@ -102,7 +105,7 @@ typedef struct {
 /* ------------------------------------------------ */
 /*60*/	unsigned short sigalrm_pending, sigprof_pending;
 /*64*/	unsigned int StackMask;
-/*68*/	unsigned int reserve2;
+/*68*/	unsigned int ic_exec;	/* indirect jumps from compiled code */
 /*6c*/ 	unsigned int df_increments; /* either 0x040201 or 0xfcfeff */
 	/* begin of cr array */
 /*70*/	unsigned int cr[5]; /* only cr[0] is used in compiled code */
@@ -150,6 +153,7 @@ typedef struct {
 	void (*stub_read_8)(void);
 	void (*stub_read_16)(void);
 	void (*stub_read_32)(void);
+	void (*stub_inv_87)(void);
 
 	/* should be moved to TSS once implemented */
 	struct revectored_struct int_revectored;
@@ -158,6 +162,20 @@ typedef struct {
 	   if NULL, emulator uses FPU instructions, so flags that
 	   dosemu needs to restore its own FPU environment. */
 	emu_fpregset_t fpstate;
+
+	/* return address stack, filled by compiled near calls and
+	   used by compiled near returns */
+	unsigned int ras_top;
+	unsigned int ras_pc[RAS_SIZE];
+	unsigned char *ras_addr[RAS_SIZE];
+	unsigned int ras_hits;
+	/* key of the last node leaving through an inline cache miss */
+	unsigned int ic_miss;
+
+	/* write barrier: one bit per low memory page containing code,
+	   mirrors the mprotect page map; stores hitting it are counted */
+	unsigned int smc_map[SMC_MAPSIZE];
+	unsigned int smc_hits;
 } SynCPU;
 
 union _SynCPU {
@@ -236,8 +254,17 @@ extern union _SynCPU TheCPU_union;
 #define Ofs_stub_read_8	(unsigned int)(offsetof(SynCPU,stub_read_8)-SCBASE)
 #define Ofs_stub_read_16	(unsigned int)(offsetof(SynCPU,stub_read_16)-SCBASE)
 #define Ofs_stub_read_32	(unsigned int)(offsetof(SynCPU,stub_read_32)-SCBASE)
+#define Ofs_stub_inv_87	(unsigned int)(offsetof(SynCPU,stub_inv_87)-SCBASE)
 #define Ofs_ERR		(unsigned int)(offsetof(SynCPU,err)-SCBASE)
 #define Ofs_int_revectored	(unsigned int)(offsetof(SynCPU,int_revectored)-SCBASE)
+#define Ofs_ICEXEC	(unsigned char)(offsetof(SynCPU,ic_exec)-SCBASE)
+#define Ofs_RASTOP	(unsigned int)(offsetof(SynCPU,ras_top)-SCBASE)
+#define Ofs_RASPC	(unsigned int)(offsetof(SynCPU,ras_pc)-SCBASE)
+#define Ofs_RASADDR	(unsigned int)(offsetof(SynCPU,ras_addr)-SCBASE)
+#define Ofs_RASHITS	(unsigned int)(offsetof(SynCPU,ras_hits)-SCBASE)
+#define Ofs_ICMISS	(unsigned int)(offsetof(SynCPU,ic_miss)-SCBASE)
+#define Ofs_SMCMAP	(unsigned int)(offsetof(SynCPU,smc_map)-SCBASE)
+#define Ofs_SMCHITS	(unsigned int)(offsetof(SynCPU,smc_hits)-SCBASE)
 
 #define rAX		CPUWORD(Ofs_AX)
 #define Ofs_AX		(Ofs_EAX)
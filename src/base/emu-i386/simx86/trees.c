@@ -30,13 +30,6 @@
  *  (linux/arch/i386/kernel/vm86.c). This code originally was written by
  *  Linus Torvalds with later enhancements by Lutz Molgedey and Hans Lermen.
  *
- * 2. The tree handling routines were adapted from libavl:
- *  libavl - manipulates AVL trees.
- *  Copyright (C) 1998, 1999 Free Software Foundation, Inc.
- *  The author may be contacted at <pfaffben@pilot.msu.edu> on the
- *  Internet, or as Ben Pfaff, 12167 Airport Rd, DeWitt MI 48820, USA
- *  through more mundane means.
- *
  ***************************************************************************/
 
 #include <stddef.h>
@@ -53,19 +46,26 @@
 IMeta	*InstrMeta;
 int	CurrIMeta = -1;
 
-/* Tree structure to store collected code sequences */
-avltr_tree CollectTree;
-avltr_traverser Traverser;
+/* Page directory of collected code sequences */
+#define CPDIR_SHIFT	10
+#define CPDIR_SIZE	(1 << CPDIR_SHIFT)
+#define CPDIR_MASK	(CPDIR_SIZE - 1)
+static CodePage **CodePageDir[1 << (32 - PAGE_SHIFT - CPDIR_SHIFT)];
+static CodePage *CodePages;	/* list of all code pages */
+static CodePage *CleanPage;	/* TraverseAndClean cursor */
+static int CleanSlot;
 int ninodes = 0;
+static int ncpages = 0;
 
 int NodesCleaned = 0;
 int NodesParsed = 0;
+int NodesIcMissed = 0;
 int NodesExecd = 0;
 int CleanFreq = 8;
 int CreationIndex = 0;
 
 #ifdef PROFILE
-int MaxDepth = 0;
+int MaxProbes = 0;
 int MaxNodes = 0;
 int MaxNodeSize = 0;
 int TotalNodesParsed = 0;
@@ -74,6 +74,7 @@ int NodesFound = 0;
 int NodesFastFound = 0;
 int NodesNotFound = 0;
 int TreeCleanups = 0;
+int BarrierHits = 0;
 #endif
 
 #ifdef HOST_ARCH_X86
@@ -89,19 +90,23 @@ int NodeLimit = 10000;
 #define ADDR_IN_RANGE(a,l,h)		({typeof(a) _a2=(a);	\
 	((_a2 >= (l)) && (_a2 < (h))); })
 
-/////////////////////////////////////////////////////////////////////////////
+/* slot of a page offset in a code page table */
+#define CPSLOT(cp,k)	(((k) ^ ((k) >> 6)) & ((cp)->size - 1))
+
+/* iterate over all nodes of all code pages */
+#define FOR_EACH_NODE(cp,i,G) \
+	for (cp = CodePages; cp; cp = cp->next) \
+	    for (i = 0; i < cp->size; i++) \
+		if ((G = cp->tab[i]) != NULL)
 
-#define NEXTNODE(g)	({__typeof__(g) _g = (g)->link[1]; \
-			  if ((g)->rtag == PLUS) \
-			    while (_g->link[0]!=NULL) _g=_g->link[0]; \
-			  _g; })
+/////////////////////////////////////////////////////////////////////////////
 
 static inline TNode *Tmalloc(void)
 {
-  TNode *G  = TNodePool->link[0];
-  TNode *G1 = G->link[0];
+  TNode *G  = TNodePool->next;
+  TNode *G1 = G->next;
   if (G1==TNodePool) leavedos_main(0x4c4c); // return NULL;
-  TNodePool->link[0] = G1; G->link[0]=NULL;
+  TNodePool->next = G1; G->next=NULL;
   memset(G, 0, sizeof(TNode));	// "bug covering"
   return G;
 }
@@ -110,450 +115,267 @@ static inline void Tfree(TNode *G)
 {
   G->key = G->alive = 0;
   G->addr = NULL;
-  G->link[0] = TNodePool->link[0];
-  TNodePool->link[0] = G;
+  G->next = TNodePool->next;
+  TNodePool->next = G;
 }
 
 /////////////////////////////////////////////////////////////////////////////
 
-static inline void datacopy(TNode *nd, TNode *ns)
+static inline CodePage *FindCodePage(unsigned int page)
 {
-  char *s = (char *)&(ns->key);
-  char *d = (char *)&(nd->key);
-  int l = sizeof(TNode)-offsetof(TNode,key);
-  memcpy(d,s,l);
+  CodePage **dir = CodePageDir[page >> CPDIR_SHIFT];
+
+  if (dir == NULL) return NULL;
+  return dir[page & CPDIR_MASK];
 }
 
-static TNode *avltr_probe (const int key, int *found)
+static CodePage *GetCodePage(unsigned int page)
 {
-  avltr_tree *tree = &CollectTree;
-  TNode *t;
-  TNode *s, *p, *q, *r;
-  int k = 1;
-
-  t = &tree->root;
-  s = p = t->link[0];
-
-  if (s == NULL) {
-      tree->count++;
-      ninodes = tree->count;
-      q = t->link[0] = Tmalloc();
-      q->link[0] = NULL;
-      q->link[1] = t;
-      q->rtag = MINUS;
-      q->bal = 0;
-      return q;
+  CodePage **dir = CodePageDir[page >> CPDIR_SHIFT];
+  CodePage *cp;
+
+  if (dir == NULL) {
+      dir = calloc(CPDIR_SIZE, sizeof(CodePage *));
+      CodePageDir[page >> CPDIR_SHIFT] = dir;
   }
+  cp = dir[page & CPDIR_MASK];
+  if (cp == NULL) {
+      cp = calloc(1, sizeof(CodePage));
+      cp->page = page;
+      cp->size = CPTAB_MINSIZE;
+      cp->tab = calloc(cp->size, sizeof(TNode *));
+      cp->next = CodePages;
+      if (CodePages) CodePages->prev = cp;
+      CodePages = cp;
+      dir[page & CPDIR_MASK] = cp;
+      ncpages++;
+      if (debug_level('e')>2) e_printf("New code page %05x\n",page);
+  }
+  return cp;
+}
 
-  for (;;) {
-      int diff = (key - p->key);
-
-      if (diff < 0) {
-	  p->cache = 0;
-	  q = p->link[0];
-	  if (q == NULL) {
-	      q = Tmalloc();
-	      p->link[0] = q;
-	      q->link[0] = NULL;
-	      q->link[1] = p;
-	      q->rtag = MINUS;
-	      break;
-	  }
-      }
-      else if (diff > 0) {
-	  p->cache = 1;
-	  q = p->link[1];
-	  if (p->rtag == MINUS) {
-	      q = Tmalloc();
-	      q->link[1] = p->link[1];
-	      q->rtag = p->rtag;
-	      p->link[1] = q;
-	      p->rtag = PLUS;
-	      q->link[0] = NULL;
-	      break;
-	  }
-      }
-      else {	/* found */
-        *found = 1;
-	return p;
-      }
+static void FreeCodePage(CodePage *cp)
+{
+  if (debug_level('e')>2) e_printf("Free code page %05x\n",cp->page);
+  if (CleanPage == cp) {
+      CleanPage = cp->next;
+      CleanSlot = 0;
+  }
+  if (cp->prev) cp->prev->next = cp->next;
+    else CodePages = cp->next;
+  if (cp->next) cp->next->prev = cp->prev;
+  CodePageDir[cp->page >> CPDIR_SHIFT][cp->page & CPDIR_MASK] = NULL;
+  ncpages--;
+  free(cp->tab);
+  free(cp->res);
+  free(cp);
+}
+
+static inline int CodePageEmpty(CodePage *cp)
+{
+  return cp->count == 0 && cp->nres == 0;
+}
 
-      if (q->bal != 0) t = p, s = q;
-      p = q;
-      k++;
-/**/ if (k>=AVL_MAX_HEIGHT) leavedos_main(0x777);
+static TNode **CodePageProbe(CodePage *cp, int key)
+{
+  unsigned int k = key & ~_PAGE_MASK;
+  unsigned int i = CPSLOT(cp, k);
 #ifdef PROFILE
-      if (debug_level('e')) if (k>MaxDepth) MaxDepth=k;
+  int d = 1;
 #endif
-  }
 
-  tree->count++;
-  ninodes = tree->count;
+  while (cp->tab[i] && cp->tab[i]->key != key) {
+      i = (i + 1) & (cp->size - 1);
 #ifdef PROFILE
-  if (debug_level('e')) if (ninodes > MaxNodes) MaxNodes = ninodes;
+      d++;
 #endif
-  q->bal = 0;
-
-  r = p = s->link[(int) s->cache];
-  while (p != q) {
-      p->bal = p->cache * 2 - 1;
-      p = p->link[(int) p->cache];
   }
+#ifdef PROFILE
+  if (debug_level('e')) if (d>MaxProbes) MaxProbes=d;
+#endif
+  return &cp->tab[i];
+}
 
-  if (s->cache == 0) {
-      if (s->bal == 0) {
-	  s->bal = -1;
-	  return q;
-      }
-      else if (s->bal == +1) {
-	  s->bal = 0;
-	  return q;
-      }
+static void CodePageGrow(CodePage *cp)
+{
+  TNode **otab = cp->tab;
+  int i, osize = cp->size;
+
+  cp->size <<= 1;
+  cp->tab = calloc(cp->size, sizeof(TNode *));
+  for (i = 0; i < osize; i++)
+      if (otab[i])
+	  *CodePageProbe(cp, otab[i]->key) = otab[i];
+  free(otab);
+  /* the cursor position is meaningless in the new table */
+  if (CleanPage == cp) CleanSlot = 0;
+}
 
-      if (r->bal == -1)	{
-	  p = r;
-	  if (r->rtag == MINUS) {
-	      s->link[0] = NULL;
-	      r->link[1] = s;
-	      r->rtag = PLUS;
-	  }
-	  else {
-	      s->link[0] = r->link[1];
-	      r->link[1] = s;
-	  }
-	  s->bal = r->bal = 0;
-      }
-      else {
-	  p = r->link[1];
-	  r->link[1] = p->link[0];
-	  p->link[0] = r;
-	  s->link[0] = p->link[1];
-	  p->link[1] = s;
-	  if (p->bal == -1) s->bal = 1, r->bal = 0;
-	    else if (p->bal == 0) s->bal = r->bal = 0;
-	      else s->bal = 0, r->bal = -1;
-	  p->bal = 0;
-	  p->rtag = PLUS;
-	  if (s->link[0] == s) s->link[0] = NULL;
-	  if (r->link[1] == NULL) {
-	      r->link[1] = p;
-	      r->rtag = MINUS;
-	  }
+/* backward-shift deletion keeps the probe sequences intact */
+static void CodePageRemove(CodePage *cp, TNode **slot)
+{
+  unsigned int mask = cp->size - 1;
+  unsigned int i = slot - cp->tab, j = i;
+
+  cp->tab[i] = NULL;
+  cp->count--;
+  for (;;) {
+      unsigned int h;
+      j = (j + 1) & mask;
+      if (cp->tab[j] == NULL) break;
+      h = CPSLOT(cp, cp->tab[j]->key & ~_PAGE_MASK);
+      /* move tab[j] into the hole if its home slot is not in (i,j] */
+      if (((j - h) & mask) >= ((j - i) & mask)) {
+	  cp->tab[i] = cp->tab[j];
+	  cp->tab[j] = NULL;
+	  i = j;
       }
   }
-  else {
-      if (s->bal == 0) {
-	  s->bal = 1;
-	  return q;
-      }
-      else if (s->bal == -1) {
-	  s->bal = 0;
-	  return q;
-      }
+}
 
-      if (r->bal == +1)	{
-	  p = r;
-	  if (r->link[0] == NULL) {
-	      s->rtag = MINUS;
-	      r->link[0] = s;
-	  }
-	  else {
-	      s->link[1] = r->link[0];
-	      s->rtag = PLUS;
-	      r->link[0] = s;
-	  }
-	  s->bal = r->bal = 0;
+/* register/unregister a node in all pages its source range overlaps */
+static void AddResident(TNode *G)
+{
+  unsigned int p, pl = G->seqbase >> PAGE_SHIFT;
+  unsigned int ph = (G->seqbase + G->seqlen) >> PAGE_SHIFT;
+
+  for (p = pl; p <= ph; p++) {
+      CodePage *cp = GetCodePage(p);
+      if (cp->nres == cp->maxres) {
+	  cp->maxres = cp->maxres ? cp->maxres * 2 : CPTAB_MINSIZE;
+	  cp->res = realloc(cp->res, cp->maxres * sizeof(TNode *));
       }
-      else {
-	  p = r->link[0];
-	  r->link[0] = p->link[1];
-	  p->link[1] = r;
-	  s->link[1] = p->link[0];
-	  p->link[0] = s;
-	  if (p->bal == +1) s->bal = -1, r->bal = 0;
-	    else if (p->bal == 0) s->bal = r->bal = 0;
-	      else s->bal = 0, r->bal = 1;
-	  p->rtag = PLUS;
-	  if (s->link[1] == NULL) {
-	      s->link[1] = p;
-	      s->rtag = MINUS;
+      cp->res[cp->nres++] = G;
+  }
+}
+
+static void DelResident(TNode *G)
+{
+  unsigned int p, pl = G->seqbase >> PAGE_SHIFT;
+  unsigned int ph = (G->seqbase + G->seqlen) >> PAGE_SHIFT;
+
+  for (p = pl; p <= ph; p++) {
+      CodePage *cp = FindCodePage(p);
+      int i;
+      if (cp == NULL) continue;
+      for (i = 0; i < cp->nres; i++) {
+	  if (cp->res[i] == G) {
+	      cp->res[i] = cp->res[--cp->nres];
+	      break;
 	  }
-	  if (r->link[0] == r) r->link[0] = NULL;
-	  p->bal = 0;
       }
+      if (CodePageEmpty(cp)) FreeCodePage(cp);
   }
-
-  if (t != &tree->root && s == t->link[1]) t->link[1] = p;
-    else t->link[0] = p;
-
-  return q;
 }
 
+/////////////////////////////////////////////////////////////////////////////
 
-void avltr_delete (const int key)
+static TNode *NodeProbe(const int key, int *found)
 {
-  avltr_tree *tree = &CollectTree;
-  TNode *pa[AVL_MAX_HEIGHT];		/* Stack P: Nodes. */
-  unsigned char a[AVL_MAX_HEIGHT];	/* Stack P: Bits. */
-  int k = 1;				/* Stack P: Pointer. */
-  TNode *p;
-
-  a[0] = 0;
-  pa[0] = &tree->root;
-  p = tree->root.link[0];
-  if (p == NULL) return;
-
-  for (;;) {
-      int diff = (key - p->key);
+  CodePage *cp = GetCodePage((unsigned)key >> PAGE_SHIFT);
+  TNode **slot = CodePageProbe(cp, key);
 
-      if (diff==0) break;
-      pa[k] = p;
-      if (diff < 0) {
-	  if (p->link[0] == NULL) return;
-	  p = p->link[0]; a[k] = 0;
-      }
-      else if (diff > 0) {
-	  if (p->rtag != PLUS) return;
-	  p = p->link[1]; a[k] = 1;
-      }
-      k++;
-/**/ if (k>=AVL_MAX_HEIGHT) leavedos_main(0x777);
+  if (*slot) {
+      *found = 1;
+      return *slot;
   }
-#if !defined(SINGLESTEP)&&!defined(SINGLEBLOCK)
-  if (debug_level('e')>2)
-	e_printf("Found node to delete at %p(%08x)\n",p,p->key);
+  /* keep the load factor below 3/4 */
+  if ((cp->count + 1) * 4 > cp->size * 3) {
+      CodePageGrow(cp);
+      slot = CodePageProbe(cp, key);
+  }
+  *slot = Tmalloc();
+  (*slot)->key = key;
+  cp->count++;
+  ninodes++;
+#ifdef PROFILE
+  if (debug_level('e')) if (ninodes > MaxNodes) MaxNodes = ninodes;
 #endif
-  tree->count--;
-  ninodes = tree->count;
-
-  {
-    TNode *t = p;
-    TNode **q = &pa[k - 1]->link[(int) a[k - 1]];
-
-    if (t->rtag == MINUS) {
-	if (t->link[0] != NULL) {
-	    TNode *const x = t->link[0];
-
-	    *q = x;
-	    (*q)->bal = 0;
-	    if (x->rtag == MINUS) {
-		if (a[k - 1] == 1) x->link[1] = t->link[1];
-		  else x->link[1] = pa[k - 1];
-	    }
-	}
-	else {
-	    *q = t->link[a[k - 1]];
-	    if (a[k - 1] == 0) pa[k - 1]->link[0] = NULL;
-	      else pa[k - 1]->rtag = MINUS;
-	}
-    }
-    else {
-	TNode *r = t->link[1];
-	if (r->link[0] == NULL) {
-	    r->link[0] = t->link[0];
-	    r->bal = t->bal;
-	    if (r->link[0] != NULL) {
-		TNode *s = r->link[0];
-		while (s->rtag == PLUS) s = s->link[1];
-		s->link[1] = r;
-	    }
-	    *q = r;
-	    a[k] = 1;
-	    pa[k++] = r;
-	}
-	else {
-	    TNode *s = r->link[0];
-
-	    a[k] = 1;
-	    pa[k++] = t;
-
-	    a[k] = 0;
-	    pa[k++] = r;
-
-	    while (s->link[0] != NULL) {
-		r = s;
-		s = r->link[0];
-		a[k] = 0;
-		pa[k++] = r;
-	    }
+  return *slot;
+}
 
-	    if (t->mblock) dlfree(t->mblock);
-/* e_printf("<03 node exchange %p->%p>\n",s,t); */
-	    datacopy(t, s);
-/**/	    if (t->addr==NULL) leavedos_main(0x8130);
-	    /* keep the node reference to itself */
-	    t->mblock->bkptr = t;
-	    s->addr = NULL;
-	    s->mblock = NULL;
-	    memset(&s->clink, 0, sizeof(linkdesc));
-	    s->key = 0;
-
-	    if (s->rtag == PLUS) r->link[0] = s->link[1];
-	      else r->link[0] = NULL;
-	    p = s;
-	}
-    }
-  }
+static void DelNode(CodePage *cp, TNode **slot)
+{
+  TNode *G = *slot;
 
-/**/ if (Traverser.p==p) Traverser.init=0;
 #if !defined(SINGLESTEP)&&!defined(SINGLEBLOCK)
-  if (debug_level('e')>2) e_printf("Remove node %p\n",p);
+  if (debug_level('e')>2) e_printf("Remove node %p(%08x)\n",G,G->key);
 #endif
 #ifdef DEBUG_LINKER
-	if (p->clink.nrefs) {
-	    dbug_printf("Cannot delete - nrefs=%d\n",p->clink.nrefs);
+	if (G->clink.nrefs) {
+	    dbug_printf("Cannot delete - nrefs=%d\n",G->clink.nrefs);
 	    leavedos_main(0x9140);
 	}
-	if (p->clink.bkr.next) {
+	if (G->clink.bkr.next) {
 	    dbug_printf("Cannot delete - bkr busy\n");
 	    leavedos_main(0x9141);
 	}
-	if (p->clink.t_ref || p->clink.nt_ref) {
+	if (G->clink.t_ref || G->clink.nt_ref) {
 	    dbug_printf("Cannot delete - ref busy\n");
 	    leavedos_main(0x9142);
 	}
 #endif
-  if (p->mblock) dlfree(p->mblock);
-  Tfree(p);
-
-  while (--k) {
-      TNode *const s = pa[k];
-
-      if (a[k] == 0) {
-	  TNode *const r = s->link[1];
+  CodePageRemove(cp, slot);
+  ninodes--;
+  if (findtree_cache[G->key&FINDTREE_CACHE_HASH_MASK] == G)
+      findtree_cache[G->key&FINDTREE_CACHE_HASH_MASK] = NULL;
+  /* this may free the page */
+  if (G->addr) DelResident(G);
+  else if (CodePageEmpty(cp)) FreeCodePage(cp);
+  if (G->mblock) {
+      RasFlushCode(G->addr, G->len);
+      dlfree(G->mblock);
+  }
+  G->mblock = NULL;
+  Tfree(G);
+}
 
-	  if (s->bal == -1) {
-	      s->bal = 0;
-	      continue;
-	  }
-	  else if (s->bal == 0) {
-	      s->bal = +1;
-	      break;
-	  }
+void DeleteNode(const int key)
+{
+  CodePage *cp = FindCodePage((unsigned)key >> PAGE_SHIFT);
+  TNode **slot;
 
-	  if (s->rtag == MINUS || r->bal == 0) {
-	      s->link[1] = r->link[0];
-	      r->link[0] = s;
-	      r->bal = -1;
-	      pa[k - 1]->link[(int) a[k - 1]] = r;
-	      break;
-	  }
-	  else if (r->bal == +1) {
-	      if (r->link[0] != NULL) {
-		  s->rtag = PLUS;
-		  s->link[1] = r->link[0];
-	      }
-	      else
-		s->rtag = MINUS;
-	      r->link[0] = s;
-	      s->bal = r->bal = 0;
-	      pa[k - 1]->link[a[k - 1]] = r;
-	  }
-	  else {
-	      p = r->link[0];
-	      if (p->rtag == PLUS) r->link[0] = p->link[1];
-	        else r->link[0] = NULL;
-	      p->link[1] = r;
-	      p->rtag = PLUS;
-	      if (p->link[0] == NULL) {
-		  s->link[1] = p;
-		  s->rtag = MINUS;
-	      }
-	      else {
-		  s->link[1] = p->link[0];
-		  s->rtag = PLUS;
-	      }
-	      p->link[0] = s;
-	      if (p->bal == +1)	s->bal = -1, r->bal = 0;
-	        else if (p->bal == 0) s->bal = r->bal = 0;
-		  else s->bal = 0, r->bal = +1;
-	      p->bal = 0;
-	      pa[k - 1]->link[(int) a[k - 1]] = p;
-	      if (a[k - 1] == 1) pa[k - 1]->rtag = PLUS;
-	  }
-      }
-      else {
-	  TNode *const r = s->link[0];
+  if (cp == NULL) return;
+  slot = CodePageProbe(cp, key);
+  if (*slot) DelNode(cp, slot);
+}
 
-	  if (s->bal == +1) {
-	      s->bal = 0;
-	      continue;
-	  }
-	  else if (s->bal == 0) {
-	      s->bal = -1;
-	      break;
-	  }
+/* find a node without touching its life or the lookup cache */
+TNode *LookupNode(int key)
+{
+  CodePage *cp = FindCodePage((unsigned)key >> PAGE_SHIFT);
 
-	  if (s->link[0] == NULL || r->bal == 0) {
-	      s->link[0] = r->link[1];
-	      r->link[1] = s;
-	      r->bal = +1;
-	      pa[k - 1]->link[(int) a[k - 1]] = r;
-	      break;
-	  }
-	  else if (r->bal == -1) {
-	      if (r->rtag == PLUS) s->link[0] = r->link[1];
-	        else s->link[0] = NULL;
-	      r->link[1] = s;
-	      r->rtag = PLUS;
-	      s->bal = r->bal = 0;
-	      pa[k - 1]->link[a[k - 1]] = r;
-	  }
-	  else {
-	      p = r->link[1];
-	      if (p->link[0] != NULL) {
-		  r->rtag = PLUS;
-		  r->link[1] = p->link[0];
-	      }
-	      else
-		r->rtag = MINUS;
-	      p->link[0] = r;
-	      if (p->rtag == MINUS) s->link[0] = NULL;
-	        else s->link[0] = p->link[1];
-	      p->link[1] = s;
-	      p->rtag = PLUS;
-	      if (p->bal == -1)	s->bal = +1, r->bal = 0;
-	        else if (p->bal == 0) s->bal = r->bal = 0;
-		  else s->bal = 0, r->bal = -1;
-	      p->bal = 0;
-	      if (a[k - 1] == 1)
-		pa[k - 1]->rtag = PLUS;
-	      pa[k - 1]->link[(int) a[k - 1]] = p;
-	  }
-      }
-  }
+  if (cp == NULL) return NULL;
+  return *CodePageProbe(cp, key);
 }
 
 #endif	// HOST_ARCH_X86
 
 /////////////////////////////////////////////////////////////////////////////
 
-static void avltr_init(void)
+static void trees_init(void)
 {
 #ifdef HOST_ARCH_X86
  if (!config.cpusim) {
   int i;
   TNode *G;
 
-  CollectTree.root.link[0] = NULL;
-  CollectTree.root.link[1] = &CollectTree.root;
-  CollectTree.root.rtag = PLUS;
-  CollectTree.count = 0;
-  Traverser.init = 0;
-  Traverser.p = NULL;
+  CodePages = CleanPage = NULL;
+  CleanSlot = 0;
+  ncpages = 0;
 
   G = TNodePool;
   for (i=0; i<(NODES_IN_POOL-1); i++) {
 	TNode *G1 = G; G++;
-	G1->link[0] = G;
+	G1->next = G;
   }
-  G->link[0] = TNodePool;
+  G->next = TNodePool;
 
   InstrMeta = malloc(sizeof(IMeta) * MAXINODES);
   memset(InstrMeta, 0, sizeof(IMeta));
  }
 #endif
-  g_printf("avltr_init\n");
+  g_printf("trees_init\n");
   CurrIMeta = -1;
   NodesCleaned = 0;
   ninodes = 0;
@@ -562,16 +384,16 @@ static void avltr_init(void)
 
 #ifdef HOST_ARCH_X86
 
-void avltr_destroy(void)
+static void trees_destroy(void)
 {
-  avltr_tree *tree;
+  CodePage *cp;
+  int i;
 #ifdef PROFILE
   hitimer_t t0 = 0;
 #endif
 
-  tree = &CollectTree;
   e_printf("--------------------------------------------------------------\n");
-  e_printf("Destroy AVLtree with %d nodes\n",ninodes);
+  e_printf("Destroy code pages with %d nodes in %d pages\n",ninodes,ncpages);
   e_printf("--------------------------------------------------------------\n");
 #ifdef DEBUG_TREE
   DumpTree (tLog);
@@ -581,41 +403,35 @@ void avltr_destroy(void)
 #endif
 
   mprot_end();
-  if (tree->root.link[0] != &tree->root) {
-      TNode *an[AVL_MAX_HEIGHT];	/* Stack A: nodes. */
-      char ab[AVL_MAX_HEIGHT];		/* Stack A: bits. */
-      int ap = 0;			/* Stack A: height. */
-      TNode *p = tree->root.link[0];
-
-      for (;;) {
-	  while (p != NULL) {
-	      ab[ap] = 0;
-	      an[ap++] = p;
-	      p = p->link[0];
-	  }
-
-	  for (;;) {
-	      backref *B;
-	      if (ap == 0) goto quit;
-
-	      p = an[--ap];
-	      if (ab[ap] == 0) {
-		  ab[ap++] = 1;
-		  if (p->rtag == MINUS) continue;
-		  p = p->link[1];
-		  break;
-	      }
-	      B = p->clink.bkr.next;
-	      while (B) {
-		  backref *B2 = B;
-		  B = B->next;
-		  free(B2);
-	      }
-	      if (p->mblock) dlfree(p->mblock);
+  cp = CodePages;
+  while (cp) {
+      CodePage *cp2 = cp;
+      for (i = 0; i < cp->size; i++) {
+	  TNode *G = cp->tab[i];
+	  backref *B;
+	  if (G == NULL) continue;
+	  B = G->clink.bkr.next;
+	  while (B) {
+	      backref *B2 = B;
+	      B = B->next;
+	      free(B2);
 	  }
+	  if (G->mblock) dlfree(G->mblock);
       }
+      cp = cp->next;
+      free(cp2->tab);
+      free(cp2->res);
+      free(cp2);
   }
-quit:
+  CodePages = CleanPage = NULL;
+  for (i = 0; i < (1 << (32 - PAGE_SHIFT - CPDIR_SHIFT)); i++) {
+      free(CodePageDir[i]);
+      CodePageDir[i] = NULL;
+  }
+  memset(findtree_cache, 0, sizeof(findtree_cache));
+  RasFlush();
+  HotTabClear(0, ~0u);
+  ninodes = ncpages = 0;
   free(InstrMeta);
 #ifdef PROFILE
   if (debug_level('e')) {
@@ -635,15 +451,14 @@ quit:
  */
 unsigned int FindPC(unsigned char *addr)
 {
-  TNode *G = &CollectTree.root;
+  CodePage *cp;
+  TNode *G;
   unsigned char *ahE;
   Addr2Pc *AP;
+  int n;
   unsigned int i;
 
-  for (;;) {
-      /* walk to next node */
-      G = NEXTNODE(G);
-      if (G == &CollectTree.root) break;
+  FOR_EACH_NODE(cp, n, G) {
       if (!G->addr || !G->pmeta || G->alive<=0) continue;
       ahE = G->addr + G->len;
       if (!ADDR_IN_RANGE(addr,G->addr,ahE)) continue;
@@ -666,20 +481,15 @@ unsigned int FindPC(unsigned char *addr)
 
 static void CheckLinks(void)
 {
-  TNode *G = &CollectTree.root;
+  CodePage *cp;
+  TNode *G;
   TNode *GL;
   unsigned char *p;
   linkdesc *L, *T;
   backref *B;
-  int n;
+  int i, n;
 
-  for (;;) {
-    /* walk to next node */
-    G = NEXTNODE(G);
-    if (G == &CollectTree.root) {
-	e_printf("DEBUG: node link check ok\n");
-	return;
-    }
+  FOR_EACH_NODE(cp, i, G) {
     if (G->key<=0) {
 	error("Invalid key %08x\n",G->key);
 	goto nquit;
@@ -715,7 +525,7 @@ static void CheckLinks(void)
 	    }
 	    n = 0;
 	    while (B) {
-		if (B->ref==&G->mblock->bkptr) {
+		if (B->ref==&G->mblock->bkptr && B->branch=='T') {
 		    n++;
 		    if (debug_level('e')>5) e_printf("  T: backref %d from %p\n",n,GL);
 		}
@@ -751,7 +561,7 @@ static void CheckLinks(void)
 	    }
 	    n = 0;
 	    while (B) {
-		if (B->ref==&G->mblock->bkptr) {
+		if (B->ref==&G->mblock->bkptr && B->branch=='N') {
 		    n++;
 		    if (debug_level('e')>5) e_printf("  N: backref %d from %p\n",n,GL);
 		}
@@ -769,6 +579,8 @@ static void CheckLinks(void)
 	}
     }
   }
+  e_printf("DEBUG: node link check ok\n");
+  return;
 nquit:
   leavedos_main(0x9143);
 }
@@ -779,23 +591,19 @@ nquit:
 
 void DumpTree (FILE *fd)
 {
-  TNode *G = &CollectTree.root;
+  CodePage *cp;
+  TNode *G;
   linkdesc *L;
   backref *B;
-  int nn;
+  int i, nn;
 
   if (fd==NULL) return;
   fprintf(fd,"\n== BOT ========= %6d nodes =============================\n",ninodes);
   nn = 0;
 
-  while (nn < 10000) {		// sorry,only 4 digits available
-    /* walk to next node */
-    G = NEXTNODE(G);
-    if (G == &CollectTree.root) {
-	fprintf(fd,"\n== EOT ====================================================\n");
-	fflush(fd);
-	return;
-    }
+  FOR_EACH_NODE(cp, i, G) {
+    if (nn >= 10000)		// sorry,only 4 digits available
+	break;
     fprintf(fd,"\n-----------------------------------------------------------\n");
     if (G->alive <= 0) {
 	fprintf(fd,"%04d Node %p invalidated\n",nn,G);
@@ -804,8 +612,7 @@ void DumpTree (FILE *fd)
     }
     fprintf(fd,"%04d Node %p at %08x..%08x mblock=%p flags=%#x\n",
 	nn,G,G->key,(G->seqbase+G->seqlen-1),G->mblock,G->flags);
-    fprintf(fd,"     AVL (%p:%p),%d,%d,%d,%d\n",G->link[0],G->link[1],
-		G->bal,G->cache,G->pad,G->rtag);
+    fprintf(fd,"     page %05x slot %d\n",cp->page,i);
     fprintf(fd,"     source:     instr=%d, len=%#x\n",G->seqnum,G->seqlen);
     fprintf(fd,"     translated: len=%#x\n",G->len);
     L = &G->clink;
@@ -854,28 +661,45 @@ void DumpTree (FILE *fd)
     fflush(fd);
     nn++;
   }
+  fprintf(fd,"\n== EOT ====================================================\n");
+  fflush(fd);
 }
 
 #endif // DEBUG_TREE
 
+/*
+ * Age one node per call, walking the code pages in turn; dead nodes
+ * are removed here, so the cost of a sweep is spread over the pages.
+ */
 static int TraverseAndClean(void)
 {
   int cnt = 0;
   TNode *G;
-  if (Traverser.init == 0) {
-      Traverser.p = G = &CollectTree.root;
-      Traverser.init = 1;
-  }
-  else
-      G = Traverser.p;
+  TNode **slot;
+#ifdef PROFILE
+  hitimer_t t0 = 0;
+  if (debug_level('e')) t0 = GETTSC();
+#endif
 
+  if (CodePages == NULL)
+      return 0;
   /* walk to next node */
-  G = NEXTNODE(G);
-  if (G == &CollectTree.root) {
-      G = NEXTNODE(G);
-      if (G == &CollectTree.root)
-          return 0;
+  for (;;) {
+      if (CleanPage == NULL) {
+	  CleanPage = CodePages;
+	  CleanSlot = 0;
+      }
+      while (CleanSlot < CleanPage->size && CleanPage->tab[CleanSlot] == NULL)
+	  CleanSlot++;
+      if (CleanSlot < CleanPage->size)
+	  break;
+      CleanPage = CleanPage->next;
+      /* only residents left, no nodes at all */
+      if (CleanPage == NULL && ninodes == 0)
+	  return 0;
   }
+  slot = &CleanPage->tab[CleanSlot];
+  G = *slot;
 
   if ((G->addr != NULL) && (G->alive>0)) {
       G->alive -= AGENODE;
@@ -887,14 +711,15 @@ static int TraverseAndClean(void)
   }
   if ((G->addr == NULL) || (G->alive<=0)) {
       if (debug_level('e')>2) e_printf("Delete node %08x\n",G->key);
-      avltr_delete(G->key);
+      /* the slot gets refilled by the deletion, so stay on it */
+      DelNode(CleanPage, slot);
       cnt++;
   }
   else {
       if (debug_level('e')>3)
 	e_printf("TraverseAndClean: node at %08x of %d life=%d\n",
 		G->key,ninodes,G->alive);
-      Traverser.p = G;
+      CleanSlot++;
   }
 #ifdef PROFILE
   if (debug_level('e')) CleanupTime += (GETTSC() - t0);
@@ -935,7 +760,7 @@ TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf)
   key = I0->npc;
 
   found = 0;
-  nG = avltr_probe(key, &found);
+  nG = NodeProbe(key, &found);
 /**/ if (nG==NULL) leavedos_main(0x8201);
 
   if (found) {
@@ -946,7 +771,12 @@ TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf)
 	/* ->REPLACE the code of the node found with the latest
 	   compiled version */
 	NodeUnlinker(nG);
-	if (nG->mblock) dlfree(nG->mblock);
+	/* the page itself stays, as the node is still in its table */
+	if (nG->addr) DelResident(nG);
+	if (nG->mblock) {
+	    RasFlushCode(nG->addr, nG->len);
+	    dlfree(nG->mblock);
+	}
   }
   else {
 #if !defined(SINGLESTEP)&&!defined(SINGLEBLOCK)
@@ -958,12 +788,12 @@ TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf)
 				I0->totlen, I0->ncount, I0->npc);
 	}
 #endif
-	nG->key = key;
   }
 
   /* transfer info from first node of the Meta list to our new node */
   nG->seqbase = I0->seqbase;
   nG->seqlen = I0->seqlen;
+  AddResident(nG);
   nG->seqnum = I0->ncount;
 #ifdef PROFILE
   if (debug_level('e')) if (nG->len > MaxNodeSize) MaxNodeSize = nG->len;
@@ -977,9 +807,8 @@ TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf)
    * translated code plus the table of correspondences between source
    * and translated addresses.
    * The first longword of the memory block is special; it stores a
-   * back-pointer to the node. This because nodes can be moved in
-   * memory when rebalancing the AVL tree, while we need absolute and
-   * constant memory references.
+   * back-pointer to the node, which is what links between nodes refer
+   * to, so that they only depend on the code buffer.
    * The second longword is equal to its own address. Guess why.
    * After that come the offset table, then the code.
    */
@@ -1003,13 +832,19 @@ TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf)
   }
   else
     nG->clink.t_link.abs  = I0->clink.t_link.abs;
-  if (I0->clink.t_type > JMP_LINK) {
+  /* a near call also has a return stub */
+  if (I0->clink.t_type > JMP_LINK ||
+      (I0->clink.t_type == JMP_LINK && I0->clink.nt_link.rel)) {
     nG->clink.nt_link.abs = (unsigned int *)(nG->addr + I0->clink.nt_link.rel);
     nG->clink.nt_target = *nG->clink.nt_link.abs;
     nG->clink.unlinked_jmp_targets |= TARGET_NT;
   }
   else
     nG->clink.nt_link.abs = I0->clink.nt_link.abs;
+  nG->clink.ic_ways = I0->clink.ic_ways;
+  nG->clink.ic_next = 0;
+  for (i=0; i<nG->clink.ic_ways; i++)
+    nG->clink.ic_link[i].abs = (unsigned int *)(nG->addr + I0->clink.ic_link[i].rel);
   if ((debug_level('e')>3) && nG->clink.t_type)
 	dbug_printf("Link %d: %p:%08x\n",nG->clink.t_type,
 		nG->clink.nt_link.abs,
@@ -1075,21 +910,10 @@ TNode *FindTree(int key)
 #ifdef PROFILE
   if (debug_level('e')) t0 = GETTSC();
 #endif
-  I = CollectTree.root.link[0];
-  if (I == NULL) return NULL;	/* always NULL the first time! */
-
-  for (;;) {
-      int diff = (key - I->key);
-
-      if (diff < 0) {
-	  I = I->link[0];
-	  if (I == NULL) goto endsrch;
-      }
-      else if (diff > 0) {
-	  if (I->rtag == MINUS) goto endsrch;
-	  I = I->link[1];
-      }
-      else break;
+  {
+      CodePage *cp = FindCodePage((unsigned)key >> PAGE_SHIFT);
+      if (cp == NULL) goto endsrch;
+      I = *CodePageProbe(cp, key);
   }
 
   if (I && I->addr && (I->alive>0)) {
@@ -1170,17 +994,9 @@ static void BreakNode(TNode *G, unsigned char *eip)
   e_printf("============ Node %08x break failed\n",G->key);
 }
 
-static TNode *DoDelNode(TNode *G)
-{
-  if (Traverser.p == G)
-    Traverser.p = NEXTNODE(G);
-  avltr_delete(G->key);
-  return CollectTree.root.link[0];
-}
-
 int InvalidateNodeRange(int al, int len, unsigned char *eip)
 {
-  TNode *G;
+  unsigned int p, pl, ph;
   int ah;
   int cleaned = 0;
 #ifdef PROFILE
@@ -1190,73 +1006,48 @@ int InvalidateNodeRange(int al, int len, unsigned char *eip)
 #endif
   ah = al + len;
   if (debug_level('e')>1) dbug_printf("Invalidate area %08x..%08x\n",al,ah);
-
-  G = CollectTree.root.link[0];
-  if (G == NULL) goto quit;
-  /* find nearest (lesser than) node */
-  for (;;) {
-      if (G == NULL) goto quit;
-      if (G->key > al) {
-	/* no need to check for dead node here as the left-most
-	 * node will not be overlapped by anything from left */
-	if (G->link[0]==NULL) break;
-	G = G->link[0];
-      }
-      else if (G->key < al) {
-        TNode *G2;
-	G2 = G->link[1];
-	if (G2 == &CollectTree.root || G2->key > al) {
-	  if (G->alive <= 0) {
-	    /* remove dead node as it may be overlapped by good one */
-	    G = DoDelNode(G);
-	    continue;
-	  }
-	  break;
-	} else G = G2;
-      }
-      else {
-	if (G->alive <= 0) {
-	  G = DoDelNode(G);
-	  continue;
-	}
-	break;
-      }
-  }
-  if (debug_level('e')>1) e_printf("Invalidate from node %08x on\n",G->key);
-
-  /* walk tree in ascending, hopefully sorted, address order */
-  for (;;) {
-      if (G == &CollectTree.root || G->key >= ah)
-        break;
-      if (G->addr && (G->alive>0)) {
-	int ahG = G->seqbase + G->seqlen;
-	if (RANGE_IN_RANGE(G->seqbase,ahG,al,ah)) {
-	    unsigned char *ahE = G->addr + G->len;
+  HotTabClear(al, len);
+
+  /* only the pages in the range have to be looked at, as every
+   * node is listed in all the pages its source code overlaps */
+  pl = (unsigned)al >> PAGE_SHIFT;
+  ph = (unsigned)(len ? ah - 1 : al) >> PAGE_SHIFT;
+  for (p = pl; p <= ph; p++) {
+      CodePage *cp = FindCodePage(p);
+      int i;
+      if (cp == NULL) continue;
+      if (debug_level('e')>1) e_printf("Invalidate in page %05x, %d nodes\n",
+	  p, cp->nres);
+      for (i = 0; i < cp->nres; i++) {
+	TNode *G = cp->res[i];
+	int ahG;
+	unsigned char *ahE;
+	if (!G->addr || (G->alive<=0)) continue;
+	ahG = G->seqbase + G->seqlen;
+	if (!RANGE_IN_RANGE(G->seqbase,ahG,al,ah)) continue;
+	ahE = G->addr + G->len;
+	if (debug_level('e')>1)
+	    dbug_printf("Invalidated node %p at %08x\n",G,G->key);
+	G->alive = 0;
+	e_unmarkpage(G->seqbase, G->seqlen);
+	NodeUnlinker(G);
+	cleaned++;
+	NodesCleaned++;
+	/* if the current eip is in *any* chunk of code that is deleted
+	    (not just the one written to)
+	   then we need to break the node immediately to go back to
+	   the interpreter; otherwise the remaining chunk (that does
+	   not officially exist anymore) that the SIGSEGV or patched
+	   call returns to may write to the current unprotected page.
+	*/
+	if (eip && ADDR_IN_RANGE(eip,G->addr,ahE)) {
 	    if (debug_level('e')>1)
-		dbug_printf("Invalidated node %p at %08x\n",G,G->key);
-	    G->alive = 0;
-	    e_unmarkpage(G->seqbase, G->seqlen);
-	    NodeUnlinker(G);
-	    cleaned++;
-	    NodesCleaned++;
-	    /* if the current eip is in *any* chunk of code that is deleted
-	        (not just the one written to)
-	       then we need to break the node immediately to go back to
-	       the interpreter; otherwise the remaining chunk (that does
-	       not officially exist anymore) that the SIGSEGV or patched
-	       call returns to may write to the current unprotected page.
-	    */
-	    if (eip && ADDR_IN_RANGE(eip,G->addr,ahE)) {
-		if (debug_level('e')>1)
-		    e_printf("### Node self hit %p->%p..%p\n",
-			     eip,G->addr,ahE);
-		BreakNode(G, eip);
-	    }
+		e_printf("### Node self hit %p->%p..%p\n",
+			 eip,G->addr,ahE);
+	    BreakNode(G, eip);
 	}
       }
-      G = NEXTNODE(G);
   }
-quit:
   if (debug_level('e') && e_querymark(al, len))
     error("simx86: InvalidateNodeRange did not clear all code for %#08x, len=%x\n",
 	  al, len);
@@ -1491,8 +1282,25 @@ void CollectStat (void)
 			TheCPU.sigprof_pending,
 			ninodes,NodesParsed,NodesExecd,CreationIndex,
 			CleanFreq);
+#endif
+	if (debug_level('e')>1 && TheCPU.ic_exec) {
+		int ich = TheCPU.ic_exec - TheCPU.ras_hits - NodesIcMissed;
+		e_printf("SIGPROF ind=%8d ras=%8d(%3d%%) ic=%8d(%3d%%)\n",
+			TheCPU.ic_exec,
+			TheCPU.ras_hits, TheCPU.ras_hits*100/TheCPU.ic_exec,
+			ich, ich*100/(int)TheCPU.ic_exec);
+	}
+#ifdef PROFILE
+	if (debug_level('e')>1 && (SmcFaults || TheCPU.smc_hits))
+		e_printf("SIGPROF smc=%s flt=%8d bar=%8d\n",
+			SmcBarrier ? "barrier" : "mprotect",
+			SmcFaults, TheCPU.smc_hits);
+	SmcFaults = 0;
 #endif
 	NodesParsed = NodesExecd = 0;
+	TheCPU.ic_exec = TheCPU.ras_hits = NodesIcMissed = 0;
+	BarrierHits += TheCPU.smc_hits;
+	TheCPU.smc_hits = 0;
 }
 
 
@@ -1506,11 +1314,11 @@ void InitTrees(void)
 	    TNodePool = calloc(NODES_IN_POOL, sizeof(TNode));
 #endif
 
-	avltr_init();
+	trees_init();
 
 #ifdef HOST_ARCH_X86
 	if (!config.cpusim && debug_level('e')>1) {
-	    e_printf("Root tree node at %p\n",&CollectTree.root);
+	    e_printf("Code page directory at %p\n",CodePageDir);
 	    e_printf("TNode pool at %p\n",TNodePool);
 	}
 #endif
@@ -1520,7 +1328,7 @@ void InitTrees(void)
 	CreationIndex = 0;
 #ifdef PROFILE
 	if (debug_level('e')) {
-	    MaxDepth = MaxNodes = MaxNodeSize = 0;
+	    MaxProbes = MaxNodes = MaxNodeSize = 0;
 	    TotalNodesParsed = TotalNodesExecd = 0;
 	    NodesFound = NodesFastFound = NodesNotFound = 0;
 	    TreeCleanups = 0;
@@ -1541,7 +1349,7 @@ void EndGen(void)
 	CurrIMeta = -1;
 #ifdef HOST_ARCH_X86
 	if (!config.cpusim) {
-	    avltr_destroy();
+	    trees_destroy();
 	    free(TNodePool); TNodePool=NULL;
 	}
 #endif
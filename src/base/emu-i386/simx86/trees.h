@@ -30,13 +30,6 @@
  *  (linux/arch/i386/kernel/vm86.c). This code originaly was written by
  *  Linus Torvalds with later enhancements by Lutz Molgedey and Hans Lermen.
  *
- * 2. The tree handling routines were adapted from libavl:
- *  libavl - manipulates AVL trees.
- *  Copyright (C) 1998, 1999 Free Software Foundation, Inc.
- *  The author may be contacted at <pfaffben@pilot.msu.edu> on the
- *  Internet, or as Ben Pfaff, 12167 Airport Rd, DeWitt MI 48820, USA
- *  through more mundane means.
- *
  ***************************************************************************/
 
 #ifndef _EMU86_TREES_H
@@ -47,16 +40,18 @@
 // Tree node key definition.
 //
 
-struct avltr_node;
+struct tnode;
 
 typedef struct _bkref {
 	struct _bkref *next;
-	struct avltr_node **ref;
+	struct tnode **ref;
 	char branch;
+	char way;		/* inline cache entry for branch 'I' */
 } backref;
 
 #define TARGET_T 1
 #define TARGET_NT 2
+#define IC_NOTARGET 0xffffffffU
 
 typedef struct _lnkdesc {
 	unsigned char t_type;
@@ -71,7 +66,16 @@ typedef struct _lnkdesc {
 	} nt_link;
 	unsigned int t_target, nt_target;
 	unsigned unlinked_jmp_targets;
-	struct avltr_node **t_ref, **nt_ref;
+	struct tnode **t_ref, **nt_ref;
+	/* inline cache of an indirect jump; ic_link points to the
+	 * immediate of a "cmp $target,%eax; jne; jmp" entry */
+	unsigned char ic_ways;		/* 0 if no cache */
+	unsigned char ic_next;
+	union {
+		unsigned int *abs;
+		unsigned int rel;
+	} ic_link[IC_WAYS];
+	struct tnode **ic_ref[IC_WAYS];
 	backref bkr;
 } linkdesc;
 
@@ -95,7 +99,7 @@ typedef struct _imeta {
 } IMeta;
 
 typedef struct _codebufhdr {
-	struct avltr_node *bkptr;
+	struct tnode *bkptr;
 	void *selfptr;
 	Addr2Pc meta[0]; /* there are nap of these */
 	/* behind these follows the code */
@@ -106,27 +110,22 @@ extern int   CurrIMeta;
 extern int NodesExecd;
 extern int TotalNodesExecd;
 extern int NodesParsed;
+extern int NodesIcMissed;
 extern int TotalNodesParsed;
 extern int MaxNodes;
 extern int MaxNodeSize;
-extern int MaxDepth;
+extern int MaxProbes;
 extern int NodesNotFound;
 extern int NodesFastFound;
 extern int EmuSignals;
 extern int NodesFound;
 extern int TreeCleanups;
+extern int BarrierHits;
 
-typedef struct avltr_node
+typedef struct tnode
 {
-/* ----- Structure for a node in a right-threaded AVL tree. ----- */
-    struct avltr_node *link[2];	/* Subtrees or threads. */
-    signed char bal;		/* Balance factor. */
-    char cache;			/* Used during insertion. */
-    char pad;			/* Reserved for fully threaded trees. */
-    signed char rtag;		/* Right thread tag. */
-/* -------------------------------------------------------------- */
-	int key;		/* signed! and don't move it from here! */
-/* -------------------------------------------------------------- */
+	struct tnode *next;	/* free list link */
+	int key;
 	int alive;
 	CodeBuf *mblock;
 	unsigned char *addr;
@@ -138,30 +137,27 @@ typedef struct avltr_node
 	unsigned mode;
 } TNode;
 
-/* Used for traversing a right-threaded AVL tree. */
-typedef struct avltr_traverser
-{
-    int init;				/* Initialized? */
-    struct avltr_node *p;		/* Last node returned. */
-} avltr_traverser;
-
-/* Structure which holds information about a threaded AVL tree. */
-typedef struct avltr_tree
-{
-    struct avltr_node root;	/* Tree root node. */
-    int count;			/* Number of nodes in the tree. */
-} avltr_tree;
-
-/* Tag types. */
-#define PLUS +1
-#define MINUS -1
+/*
+ * Translated code is indexed by source page. Every 4k page holding
+ * code has a small open-addressed table of the nodes whose entry PC
+ * lies in that page, plus a list of all nodes whose source range
+ * overlaps the page, which is what invalidation has to look at.
+ */
+typedef struct _codepage {
+	struct _codepage *next, *prev;	/* list of all code pages */
+	unsigned int page;		/* source address >> PAGE_SHIFT */
+	unsigned short size;		/* slots in tab, power of 2 */
+	unsigned short count;		/* nodes in tab */
+	TNode **tab;
+	int nres, maxres;
+	TNode **res;			/* nodes overlapping this page */
+} CodePage;
 
 #ifdef HOST_ARCH_X86
-extern avltr_tree CollectTree;
-
-void avltr_delete (const int key);
+void DeleteNode(int key);
 //
 TNode *FindTree(int key);
+TNode *LookupNode(int key);
 TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf);
 //
 #endif
@@ -246,7 +246,7 @@ enum {
 	/* speaker */
 %token EMULATED NATIVE
 	/* cpuemu */
-%token CPUEMU CPU_VM CPU_VM_DPMI VM86 KVM
+%token CPUEMU CPUEMU_SMC CPUEMU_CACHE CPUEMU_HOT CPUEMU_CHECK CPU_VM CPU_VM_DPMI VM86 KVM
 	/* keyboard */
 %token RAWKEYBOARD
 %token PRESTROKE
@@ -266,7 +266,7 @@ enum {
 %token L_DISPLAY L_TITLE X_TITLE_SHOW_APPNAME ICON_NAME X_BLINKRATE X_SHARECMAP X_MITSHM X_FONT
 %token X_FIXED_ASPECT X_ASPECT_43 X_LIN_FILT X_BILIN_FILT X_MODE13FACT
 %token X_WINSIZE X_NOCLOSE X_NORESIZE
-%token X_GAMMA X_FULLSCREEN VGAEMU_MEMSIZE VESAMODE X_LFB X_PM_INTERFACE X_MGRAB_KEY X_BACKGROUND_PAUSE
+%token X_GAMMA X_FULLSCREEN VGAEMU_MEMSIZE VESAMODE X_LFB X_VGA_SUBPAGE X_VGA_UNPROTECT X_RENDER_BANDS X_RENDER_PACING X_PM_INTERFACE X_MGRAB_KEY X_BACKGROUND_PAUSE
 	/* sdl */
 %token SDL_HWREND SDL_FONTS SDL_WCONTROLS
 	/* video */
@@ -304,7 +304,7 @@ enum {
 %token MPU_IRQ MPU_IRQ_MT32 MIDI_SYNTH
 %token SOUND_DRIVER MIDI_DRIVER FLUID_SFONT FLUID_VOLUME
 %token MUNT_ROMS OPL2LPT_DEV OPL2LPT_TYPE
-%token SND_PLUGIN_PARAMS PCM_HPF MIDI_FILE WAV_FILE
+%token SND_PLUGIN_PARAMS PCM_HPF PCM_RESAMPLE_QUALITY MIDI_FILE WAV_FILE
 	/* CD-ROM */
 %token CDROM
 	/* ASPI driver */
@@ -485,6 +485,38 @@ line:		CHARSET '{' charset_flags '}' {}
 			config.cpusim = $2;
 			c_printf("CONF: CPUEMU set to %s\n",
 				config.cpusim ? "sim" : "jit");
+#endif
+			}
+		| CPUEMU_SMC INTEGER
+			{
+#ifdef X86_EMULATOR
+			config.cpusmc = $2;
+			c_printf("CONF: CPUEMU SMC detection set to %s\n",
+				config.cpusmc ? "barrier" : "mprotect");
+#endif
+			}
+		| CPUEMU_CACHE INTEGER
+			{
+#ifdef X86_EMULATOR
+			config.cpucache = $2;
+			c_printf("CONF: CPUEMU code cache size %d MB\n",
+				config.cpucache);
+#endif
+			}
+		| CPUEMU_HOT INTEGER
+			{
+#ifdef X86_EMULATOR
+			config.cpuhot = $2;
+			c_printf("CONF: CPUEMU compile threshold %d\n",
+				config.cpuhot);
+#endif
+			}
+		| CPUEMU_CHECK bool
+			{
+#ifdef X86_EMULATOR
+			config.cpucheck = ($2!=0);
+			c_printf("CONF: CPUEMU lockstep check %s\n",
+				config.cpucheck ? "on" : "off");
 #endif
 			}
 		| CPUSPEED real_expression
@@ -1099,6 +1131,10 @@ x_flag		: L_DISPLAY string_expr	{ free(config.X_display); config.X_display = $2;
 		| VESAMODE expression ',' expression ',' expression
 			{ set_vesamodes($2,$4,$6);}
 		| X_LFB bool            { config.X_lfb = ($2!=0); }
+		| X_VGA_SUBPAGE bool    { config.vga_subpage = ($2!=0); }
+		| X_VGA_UNPROTECT expression { config.vga_unprotect = $2; }
+		| X_RENDER_BANDS expression { config.render_bands = $2; }
+		| X_RENDER_PACING bool  { config.render_pacing = ($2!=0); }
 		| X_PM_INTERFACE bool   { config.X_pm_interface = ($2!=0); }
 		| X_MGRAB_KEY string_expr { free(config.X_mgrab_key); config.X_mgrab_key = $2; }
 		| X_BACKGROUND_PAUSE bool	{ config.X_background_pause = ($2!=0); }
@@ -1152,6 +1188,7 @@ sound_flag	: SB_BASE expression	{ config.sb_base = $2; }
 			}
 		| SND_PLUGIN_PARAMS string_expr	{ free(config.snd_plugin_params); config.snd_plugin_params = $2; }
 		| PCM_HPF bool		{ config.pcm_hpf = ($2!=0); }
+		| PCM_RESAMPLE_QUALITY expression	{ config.pcm_resample_quality = $2; }
 		| MIDI_FILE string_expr	{ free(config.midi_file); config.midi_file = $2; }
 		| WAV_FILE string_expr	{ free(config.wav_file); config.wav_file = $2; }
 		;
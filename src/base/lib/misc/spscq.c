@@ -15,10 +15,13 @@
  */
 
 /*
- * Purpose: single-producer single-consumer queue with locking
+ * Purpose: single-producer single-consumer queue
  *
  * Author: stsp
  *
+ * The reader and the writer each move their own free-running byte
+ * counter, so neither of them takes a lock. The mutex is only used to
+ * sleep the writer of spscq_write_area() while the queue is full.
  */
 #include <pthread.h>
 #include <stdlib.h>
@@ -29,8 +32,9 @@
 
 struct spscq {
     unsigned size;
-    unsigned rd_pos;
-    unsigned fillup;
+    unsigned long long rd_cnt;	/* moved by the reader */
+    unsigned long long wr_cnt;	/* moved by the writer */
+    int waiters;
     pthread_cond_t wr_cnd;
     pthread_mutex_t wr_mtx;
     unsigned char data[0];
@@ -40,7 +44,8 @@ void *spscq_init(unsigned size)
 {
     struct spscq *q = malloc(sizeof(*q) + size);
     q->size = size;
-    q->rd_pos = q->fillup = 0;
+    q->rd_cnt = q->wr_cnt = 0;
+    q->waiters = 0;
     pthread_cond_init(&q->wr_cnd, NULL);
     pthread_mutex_init(&q->wr_mtx, NULL);
     return q;
@@ -51,61 +56,91 @@ void spscq_done(void *arg)
     free(arg);
 }
 
+static unsigned q_fillup(struct spscq *q)
+{
+    return __atomic_load_n(&q->wr_cnt, __ATOMIC_SEQ_CST) -
+	    __atomic_load_n(&q->rd_cnt, __ATOMIC_SEQ_CST);
+}
+
+void *spscq_try_write_area(void *arg, unsigned *r_len)
+{
+    struct spscq *q = arg;
+    unsigned fillup = q_fillup(q);
+    unsigned wr_pos = q->wr_cnt % q->size;
+
+    if (fillup == q->size)
+        return NULL;
+    *r_len = _min(q->size - wr_pos, q->size - fillup);
+    return (q->data + wr_pos);
+}
+
+/* bytes from the write position to the end of the buffer */
+unsigned spscq_write_tail(void *arg)
+{
+    struct spscq *q = arg;
+    return q->size - q->wr_cnt % q->size;
+}
+
 void *spscq_write_area(void *arg, unsigned *r_len)
 {
     struct spscq *q = arg;
-    unsigned wr_pos, top;
+    void *ret = spscq_try_write_area(q, r_len);
+
+    if (ret)
+        return ret;
     pthread_mutex_lock(&q->wr_mtx);
-    while (q->fillup == q->size)
+    __atomic_add_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+    while (!(ret = spscq_try_write_area(q, r_len)))
         cond_wait(&q->wr_cnd, &q->wr_mtx);
-    wr_pos = q->rd_pos + q->fillup;
-    if (wr_pos >= q->size) {
-        wr_pos -= q->size;
-        top = q->rd_pos;
-    } else {
-        top = q->size;
-    }
+    __atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
     pthread_mutex_unlock(&q->wr_mtx);
-    assert(top > wr_pos);
-    *r_len = top - wr_pos;
-    return (q->data + wr_pos);
+    return ret;
 }
 
 void spscq_commit_write(void *arg, unsigned len)
 {
     struct spscq *q = arg;
-    pthread_mutex_lock(&q->wr_mtx);
-    q->fillup += len;
-    pthread_mutex_unlock(&q->wr_mtx);
+    assert(q_fillup(q) + len <= q->size);
+    __atomic_store_n(&q->wr_cnt, q->wr_cnt + len, __ATOMIC_SEQ_CST);
 }
 
-int spscq_read(void *arg, void *buf, unsigned len)
+void *spscq_read_area(void *arg, unsigned *r_len)
 {
     struct spscq *q = arg;
-    unsigned done = 0;
-    pthread_mutex_lock(&q->wr_mtx);
-    if (q->fillup) {
-        unsigned ret;
-        ret = _min(q->fillup, q->size - q->rd_pos);
+    unsigned fillup = q_fillup(q);
+    unsigned rd_pos = q->rd_cnt % q->size;
+
+    if (!fillup)
+        return NULL;
+    *r_len = _min(q->size - rd_pos, fillup);
+    return (q->data + rd_pos);
+}
+
+void spscq_commit_read(void *arg, unsigned len)
+{
+    struct spscq *q = arg;
+    __atomic_store_n(&q->rd_cnt, q->rd_cnt + len, __ATOMIC_SEQ_CST);
+    /* a writer that found the queue full either sees the new rd_cnt,
+     * or is counted in waiters */
+    if (__atomic_load_n(&q->waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&q->wr_mtx);
+        pthread_cond_signal(&q->wr_cnd);
+        pthread_mutex_unlock(&q->wr_mtx);
+    }
+}
+
+int spscq_read(void *arg, void *buf, unsigned len)
+{
+    unsigned done = 0, ret;
+    void *ptr;
+
+    /* at most two pieces, before and after the end of the ring */
+    while (len && (ptr = spscq_read_area(arg, &ret))) {
         ret = _min(ret, len);
-        memcpy(buf, q->data + q->rd_pos, ret);
-        q->rd_pos += ret;
-        if (q->rd_pos == q->size)
-            q->rd_pos = 0;
-        q->fillup -= ret;
+        memcpy(buf + done, ptr, ret);
+        spscq_commit_read(arg, ret);
         len -= ret;
         done += ret;
-        if (q->fillup && len) {  // can read more
-            ret = _min(q->fillup, len);
-            memcpy(buf + done, q->data + q->rd_pos, ret);
-            q->rd_pos += ret;
-            q->fillup -= ret;
-            len -= ret;
-            done += ret;
-        }
     }
-    pthread_mutex_unlock(&q->wr_mtx);
-    if (done)
-        pthread_cond_signal(&q->wr_cnd);
     return done;
 }
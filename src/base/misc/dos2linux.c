@@ -509,6 +509,7 @@ void invalidate_unprotected_page_cache(dosaddr_t addr, int len)
   for (page = addr >> PAGE_SHIFT;
        page <= (addr + len - 1) >> PAGE_SHIFT; page++)
     unprotected_page_cache[page & (PAGE_SIZE-1)] = 0xffffffff;
+  e_invalidate_fetch(addr, len);
 }
 
 /* returns the host address if it's definitely unprotected,
@@ -704,6 +705,32 @@ void do_write_qword(dosaddr_t addr, uint64_t qword, sim_pagefault_handler_t hand
   do_write_dword(addr+4, qword >> 32, handler);
 }
 
+/* returns the host address of [addr, addr+len) if the range lies within one
+   page that string instructions may access directly, otherwise NULL.
+   VGA, traced MMIO, ROM and DPMI pages without the needed access are left
+   to the byte/word/dword accessors. Callers that write through the
+   result must invalidate the code in the range themselves. */
+void *dosaddr_to_unixaddr_run(dosaddr_t addr, int len, int write)
+{
+  void *uaddr = unprotected_dosaddr_to_unixaddr(addr, len);
+  if (uaddr)
+    return uaddr;
+  if ((addr ^ (addr + len - 1)) & _PAGE_MASK)
+    return NULL;
+  if (vga_write_access(addr) || (config.mmio_tracing && mmio_check(addr)))
+    return NULL;
+  if (addr >= LOWMEM_SIZE + HMASIZE &&
+      !(write ? dpmi_write_access(addr) : dpmi_read_access(addr)))
+    return NULL;
+  if (memcheck_is_rom(addr))
+    return NULL;
+  uaddr = dosaddr_to_unixaddr(addr);
+  if (!e_querymprot(addr) &&
+      (addr < LOWMEM_SIZE + HMASIZE || dpmi_write_access(addr)))
+    set_unprotected_page(addr, uaddr);
+  return uaddr;
+}
+
 uint8_t read_byte(dosaddr_t addr)
 {
   return do_read_byte(addr, default_sim_pagefault_handler);
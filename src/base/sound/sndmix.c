@@ -0,0 +1,228 @@
+/*
+ * Stream mixing kernels: a generic one, and SSE2, AVX2 and NEON ones
+ * which give the same result.
+ *
+ * A stream is added to the 32 bit accumulators by a 2x2 fixed point
+ * volume matrix, 4 (SSE2, NEON) or 8 (AVX2) frames at a time; the sum of
+ * all streams is then saturated to S16. The 32 bit accumulators can't
+ * overflow with the few streams sndpcm.c has, so unlike with saturating
+ * 16 bit adds the result does not depend on the order of the streams.
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+#include <math.h>
+#include "sndmix.h"
+
+#define MIX_ROUND (1 << (MIX_VOL_SHIFT - 1))
+
+static void mix_generic(int32_t acc[][SNDBUF_CHANS],
+	const sndbuf_t in[][SNDBUF_CHANS], int nframes, const mix_vol_t vol)
+{
+    int i, j, k;
+
+    for (i = 0; i < nframes; i++) {
+	for (j = 0; j < SNDBUF_CHANS; j++) {
+	    int32_t v = MIX_ROUND;
+	    for (k = 0; k < SNDBUF_CHANS; k++)
+		v += in[i][k] * vol[j][k];
+	    acc[i][j] += v >> MIX_VOL_SHIFT;
+	}
+    }
+}
+
+static void clip_generic(sndbuf_t out[][SNDBUF_CHANS],
+	const int32_t acc[][SNDBUF_CHANS], int nframes)
+{
+    int i, j;
+
+    for (i = 0; i < nframes; i++) {
+	for (j = 0; j < SNDBUF_CHANS; j++) {
+	    int32_t v = acc[i][j];
+	    out[i][j] = (v > INT16_MAX ? INT16_MAX :
+		    (v < INT16_MIN ? INT16_MIN : v));
+	}
+    }
+}
+
+static const struct pcm_mixer mixer_generic =
+	{ "generic", mix_generic, clip_generic };
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+/*
+ * A frame is an L,R pair of int16, so pmaddwd of a frame repeated twice
+ * with vol[0][0],vol[0][1],vol[1][0],vol[1][1] gives the mixed L and R.
+ */
+static SSE2 void mix_sse2(int32_t acc[][SNDBUF_CHANS],
+	const sndbuf_t in[][SNDBUF_CHANS], int nframes, const mix_vol_t vol)
+{
+    const __m128i v = _mm_setr_epi16(vol[0][0], vol[0][1], vol[1][0],
+	    vol[1][1], vol[0][0], vol[0][1], vol[1][0], vol[1][1]);
+    const __m128i rnd = _mm_set1_epi32(MIX_ROUND);
+    __m128i s, lo, hi, *a;
+    int i = 0;
+
+    for (; i + 4 <= nframes; i += 4) {
+	s = _mm_loadu_si128((const __m128i *)in[i]);
+	lo = _mm_madd_epi16(_mm_unpacklo_epi32(s, s), v);
+	hi = _mm_madd_epi16(_mm_unpackhi_epi32(s, s), v);
+	lo = _mm_srai_epi32(_mm_add_epi32(lo, rnd), MIX_VOL_SHIFT);
+	hi = _mm_srai_epi32(_mm_add_epi32(hi, rnd), MIX_VOL_SHIFT);
+	a = (__m128i *)acc[i];
+	_mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), lo));
+	_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), hi));
+    }
+    mix_generic(acc + i, in + i, nframes - i, vol);
+}
+
+static SSE2 void clip_sse2(sndbuf_t out[][SNDBUF_CHANS],
+	const int32_t acc[][SNDBUF_CHANS], int nframes)
+{
+    const __m128i *a;
+    int i = 0;
+
+    for (; i + 4 <= nframes; i += 4) {
+	a = (const __m128i *)acc[i];
+	_mm_storeu_si128((__m128i *)out[i], _mm_packs_epi32(
+		_mm_loadu_si128(a), _mm_loadu_si128(a + 1)));
+    }
+    clip_generic(out + i, acc + i, nframes - i);
+}
+
+/* the AVX2 kernels leave the tails to the generic code, not to the SSE2
+ * one, which would pay for the switch from AVX to legacy SSE */
+static AVX2 void mix_avx2(int32_t acc[][SNDBUF_CHANS],
+	const sndbuf_t in[][SNDBUF_CHANS], int nframes, const mix_vol_t vol)
+{
+    const __m256i v = _mm256_setr_epi16(vol[0][0], vol[0][1], vol[1][0],
+	    vol[1][1], vol[0][0], vol[0][1], vol[1][0], vol[1][1],
+	    vol[0][0], vol[0][1], vol[1][0], vol[1][1],
+	    vol[0][0], vol[0][1], vol[1][0], vol[1][1]);
+    const __m256i rnd = _mm256_set1_epi32(MIX_ROUND);
+    __m256i s, lo, hi, *a;
+    int i = 0;
+
+    for (; i + 8 <= nframes; i += 8) {
+	/* frames 0,1,4,5,2,3,6,7, as unpack works within the 128 bit lanes */
+	s = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i *)in[i]),
+		_MM_SHUFFLE(3, 1, 2, 0));
+	lo = _mm256_madd_epi16(_mm256_unpacklo_epi32(s, s), v);
+	hi = _mm256_madd_epi16(_mm256_unpackhi_epi32(s, s), v);
+	lo = _mm256_srai_epi32(_mm256_add_epi32(lo, rnd), MIX_VOL_SHIFT);
+	hi = _mm256_srai_epi32(_mm256_add_epi32(hi, rnd), MIX_VOL_SHIFT);
+	a = (__m256i *)acc[i];
+	_mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), lo));
+	_mm256_storeu_si256(a + 1, _mm256_add_epi32(_mm256_loadu_si256(a + 1), hi));
+    }
+    mix_generic(acc + i, in + i, nframes - i, vol);
+}
+
+static AVX2 void clip_avx2(sndbuf_t out[][SNDBUF_CHANS],
+	const int32_t acc[][SNDBUF_CHANS], int nframes)
+{
+    const __m256i *a;
+    __m256i p;
+    int i = 0;
+
+    for (; i + 8 <= nframes; i += 8) {
+	a = (const __m256i *)acc[i];
+	p = _mm256_packs_epi32(_mm256_loadu_si256(a),
+		_mm256_loadu_si256(a + 1));
+	_mm256_storeu_si256((__m256i *)out[i],
+		_mm256_permute4x64_epi64(p, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    clip_generic(out + i, acc + i, nframes - i);
+}
+
+static const struct pcm_mixer mixer_sse2 = { "sse2", mix_sse2, clip_sse2 };
+static const struct pcm_mixer mixer_avx2 = { "avx2", mix_avx2, clip_avx2 };
+
+#endif
+
+#ifdef __ARM_NEON
+
+#include <arm_neon.h>
+
+/* add 4 frames, given as separate L and R vectors, to acc */
+static inline void mix4_neon(int32_t *acc, int16x4_t l, int16x4_t r,
+	const mix_vol_t vol)
+{
+    int32x4x2_t a = vld2q_s32(acc);
+    int32x4_t ml, mr;
+
+    ml = vmlal_n_s16(vmull_n_s16(l, vol[0][0]), r, vol[0][1]);
+    mr = vmlal_n_s16(vmull_n_s16(l, vol[1][0]), r, vol[1][1]);
+    a.val[0] = vaddq_s32(a.val[0], vrshrq_n_s32(ml, MIX_VOL_SHIFT));
+    a.val[1] = vaddq_s32(a.val[1], vrshrq_n_s32(mr, MIX_VOL_SHIFT));
+    vst2q_s32(acc, a);
+}
+
+static void mix_neon(int32_t acc[][SNDBUF_CHANS],
+	const sndbuf_t in[][SNDBUF_CHANS], int nframes, const mix_vol_t vol)
+{
+    int16x8x2_t s;
+    int i = 0;
+
+    for (; i + 8 <= nframes; i += 8) {
+	s = vld2q_s16(in[i]);
+	mix4_neon(acc[i], vget_low_s16(s.val[0]), vget_low_s16(s.val[1]), vol);
+	mix4_neon(acc[i + 4], vget_high_s16(s.val[0]),
+		vget_high_s16(s.val[1]), vol);
+    }
+    mix_generic(acc + i, in + i, nframes - i, vol);
+}
+
+static void clip_neon(sndbuf_t out[][SNDBUF_CHANS],
+	const int32_t acc[][SNDBUF_CHANS], int nframes)
+{
+    int i = 0;
+
+    for (; i + 4 <= nframes; i += 4)
+	vst1q_s16(out[i], vcombine_s16(vqmovn_s32(vld1q_s32(acc[i])),
+		vqmovn_s32(vld1q_s32(acc[i + 2]))));
+    clip_generic(out + i, acc + i, nframes - i);
+}
+
+static const struct pcm_mixer mixer_neon = { "neon", mix_neon, clip_neon };
+
+#endif
+
+int pcm_mixer_list(const struct pcm_mixer *list[], int max)
+{
+    int n = 0;
+
+#define ADD_MIXER(m) do { if (n < max) list[n++] = &(m); } while (0)
+    ADD_MIXER(mixer_generic);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+	ADD_MIXER(mixer_sse2);
+    if (__builtin_cpu_supports("avx2"))
+	ADD_MIXER(mixer_avx2);
+#endif
+#ifdef __ARM_NEON
+    ADD_MIXER(mixer_neon);
+#endif
+#undef ADD_MIXER
+    return n;
+}
+
+const struct pcm_mixer *pcm_mixer_best(void)
+{
+    const struct pcm_mixer *list[4];
+
+    return list[pcm_mixer_list(list, 4) - 1];
+}
+
+int16_t pcm_mix_vol(double vol)
+{
+    long v = lrint(vol * MIX_VOL_ONE);
+
+    return (v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : v));
+}
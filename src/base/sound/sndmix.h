@@ -0,0 +1,39 @@
+/*
+ * Stream mixing kernels for sndpcm.c.
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+#ifndef SNDMIX_H
+#define SNDMIX_H
+
+#include "sound/sound.h"
+
+/* The volumes are signed fixed point with this many fraction bits. The
+ * SB16 output gain takes them up to about 2.3, so the int16 coefficients
+ * need 2 integer bits, leaving 13. */
+#define MIX_VOL_SHIFT 13
+#define MIX_VOL_ONE (1 << MIX_VOL_SHIFT)
+
+/* the kernels assume SNDBUF_CHANS == 2 */
+typedef int16_t mix_vol_t[SNDBUF_CHANS][SNDBUF_CHANS];
+
+struct pcm_mixer {
+    const char *name;
+    /* acc[i][j] += (sum over k of in[i][k] * vol[j][k]) >> MIX_VOL_SHIFT,
+     * rounded to nearest */
+    void (*mix)(int32_t acc[][SNDBUF_CHANS], const sndbuf_t in[][SNDBUF_CHANS],
+	    int nframes, const mix_vol_t vol);
+    /* out[i][j] = acc[i][j], saturated to the S16 range */
+    void (*clip)(sndbuf_t out[][SNDBUF_CHANS], const int32_t acc[][SNDBUF_CHANS],
+	    int nframes);
+};
+
+/* the best mixer for the CPU we run on */
+const struct pcm_mixer *pcm_mixer_best(void);
+/* stores the mixers the CPU can run, generic first; returns their number */
+int pcm_mixer_list(const struct pcm_mixer *list[], int max);
+/* converts the volume factor to MIX_VOL_SHIFT fixed point */
+int16_t pcm_mix_vol(double vol);
+
+#endif
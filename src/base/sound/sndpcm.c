@@ -37,15 +37,24 @@
 #include <assert.h>
 #include "emu.h"
 #include "utilities.h"
-#include "ringbuf.h"
 #include "timers.h"
 #include "sound/sound.h"
+#include "spscq.h"
+#include "sndmix.h"
+#include "sndrsmp.h"
 
 
 #define pcm_printf(...) do { \
     if (debug_level('S') >= 9) S_printf(__VA_ARGS__); \
 } while (0)
-#define SND_BUFFER_SIZE 100000	/* enough to hold 1.1s of 44100/stereo */
+#define SND_BUFFER_SIZE 200000	/* bytes, 1.1s of 44100/stereo/16bit */
+#define MAX_BLOCKS 1024
+#define MIX_CHUNK 256
+#define QREC_FRAMES MIX_CHUNK
+/* 64K, a multiple of the record alignment */
+#define QUEUE_SIZE (65536 / sizeof(struct pcm_qrec) * sizeof(struct pcm_qrec))
+/* input frames for the FIR of one chunk, for ratios down to 1/8 */
+#define RSMP_WIN (MIX_CHUNK * 8 + RSMP_MAX_TAPS)
 #define BUFFER_DELAY 40000.0
 
 #define MIN_BUFFER_DELAY (BUFFER_DELAY)
@@ -90,20 +99,49 @@ enum {
     SNDBUF_STATE_STALLED,
 };
 
-struct sample {
+/* A run of frames of one format, evenly spaced in time: frame n of the
+ * block plays at tstamp + n * period. A write that continues the last
+ * block is appended to it, so a steadily playing stream is just one or
+ * two blocks. The frames are kept in the stream's data ring in their
+ * native format, with the channels interleaved. */
+struct pcm_block {
+    long long first;		/* stream frame number of the first frame */
+    int nframes;
     int format;
     double tstamp;
-    unsigned char data[2];
+    double period;
+    unsigned long long pos;	/* data offset of the first frame */
+};
+
+/* Frames on their way from a producer to the stream's blocks. The
+ * producer only fills the stream's queue, so it never waits for a player
+ * that holds strm_mtx; whoever takes strm_mtx next moves the records to
+ * the blocks. A record is followed by its frames and padded to a
+ * multiple of sizeof(struct pcm_qrec), so that the end of the ring always
+ * leaves room for at least a header, and records never wrap around. */
+struct pcm_qrec {
+    double tstamp;
+    double period;
+    int format;
+    int nframes;		/* 0 for the padding at the end of the ring */
+    unsigned size;		/* of the whole record */
 };
 
 struct stream {
     int channels;
-    struct rng_s buffer;
-    /* buf_cnt is a flat counter, never decrements. We have to use
-     * something really "long" for it, because "int" can overflow in
-     * about 6.7 hours of playing stereo sound at rate 44100.
-     * Surprisingly @runderwoo have actually hit such overflow when
-     * buf_cnt was "int". Lets use "long long". */
+    unsigned char *data;	/* SND_BUFFER_SIZE bytes ring */
+    /* offsets of the first frame and of the end, they only grow */
+    unsigned long long data_head;
+    unsigned long long data_tail;
+    struct pcm_block *blk;	/* MAX_BLOCKS ring */
+    int blk_first;
+    int blk_num;
+    void *queue;		/* of struct pcm_qrec, QUEUE_SIZE bytes */
+    /* buf_cnt is the number of the first frame in the buffer, a flat
+     * counter, never decrements. We have to use something really "long"
+     * for it, because "int" can overflow in about 6.7 hours of playing
+     * stereo sound at rate 44100. Surprisingly @runderwoo have actually
+     * hit such overflow when buf_cnt was "int". Lets use "long long". */
     long long buf_cnt;
     int state;
     int flags;
@@ -120,6 +158,10 @@ struct stream {
     double adj_time_delay;
     double last_fillup;
     /* --- */
+    /* the stream ran dry while playing */
+    unsigned underruns;
+    /* frames dropped because the queue or the buffer was full */
+    unsigned overruns;
     const char *name;
 };
 
@@ -136,9 +178,12 @@ struct efp_link {
 
 struct pcm_player_wr {
     double time;
-    long long last_cnt[MAX_STREAMS];
-    int last_idx[MAX_STREAMS];
-    double last_tstamp[MAX_STREAMS];
+    /* per stream, the number of the first frame not yet passed */
+    long long pos[MAX_STREAMS];
+    /* per stream, the volumes and is_connected() of vol_gen */
+    int vol_gen;
+    mix_vol_t vol[MAX_STREAMS];
+    int connected[MAX_STREAMS];
     struct efp_link efpl[MAX_EFP_LINKS];
     int num_efp_links;
 };
@@ -163,6 +208,9 @@ struct pcm_struct {
     double (*get_volume)(int id, int chan_dst, int chan_src, void *);
     int (*is_connected)(int id, void *arg);
     int (*checkid2)(void *id2, void *arg);
+    int vol_gen;
+    const struct pcm_mixer *mixer;
+    int rsmp_quality;
     pthread_mutex_t strm_mtx;
     pthread_mutex_t time_mtx;
     struct pcm_holder players[MAX_PLAYERS];
@@ -259,6 +307,10 @@ int pcm_init(void)
     pcm.get_volume = get_vol_dummy;
     pcm.is_connected = is_connected_dummy;
     pcm.checkid2 = checkid2_dummy;
+    pcm.mixer = pcm_mixer_best();
+    pcm_printf("PCM: using %s mixer\n", pcm.mixer->name);
+    pcm.rsmp_quality = _max(_min(config.pcm_resample_quality,
+	    RSMP_MAX_QUALITY), RSMP_LINEAR);
 
     /* init efps before players because players init code refers to efps */
     if (!pcm_init_plugins(pcm.efps, pcm.num_efps))
@@ -270,10 +322,82 @@ int pcm_init(void)
     return 1;
 }
 
+#define BLK(s, n) (&(s)->blk[((s)->blk_first + (n)) % MAX_BLOCKS])
+
+static struct pcm_block *last_block(struct stream *s)
+{
+    return s->blk_num ? BLK(s, s->blk_num - 1) : NULL;
+}
+
+/* number of the frame after the last one */
+static long long stream_end(struct stream *s)
+{
+    struct pcm_block *b = last_block(s);
+    return b ? b->first + b->nframes : s->buf_cnt;
+}
+
+static int stream_frames(int strm_idx)
+{
+    struct stream *s = &pcm.stream[strm_idx];
+    return stream_end(s) - s->buf_cnt;
+}
+
+static int frame_size(struct stream *s, int format)
+{
+    return s->channels * pcm_format_size(format);
+}
+
+static double frame_tstamp(struct pcm_block *b, long long frame)
+{
+    return b->tstamp + (frame - b->first) * b->period;
+}
+
+static unsigned char *frame_data(struct stream *s, struct pcm_block *b,
+	long long frame)
+{
+    return s->data + (b->pos + (frame - b->first) *
+	    frame_size(s, b->format)) % SND_BUFFER_SIZE;
+}
+
+/* the block holding frame, or NULL if it is not in the buffer */
+static struct pcm_block *find_block(struct stream *s, long long frame)
+{
+    int i;
+    for (i = 0; i < s->blk_num; i++) {
+	struct pcm_block *b = BLK(s, i);
+	if (frame >= b->first && frame < b->first + b->nframes)
+	    return b;
+    }
+    return NULL;
+}
+
+/* remove the frames before frame number upto */
+static void drop_frames(struct stream *s, long long upto)
+{
+    s->buf_cnt = upto;
+    while (s->blk_num) {
+	struct pcm_block *b = BLK(s, 0);
+	if (upto < b->first + b->nframes) {
+	    s->data_head = b->pos + (upto - b->first) *
+		    frame_size(s, b->format);
+	    return;
+	}
+	s->blk_first = (s->blk_first + 1) % MAX_BLOCKS;
+	s->blk_num--;
+    }
+    s->data_head = s->data_tail;
+}
+
 static void pcm_clear_stream(int strm_idx)
 {
-    pcm.stream[strm_idx].buf_cnt += rng_count(&pcm.stream[strm_idx].buffer);
-    rng_clear(&pcm.stream[strm_idx].buffer);
+    struct stream *s = &pcm.stream[strm_idx];
+    struct pcm_qrec *r;
+    unsigned len;
+
+    /* the queued frames go too */
+    while ((r = spscq_read_area(s->queue, &len)))
+	spscq_commit_read(s->queue, r->size);
+    drop_frames(s, stream_end(s));
 }
 
 static void pcm_reset_stream(int strm_idx)
@@ -295,16 +419,18 @@ int pcm_allocate_stream(int channels, const char *name, void *vol_arg)
     }
     pthread_mutex_lock(&pcm.strm_mtx);
     index = pcm.num_streams++;
-    rng_init(&pcm.stream[index].buffer, SND_BUFFER_SIZE,
-	     sizeof(struct sample));
-    /* to keep timestamps contiguous, we disable overwrites */
-    rng_allow_ovw(&pcm.stream[index].buffer, 0);
+    pcm.stream[index].data = malloc(SND_BUFFER_SIZE);
+    pcm.stream[index].blk = malloc(MAX_BLOCKS * sizeof(struct pcm_block));
+    pcm.stream[index].data_head = pcm.stream[index].data_tail = 0;
+    pcm.stream[index].blk_first = pcm.stream[index].blk_num = 0;
+    pcm.stream[index].queue = spscq_init(QUEUE_SIZE);
     pcm.stream[index].channels = channels;
     pcm.stream[index].name = name;
     pcm.stream[index].buf_cnt = 0;
     pcm.stream[index].vol_arg = vol_arg;
     pcm_reset_stream(index);
     pthread_mutex_unlock(&pcm.strm_mtx);
+    pcm_volume_changed();
     pcm_printf("PCM: Stream %i allocated for \"%s\"\n", index, name);
     return index;
 }
@@ -463,14 +589,6 @@ int pcm_frag_size(double period, struct player_params *params)
     return nsamps * pcm_format_size(params->format);
 }
 
-static int peek_last_sample(int strm_idx, struct sample *samp)
-{
-    int idx = rng_count(&pcm.stream[strm_idx].buffer);
-    if (!idx)
-	return 0;
-    return rng_peek(&pcm.stream[strm_idx].buffer, idx - 1, samp);
-}
-
 void pcm_prepare_stream(int strm_idx)
 {
     long long now = GETusTIME(0);
@@ -630,17 +748,18 @@ static void pcm_handle_get(int strm_idx, double time)
     case SNDBUF_STATE_PLAYING:
 	if (pcm.stream[strm_idx].flags & PCM_FLAG_RAW)
 	    handle_raw_adj(strm_idx, fillup, stop_time);
-	if (rng_count(&pcm.stream[strm_idx].buffer) <
-	    pcm.stream[strm_idx].channels * 2 && fillup == 0) {
+	if (stream_frames(strm_idx) < 2 && fillup == 0) {
 	    pcm_printf("PCM: ERROR: buffer on stream %i exhausted (%s)\n",
 		      strm_idx, pcm.stream[strm_idx].name);
 	    /* ditch the last sample here, if it is the only remaining */
 	    pcm_clear_stream(strm_idx);
 	}
 	if (fillup == 0) {
-	    if (!(pcm.stream[strm_idx].flags & PCM_FLAG_RAW))
+	    if (!(pcm.stream[strm_idx].flags & PCM_FLAG_RAW)) {
 		pcm_printf("PCM: ERROR: buffer on stream %i stalled (%s)\n",
 		      strm_idx, pcm.stream[strm_idx].name);
+		pcm.stream[strm_idx].underruns++;
+	    }
 	    pcm.stream[strm_idx].state = SNDBUF_STATE_STALLED;
 	}
 	if (pcm.stream[strm_idx].state == SNDBUF_STATE_PLAYING &&
@@ -648,13 +767,12 @@ static void pcm_handle_get(int strm_idx, double time)
 		fillup < WR_BUFFER_LW) {
 	    pcm_printf("PCM: buffer fillup %f is too low, %s %i %f\n",
 		    fillup, pcm.stream[strm_idx].name,
-		    rng_count(&pcm.stream[strm_idx].buffer), stop_time);
+		    stream_frames(strm_idx), stop_time);
 	}
 	break;
 
     case SNDBUF_STATE_FLUSHING:
-	if (rng_count(&pcm.stream[strm_idx].buffer) <
-		pcm.stream[strm_idx].channels * 2 && fillup == 0) {
+	if (stream_frames(strm_idx) < 2 && fillup == 0) {
 	    pcm_reset_stream(strm_idx);
 	    pcm_printf("PCM: stream %s stopped\n", pcm.stream[strm_idx].name);
 	} else if (fillup == 0 && !pcm.stream[strm_idx].stretch) {
@@ -818,224 +936,366 @@ static double pcm_calc_tstamp(int strm_idx)
     return tstamp;
 }
 
+/* the block to append frames at tstamp to, or NULL if there is no room */
+static struct pcm_block *get_block(struct stream *s, double tstamp,
+	double period, int format)
+{
+    struct pcm_block *b = last_block(s);
+    unsigned long long tail;
+    long long end = stream_end(s);
+
+    if (b && b->format == format && b->period == period &&
+	    fabs(frame_tstamp(b, end) - tstamp) < 1.0)
+	return b;
+    if (s->blk_num == MAX_BLOCKS)
+	return NULL;
+    /* align, so that no frame wraps around the end of the ring */
+    tail = (s->data_tail + 3) & ~3ULL;
+    if (tail - s->data_head + frame_size(s, format) > SND_BUFFER_SIZE)
+	return NULL;
+    if (!s->blk_num)
+	s->data_head = tail;
+    s->data_tail = tail;
+    b = BLK(s, s->blk_num++);
+    b->first = end;
+    b->nframes = 0;
+    b->format = format;
+    b->tstamp = tstamp;
+    b->period = period;
+    b->pos = tail;
+    return b;
+}
+
+/* move the frames of r to the stream's blocks; under strm_mtx */
+static void pcm_store_frames(int strm_idx, const struct pcm_qrec *r)
+{
+    struct stream *s = &pcm.stream[strm_idx];
+    const unsigned char *src = (const unsigned char *)(r + 1);
+    struct pcm_block *b = last_block(s);
+    int k, n, fsz = frame_size(s, r->format);
+
+    assert(!(b && r->tstamp < frame_tstamp(b, stream_end(s) - 1)));
+    b = get_block(s, r->tstamp, r->period, r->format);
+    n = b ? (SND_BUFFER_SIZE - (s->data_tail - s->data_head)) / fsz : 0;
+    if (n < r->nframes) {
+	/* the frames are already timed, so the rest can only be dropped */
+	__atomic_add_fetch(&s->overruns, 1, __ATOMIC_RELAXED);
+	if (!(s->flags & PCM_FLAG_RAW)) {
+	    error("Sound buffer %i overflowed (%s)\n", strm_idx, s->name);
+	} else {
+	    pcm_printf("Sound buffer %i overflowed (%s)\n", strm_idx,
+		    s->name);
+	    s->adj_time_delay = 0;
+	}
+	if (!n)
+	    return;
+    }
+    n = _min(n, r->nframes);
+    for (k = 0; k < n; k++, src += fsz) {
+	memcpy(s->data + s->data_tail % SND_BUFFER_SIZE, src, fsz);
+	s->data_tail += fsz;
+    }
+    b->nframes += n;
+}
+
+static void pcm_drain_queue(int strm_idx)
+{
+    struct stream *s = &pcm.stream[strm_idx];
+    struct pcm_qrec *r;
+    unsigned len;
+
+    while ((r = spscq_read_area(s->queue, &len))) {
+	assert(len >= r->size);
+	if (r->nframes)
+	    pcm_store_frames(strm_idx, r);
+	spscq_commit_read(s->queue, r->size);
+    }
+}
+
+static void pcm_drain_queues(void)
+{
+    int i;
+    for (i = 0; i < pcm.num_streams; i++)
+	pcm_drain_queue(i);
+}
+
+/* room for a record of size bytes, or NULL if the queue is full */
+static struct pcm_qrec *queue_area(struct stream *s, unsigned size)
+{
+    struct pcm_qrec *r;
+    unsigned len;
+
+    r = spscq_try_write_area(s->queue, &len);
+    if (r && len < size && len == spscq_write_tail(s->queue)) {
+	/* the record would cross the end of the ring: pad up to the end
+	   and retry at its start. If the queue is just full, fail. */
+	r->nframes = 0;
+	r->size = len;
+	spscq_commit_write(s->queue, len);
+	r = spscq_try_write_area(s->queue, &len);
+    }
+    return (r && len >= size ? r : NULL);
+}
+
 void pcm_write_interleaved(sndbuf_t ptr[][SNDBUF_CHANS], int frames,
 	int rate, int format, int nchans, int strm_idx)
 {
-    int i, j;
-    struct sample samp;
-    double frame_per;
+    int i, j, k, n, ssz, fsz;
+    unsigned size;
+    double frame_per, tstamp;
     struct stream *strm;
+    struct pcm_qrec *r;
+    unsigned char *dst;
 
     strm = &pcm.stream[strm_idx];
     assert(nchans <= strm->channels);
     if (strm->flags & PCM_FLAG_RAW)
 	rate /= strm->raw_speed_adj;
 
-    samp.format = format;
-    samp.tstamp = 0;
+    ssz = pcm_format_size(format);
+    fsz = frame_size(strm, format);
     frame_per = pcm_frame_period_us(rate);
-    pthread_mutex_lock(&pcm.strm_mtx);
-    for (i = 0; i < frames; i++) {
-	int l;
-	struct sample s2;
-retry:
-	samp.tstamp = pcm_calc_tstamp(strm_idx);
-	l = peek_last_sample(strm_idx, &s2);
-	assert(!(l && samp.tstamp < s2.tstamp));
-	for (j = 0; j < strm->channels; j++) {
-	    int ch = j % nchans;
-	    memcpy(samp.data, &ptr[i][ch], pcm_format_size(format));
-	    l = rng_put(&strm->buffer, &samp);
-	    if (!l) {
-		if (!(strm->flags & PCM_FLAG_RAW)) {
-		    error("Sound buffer %i overflowed (%s)\n", strm_idx,
-			    strm->name);
-		    pcm_reset_stream(strm_idx);
-		    goto retry;
-		} else {
-		    pcm_printf("Sound buffer %i overflowed (%s)\n", strm_idx,
-			    strm->name);
-		    strm->adj_time_delay = 0;
-		    goto cont;
-		}
-	    }
+    /* time_mtx keeps pcm_timer() off the stream state, but is never held
+     * while waiting for a player */
+    pthread_mutex_lock(&pcm.time_mtx);
+    for (i = 0; i < frames; i += n) {
+	n = _min(frames - i, QREC_FRAMES);
+	size = sizeof(*r) + n * fsz;
+	size = (size + sizeof(*r) - 1) / sizeof(*r) * sizeof(*r);
+	r = queue_area(strm, size);
+	if (!r) {
+	    /* no one took the frames for the whole queue length */
+	    __atomic_add_fetch(&strm->overruns, 1, __ATOMIC_RELAXED);
+	    pcm_printf("PCM: queue of stream %i overflowed (%s)\n", strm_idx,
+		    strm->name);
+	    break;
 	}
-	pcm_handle_write(strm_idx, samp.tstamp);
-	strm->stop_time = samp.tstamp + frame_per;
+	tstamp = pcm_calc_tstamp(strm_idx);
+	r->tstamp = tstamp;
+	r->period = frame_per;
+	r->format = format;
+	r->nframes = n;
+	r->size = size;
+	dst = (unsigned char *)(r + 1);
+	for (k = i; k < i + n; k++, dst += fsz) {
+	    for (j = 0; j < strm->channels; j++)
+		memcpy(dst + j * ssz, &ptr[k][j % nchans], ssz);
+	}
+	spscq_commit_write(strm->queue, size);
+	pcm_handle_write(strm_idx, tstamp);
+	strm->stop_time = tstamp + n * frame_per;
+    }
+    pthread_mutex_unlock(&pcm.time_mtx);
+
+    /* if a player is mixing, it takes the frames itself */
+    if (pthread_mutex_trylock(&pcm.strm_mtx) == 0) {
+	pcm_drain_queue(strm_idx);
+	pthread_mutex_unlock(&pcm.strm_mtx);
     }
 
-cont:
     for (i = 0; i < PCM_ID_MAX; i++) {
 	int id = 1 << i;
 	if (!pcm.is_connected(id, strm->vol_arg))
 	    continue;
-	if (!(id & pcm.playing))
-	    pcm_start_output(id);
+	if (!(id & pcm.playing)) {
+	    pthread_mutex_lock(&pcm.strm_mtx);
+	    if (!(id & pcm.playing))
+		pcm_start_output(id);
+	    pthread_mutex_unlock(&pcm.strm_mtx);
+	}
     }
-    pthread_mutex_unlock(&pcm.strm_mtx);
 }
 
 static void pcm_remove_samples(double time)
 {
-    #define GUARD_SAMPS 1
-    int i;
-    struct sample s;
+    int i, m;
+    struct stream *s;
+    struct pcm_block *b;
     for (i = 0; i < pcm.num_streams; i++) {
-	if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE)
+	s = &pcm.stream[i];
+	if (s->state == SNDBUF_STATE_INACTIVE)
 	    continue;
-	while (rng_count(&pcm.stream[i].buffer) >= pcm.stream[i].channels *
-		(GUARD_SAMPS + 1)) {
-	    /* we leave GUARD_SAMPS samples below the timestamp untouched */
-	    rng_peek(&pcm.stream[i].buffer, pcm.stream[i].channels *
-		    GUARD_SAMPS, &s);
-	    if (s.tstamp > time)
-		break;
-	    pcm.stream[i].buf_cnt += pcm.stream[i].channels;
-	    rng_remove(&pcm.stream[i].buffer, pcm.stream[i].channels, NULL);
+	/* we leave the last frame below the timestamp untouched */
+	while (s->blk_num) {
+	    b = BLK(s, 0);
+	    if (s->blk_num > 1 && BLK(s, 1)->tstamp <= time) {
+		drop_frames(s, b->first + b->nframes);
+		continue;
+	    }
+	    /* the last frame of b at or below time */
+	    m = _min((time - b->tstamp) / b->period, b->nframes - 1);
+	    while (m >= 0 && frame_tstamp(b, b->first + m) > time)
+		m--;
+	    while (m + 1 < b->nframes &&
+		    frame_tstamp(b, b->first + m + 1) <= time)
+		m++;
+	    if (b->first + m > s->buf_cnt)
+		drop_frames(s, b->first + m);
+	    break;
 	}
     }
 }
 
-static sndbuf_t pcm_interpolate(struct sample s1, struct sample s2,
-		double time)
+static sndbuf_t pcm_interpolate(sndbuf_t v1, double t1, sndbuf_t v2,
+		double t2, double time)
 {
-    sndbuf_t v1 = sample_to_S16(s1.data, s1.format);
-    sndbuf_t v2 = sample_to_S16(s2.data, s2.format);
-    if (s2.tstamp <= s1.tstamp)
+    if (t2 <= t1)
 	return v1;
     /* simple linear interpolation for now */
-    return (v1 + (time - s1.tstamp) * (v2 - v1) / (s2.tstamp - s1.tstamp));
+    return (v1 + (time - t1) * (v2 - v1) / (t2 - t1));
 }
 
-static void pcm_get_samples(double time,
-		sndbuf_t samp[MAX_STREAMS][SNDBUF_CHANS], int *idxs,
-		int out_channels, int id)
+static void get_frame(struct stream *s, struct pcm_block *b, long long frame,
+		sndbuf_t v[SNDBUF_CHANS], int out_channels)
 {
-    int i, j;
-    int started;
-    int have_prev;
-    struct sample s[SNDBUF_CHANS], prev_s[SNDBUF_CHANS];
+    unsigned char *p = frame_data(s, b, frame);
+    int j, ssz = pcm_format_size(b->format);
 
-    for (i = 0; i < pcm.num_streams; i++) {
-	for (j = 0; j < SNDBUF_CHANS; j++)
-	    samp[i][j] = 0;
-	if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE ||
-		!pcm.is_connected(id, pcm.stream[i].vol_arg))
-	    continue;
-
-	have_prev = 0;
-	started = 0;
-	if (idxs[i] >= pcm.stream[i].channels) {
-	    idxs[i] -= pcm.stream[i].channels;
-	    have_prev = 1;
-	}
-	while (rng_count(&pcm.stream[i].buffer) - idxs[i] >=
-	       pcm.stream[i].channels) {
-	    for (j = 0; j < pcm.stream[i].channels; j++)
-		rng_peek(&pcm.stream[i].buffer, idxs[i] + j, &s[j]);
-	    if (out_channels == 2 && pcm.stream[i].channels == 1)
-		s[1] = s[0];
-	    if (s[0].tstamp > time) {
-		if (!started) {
-		    /* assert on idxs in sync with time */
-		    assert(!have_prev);
-		    break;
-		}
-		for (j = 0; j < out_channels; j++)
-		    samp[i][j] = pcm_interpolate(prev_s[j], s[j], time);
-		break;
-	    }
-	    memcpy(prev_s, s, sizeof(struct sample) * out_channels);
-	    idxs[i] += pcm.stream[i].channels;
-	    started = 1;
-	}
-    }
+    for (j = 0; j < s->channels; j++)
+	v[j] = sample_to_S16(p + j * ssz, b->format);
+    if (out_channels == 2 && s->channels == 1)
+	v[1] = v[0];
 }
 
-static void pcm_mix_samples(sndbuf_t in[][SNDBUF_CHANS],
-	sndbuf_t out[SNDBUF_CHANS], int channels, int format,
-	double volume[][SNDBUF_CHANS][SNDBUF_CHANS])
+/* Fill win with the n frames from lo on; the frames not in the buffer
+ * repeat the nearest one that is. */
+static void get_window(struct stream *s, long long lo, int n,
+		sndbuf_t win[][SNDBUF_CHANS], int out_channels)
 {
-    int i, j, k;
-    int value[SNDBUF_CHANS] = { 0 };
+    struct pcm_block *b = NULL;
+    long long f, end = stream_end(s);
+    int i;
 
-    for (j = 0; j < SNDBUF_CHANS; j++) {
-	for (i = 0; i < pcm.num_streams; i++) {
-	    if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE)
-		continue;
-	    for (k = 0; k < SNDBUF_CHANS; k++) {
-		if (volume[i][j][k] == 0)
-		    continue;
-		value[j] += in[i][k] * volume[i][j][k];
-	    }
-	}
-    }
-    for (i = channels; i < SNDBUF_CHANS; i++)
-	value[0] += value[i];
-    for (i = 0; i < channels; i++) {
-	S16_to_sample(pcm_samp_cutoff(value[i], PCM_FORMAT_S16_LE),
-		&out[i], format);
+    for (i = 0; i < n; i++) {
+	f = _max(_min(lo + i, end - 1), s->buf_cnt);
+	if (!b || f < b->first || f >= b->first + b->nframes)
+	    b = find_block(s, f);
+	get_frame(s, b, f, win[i], out_channels);
     }
 }
 
-static void calc_idxs(struct pcm_player_wr *pl, int idxs[MAX_STREAMS])
+/* Fill samp with nframes of stream strm_idx at time, time + period, ...
+ * resampled by a FIR, or interpolated between the frames around them
+ * with $_pcm_resample_quality 0; *pos is the first frame after the
+ * previous call's times, and is moved on. */
+static void pcm_get_samples(int strm_idx, double time, double period,
+		int nframes, long long *pos, sndbuf_t samp[][SNDBUF_CHANS],
+		int out_channels)
 {
-    int i;
-    for (i = 0; i < pcm.num_streams; i++) {
-	if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE)
+    struct stream *s = &pcm.stream[strm_idx];
+    struct pcm_block *b, *pb;
+    const struct pcm_fir *fir = NULL;
+    sndbuf_t v1[SNDBUF_CHANS], v2[SNDBUF_CHANS];
+    sndbuf_t win[RSMP_WIN][SNDBUF_CHANS];
+    int first[MIX_CHUNK], phase[MIX_CHUNK];
+    long long f = *pos, end = stream_end(s), got = -1, lo = LLONG_MIN, base;
+    double t, t1 = 0, t2;
+    int i, j, ph, hi = 0;
+
+    b = find_block(s, f);
+    pb = f > s->buf_cnt ? find_block(s, f - 1) : NULL;
+    if (pcm.rsmp_quality != RSMP_LINEAR && b &&
+	    nframes * period / b->period + RSMP_MAX_TAPS + 2 <= RSMP_WIN)
+	fir = pcm_fir_get(pcm.rsmp_quality, b->period / period);
+    for (i = 0; i < nframes; i++) {
+	first[i] = -1;
+	t = time + i * period;
+	for (j = 0; j < SNDBUF_CHANS; j++)
+	    samp[i][j] = 0;
+	/* move to the first frame after t */
+	while (f < end && frame_tstamp(b, f) <= t) {
+	    pb = b;
+	    if (++f == b->first + b->nframes)
+		b = f < end ? &s->blk[(b - s->blk + 1) % MAX_BLOCKS] : NULL;
+	}
+	if (f == end || !pb)
+	    continue;
+	if (fir) {
+	    /* the nearest phase between frames f - 1 and f */
+	    t1 = frame_tstamp(pb, f - 1);
+	    t2 = frame_tstamp(b, f);
+	    ph = (t2 > t1 && t > t1 ?
+		    (t - t1) / (t2 - t1) * fir->phases + 0.5 : 0);
+	    base = f - 1;
+	    if (ph >= fir->phases) {
+		ph = 0;
+		base++;
+	    }
+	    base -= fir->taps / 2 - 1;
+	    if (lo == LLONG_MIN)
+		lo = base;
+	    if (base - lo + fir->taps > RSMP_WIN)
+		continue;
+	    first[i] = base - lo;
+	    phase[i] = ph;
+	    hi = first[i] + fir->taps;
 	    continue;
-	assert(pcm.stream[i].buf_cnt >= pl->last_cnt[i]);
-	if (pl->last_idx[i] > pcm.stream[i].buf_cnt - pl->last_cnt[i]) {
-	    struct sample s;
-	    idxs[i] = pl->last_idx[i] - (pcm.stream[i].buf_cnt -
-		    pl->last_cnt[i]);
-	    assert(idxs[i] <= rng_count(&pcm.stream[i].buffer));
-	    rng_peek(&pcm.stream[i].buffer, idxs[i] - 1, &s);
-	    assert(pl->last_tstamp[i] == s.tstamp);
-	} else {
-	    idxs[i] = 0;
 	}
+	if (got != f) {
+	    get_frame(s, pb, f - 1, v1, out_channels);
+	    get_frame(s, b, f, v2, out_channels);
+	    t1 = frame_tstamp(pb, f - 1);
+	    got = f;
+	}
+	t2 = frame_tstamp(b, f);
+	for (j = 0; j < out_channels; j++)
+	    samp[i][j] = pcm_interpolate(v1[j], t1, v2[j], t2, t);
+    }
+    if (lo != LLONG_MIN) {
+	get_window(s, lo, hi, win, out_channels);
+	pcm_fir_run(fir, win, first, phase, nframes, samp, out_channels);
     }
+    *pos = f;
 }
 
-static void save_idxs(struct pcm_player_wr *pl, int idxs[MAX_STREAMS])
+static void pcm_mix_chunk(double time, double period, int nframes,
+	sndbuf_t out[][SNDBUF_CHANS], int channels, int format,
+	long long pos[MAX_STREAMS], struct pcm_player_wr *pl)
 {
-    int i;
+    int i, j;
+    sndbuf_t in[MIX_CHUNK][SNDBUF_CHANS];
+    int32_t value[MIX_CHUNK][SNDBUF_CHANS];
+
+    memset(value, 0, nframes * sizeof(value[0]));
     for (i = 0; i < pcm.num_streams; i++) {
-	if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE)
+	if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE || !pl->connected[i])
 	    continue;
-	assert(idxs[i] <= rng_count(&pcm.stream[i].buffer));
-	if (idxs[i] > 0) {
-	    struct sample s;
-	    rng_peek(&pcm.stream[i].buffer, idxs[i] - 1, &s);
-	    pl->last_tstamp[i] = s.tstamp;
+	pcm_get_samples(i, time, period, nframes, &pos[i], in, channels);
+	pcm.mixer->mix(value, in, nframes, pl->vol[i]);
+    }
+    if (channels == SNDBUF_CHANS && format == PCM_FORMAT_S16_LE) {
+	pcm.mixer->clip(out, value, nframes);
+	return;
+    }
+    for (i = 0; i < nframes; i++) {
+	for (j = channels; j < SNDBUF_CHANS; j++)
+	    value[i][0] += value[i][j];
+	for (j = 0; j < channels; j++) {
+	    S16_to_sample(pcm_samp_cutoff(value[i][j], PCM_FORMAT_S16_LE),
+		    &out[i][j], format);
 	}
-	pl->last_cnt[i] = pcm.stream[i].buf_cnt;
-	pl->last_idx[i] = idxs[i];
     }
 }
 
-static void get_volumes(int id, double volume[][SNDBUF_CHANS][SNDBUF_CHANS])
+static void get_volumes(int id, struct pcm_player_wr *pl)
 {
     int i, j, k;
     for (i = 0; i < pcm.num_streams; i++) {
 	struct stream *strm = &pcm.stream[i];
-	if (strm->state == SNDBUF_STATE_INACTIVE)
-	    continue;
+	pl->connected[i] = pcm.is_connected(id, strm->vol_arg);
 	for (j = 0; j < SNDBUF_CHANS; j++)
 	    for (k = 0; k < SNDBUF_CHANS; k++)
-		volume[i][j][k] = pcm.get_volume(id, j, k, strm->vol_arg);
+		pl->vol[i][j][k] = pcm_mix_vol(pcm.get_volume(id, j, k,
+			strm->vol_arg));
     }
 }
 
 int pcm_data_get_interleaved(sndbuf_t buf[][SNDBUF_CHANS], int nframes,
 			   struct player_params *params)
 {
-    int idxs[MAX_STREAMS], out_idx, handle, i;
-    long long now;
+    int out_idx, handle, i, n, gen;
+    long long now, pos[MAX_STREAMS];
     double start_time, stop_time, frame_period, frag_period, time;
-    sndbuf_t samp[MAX_STREAMS][SNDBUF_CHANS];
-    double volume[MAX_STREAMS][SNDBUF_CHANS][SNDBUF_CHANS];
     struct pcm_holder *p;
 
     now = GETusTIME(0);
@@ -1081,21 +1341,29 @@ int pcm_data_get_interleaved(sndbuf_t buf[][SNDBUF_CHANS], int nframes,
 	pthread_mutex_unlock(&pcm.strm_mtx);
 	return 0;
     }
+    pcm_drain_queues();
     frame_period = pcm_frame_period_us(params->rate);
     time = start_time;
-    calc_idxs(PL_PRIV(p), idxs);
-    get_volumes(PLAYER(p)->id, volume);
-    for (out_idx = 0; out_idx < nframes; out_idx++) {
-	pcm_get_samples(time, samp, idxs, params->channels, PLAYER(p)->id);
-	pcm_mix_samples(samp, buf[out_idx], params->channels, params->format,
-		volume);
-	time += frame_period;
+    /* the frames before buf_cnt are gone */
+    for (i = 0; i < pcm.num_streams; i++)
+	pos[i] = _max(PL_PRIV(p)->pos[i], pcm.stream[i].buf_cnt);
+    /* the mixer callbacks are only asked again after pcm_volume_changed() */
+    gen = __atomic_load_n(&pcm.vol_gen, __ATOMIC_ACQUIRE);
+    if (PL_PRIV(p)->vol_gen != gen) {
+	get_volumes(PLAYER(p)->id, PL_PRIV(p));
+	PL_PRIV(p)->vol_gen = gen;
+    }
+    for (out_idx = 0; out_idx < nframes; out_idx += n) {
+	n = _min(nframes - out_idx, MIX_CHUNK);
+	pcm_mix_chunk(time, frame_period, n, &buf[out_idx], params->channels,
+		params->format, pos, PL_PRIV(p));
+	time += n * frame_period;
     }
     if (fabs(time - stop_time) > frame_period)
 	error("PCM: time=%f stop_time=%f p=%f\n",
 		    time, stop_time, frame_period);
     PL_PRIV(p)->time = stop_time;
-    save_idxs(PL_PRIV(p), idxs);
+    memcpy(PL_PRIV(p)->pos, pos, sizeof(pos));
     pthread_mutex_unlock(&pcm.strm_mtx);
 
     for (i = 0; i < PL_PRIV(p)->num_efp_links; i++) {
@@ -1127,12 +1395,17 @@ size_t pcm_data_get(void *data, size_t size,
     return nframes * fsz;
 }
 
-static void pcm_advance_time(double time)
+/* returns the outputs that have nothing more to play */
+static int pcm_advance_time(double time)
 {
-    int i;
+    int i, stop = 0;
     double start_time = time - MAX_BUFFER_DELAY;
-    pthread_mutex_lock(&pcm.strm_mtx);
+    /* a player is mixing: it drains the queues, and we catch up on the
+     * next tick rather than wait for it */
+    if (pthread_mutex_trylock(&pcm.strm_mtx) != 0)
+	return 0;
     pcm.time = start_time;
+    pcm_drain_queues();
     /* remove processed samples from input buffers (last sample stays) */
     pcm_remove_samples(start_time);
     for (i = 0; i < pcm.num_streams; i++) {
@@ -1140,15 +1413,16 @@ static void pcm_advance_time(double time)
 	    continue;
 	if (debug_level('S') >= 9)
 	    pcm_printf("PCM: stream %i fillup2: %i\n", i,
-		 rng_count(&pcm.stream[i].buffer));
+		 stream_frames(i));
 	pcm_handle_get(i, time);
     }
 
     for (i = 0; i < PCM_ID_MAX; i++) {
 	if (!count_active_streams(1 << i) && (pcm.playing & (1 << i)))
-	    pcm_stop_output(1 << i);
+	    stop |= 1 << i;
     }
     pthread_mutex_unlock(&pcm.strm_mtx);
+    return stop;
 }
 
 int pcm_register_player(const struct pcm_player *player, void *arg)
@@ -1164,6 +1438,7 @@ int pcm_register_player(const struct pcm_player *player, void *arg)
     p->arg = arg;
     p->priv = malloc(sizeof(struct pcm_player_wr));
     memset(p->priv, 0, sizeof(struct pcm_player_wr));
+    PL_PRIV(p)->vol_gen = -1;
     return pcm.num_players++;
 }
 
@@ -1204,13 +1479,12 @@ void pcm_reset_player(int handle)
     struct pcm_holder *p = &pcm.players[handle];
     struct pcm_player_wr *pl = PL_PRIV(p);
     pl->time = now - INIT_BUFFER_DELAY;
-    memset(pl->last_idx, 0, sizeof(pl->last_idx));
-    memset(pl->last_cnt, 0, sizeof(pl->last_cnt));
+    memset(pl->pos, 0, sizeof(pl->pos));
 }
 
 void pcm_timer(void)
 {
-    int i;
+    int i, stop;
     long long now = GETusTIME(0);
     for (i = 0; i < pcm.num_players; i++) {
 	struct pcm_holder *p = &pcm.players[i];
@@ -1221,8 +1495,20 @@ void pcm_timer(void)
 	}
     }
     pthread_mutex_lock(&pcm.time_mtx);
-    pcm_advance_time(now);
+    stop = pcm_advance_time(now);
     pthread_mutex_unlock(&pcm.time_mtx);
+    /* stopping a player may wait for it, so the producers must not be
+     * held up by time_mtx meanwhile */
+    if (stop) {
+	pthread_mutex_lock(&pcm.strm_mtx);
+	for (i = 0; i < PCM_ID_MAX; i++) {
+	    int id = 1 << i;
+	    if ((stop & id) && !count_active_streams(id) &&
+		    (pcm.playing & id))
+		pcm_stop_output(id);
+	}
+	pthread_mutex_unlock(&pcm.strm_mtx);
+    }
 }
 
 void pcm_done(void)
@@ -1242,8 +1528,15 @@ void pcm_done(void)
     pcm_deinit_plugins(pcm.players, pcm.num_players);
     pcm_deinit_plugins(pcm.efps, pcm.num_efps);
 
-    for (i = 0; i < pcm.num_streams; i++)
-	rng_destroy(&pcm.stream[i].buffer);
+    for (i = 0; i < pcm.num_streams; i++) {
+	struct stream *s = &pcm.stream[i];
+	if (s->underruns || s->overruns)
+	    S_printf("PCM: stream %i (%s): %u underruns, %u overruns\n",
+		    i, s->name, s->underruns, s->overruns);
+	free(s->data);
+	free(s->blk);
+	spscq_done(s->queue);
+    }
     pthread_mutex_destroy(&pcm.strm_mtx);
     pthread_mutex_destroy(&pcm.time_mtx);
 
@@ -1377,11 +1670,20 @@ void pcm_stop_input(void *arg)
 void pcm_set_volume_cb(double (*get_vol)(int, int, int, void *))
 {
     pcm.get_volume = get_vol;
+    pcm_volume_changed();
 }
 
 void pcm_set_connected_cb(int (*is_connected)(int, void *))
 {
     pcm.is_connected = is_connected;
+    pcm_volume_changed();
+}
+
+/* The volume or is_connected callbacks give new results; the players
+ * ask them again before their next fragment. */
+void pcm_volume_changed(void)
+{
+    __atomic_add_fetch(&pcm.vol_gen, 1, __ATOMIC_RELEASE);
 }
 
 void pcm_set_checkid2_cb(int (*checkid2)(void *, void *))
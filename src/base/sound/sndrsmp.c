@@ -0,0 +1,153 @@
+/*
+ * Polyphase FIR resampler: Kaiser windowed sinc filters, made for the
+ * cutoff a rate ratio needs (the output Nyquist frequency when going
+ * down, the input one when going up) and kept as int16 tables of one
+ * row per phase. Every row adds up to exactly 1 << RSMP_SHIFT, so that
+ * DC passes unchanged.
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include "sndrsmp.h"
+
+#define MAX_FIRS 8
+
+static const struct {
+    int taps;
+    int phases;
+    double rolloff;		/* passband, as a fraction of the cutoff */
+    double beta;		/* Kaiser window */
+} fir_qual[RSMP_MAX_QUALITY + 1] = {
+    [1] = { 8, 64, 0.80, 5.0 },
+    [2] = { 16, 128, 0.88, 7.0 },
+    [3] = { RSMP_MAX_TAPS, 256, 0.93, 9.0 },
+};
+
+static struct pcm_fir firs[MAX_FIRS];
+static int num_firs, next_fir;
+
+static double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    int k;
+
+    for (k = 1; k < 30; k++) {
+	term *= (x / (2 * k)) * (x / (2 * k));
+	sum += term;
+    }
+    return sum;
+}
+
+static void fir_make(struct pcm_fir *fir)
+{
+    double fc, beta, h[RSMP_MAX_TAPS], sum, d, x;
+    int taps = fir->taps, half = taps / 2, ph, k, s, c;
+    int16_t *row;
+
+    beta = fir_qual[fir->quality].beta;
+    /* cutoff as a fraction of the input rate */
+    fc = 0.5 * fir_qual[fir->quality].rolloff * fir->cutoff /
+	    RSMP_CUTOFF_STEPS;
+    for (ph = 0; ph < fir->phases; ph++) {
+	row = fir->coef + ph * taps;
+	sum = 0;
+	for (k = 0; k < taps; k++) {
+	    /* distance of tap k from the output frame */
+	    d = k - half + 1 - (double)ph / fir->phases;
+	    x = d / half;
+	    h[k] = 2 * fc * (d == 0 ? 1 : sin(2 * M_PI * fc * d) /
+		    (2 * M_PI * fc * d));
+	    h[k] *= (fabs(x) < 1 ? bessel_i0(beta * sqrt(1 - x * x)) : 1) /
+		    bessel_i0(beta);
+	    sum += h[k];
+	}
+	s = 0;
+	for (k = 0; k < taps; k++) {
+	    row[k] = lrint(h[k] / sum * (1 << RSMP_SHIFT));
+	    s += row[k];
+	}
+	/* the rounding error goes to the tap nearest the output frame */
+	c = half - 1 + (2 * ph >= fir->phases);
+	row[c] += (1 << RSMP_SHIFT) - s;
+    }
+}
+
+const struct pcm_fir *pcm_fir_get(int quality, double ratio)
+{
+    struct pcm_fir *fir;
+    int i, cutoff;
+
+    if (quality < 1)
+	quality = 1;
+    if (quality > RSMP_MAX_QUALITY)
+	quality = RSMP_MAX_QUALITY;
+    cutoff = lrint((ratio < 1 ? ratio : 1) * RSMP_CUTOFF_STEPS);
+    if (cutoff < 1)
+	cutoff = 1;
+    for (i = 0; i < num_firs; i++) {
+	if (firs[i].quality == quality && firs[i].cutoff == cutoff)
+	    return &firs[i];
+    }
+
+    if (num_firs < MAX_FIRS)
+	fir = &firs[num_firs++];
+    else
+	fir = &firs[next_fir++ % MAX_FIRS];
+    fir->quality = quality;
+    fir->cutoff = cutoff;
+    fir->taps = fir_qual[quality].taps;
+    fir->phases = fir_qual[quality].phases;
+    free(fir->coef);
+    fir->coef = malloc(fir->phases * fir->taps * sizeof(*fir->coef));
+    fir_make(fir);
+    return fir;
+}
+
+static inline void fir_run(const struct pcm_fir *fir,
+	const sndbuf_t win[][SNDBUF_CHANS], const int first[],
+	const int phase[], int nframes, sndbuf_t out[][SNDBUF_CHANS],
+	int channels, int taps)
+{
+    const sndbuf_t (*w)[SNDBUF_CHANS];
+    const int16_t *h;
+    int32_t acc;
+    int i, j, k;
+
+    for (i = 0; i < nframes; i++) {
+	if (first[i] < 0) {
+	    for (j = 0; j < channels; j++)
+		out[i][j] = 0;
+	    continue;
+	}
+	w = win + first[i];
+	h = fir->coef + phase[i] * taps;
+	for (j = 0; j < channels; j++) {
+	    acc = 1 << (RSMP_SHIFT - 1);
+	    for (k = 0; k < taps; k++)
+		acc += w[k][j] * h[k];
+	    acc >>= RSMP_SHIFT;
+	    out[i][j] = (acc > INT16_MAX ? INT16_MAX :
+		    (acc < INT16_MIN ? INT16_MIN : acc));
+	}
+    }
+}
+
+void pcm_fir_run(const struct pcm_fir *fir, const sndbuf_t win[][SNDBUF_CHANS],
+	const int first[], const int phase[], int nframes,
+	sndbuf_t out[][SNDBUF_CHANS], int channels)
+{
+    /* constant tap counts let the compiler unroll and vectorize */
+    switch (fir->taps) {
+    case 8:
+	fir_run(fir, win, first, phase, nframes, out, channels, 8);
+	break;
+    case 16:
+	fir_run(fir, win, first, phase, nframes, out, channels, 16);
+	break;
+    default:
+	fir_run(fir, win, first, phase, nframes, out, channels, fir->taps);
+	break;
+    }
+}
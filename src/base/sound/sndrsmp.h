@@ -0,0 +1,42 @@
+/*
+ * Polyphase FIR resampler for sndpcm.c.
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+#ifndef SNDRSMP_H
+#define SNDRSMP_H
+
+#include "sound/sound.h"
+
+/* $_pcm_resample_quality: 0 is linear interpolation, 1..3 are FIRs */
+#define RSMP_LINEAR 0
+#define RSMP_MAX_QUALITY 3
+#define RSMP_MAX_TAPS 32
+/* fraction bits of the coefficients */
+#define RSMP_SHIFT 14
+#define RSMP_CUTOFF_STEPS 1024
+
+struct pcm_fir {
+    int quality;
+    int cutoff;			/* in 1/RSMP_CUTOFF_STEPS of the input Nyquist */
+    int taps;
+    int phases;
+    int16_t *coef;		/* [phases][taps] */
+};
+
+/* The filter for resampling by ratio (output rate / input rate) at
+ * quality 1..RSMP_MAX_QUALITY. The filters are made on first use and
+ * cached; the caller serializes the calls. */
+const struct pcm_fir *pcm_fir_get(int quality, double ratio);
+
+/*
+ * Filter nframes frames. For frame i, win + first[i] are the taps input
+ * frames around it and phase[i] is its position between the middle two
+ * of them, in 1/fir->phases; first[i] < 0 gives silence.
+ */
+void pcm_fir_run(const struct pcm_fir *fir, const sndbuf_t win[][SNDBUF_CHANS],
+	const int first[], const int phase[], int nframes,
+	sndbuf_t out[][SNDBUF_CHANS], int channels);
+
+#endif
@@ -57,6 +57,9 @@ RemapFuncDesc *remap_gen(void);
 
 RemapFuncDesc *(*remap_list_funcs[])(void) = {
   remap_gen,
+#if defined(__x86_64__) || defined(__i386__)
+  remap_simd,
+#endif
 #if 0
 #if defined(__i386__) && !defined(__clang__)
   remap_opt,
@@ -100,6 +100,13 @@ void gamma_correct(RemapObject *, RGBColor *, unsigned *);
 /* remap_pent.c */
 RemapFuncDesc *remap_opt(void);
 
+/* remap_simd.c */
+RemapFuncDesc *remap_simd(void);
+RemapFuncDesc *remap_simd_set(const char *isa);
+
+/* remap.c */
+void gen_8to32_all(RemapObject *);
+
 #else /* __ASSEMBLER__ */
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 		.macro RO_Struct _str_
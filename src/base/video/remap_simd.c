@@ -0,0 +1,241 @@
+/*
+ * SSE2 and AVX2 versions of the most used remap functions:
+ * 8 bit pseudo color --> 32 bit true color, unscaled and scaled (with
+ * fast paths for 1x, 2x and 3x horizontal scaling).
+ *
+ * remap_simd() returns the best set the CPU we run on supports, and
+ * remap_simd_set() a given one (for test/remap/remap-bench). They are
+ * flagged RFF_OPT_PENTIUM, so find_best_remap_func() prefers them over
+ * the generic functions in remap.c, and they produce the same pixels.
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "remap.h"
+#include "remap_priv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+typedef void (*lut_line_func)(unsigned *dst, const unsigned char *src,
+	int len, int scale, const unsigned *lut);
+
+/*
+ * convert len pixels of one line through lut, repeating every pixel
+ * scale (1..3) times
+ */
+static SSE2 void lut_line_sse2(unsigned *dst, const unsigned char *src,
+	int len, int scale, const unsigned *lut)
+{
+  __m128i v;
+  int i = 0, k;
+
+  switch(scale) {
+    case 1:
+      for(; i + 4 <= len; i += 4, dst += 4) {
+        v = _mm_setr_epi32(lut[src[i]], lut[src[i + 1]], lut[src[i + 2]], lut[src[i + 3]]);
+        _mm_storeu_si128((__m128i *) dst, v);
+      }
+      break;
+    case 2:
+      for(; i + 4 <= len; i += 4, dst += 8) {
+        v = _mm_setr_epi32(lut[src[i]], lut[src[i + 1]], lut[src[i + 2]], lut[src[i + 3]]);
+        _mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi32(v, v));
+        _mm_storeu_si128((__m128i *) dst + 1, _mm_unpackhi_epi32(v, v));
+      }
+      break;
+    case 3:
+      for(; i + 4 <= len; i += 4, dst += 12) {
+        v = _mm_setr_epi32(lut[src[i]], lut[src[i + 1]], lut[src[i + 2]], lut[src[i + 3]]);
+        _mm_storeu_si128((__m128i *) dst, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+        _mm_storeu_si128((__m128i *) dst + 1, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+        _mm_storeu_si128((__m128i *) dst + 2, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+      }
+      break;
+  }
+  for(; i < len; i++)
+    for(k = 0; k < scale; k++) *dst++ = lut[src[i]];
+}
+
+static AVX2 void lut_line_avx2(unsigned *dst, const unsigned char *src,
+	int len, int scale, const unsigned *lut)
+{
+  const __m256i dup2_lo = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+  const __m256i dup2_hi = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+  const __m256i dup3_0 = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+  const __m256i dup3_1 = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+  const __m256i dup3_2 = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+  __m256i v;
+  int i = 0, k;
+
+#define GATHER8(s) _mm256_i32gather_epi32((const int *) lut, \
+	_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (s))), 4)
+
+  switch(scale) {
+    case 1:
+      for(; i + 8 <= len; i += 8, dst += 8)
+        _mm256_storeu_si256((__m256i *) dst, GATHER8(src + i));
+      break;
+    case 2:
+      for(; i + 8 <= len; i += 8, dst += 16) {
+        v = GATHER8(src + i);
+        _mm256_storeu_si256((__m256i *) dst, _mm256_permutevar8x32_epi32(v, dup2_lo));
+        _mm256_storeu_si256((__m256i *) dst + 1, _mm256_permutevar8x32_epi32(v, dup2_hi));
+      }
+      break;
+    case 3:
+      for(; i + 8 <= len; i += 8, dst += 24) {
+        v = GATHER8(src + i);
+        _mm256_storeu_si256((__m256i *) dst, _mm256_permutevar8x32_epi32(v, dup3_0));
+        _mm256_storeu_si256((__m256i *) dst + 1, _mm256_permutevar8x32_epi32(v, dup3_1));
+        _mm256_storeu_si256((__m256i *) dst + 2, _mm256_permutevar8x32_epi32(v, dup3_2));
+      }
+      break;
+  }
+#undef GATHER8
+  for(; i < len; i++)
+    for(k = 0; k < scale; k++) *dst++ = lut[src[i]];
+}
+
+/*
+ * 8 bit pseudo color --> 32 bit true color, unscaled
+ */
+static inline void simd_8to32_1(RemapObject *ro, lut_line_func line)
+{
+  int j, l;
+  const unsigned char *src;
+  unsigned *dst;
+
+  src = ro->src_image + ro->src_start + ro->src_offset;
+  dst = (unsigned *) (ro->dst_image + ro->dst_start + ro->dst_offset);
+  l = (ro->src_x1 - ro->src_x0);
+
+  for(j = ro->src_y0; j < ro->src_y1; j++) {
+    line(dst, src, l, 1, ro->true_color_lut);
+    dst += ro->dst_scan_len >> 2;
+    src += ro->src_scan_len;
+  }
+}
+
+/*
+ * 8 bit pseudo color --> 32 bit true color
+ * supports arbitrary scaling; only horizontal factors of 1, 2 and 3 are
+ * done here, the rest is left to gen_8to32_all()
+ */
+static inline void simd_8to32_all(RemapObject *ro, lut_line_func line)
+{
+  int d_y, scale;
+  int d_scan_len = ro->dst_scan_len >> 2;
+  int *bre_y = ro->bre_y;
+  const unsigned char *src0;
+  unsigned *dst;
+
+  scale = ro->dst_width / ro->src_width;
+  if(scale < 1 || scale > 3 || scale * ro->src_width != ro->dst_width) {
+    gen_8to32_all(ro);
+    return;
+  }
+
+  src0 = ro->src_image + ro->src_start;
+  dst = (unsigned *) (ro->dst_image + ro->dst_start + ro->dst_offset);
+
+  for(d_y = ro->dst_y0; d_y < ro->dst_y1; d_y++, dst += d_scan_len) {
+    /* a line repeated by vertical scaling is just copied */
+    if(d_y > ro->dst_y0 && bre_y[d_y] == bre_y[d_y - 1])
+      memcpy(dst, dst - d_scan_len, ro->dst_width << 2);
+    else
+      line(dst, src0 + bre_y[d_y], ro->src_width, scale, ro->true_color_lut);
+  }
+}
+
+static void simd_8to32_1_sse2(RemapObject *ro) { simd_8to32_1(ro, lut_line_sse2); }
+static void simd_8to32_1_avx2(RemapObject *ro) { simd_8to32_1(ro, lut_line_avx2); }
+static void simd_8to32_all_sse2(RemapObject *ro) { simd_8to32_all(ro, lut_line_sse2); }
+static void simd_8to32_all_avx2(RemapObject *ro) { simd_8to32_all(ro, lut_line_avx2); }
+
+static RemapFuncDesc remap_sse2_list[] = {
+
+  REMAP_DESC(
+    RFF_SCALE_ALL | RFF_REMAP_LINES | RFF_OPT_PENTIUM,
+    MODE_PSEUDO_8,
+    MODE_TRUE_32,
+    simd_8to32_all_sse2,
+    NULL
+  ),
+
+  REMAP_DESC(
+    RFF_SCALE_1 | RFF_REMAP_RECT | RFF_OPT_PENTIUM,
+    MODE_PSEUDO_8,
+    MODE_TRUE_32,
+    simd_8to32_1_sse2,
+    NULL
+  ),
+
+};
+
+static RemapFuncDesc remap_avx2_list[] = {
+
+  REMAP_DESC(
+    RFF_SCALE_ALL | RFF_REMAP_LINES | RFF_OPT_PENTIUM,
+    MODE_PSEUDO_8,
+    MODE_TRUE_32,
+    simd_8to32_all_avx2,
+    NULL
+  ),
+
+  REMAP_DESC(
+    RFF_SCALE_1 | RFF_REMAP_RECT | RFF_OPT_PENTIUM,
+    MODE_PSEUDO_8,
+    MODE_TRUE_32,
+    simd_8to32_1_avx2,
+    NULL
+  ),
+
+};
+
+/*
+ * returns the chained list of modes of the named set ("sse2" or "avx2"),
+ * or NULL if the CPU can't run it
+ */
+RemapFuncDesc *remap_simd_set(const char *isa)
+{
+  RemapFuncDesc *list;
+  int i, n;
+
+  __builtin_cpu_init();
+  if(!strcmp(isa, "avx2") && __builtin_cpu_supports("avx2")) {
+    list = remap_avx2_list;
+    n = sizeof(remap_avx2_list) / sizeof(*remap_avx2_list);
+  }
+  else if(!strcmp(isa, "sse2") && __builtin_cpu_supports("sse2")) {
+    list = remap_sse2_list;
+    n = sizeof(remap_sse2_list) / sizeof(*remap_sse2_list);
+  }
+  else
+    return NULL;
+
+  for(i = 0; i < n - 1; i++) {
+    list[i].next = list + i + 1;
+  }
+
+  return list;
+}
+
+/*
+ * returns the best set the CPU can run, or NULL
+ */
+RemapFuncDesc *remap_simd(void)
+{
+  RemapFuncDesc *list = remap_simd_set("avx2");
+
+  return list ? list : remap_simd_set("sse2");
+}
+
+#endif
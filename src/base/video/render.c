@@ -5,6 +5,10 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -15,6 +19,7 @@
 #include "vgatext.h"
 #include "render.h"
 #include "video.h"
+#include "timers.h"
 #include "render_priv.h"
 
 #define RENDER_THREADED 1
@@ -40,6 +45,11 @@ static void do_rend_gfx(void);
 static void do_rend_text(void);
 static int remap_mode(void);
 static void bitmap_refresh_pal(void *opaque, DAC_entry *col, int index);
+static int bitmap_copy_rect(void *opaque, int x, int y, int width,
+    int height, int dst_x, int dst_y);
+static void line_hash_reset(void);
+static void stats_add(unsigned long *hist, unsigned us, unsigned bytes);
+static void stats_log(const char *fmt, ...);
 
 struct rs_wrp {
     struct render_system *render;
@@ -59,6 +69,46 @@ struct render_wrp {
 static struct render_wrp Render;
 static int initialized;
 static int cur_mode_class;
+struct render_stats render_stats;
+
+#define MAX_BANDS 8
+#define BAND_RECTS 16
+/* a dirty range of the graphics screen, as passed to remap_remap_mem() */
+struct rend_range {
+  struct bitmap_desc src;
+  int mode;
+  int src_start, offset, len;
+};
+/* a horizontal band of the screen, remapped by its own thread */
+struct rend_band {
+#if RENDER_THREADED
+  pthread_t thr;
+  sem_t start;
+#endif
+  struct remap_object *remap;
+  int lo, hi;			/* source offsets of the band */
+  RectArea rect[MAX_RENDERS][BAND_RECTS];
+  int num_rects[MAX_RENDERS];
+};
+static struct rend_band bands[MAX_BANDS];
+static int num_bands = 1;
+static sem_t bands_done;
+static struct rend_range *ranges;
+static int num_ranges, max_ranges;
+
+static int dst_bytes;		/* bytes per pixel of the render targets */
+static int dst_features;
+
+/*
+ * For the scroll detection in graphics modes: a hash of every source
+ * line as it was last remapped, or 0 if unknown, and what the hashes
+ * were taken for.
+ */
+static uint64_t *line_hash, *line_cur;
+static struct {
+  unsigned start;
+  int width, height, scan_len, mode;
+} line_geom;
 
 __attribute__((warn_unused_result))
 static int render_lock(void)
@@ -141,6 +191,96 @@ static void render_rect_add(int rend_idx, RectArea rect)
   Render.wrp[rend_idx].render->refresh_rect(rect.x, rect.y, rect.width, rect.height);
 }
 
+/* move a rect of bmp, in pixels of bpp bytes, to (dst_x, dst_y) */
+static void bitmap_move(struct bitmap_desc bmp, int bpp, int x, int y,
+    int width, int height, int dst_x, int dst_y)
+{
+  unsigned char *s = bmp.img + y * bmp.scan_len + x * bpp;
+  unsigned char *d = bmp.img + dst_y * bmp.scan_len + dst_x * bpp;
+  int i;
+
+  if (d < s) {
+    for (i = 0; i < height; i++)
+      memmove(d + i * bmp.scan_len, s + i * bmp.scan_len, width * bpp);
+  } else {
+    for (i = height; i-- > 0; )
+      memmove(d + i * bmp.scan_len, s + i * bmp.scan_len, width * bpp);
+  }
+}
+
+static int render_can_copy(int src_w, int src_h)
+{
+  struct bitmap_desc *d;
+  int i;
+
+  check_locked();
+  if (!dst_bytes || (dst_features & (RFF_LIN_FILT | RFF_BILIN_FILT)) ||
+      src_w <= 0 || src_h <= 0)
+    return 0;
+  for (i = 0; i < Render.num_renders; i++) {
+    d = &Render.dst_image[i];
+    if (Render.wrp[i].locked && (d->width % src_w || d->height % src_h))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Move the rect (x, y, width, height) of a src_w x src_h source image
+ * to (dst_x, dst_y) in all render targets, without remapping it again,
+ * and let the frontends move it on screen. This only gives the same
+ * pixels as remapping if every target is an integer multiple of the
+ * source size and no filter mixes in the neighbours; otherwise nothing
+ * is done and -1 is returned.
+ */
+static int render_copy_rect(int src_w, int src_h, int x, int y,
+    int width, int height, int dst_x, int dst_y)
+{
+  struct bitmap_desc *d;
+  RectArea ra;
+  int i, kx, ky;
+
+  if (!render_can_copy(src_w, src_h))
+    return -1;
+
+  pthread_mutex_lock(&render_mtx);
+  for (i = 0; i < Render.num_renders; i++) {
+    if (!Render.wrp[i].locked)
+      continue;
+    d = &Render.dst_image[i];
+    kx = d->width / src_w;
+    ky = d->height / src_h;
+    bitmap_move(*d, dst_bytes, x * kx, y * ky, width * kx, height * ky,
+        dst_x * kx, dst_y * ky);
+    if (Render.wrp[i].render->copy_rect) {
+      Render.wrp[i].render->copy_rect(x * kx, y * ky, width * kx,
+          height * ky, dst_x * kx, dst_y * ky);
+    } else {
+      ra.x = dst_x * kx;
+      ra.y = dst_y * ky;
+      ra.width = width * kx;
+      ra.height = height * ky;
+      render_rect_add(i, ra);
+    }
+  }
+  pthread_mutex_unlock(&render_mtx);
+  return 0;
+}
+
+static int bitmap_copy_rect(void *opaque, int x, int y, int width,
+    int height, int dst_x, int dst_y)
+{
+  struct bitmap_desc canvas = get_text_canvas();
+  int cw = vga.char_width, ch = vga.char_height;
+
+  if (render_copy_rect(canvas.width, canvas.height, x * cw, y * ch,
+      width * cw, height * ch, dst_x * cw, dst_y * ch))
+    return -1;
+  bitmap_move(canvas, 1, x * cw, y * ch, width * cw, height * ch,
+      dst_x * cw, dst_y * ch);
+  return 0;
+}
+
 /*
  * Draw a text string for bitmap fonts.
  * The attribute is the VGA color/mono text attribute.
@@ -191,6 +331,7 @@ static struct text_system Text_bitmap =
   &Render.text_remap,
   "text_bitmap",
   TEXTF_BMAP_FONT,
+  bitmap_copy_rect,
 };
 
 int register_render_system(struct render_system *render_system)
@@ -207,7 +348,7 @@ int register_render_system(struct render_system *render_system)
 int remapper_init(int have_true_color, int have_shmap, int features,
     ColorSpaceDesc *csd)
 {
-  int remap_src_modes, ximage_mode;
+  int remap_src_modes, ximage_mode, i;
 
 //  set_remap_debug_msg(stderr);
 
@@ -228,8 +369,26 @@ int remapper_init(int have_true_color, int have_shmap, int features,
     }
   }
 
+  switch (ximage_mode) {
+    case MODE_TRUE_8:
+    case MODE_PSEUDO_8: dst_bytes = 1; break;
+    case MODE_TRUE_15:
+    case MODE_TRUE_16: dst_bytes = 2; break;
+    case MODE_TRUE_24: dst_bytes = 3; break;
+    case MODE_TRUE_32: dst_bytes = 4; break;
+    default: dst_bytes = 0;
+  }
+  dst_features = features;
+
   remap_src_modes = find_supported_modes(ximage_mode);
   Render.gfx_remap = remap_init(ximage_mode, features, csd);
+#if RENDER_THREADED
+  /* every band needs its own remap object, as they keep state */
+  num_bands = _max(1, _min(config.render_bands, MAX_BANDS));
+  bands[0].remap = Render.gfx_remap;
+  for (i = 1; i < num_bands; i++)
+    bands[i].remap = remap_init(ximage_mode, features, csd);
+#endif
   /* linear 1 byte per pixel */
   Render.text_remap = remap_init(ximage_mode, features, csd);
   register_text_system(&Text_bitmap);
@@ -239,10 +398,185 @@ int remapper_init(int have_true_color, int have_shmap, int features,
 }
 
 #if RENDER_THREADED
+static int rect_touches(RectArea a, RectArea b)
+{
+  return a.y <= b.y + b.height && b.y <= a.y + a.height;
+}
+
+static RectArea rect_union(RectArea a, RectArea b)
+{
+  RectArea r;
+  r.x = _min(a.x, b.x);
+  r.y = _min(a.y, b.y);
+  r.width = _max(a.x + a.width, b.x + b.width) - r.x;
+  r.height = _max(a.y + a.height, b.y + b.height) - r.y;
+  return r;
+}
+
+/* remap the parts of the dirty ranges that fall into band b */
+static void band_remap(struct rend_band *b)
+{
+  struct remap_object *ro = b->remap;
+  struct rend_range *r;
+  RectArea ra, *last;
+  int i, ofs, end, *n;
+
+  for (i = 0; i < Render.num_renders; i++)
+    b->num_rects[i] = 0;
+  for (r = ranges; r < &ranges[num_ranges]; r++) {
+    ofs = _max(r->offset, b->lo);
+    end = _min(r->offset + r->len, b->hi);
+    if (ofs >= end)
+      continue;
+    for (i = 0; i < Render.num_renders; i++) {
+      if (!Render.wrp[i].locked)
+        continue;
+      ra = ro->calls->remap_mem(ro->priv, r->src, r->mode, r->src_start,
+          ofs, end - ofs, Render.dst_image[i]);
+      if (!ra.width)
+        continue;
+      /* the ranges come in ascending order, so merge with the last one */
+      n = &b->num_rects[i];
+      last = *n ? &b->rect[i][*n - 1] : NULL;
+      if (last && (rect_touches(*last, ra) || *n == BAND_RECTS))
+        *last = rect_union(*last, ra);
+      else
+        b->rect[i][(*n)++] = ra;
+    }
+  }
+}
+
+static void *band_thread(void *arg)
+{
+  struct rend_band *b = arg;
+  while (1) {
+    sem_wait(&b->start);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    band_remap(b);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    sem_post(&bands_done);
+  }
+  return NULL;
+}
+
+/*
+ * Remap the collected dirty ranges in num_bands horizontal bands, the
+ * first one in the render thread, the others in the band threads.
+ * The caller holds the render and the vga update locks; render_mtx is
+ * held here for the whole frame, so nobody else uses the remap objects
+ * while the bands are at work. The band rects are passed on only when
+ * all bands are done, merging those which meet at the band borders.
+ */
+static void render_bands(void)
+{
+  RectArea cur, ra;
+  int i, j, k, lines;
+
+  if (!num_ranges)
+    return;
+  pthread_mutex_lock(&render_mtx);
+  for (i = 0; i < num_bands; i++) {
+    lines = vga.height * i / num_bands;
+    bands[i].lo = lines * vga.scan_len;
+    lines = vga.height * (i + 1) / num_bands;
+    bands[i].hi = i == num_bands - 1 ? INT_MAX : lines * vga.scan_len;
+  }
+  for (i = 1; i < num_bands; i++)
+    sem_post(&bands[i].start);
+  band_remap(&bands[0]);
+  for (i = 1; i < num_bands; i++)
+    sem_wait(&bands_done);
+
+  for (i = 0; i < Render.num_renders; i++) {
+    cur.width = 0;
+    for (j = 0; j < num_bands; j++) {
+      for (k = 0; k < bands[j].num_rects[i]; k++) {
+        ra = bands[j].rect[i][k];
+        if (cur.width && rect_touches(cur, ra)) {
+          cur = rect_union(cur, ra);
+          continue;
+        }
+        if (cur.width)
+          render_rect_add(i, cur);
+        cur = ra;
+      }
+    }
+    if (cur.width)
+      render_rect_add(i, cur);
+  }
+  pthread_mutex_unlock(&render_mtx);
+}
+
+/*
+ * Frame pacing. update_screen() runs on the timer at 100Hz and used to
+ * start a graphics update every time, often in the middle of a frame
+ * the guest was drawing, and again 10ms later. The guest tells when a
+ * frame is done: it waits for the vertical retrace, or flips pages by
+ * moving the CRTC start address. vgaemu calls render_frame_mark() for
+ * both (for a flip, once the low byte of the start address is written),
+ * and while these come in the render thread is started from there, once
+ * per frame. Mode switches and video off are left to the timer. Without
+ * marks the timer still drives the updates, but checks for changes less
+ * often the longer the screen stays the same.
+ */
+#define PACE_MARK_TIMEOUT 200000	/* us without a mark: back to the timer */
+#define PACE_MAX_WAIT 50000		/* us between updates without marks */
+#define PACE_IDLE_TICKS 8		/* clean ticks before slowing down */
+#define PACE_IDLE_MAX 4			/* check every 4th tick at most */
+
+static int pacing;
+static int frame_pending;
+static hitimer_t last_mark, last_render;
+static int idle_ticks, idle_skip, idle_wait;
+
+void render_frame_mark(void)
+{
+  if (!pacing || vga.mode_class != GRAPH)
+    return;
+  /* update_screen() has to switch the video mode first, and there is
+     nothing to show with the video off: leave these to the timer */
+  if (vga.reconfig.display || vga.config.video_off)
+    return;
+  last_mark = GETusTIME(0);
+  /* one update for the marks that come in before it starts */
+  if (!__atomic_exchange_n(&frame_pending, 1, __ATOMIC_ACQ_REL))
+    sem_post(&render_sem);
+  else
+    render_stats.dropped++;
+}
+
+/* whether this timer tick should start a graphics update */
+static int render_pace(void)
+{
+  hitimer_t t;
+
+  if (!pacing || vga.mode_class != GRAPH)
+    return 1;
+  t = GETusTIME(0);
+  if (t - last_mark < PACE_MARK_TIMEOUT) {
+    /* updates come from the marks; catch what's drawn without one */
+    return t - last_render >= PACE_MAX_WAIT;
+  }
+  if (idle_wait && --idle_wait)
+    return 0;
+  if (vga.reconfig.mem || vga.reconfig.dac || vgaemu_is_dirty()) {
+    idle_ticks = idle_skip = idle_wait = 0;
+    return 1;
+  }
+  if (++idle_ticks >= PACE_IDLE_TICKS && idle_skip < PACE_IDLE_MAX) {
+    idle_skip = idle_skip ? idle_skip * 2 : 2;
+    idle_ticks = 0;
+  }
+  idle_wait = idle_skip;
+  return 0;
+}
+
 static void *render_thread(void *arg)
 {
   while (1) {
     sem_wait(&render_sem);
+    __atomic_store_n(&frame_pending, 0, __ATOMIC_RELEASE);
+    last_render = GETusTIME(0);
     pthread_mutex_lock(&upd_mtx);
     is_updating = 1;
     pthread_mutex_unlock(&upd_mtx);
@@ -258,12 +592,18 @@ static void *render_thread(void *arg)
   }
   return NULL;
 }
+#else
+void render_frame_mark(void)
+{
+}
 #endif
 
 int render_init(void)
 {
   int err = 0;
 #if RENDER_THREADED
+  int i;
+
   err = sem_init(&render_sem, 0, 0);
   assert(!err);
   err = pthread_create(&render_thr, NULL, render_thread, NULL);
@@ -271,6 +611,22 @@ int render_init(void)
   pthread_setname_np(render_thr, "dosemu: render");
 #endif
   assert(!err);
+  if (num_bands > 1) {
+    err = sem_init(&bands_done, 0, 0);
+    assert(!err);
+  }
+  for (i = 1; i < num_bands; i++) {
+    err = sem_init(&bands[i].start, 0, 0);
+    assert(!err);
+    err = pthread_create(&bands[i].thr, NULL, band_thread, &bands[i]);
+#if defined(HAVE_PTHREAD_SETNAME_NP) && defined(__GLIBC__)
+    pthread_setname_np(bands[i].thr, "dosemu: band");
+#endif
+    assert(!err);
+  }
+  if (num_bands > 1)
+    v_printf("render: %i bands\n", num_bands);
+  pacing = config.render_pacing;
 #endif
   initialized++;
   return err;
@@ -281,18 +637,37 @@ int render_init(void)
  */
 void render_done(void)
 {
+#if RENDER_THREADED
+  int i;
+#endif
   if (!initialized)
     return;
   initialized--;
+  if (debug_level('v'))
+    render_print_stats(stats_log);
 #if RENDER_THREADED
+  pacing = 0;
   pthread_cancel(render_thr);
   pthread_join(render_thr, NULL);
   sem_destroy(&render_sem);
+  /* the render thread is out of render_bands() now */
+  for (i = 1; i < num_bands; i++) {
+    pthread_cancel(bands[i].thr);
+    pthread_join(bands[i].thr, NULL);
+    sem_destroy(&bands[i].start);
+  }
+  if (num_bands > 1)
+    sem_destroy(&bands_done);
 #endif
 }
 
 void remapper_done(void)
 {
+  int i;
+
+  for (i = 1; i < num_bands; i++)
+    remap_done(bands[i].remap);
+  num_bands = 1;
   done_text_mapper();
   if (Render.text_remap)
     remap_done(Render.text_remap);
@@ -316,11 +691,18 @@ static void refresh_truecolor(DAC_entry *col, int index, void *udata)
   remap_palette_update(ro, index, vga.dac.bits, col->r, col->g, col->b);
 }
 
+static void refresh_bands_truecolor(DAC_entry *col, int index, void *udata)
+{
+  int i;
+  refresh_truecolor(col, index, Render.gfx_remap);
+  for (i = 1; i < num_bands; i++)
+    refresh_truecolor(col, index, bands[i].remap);
+}
+
 /* returns True if the screen needs to be redrawn */
-static Boolean refresh_palette(void *opaque)
+static Boolean refresh_palette(void)
 {
-  struct remap_object **obj = opaque;
-  return changed_vga_colors(refresh_truecolor, *obj);
+  return changed_vga_colors(refresh_bands_truecolor, NULL);
 }
 
 /*
@@ -328,8 +710,11 @@ static Boolean refresh_palette(void *opaque)
  */
 static void refresh_graphics_palette(void)
 {
-  if (refresh_palette(&Render.gfx_remap))
+  if (refresh_palette()) {
     dirty_all_video_pages();
+    /* the targets show the old colors */
+    line_hash_reset();
+  }
 }
 
 static int font_is_changed(void)
@@ -429,6 +814,7 @@ static void modify_mode(void)
 {
   if(vga.reconfig.mem) {
     dirty_all_video_pages();
+    line_hash_reset();
     vga.reconfig.mem = 0;
   }
 
@@ -440,6 +826,24 @@ static void modify_mode(void)
 }
 
 
+static void range_add(unsigned display_start, int src_offset, int offset,
+	int len)
+{
+  struct rend_range *r;
+
+  if (num_ranges == max_ranges) {
+    max_ranges = max_ranges ? 2 * max_ranges : 256;
+    ranges = realloc(ranges, max_ranges * sizeof(*ranges));
+  }
+  r = &ranges[num_ranges++];
+  r->src = BMP(vga.mem.base + display_start, vga.width, vga.height,
+      vga.scan_len);
+  r->mode = remap_mode();
+  r->src_start = src_offset;
+  r->offset = offset;
+  r->len = len;
+}
+
 static void update_graphics_loop(unsigned display_start,
 	unsigned display_end, int src_offset,
 	int update_offset, vga_emu_update_type *veut)
@@ -448,19 +852,192 @@ static void update_graphics_loop(unsigned display_start,
 
   while ((i = vga_emu_update(veut, display_start + src_offset + update_offset,
       display_end, i)) != -1) {
-    remap_remap_mem(Render.gfx_remap, BMP(vga.mem.base + display_start,
-                             vga.width, vga.height, vga.scan_len),
-                             remap_mode(),
-                             src_offset, update_offset +
-                             veut->update_start - display_start,
-                             veut->update_len);
+    range_add(display_start, src_offset,
+        update_offset + veut->update_start - display_start,
+        veut->update_len);
+  }
+}
+
+static void remap_ranges(void)
+{
+  struct rend_range *r;
+
+  for (r = ranges; r < &ranges[num_ranges]; r++)
+    remap_remap_mem(Render.gfx_remap, r->src, r->mode, r->src_start,
+        r->offset, r->len);
+}
+
+static int src_bytes(int mode)
+{
+  switch (mode) {
+    case MODE_PSEUDO_8: return 1;
+    case MODE_TRUE_15:
+    case MODE_TRUE_16: return 2;
+    case MODE_TRUE_24: return 3;
+    case MODE_TRUE_32: return 4;
+  }
+  return 0;
+}
+
+static uint64_t hash_line(int y)
+{
+  const unsigned char *p = vga.mem.base + line_geom.start +
+      y * line_geom.scan_len;
+  int i, len = line_geom.width * src_bytes(line_geom.mode);
+  uint64_t h = 0x9e3779b97f4a7c15ULL, w;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  for (; i < len; i++)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  return h | 1;		/* 0 is "unknown" */
+}
+
+static void line_hash_reset(void)
+{
+  line_geom.height = 0;
+}
+
+/*
+ * Set up the line hashes for this frame. Scrolling is only detected in
+ * the packed pixel modes, when the screen doesn't wrap, and when the
+ * render targets can be moved (see render_copy_rect()).
+ */
+static int line_track(unsigned display_end, unsigned wrap)
+{
+  int mode = remap_mode();
+
+  if (display_end > wrap || !src_bytes(mode) ||
+      !render_can_copy(vga.width, vga.height)) {
+    line_hash_reset();
+    return 0;
+  }
+  if (line_geom.start != vga.display_start || line_geom.mode != mode ||
+      line_geom.width != vga.width || line_geom.height != vga.height ||
+      line_geom.scan_len != vga.scan_len) {
+    line_geom.start = vga.display_start;
+    line_geom.mode = mode;
+    line_geom.width = vga.width;
+    line_geom.height = vga.height;
+    line_geom.scan_len = vga.scan_len;
+    line_hash = realloc(line_hash, vga.height * sizeof(*line_hash));
+    line_cur = realloc(line_cur, vga.height * sizeof(*line_cur));
+    memset(line_hash, 0, vga.height * sizeof(*line_hash));
+  }
+  return 1;
+}
+
+/* loop y over the source lines the collected ranges touch */
+#define FOR_RANGE_LINES(y) \
+  for (r = ranges; r < &ranges[num_ranges]; r++) \
+    for (y = r->offset / line_geom.scan_len; \
+         y <= (r->offset + r->len - 1) / line_geom.scan_len && \
+         y < line_geom.height; y++)
+
+/*
+ * Look for the screen contents moved up or down by some lines, as
+ * programs do to scroll. The line hashes say what each line of the
+ * render targets shows; if the current lines match them shifted by dy
+ * much better than in place, the targets are moved by render_copy_rect()
+ * and the ranges are replaced by the lines which still differ.
+ */
+static void graphics_scroll(void)
+{
+  struct rend_range *r;
+  int h = line_geom.height, y, y2, i, j, dy, ya, yb, cost;
+  int best, best_dy = 0, ndirty = 0, cand[8], ncand = 0;
+  uint64_t d, *disp = line_hash, *cur = line_cur;
+
+  memset(cur, 0, h * sizeof(*cur));
+  FOR_RANGE_LINES(y) {
+    if (!cur[y]) {
+      cur[y] = hash_line(y);
+      ndirty++;
+    }
+  }
+  if (ndirty < h / 2)
+    return;
+  for (y = 0; y < h; y++) {
+    if (!cur[y])
+      cur[y] = disp[y];
+  }
+
+  /* candidate shifts, from where a few of the lines were before */
+  for (i = 1; i < 4; i++) {
+    y = h * i / 4;
+    for (y2 = 0; y2 < h && ncand < 8; y2++) {
+      if (y2 == y || disp[y2] != cur[y])
+        continue;
+      for (j = 0; j < ncand && cand[j] != y2 - y; j++);
+      if (j == ncand)
+        cand[ncand++] = y2 - y;
+    }
+  }
+  best = ndirty;
+  for (i = 0; i < ncand; i++) {
+    dy = cand[i];
+    ya = _max(0, -dy);
+    yb = _min(h, h - dy);
+    cost = 0;
+    for (y = 0; y < h; y++) {
+      d = (y >= ya && y < yb) ? disp[y + dy] : disp[y];
+      if (!d || d != cur[y])
+        cost++;
+    }
+    if (cost < best) {
+      best = cost;
+      best_dy = dy;
+    }
+  }
+  if (!best_dy || best > ndirty - h / 4)
+    return;
+
+  dy = best_dy;
+  ya = _max(0, -dy);
+  yb = _min(h, h - dy);
+  if (render_copy_rect(line_geom.width, h, 0, ya + dy, line_geom.width,
+      yb - ya, 0, ya))
+    return;
+  memmove(disp + ya, disp + ya + dy, (yb - ya) * sizeof(*disp));
+  v_printf("render: scrolled by %i lines, %i of %i to remap\n", dy, best, h);
+
+  num_ranges = 0;
+  for (y = 0; y < h; y = y2) {
+    y2 = y + 1;
+    if (disp[y] && disp[y] == cur[y])
+      continue;
+    while (y2 < h && !(disp[y2] && disp[y2] == cur[y2]))
+      y2++;
+    range_add(line_geom.start, 0, y * line_geom.scan_len,
+        (y2 - y) * line_geom.scan_len);
+  }
+}
+
+/*
+ * Note the hashes of the remapped lines. A line which changed while it
+ * was remapped gets 0, as it is not known what the targets show.
+ */
+static void line_hash_update(void)
+{
+  struct rend_range *r;
+  uint64_t h;
+  int y;
+
+  FOR_RANGE_LINES(y) {
+    h = hash_line(y);
+    line_hash[y] = h == line_cur[y] ? h : 0;
   }
 }
 
 static void update_graphics_screen(void)
 {
   vga_emu_update_type veut;
-  unsigned display_end, wrap;
+  unsigned display_end, wrap, bytes;
+  hitimer_t t;
+  int track, i;
 
   refresh_graphics_palette();
 
@@ -495,6 +1072,85 @@ static void update_graphics_screen(void)
       align = vga.scan_len - rem;
     update_graphics_loop(0, display_end - wrap, -len, len + align, &veut);
   }
+
+  track = line_track(display_end, wrap);
+  if (track)
+    graphics_scroll();
+  for (i = 0, bytes = 0; i < num_ranges; i++)
+    bytes += ranges[i].len;
+  t = GETusTIME(0);
+#if RENDER_THREADED
+  if (num_bands > 1)
+    render_bands();
+  else
+#endif
+    remap_ranges();
+  if (num_ranges)
+    stats_add(render_stats.remap_hist, GETusTIME(0) - t, bytes);
+  if (track)
+    line_hash_update();
+  num_ranges = 0;
+}
+
+/* count a frame (bytes > 0) or a blit taking us microseconds */
+static void stats_add(unsigned long *hist, unsigned us, unsigned bytes)
+{
+  int b;
+
+  for (b = 0; b < RSTAT_HIST - 1 && us >= (32u << b); b++);
+  hist[b]++;
+  if (hist == render_stats.blit_hist) {
+    render_stats.blits++;
+    render_stats.blit_us += us;
+    return;
+  }
+  render_stats.frames++;
+  render_stats.remap_bytes += bytes;
+  render_stats.remap_us += us;
+  render_stats.last_bytes = bytes;
+  render_stats.last_us = us;
+}
+
+static void print_hist(void (*print)(const char *fmt, ...),
+    const char *name, const unsigned long *hist)
+{
+  int b;
+
+  print("  %-12s", name);
+  for (b = 0; b < RSTAT_HIST - 1; b++)
+    print(" <%u:%lu", 32u << b, hist[b]);
+  print(" more:%lu\n", hist[b]);
+}
+
+void render_print_stats(void (*print)(const char *fmt, ...))
+{
+  struct render_stats *s = &render_stats;
+  unsigned long n = s->frames ?: 1;
+
+  print("video: %lu frames, %lu update requests merged\n",
+      s->frames, s->dropped);
+  print("  write faults %lu, pages dirtied %lu\n", s->faults, s->pages);
+  print("  remapped     %llu bytes, %llu per frame, last %u\n",
+      s->remap_bytes, s->remap_bytes / n, s->last_bytes);
+  print("  remap time   %llu us, %llu per frame, last %u\n",
+      s->remap_us, s->remap_us / n, s->last_us);
+  print("  blits        %lu, %llu us\n", s->blits, s->blit_us);
+  print_hist(print, "remap us", s->remap_hist);
+  print_hist(print, "blit us", s->blit_hist);
+}
+
+void render_reset_stats(void)
+{
+  memset(&render_stats, 0, sizeof(render_stats));
+}
+
+static void stats_log(const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vlog_printf(10, fmt, args);
+  va_end(args);
 }
 
 int render_is_updating(void)
@@ -580,6 +1236,7 @@ int render_update_vidmode(void)
     pthread_rwlock_wrlock(&mode_mtx);
     vmp = get_mode_parameters();
     ret = Video->setmode(vmp);
+    line_hash_reset();
     pthread_rwlock_unlock(&mode_mtx);
     if (ret)
       cur_mode_class = vmp.mode_class;
@@ -646,9 +1303,16 @@ int update_screen(void)
     v_printf("update_screen: nothing done (video_off = 0x%x)\n", vga.config.video_off);
     return 1;
   }
-  if (upd)
+  if (upd) {
+    if (vga.mode_class == GRAPH)
+      render_stats.dropped++;
     return 1;
+  }
 
+#if RENDER_THREADED
+  if (!render_pace())
+    return 1;
+#endif
   sem_post(&render_sem);
   return 1;
 }
@@ -703,9 +1367,11 @@ static int remap_mode(void)
 
 void render_blit(int x, int y, int width, int height)
 {
+  hitimer_t t;
   int err = render_lock();
   if (err)
     return;
+  t = GETusTIME(0);
   if (vga.mode_class == TEXT) {
     struct bitmap_desc src_image;
     src_image = get_text_canvas();
@@ -720,6 +1386,7 @@ void render_blit(int x, int y, int width, int height)
 	vga.width, vga.height, vga.scan_len), remap_mode(),
 	x, y, width, height);
   }
+  stats_add(render_stats.blit_hist, GETusTIME(0) - t, 0);
   render_unlock();
 }
 
@@ -42,6 +42,9 @@
 #include "vgatext.h"
 #include "render_priv.h"
 #include "translate/translate.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MAX_TEXTS 5
 static struct text_system *Text[MAX_TEXTS];
@@ -57,6 +60,30 @@ static unsigned char *text_canvas;
 static ushort prev_screen[MAX_COLUMNS * MAX_LINES];	/* pointer to currently displayed screen   */
 static u_char prev_font[256 * 32];
 
+/*
+ * Glyph cache: the cells drawn by convert_bitmap_string(), already
+ * expanded to canvas pixels. A cell is keyed by the font selected by
+ * attribute bit 3, the character and the colors; glyph_gen changes
+ * whenever the fonts or the cell geometry change.
+ */
+#define GLYPH_W 9
+#define GLYPH_H 32
+#define GLYPH_SLOTS_SHIFT 12
+#define GLYPH_SLOTS (1 << GLYPH_SLOTS_SHIFT)
+struct glyph {
+  unsigned gen;
+  unsigned key;
+  unsigned char pix[GLYPH_W * GLYPH_H];
+};
+static struct glyph *glyphs;
+static unsigned glyph_gen = 1;
+static struct {
+  int width, height, line_gfx;
+  unsigned fontofs[2];
+} glyph_geom;
+static u_char glyph_font[2][256 * 32];
+static unsigned glyph_hits, glyph_misses;
+
 #if CONFIG_SELECTION
 static int sel_start_row = -1, sel_end_row =
     -1, sel_start_col, sel_end_col;
@@ -129,6 +156,27 @@ void text_unlock(void)
  * Draw a text string.
  * The attribute is the VGA color/mono text attribute.
  */
+static void draw_string_to(int i, int x, int y, unsigned char *text,
+			   int len, Bit8u attr)
+{
+  char charbuff[MAX_COLUMNS], *p;
+
+  memcpy(charbuff, text, len);
+  if (!(Text[i]->flags & TEXTF_BMAP_FONT)) {
+    while ((p = memchr(charbuff, '\0', len)))
+      *p = ' ';
+  }
+  Text[i]->Draw_string(Text[i]->opaque, x, y, charbuff, len, attr);
+  if (vga.mode_type == TEXT_MONO && vga.char_height
+      && (attr == 0x01 || attr == 0x09 || attr == 0x89)) {
+    int ul = vga.crtc.data[0x14] & 0x1f;
+    if (ul > vga.char_height - 1)
+      ul = vga.char_height - 1;
+    Text[i]->Draw_line(Text[i]->opaque, x, y, ul / (float)vga.char_height,
+        len, attr);
+  }
+}
+
 static void draw_string(int x, int y, unsigned char *text, int len,
 			Bit8u attr)
 {
@@ -137,24 +185,9 @@ static void draw_string(int x, int y, unsigned char *text, int len,
   x_deb2("X_draw_string: %d chars at (%d, %d), attr = 0x%02x\n",
 	 len, x, y, (unsigned) attr);
   for (i = 0; i < num_texts; i++) {
-    char charbuff[MAX_COLUMNS], *p;
-
     if (Text[i]->flags & TEXTF_DISABLED)
       continue;
-    memcpy(charbuff, text, len);
-    if (!(Text[i]->flags & TEXTF_BMAP_FONT)) {
-      while ((p = memchr(charbuff, '\0', len)))
-        *p = ' ';
-    }
-    Text[i]->Draw_string(Text[i]->opaque, x, y, charbuff, len, attr);
-    if (vga.mode_type == TEXT_MONO && vga.char_height
-        && (attr == 0x01 || attr == 0x09 || attr == 0x89)) {
-      int ul = vga.crtc.data[0x14] & 0x1f;
-      if (ul > vga.char_height - 1)
-        ul = vga.char_height - 1;
-      Text[i]->Draw_line(Text[i]->opaque, x, y, ul / (float)vga.char_height,
-          len, attr);
-    }
+    draw_string_to(i, x, y, text, len, attr);
   }
 }
 
@@ -376,6 +409,75 @@ struct bitmap_desc get_text_canvas(void)
   return BMP(text_canvas, vga.width, vga.height, vga.width);
 }
 
+/*
+ * Check the fonts and the cell geometry the glyph cache was filled for.
+ * If they changed, drop the cache and redraw the screen.
+ */
+static void glyph_cache_check(void)
+{
+  int i, changed = 0;
+
+  if (glyph_geom.width != vga.char_width ||
+      glyph_geom.height != vga.char_height ||
+      glyph_geom.line_gfx != (vga.attr.data[0x10] & 0x04)) {
+    glyph_geom.width = vga.char_width;
+    glyph_geom.height = vga.char_height;
+    glyph_geom.line_gfx = vga.attr.data[0x10] & 0x04;
+    changed = 1;
+  }
+  for (i = 0; i < 2; i++) {
+    const u_char *font = vga.mem.base + 0x20000 + vga.seq.fontofs[i];
+    if (glyph_geom.fontofs[i] != vga.seq.fontofs[i] ||
+        memcmp(glyph_font[i], font, sizeof(glyph_font[i]))) {
+      glyph_geom.fontofs[i] = vga.seq.fontofs[i];
+      memcpy(glyph_font[i], font, sizeof(glyph_font[i]));
+      changed = 1;
+    }
+  }
+  if (!changed)
+    return;
+  glyph_gen++;
+  dirty_text_screen();
+  x_msg("glyph cache: flushed, %u hits, %u misses\n", glyph_hits,
+	glyph_misses);
+}
+
+/*
+ * Return the cell for character c in the colors fg and bg, drawn from
+ * the font at font, from the cache.
+ */
+static const unsigned char *glyph_get(unsigned char c, unsigned fg,
+				      unsigned bg, int sel, unsigned font)
+{
+  unsigned key = (sel << 16) | (c << 8) | (fg << 4) | bg;
+  struct glyph *g = &glyphs[(key * 2654435761u) >> (32 - GLYPH_SLOTS_SHIFT)];
+  unsigned char *p;
+  unsigned yy, xx, bits;
+
+  if (g->gen == glyph_gen && g->key == key) {
+    glyph_hits++;
+    return g->pix;
+  }
+  glyph_misses++;
+  g->gen = glyph_gen;
+  g->key = key;
+  p = g->pix;
+  for (yy = 0; yy < _min(vga.char_height, GLYPH_H); yy++) {
+    bits = vga.mem.base[0x20000 + font + yy + 32 * c];
+    for (xx = 0; xx < 8; xx++) {
+      *p++ = (bits & 0x80) ? fg : bg;
+      bits <<= 1;
+    }
+    /* copy 8th->9th for line gfx, if enabled, or fill with background */
+    if ((vga.attr.data[0x10] & 0x04) && (c & 0xc0) == 0xc0)
+      *p = p[-1];
+    else
+      *p = bg;
+    p++;
+  }
+  return g->pix;
+}
+
 /*
  * Redraw the entire screen (in text modes). Used only for expose events.
  * It's graphics mode counterpart is a simple put_ximage() call
@@ -399,6 +501,7 @@ static void text_redraw_text_screen(void)
 
   vga.reconfig.mem = 0;
   refresh_text_palette();
+  glyph_cache_check();
 
   if (vga.text_width > MAX_COLUMNS) {
     x_msg("X_redraw_text_screen: unable to handle %d columns\n",
@@ -527,10 +630,13 @@ void init_text_mapper(int image_mode, int features, ColorSpaceDesc * csd)
     error("X: cannot allocate text mode canvas for font simulation\n");
   need_redraw_cursor = TRUE;
   memset(text_canvas, 0, MAX_COLUMNS * 9 * MAX_LINES * 32);
+  glyphs = calloc(GLYPH_SLOTS, sizeof(*glyphs));
 }
 
 void done_text_mapper(void)
 {
+  free(glyphs);
+  glyphs = NULL;
   free(text_canvas);
 }
 
@@ -590,6 +696,18 @@ struct bitmap_desc convert_bitmap_string(int x, int y, const char *text,
   srcp = vga.width * y * height;
   srcp += x * vga.char_width;
 
+  if (glyphs && height <= GLYPH_H) {
+    unsigned w = _min(vga.char_width, GLYPH_W);
+    for (cc = 0; cc < len; cc++) {
+      const unsigned char *g = glyph_get(text[cc], fgX, bgX,
+					 (attr & 8) >> 3, src);
+      srcp2 = srcp + cc * vga.char_width;
+      for (yy = 0; yy < height; yy++, srcp2 += vga.width, g += GLYPH_W)
+	memcpy(text_canvas + srcp2, g, w);
+    }
+    return BMP(text_canvas, vga.width, vga.height, vga.width);
+  }
+
   /* vgaemu -> vgaemu_put_char would edit the vga.mem.base[...] */
   /* but as vga memory is used as text buffer at this moment... */
   for (yy = 0; yy < height; yy++) {
@@ -619,6 +737,148 @@ struct bitmap_desc convert_bitmap_string(int x, int y, const char *text,
   return BMP(text_canvas, vga.width, vga.height, vga.width);
 }
 
+/*
+ * Return the number of cells, up to n, from sp on which are the same as
+ * in oldsp.
+ */
+static int cells_unchanged(Bit16u *sp, ushort *oldsp, int n)
+{
+  int i = 0;
+
+#if CONFIG_SELECTION
+  if (visible_selection) {
+    while (i < n && XREAD_WORD(sp + i) == oldsp[i])
+      i++;
+    return i;
+  }
+#endif
+#ifdef __SSE2__
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(sp + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(oldsp + i));
+    unsigned ne = _mm_movemask_epi8(_mm_cmpeq_epi16(a, b)) ^ 0xffff;
+    if (ne)
+      return i + __builtin_ctz(ne) / 2;
+  }
+#endif
+  while (i < n && sp[i] == oldsp[i])
+    i++;
+  return i;
+}
+
+#define ROW(y) ((Bit16u *) (vga.mem.base + location_to_memoffs((y) * vga.scan_len)))
+
+/*
+ * Look for the text moved up or down by some rows, as INT10 AH=06/07
+ * or a block move over the screen do. If the changed rows match
+ * prev_screen shifted by dy much better than in place, the text
+ * systems move the cells with Copy_rect() and prev_screen is shifted
+ * the same way, so the update only draws what is new. Only the columns
+ * which changed are moved, so a scrolling window leaves its frame.
+ */
+static void text_scroll(void)
+{
+  int co = vga.scan_len / 2, h = vga.text_height, w = vga.text_width;
+  int y, y2, i, j, k, dy, ya, yb, cost, best, best_dy = 0;
+  int c0 = w, c1 = 0, nchg = 0, cand[8], ncand = 0;
+  size_t cw;
+  Bit16u *sp;
+  ushort *old;
+  u_char charbuff[MAX_COLUMNS];
+
+#define ROW_IS(y, oy) \
+  (!memcmp(ROW(y) + c0, prev_screen + (oy) * co + c0, cw))
+
+  if (h < 4 || w > MAX_COLUMNS)
+    return;
+#if CONFIG_SELECTION
+  if (visible_selection)
+    return;
+#endif
+  for (y = 0; y < h; y++) {
+    sp = ROW(y);
+    old = prev_screen + y * co;
+    k = cells_unchanged(sp, old, w);
+    if (k == w)
+      continue;
+    nchg++;
+    for (j = w; j > k && sp[j - 1] == old[j - 1]; j--);
+    c0 = _min(c0, k);
+    c1 = _max(c1, j);
+  }
+  if (nchg < h / 2)
+    return;
+  cw = (c1 - c0) * sizeof(ushort);
+
+  /* candidate shifts, from where a few of the rows were before */
+  for (i = 1; i < 4; i++) {
+    y = h * i / 4;
+    for (y2 = 0; y2 < h && ncand < 8; y2++) {
+      if (y2 == y || !ROW_IS(y, y2))
+        continue;
+      for (j = 0; j < ncand && cand[j] != y2 - y; j++);
+      if (j == ncand)
+        cand[ncand++] = y2 - y;
+    }
+  }
+  best = nchg;
+  for (i = 0; i < ncand; i++) {
+    dy = cand[i];
+    ya = _max(0, -dy);
+    yb = _min(h, h - dy);
+    cost = 0;
+    for (y = 0; y < h; y++)
+      cost += !ROW_IS(y, (y >= ya && y < yb) ? y + dy : y);
+    if (cost < best) {
+      best = cost;
+      best_dy = dy;
+    }
+  }
+  if (!best_dy || best > nchg - h / 4)
+    return;
+
+  dy = best_dy;
+  ya = _max(0, -dy);
+  yb = _min(h, h - dy);
+  x_deb("text: scroll by %d rows, columns %d-%d\n", dy, c0, c1 - 1);
+  for (i = 0; i < num_texts; i++) {
+    if (Text[i]->flags & TEXTF_DISABLED)
+      continue;
+    if (Text[i]->Copy_rect && !Text[i]->Copy_rect(Text[i]->opaque,
+	c0, ya + dy, c1 - c0, yb - ya, c0, ya))
+      continue;
+    /* draw the rows which the update below will take as unchanged */
+    for (y = ya; y < yb; y++) {
+      if (!ROW_IS(y, y + dy))
+	continue;
+      sp = ROW(y) + c0;
+      for (j = c0; j < c1; j = k) {
+	for (k = j; k < c1 && ATTR(sp + k - c0) == ATTR(sp + j - c0); k++)
+	  charbuff[k - j] = CHAR(sp + k - c0);
+	draw_string_to(i, j, y, charbuff, k - j, ATTR(sp + j - c0));
+      }
+    }
+  }
+  if (dy > 0) {
+    for (y = ya; y < yb; y++)
+      memcpy(prev_screen + y * co + c0, prev_screen + (y + dy) * co + c0, cw);
+  } else {
+    for (y = yb; y-- > ya; )
+      memcpy(prev_screen + y * co + c0, prev_screen + (y + dy) * co + c0, cw);
+  }
+#undef ROW_IS
+
+  /* the cursor image moved with the cells */
+  if (prev_cursor_shape != NO_CURSOR &&
+      prev_cursor_location < h * vga.scan_len) {
+    y = prev_cursor_location / vga.scan_len - dy;
+    j = (prev_cursor_location % vga.scan_len) / 2;
+    if (y >= ya && y < yb && j >= c0 && j < c1)
+      prev_screen[y * co + j] = 0xffff;
+  }
+  need_redraw_cursor = TRUE;
+}
+
 /*
  * Update the text screen.
  */
@@ -646,6 +906,8 @@ void update_text_screen(void)
     if (refr)
       dirty_text_screen();
   }
+  glyph_cache_check();
+  text_scroll();
   update_cursor();
 
   /* The highest priority is given to the current screen row for the
@@ -685,13 +947,12 @@ void update_text_screen(void)
     do {
       /* find a non-matching character position */
       start_x = x;
-      while (XREAD_WORD(sp) == *oldsp) {
-	sp++;
-	oldsp++;
-	x++;
-	if (x == vga.text_width)
-	  goto line_done;
-      }
+      len = cells_unchanged(sp, oldsp, vga.text_width - x);
+      sp += len;
+      oldsp += len;
+      x += len;
+      if (x == vga.text_width)
+	goto line_done;
 /* now scan in a string of changed chars of the same attribute.
    To keep the number of X calls (and thus the overhead) low,
    we tolerate a few unchanged characters (up to MAX_UNCHANGED in
@@ -63,13 +63,14 @@ extern void e_priv_iopl(int);
 #define CeS_TRAP	0x1000	/* INT01 Sstep active */
 #define CeS_DRTRAP	0x2000	/* Debug Registers active */
 #define CeS_INSTREMU	0x4000	/* behave like former instr_emu, with counter for VGAEMU faults */
+#define CeS_COLD	0x8000	/* simulating a sequence not yet hot enough for the jit */
+#define CeS_CHECK	0x10000	/* simulating a node for the lockstep check */
 
 extern int IsV86Emu;
 extern int IsDpmiEmu;
 
 void enter_cpu_emu(void);
 void leave_cpu_emu(void);
-void avltr_destroy(void);
 int e_vm86(void);
 
 /* called from dpmi.c */
@@ -92,6 +93,13 @@ void e_invalidate_pa(unsigned data, int cnt);
 #define e_invalidate_pa(x,y)
 #endif
 
+/* called from dos2linux.c when memory is remapped or reprotected */
+#ifdef X86_EMULATOR
+void e_invalidate_fetch(unsigned int addr, int len);
+#else
+#define e_invalidate_fetch(x,y)
+#endif
+
 /* called from cpu.c */
 void init_emu_cpu (void);
 void reset_emu_cpu (void);
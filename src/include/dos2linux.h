@@ -346,6 +346,7 @@ void do_write_byte(dosaddr_t addr, uint8_t byte, sim_pagefault_handler_t handler
 void do_write_word(dosaddr_t addr, uint16_t word, sim_pagefault_handler_t handler);
 void do_write_dword(dosaddr_t addr, uint32_t dword, sim_pagefault_handler_t handler);
 void do_write_qword(dosaddr_t addr, uint64_t qword, sim_pagefault_handler_t handler);
+void *dosaddr_to_unixaddr_run(dosaddr_t addr, int len, int write);
 
 void memcpy_2unix(void *dest, dosaddr_t src, size_t n);
 void memcpy_2dos(dosaddr_t dest, const void *src, size_t n);
@@ -155,6 +155,10 @@ typedef struct config_info {
        #define EMU_FULL() (EMU_V86() && EMU_DPMI())
        #define IS_EMU() (EMU_V86() || EMU_DPMI())
        boolean cpusim;
+       boolean cpusmc;
+       int cpucache;		/* MB of on-disk jit code cache, 0=off */
+       int cpuhot;		/* entries before jit compiles, 0=always */
+       boolean cpucheck;	/* run the simulator in lockstep with the jit */
 #endif
        int cpu_vm;
        int cpu_vm_dpmi;
@@ -201,6 +205,10 @@ typedef struct config_info {
        u_long vgaemu_memsize;		/* for VGA emulation */
        vesamode_type *vesamode_list;	/* chained list of VESA modes */
        int     X_lfb;			/* support VESA LFB modes */
+       boolean vga_subpage;		/* track VGA writes per 256 bytes */
+       int     vga_unprotect;		/* leave VGA pages dirty this often writable */
+       int     render_bands;		/* threads remapping the graphics screen */
+       boolean render_pacing;		/* render graphics per guest frame */
        int     X_pm_interface;		/* support protected mode interface */
        int     X_background_pause;	/* pause xdosemu if it loses focus */
        boolean X_noclose;		/* hide the window close button, disable close menu entry */
@@ -331,6 +339,7 @@ typedef struct config_info {
        char *munt_roms_dir;
        char *snd_plugin_params;
        boolean pcm_hpf;
+       int pcm_resample_quality;
        char *midi_file;
        char *wav_file;
 
@@ -31,6 +31,8 @@ void kvm_set_mmio(dosaddr_t base, dosaddr_t size, int on);
 void kvm_set_readonly(dosaddr_t base, dosaddr_t size);
 void kvm_set_dirty_log(dosaddr_t base, dosaddr_t size);
 void kvm_get_dirty_map(dosaddr_t base, unsigned char *bitmap);
+int kvm_for_each_dirty_page(dosaddr_t base, unsigned npages,
+			    void (*fn)(unsigned page, void *arg), void *arg);
 
 void kvm_set_idt_default(int i);
 void kvm_set_idt(int i, uint16_t sel, uint32_t offs, int is_32, int tg);
@@ -53,6 +55,8 @@ static inline void kvm_set_mmio(dosaddr_t base, dosaddr_t size, int on) {}
 static inline void kvm_set_readonly(dosaddr_t base, dosaddr_t size) {}
 static inline void kvm_set_dirty_log(dosaddr_t base, dosaddr_t size) {}
 static inline void kvm_get_dirty_map(dosaddr_t base, unsigned char *bitmap) {}
+static inline int kvm_for_each_dirty_page(dosaddr_t base, unsigned npages,
+	void (*fn)(unsigned page, void *arg), void *arg) { return 0; }
 static inline void kvm_set_idt_default(int i) {}
 static inline void kvm_set_idt(int i, uint16_t sel, uint32_t offs, int is_32,
     int tg) {}
@@ -19,8 +19,33 @@ struct render_system
   const char *name;
 #define RENDF_DISABLED 1
   unsigned flags;
+  /* optional: move a rect of the displayed image to (dst_x, dst_y);
+   * the locked image was already moved */
+  void (*copy_rect)(int x, int y, unsigned width, unsigned height,
+	int dst_x, int dst_y);
 };
 
+/* counters for tuning the video settings; not exact, as several
+ * threads update them without locking */
+#define RSTAT_HIST 10
+struct render_stats {
+  unsigned long frames;		/* graphics updates which remapped something */
+  unsigned long dropped;	/* update requests merged into a running one */
+  unsigned long faults;		/* write faults on the VGA memory */
+  unsigned long pages;		/* VGA pages which became dirty */
+  unsigned long long remap_bytes;	/* video memory remapped */
+  unsigned long long remap_us;
+  unsigned long blits;
+  unsigned long long blit_us;
+  /* number of frames / blits taking up to 32us, 64us, ... */
+  unsigned long remap_hist[RSTAT_HIST];
+  unsigned long blit_hist[RSTAT_HIST];
+  unsigned last_bytes, last_us;	/* of the last frame */
+};
+extern struct render_stats render_stats;
+void render_print_stats(void (*print)(const char *fmt, ...));
+void render_reset_stats(void);
+
 int register_render_system(struct render_system *render_system);
 enum { REMAP_DOSEMU, REMAP_PIXMAN };
 int register_remapper(struct remap_calls *calls, int prio);
@@ -33,6 +58,7 @@ int update_screen(void);
 void color_space_complete(ColorSpaceDesc *color_space);
 void render_blit(int x, int y, int width, int height);
 int render_is_updating(void);
+void render_frame_mark(void);
 void redraw_text_screen(void);
 void render_gain_focus(void);
 void render_lose_focus(void);
@@ -209,6 +209,7 @@ extern int pcm_start_input(void *id);
 extern void pcm_stop_input(void *id);
 extern void pcm_set_volume_cb(double (*get_vol)(int, int, int, void *));
 extern void pcm_set_connected_cb(int (*is_connected)(int, void *));
+extern void pcm_volume_changed(void);
 extern void pcm_set_checkid2_cb(int (*checkid2)(void *, void *));
 
 size_t pcm_data_get(void *data, size_t size, struct player_params *params);
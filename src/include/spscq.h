@@ -4,7 +4,11 @@
 void *spscq_init(unsigned size);
 void spscq_done(void *arg);
 void *spscq_write_area(void *arg, unsigned *r_len);
+void *spscq_try_write_area(void *arg, unsigned *r_len);
+unsigned spscq_write_tail(void *arg);
 void spscq_commit_write(void *arg, unsigned len);
+void *spscq_read_area(void *arg, unsigned *r_len);
+void spscq_commit_read(void *arg, unsigned len);
 int spscq_read(void *arg, void *buf, unsigned len);
 
 #endif
@@ -275,6 +275,8 @@ typedef struct {
   unsigned bank;			/* selected bank */
   unsigned char *dirty_map;		/* 1 == dirty */
   unsigned char *dirty_bitmap;		/* filled in by KVM */
+  uint16_t *sub_dirty;			/* written 256 byte chunks per page */
+  unsigned char *shadow;		/* contents at last update, for sub_dirty */
   unsigned char *prot_map0, *prot_map1;	/* prot flags per page */
   int planes;				/* 4 for PL4 and ModeX, 1 otherwise */
   int plane_pages;			/* pages per plane  */
@@ -31,6 +31,10 @@ struct text_system
 #define TEXTF_DISABLED 1
 #define TEXTF_BMAP_FONT 2
    unsigned flags;
+   /* optional: move a rect of cells to (dst_x, dst_y); returns 0 on
+    * success, or -1 to get the cells drawn instead */
+   int (*Copy_rect)(void *opaque, int x, int y, int width, int height,
+	int dst_x, int dst_y);
 };
 
 struct RemapObjectStruct;
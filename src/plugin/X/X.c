@@ -457,6 +457,7 @@ static int try_cube(unsigned long *, c_cube *);
 static void create_ximage(void);
 static void destroy_ximage(void);
 static void put_ximage(int, int, unsigned, unsigned);
+static void X_copy_rect(int, int, unsigned, unsigned, int, int);
 static void resize_ximage(unsigned, unsigned);
 static void X_set_resizable(Display *display, Window window, int on,
 	int x_res, int y_res);
@@ -520,6 +521,7 @@ struct render_system Render_X =
    X_unlock_canvas,
    "X",
    RENDF_DISABLED,
+   X_copy_rect,
 };
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -1536,6 +1538,20 @@ static int __X_handle_events(XEvent *e)
 	  }
 	  break;
 
+       case GraphicsExpose:
+	  /* parts of an X_copy_rect() source which were hidden */
+	  X_printf("X: graphics expose event\n");
+	  if(vga.mode_class == TEXT) {
+	    if(e->xgraphicsexpose.count == 0) X_redraw_text_screen();
+	  }
+	  else {
+	    put_ximage(
+	      e->xgraphicsexpose.x, e->xgraphicsexpose.y,
+	      e->xgraphicsexpose.width, e->xgraphicsexpose.height
+	    );
+	  }
+	  break;
+
 	case UnmapNotify:
 	  X_printf("X: window unmapped\n");
 	  is_mapped = FALSE;
@@ -2097,6 +2113,17 @@ void put_ximage(int x, int y, unsigned width, unsigned height)
 }
 
 
+/*
+ * Move part of the displayed image; the ximage was already moved.
+ */
+void X_copy_rect(int x, int y, unsigned width, unsigned height,
+	int dst_x, int dst_y)
+{
+  XCopyArea(display, drawwindow, drawwindow, gc, x, y, width, height,
+	    dst_x, dst_y);
+}
+
+
 /*
  * Resize an image.
  */
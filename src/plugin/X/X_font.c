@@ -217,6 +217,22 @@ static void X_set_text_palette(void *opaque, DAC_entry *col, int i)
 }
 
 
+/*
+ * Move a rect of cells within the window. The parts which were hidden
+ * come back as GraphicsExpose events and are redrawn from there.
+ */
+static int X_copy_text_rect(void *opaque, int x, int y, int width,
+    int height, int dst_x, int dst_y)
+{
+  XCopyArea(
+    text_display, text_window, text_window, text_gc,
+    font_width * x, font_height * y,
+    font_width * width, font_height * height,
+    font_width * dst_x, font_height * dst_y
+    );
+  return 0;
+}
+
 static struct text_system Text_X =
 {
    X_draw_string,
@@ -227,6 +243,8 @@ static struct text_system Text_X =
    X_text_unlock,
    NULL,
    "X_font",
+   0,
+   X_copy_text_rect,
 };
 
 /* Runs xset to load X fonts */
@@ -408,6 +426,7 @@ int X_handle_text_expose(void)
     XNextEvent(text_display, &e);
     switch(e.type) {
     case Expose:
+    case GraphicsExpose:
       X_printf("X: text_display expose event\n");
       ret = 1;
       break;
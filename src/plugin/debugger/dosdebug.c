@@ -223,6 +223,8 @@ static COMMAND cmds[] = {
    "ADDR              display the Device Driver Request Header at ADDR\n"},
   {"dpbs", NULL,
    "[ADDR]            display DPBs by walking the chain from LOL or ADDR\n"},
+  {"vstat", NULL,
+   "[reset]           display video statistics, then reset them if asked\n"},
   {"kill", db_kill,
    "                  Kill the dosemu process\n"},
   {"quit", db_quit,
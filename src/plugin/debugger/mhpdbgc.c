@@ -63,6 +63,7 @@
 #include "dis8086.h"
 #include "dos2linux.h"
 #include "kvm.h"
+#include "render.h"
 #include "Asm/ldt.h"
 
 #define MHP_PRIVATE
@@ -105,6 +106,7 @@ static void mhp_ddrh    (int, char *[]);
 static void mhp_dpbs    (int, char *[]);
 static void mhp_bplog   (int, char *[]);
 static void mhp_bclog   (int, char *[]);
+static void mhp_vstat   (int, char *[]);
 
 static void print_log_breakpoints(void);
 static int bpchk(unsigned int a1);
@@ -175,6 +177,7 @@ static const struct cmd_db cmdtab[] = {
    {"devs",          mhp_devs},
    {"ddrh",          mhp_ddrh},
    {"dpbs",          mhp_dpbs},
+   {"vstat",         mhp_vstat},
    {"",              NULL}
 };
 
@@ -1667,6 +1670,15 @@ static void mhp_dpbs(int argc, char *argv[])
   }
 }
 
+static void mhp_vstat(int argc, char *argv[])
+{
+  render_print_stats(mhp_printf);
+  if (argc > 1 && !strcmp(argv[1], "reset")) {
+    render_reset_stats();
+    mhp_printf("video statistics reset\n");
+  }
+}
+
 static void mhp_mode(int argc, char * argv[])
 {
    if (argc >=2) {
@@ -65,6 +65,8 @@ static void SDL_close(void);
 static int SDL_set_videomode(struct vid_mode_params vmp);
 static int SDL_update_screen(void);
 static void SDL_put_image(int x, int y, unsigned width, unsigned height);
+static void SDL_copy_rect(int x, int y, unsigned width, unsigned height,
+    int dst_x, int dst_y);
 static void SDL_change_mode(int x_res, int y_res, int w_x_res,
 			    int w_y_res);
 static void SDL_handle_events(void);
@@ -105,6 +107,7 @@ static struct render_system Render_SDL = {
   .lock = lock_surface,
   .unlock = unlock_surface,
   .name = "sdl",
+  .copy_rect = SDL_copy_rect,
 };
 
 static SDL_Renderer *renderer;
@@ -134,6 +137,7 @@ static SDL_Texture *texture_ttf;
 struct rect_desc {
   SDL_Rect rect;
   SDL_Texture *tex;
+  SDL_Rect src;		/* tex == NULL: move src to rect in the target */
 };
 static int font_width, font_height;
 static int win_width, win_height;
@@ -617,6 +621,17 @@ static SDL_Texture *CreateTextureTarget(int w, int h, int clean)
   return tex;
 }
 
+/* static texture with the current contents of r on the surface */
+static SDL_Texture *CreateTextureFromRect(const SDL_Rect *r)
+{
+  int offs = r->x * SDL_csd.bits / 8 + r->y * surface->pitch;
+  SDL_Texture *tex = SDL_CreateTexture(renderer, pixel_format,
+                                       SDL_TEXTUREACCESS_STATIC, r->w, r->h);
+  if (tex)
+    SDL_UpdateTexture(tex, NULL, surface->pixels + offs, surface->pitch);
+  return tex;
+}
+
 #if defined(HAVE_SDL2_TTF) && defined(HAVE_FONTCONFIG)
 
 static TTF_Font *do_open_font(int idx, int psize, int *w, int *h)
@@ -787,6 +802,22 @@ static void do_rend_rects(struct rng_s *rng, SDL_Texture *tex)
   SDL_SetRenderTarget(renderer, tex);
   pthread_mutex_lock(&rects_mtx);
   while ((rc = rng_get(rng, &d))) {
+    if (!d.tex) {
+      /* a texture can't be copied onto itself, so go via a temp one */
+      SDL_Texture *tmp = CreateTextureTarget(d.src.w, d.src.h, 0);
+      if (tmp) {
+        SDL_SetRenderTarget(renderer, tmp);
+        SDL_RenderCopy(renderer, tex, &d.src, NULL);
+        SDL_SetRenderTarget(renderer, tex);
+        SDL_RenderCopy(renderer, tmp, NULL, &d.rect);
+        SDL_DestroyTexture(tmp);
+        continue;
+      }
+      /* the surface was already moved: update the destination from it */
+      d.tex = CreateTextureFromRect(&d.rect);
+      if (!d.tex)
+        continue;
+    }
     SDL_RenderCopy(renderer, d.tex, NULL, &d.rect);
     SDL_DestroyTexture(d.tex);
   }
@@ -1016,7 +1047,6 @@ static int SDL_update_screen(void)
 
 static void SDL_put_image(int x, int y, unsigned width, unsigned height)
 {
-  int offs = x * SDL_csd.bits / 8 + y * surface->pitch;
   struct rect_desc d;
 
   d.rect.x = x;
@@ -1025,12 +1055,8 @@ static void SDL_put_image(int x, int y, unsigned width, unsigned height)
   d.rect.h = height;
 
   pthread_mutex_lock(&rend_mtx);
-  d.tex = SDL_CreateTexture(renderer,
-        pixel_format,
-        SDL_TEXTUREACCESS_STATIC,
-        width, height);
+  d.tex = CreateTextureFromRect(&d.rect);
   assert(d.tex);
-  SDL_UpdateTexture(d.tex, NULL, surface->pixels + offs, surface->pitch);
   pthread_mutex_lock(&rects_mtx);
   if (!rng_put(&rects_rng, &d)) {
     error("SDL: rects queue overflow\n");
@@ -1041,6 +1067,34 @@ static void SDL_put_image(int x, int y, unsigned width, unsigned height)
   pthread_mutex_unlock(&rend_mtx);
 }
 
+/* the surface was already moved; move the texture the same way */
+static void SDL_copy_rect(int x, int y, unsigned width, unsigned height,
+    int dst_x, int dst_y)
+{
+  struct rect_desc d;
+  int ok;
+
+  d.src.x = x;
+  d.src.y = y;
+  d.src.w = width;
+  d.src.h = height;
+  d.rect.x = dst_x;
+  d.rect.y = dst_y;
+  d.rect.w = width;
+  d.rect.h = height;
+  d.tex = NULL;
+
+  pthread_mutex_lock(&rend_mtx);
+  pthread_mutex_lock(&rects_mtx);
+  ok = rng_put(&rects_rng, &d);
+  if (ok)
+    tmp_rects_num++;
+  pthread_mutex_unlock(&rects_mtx);
+  pthread_mutex_unlock(&rend_mtx);
+  if (!ok)
+    SDL_put_image(dst_x, dst_y, width, height);
+}
+
 static void window_grab(int on, int kbd)
 {
   if (on) {
@@ -0,0 +1,122 @@
+/*
+ * Times the stream mixers of sndmix.c on synthetic streams, the way
+ * sndpcm.c uses them: every stream of a MIX_CHUNK frames chunk is added
+ * with its own volume matrix, then the sum is saturated. Checks that
+ * the SIMD mixers give the same samples as the generic one.
+ *
+ * usage: mix-bench [streams] [iterations]
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "sndmix.h"
+
+#define MIX_CHUNK 256
+#define CHUNKS 64
+#define MAX_STRMS 64
+#define MAX_MIXERS 8
+
+static sndbuf_t in[MAX_STRMS][CHUNKS * MIX_CHUNK][SNDBUF_CHANS];
+static mix_vol_t vol[MAX_STRMS];
+static sndbuf_t out[CHUNKS * MIX_CHUNK][SNDBUF_CHANS];
+
+static uint64_t fnv1a(const unsigned char *p, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (len--)
+    h = (h ^ *p++) * 0x100000001b3ULL;
+  return h;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* mix all chunks, returns the number of frames; odd chunk lengths
+ * exercise the tails of the kernels */
+static int mix_all(const struct pcm_mixer *m, int nstrm)
+{
+  int32_t acc[MIX_CHUNK][SNDBUF_CHANS];
+  int c, s, n, pos;
+
+  for (c = pos = 0; c < CHUNKS; c++, pos += n) {
+    n = (c & 7) == 7 ? MIX_CHUNK - c % 13 : MIX_CHUNK;
+    memset(acc, 0, n * sizeof(acc[0]));
+    for (s = 0; s < nstrm; s++)
+      m->mix(acc, &in[s][pos], n, vol[s]);
+    m->clip(&out[pos], acc, n);
+  }
+  return pos;
+}
+
+int main(int argc, char **argv)
+{
+  const struct pcm_mixer *mixers[MAX_MIXERS];
+  int nstrm = argc > 1 ? atoi(argv[1]) : 4;
+  int iter = argc > 2 ? atoi(argv[2]) : 1000;
+  int nmix, frames, i, j, k, ret = 0;
+  uint64_t h, ref = 0;
+  double t;
+
+  if (nstrm < 1 || nstrm > MAX_STRMS) {
+    fprintf(stderr, "streams must be 1..%i\n", MAX_STRMS);
+    return 2;
+  }
+  srand(1);
+  for (i = 0; i < nstrm; i++) {
+    for (j = 0; j < CHUNKS * MIX_CHUNK; j++)
+      for (k = 0; k < SNDBUF_CHANS; k++)
+        in[i][j][k] = rand();
+    /* the full volume range, with some of the usual 0 and 1 */
+    for (j = 0; j < SNDBUF_CHANS; j++)
+      for (k = 0; k < SNDBUF_CHANS; k++)
+        switch (rand() % 4) {
+        case 0:
+          vol[i][j][k] = 0;
+          break;
+        case 1:
+          vol[i][j][k] = MIX_VOL_ONE;
+          break;
+        default:
+          vol[i][j][k] = pcm_mix_vol(rand() / (RAND_MAX / 2.3));
+          break;
+        }
+  }
+  /* the extremes */
+  in[0][0][0] = INT16_MIN;
+  in[0][0][1] = INT16_MAX;
+  vol[0][0][0] = vol[0][1][1] = pcm_mix_vol(2.3);
+
+  nmix = pcm_mixer_list(mixers, MAX_MIXERS);
+  for (i = 0; i < nmix; i++) {
+    memset(out, 0, sizeof(out));
+    frames = mix_all(mixers[i], nstrm);
+    h = fnv1a((const unsigned char *)out, sizeof(out));
+
+    t = now();
+    for (j = 0; j < iter; j++)
+      mix_all(mixers[i], nstrm);
+    t = now() - t;
+
+    printf("%-8s %2d streams %8.1f Mframes/s", mixers[i]->name, nstrm,
+           (double)frames * iter / t / 1e6);
+    if (i == 0) {
+      ref = h;
+      printf("\n");
+    } else if (h != ref) {
+      printf("  DIFFERS from generic\n");
+      ret = 1;
+    } else
+      printf("  same as generic\n");
+  }
+  return ret;
+}
@@ -0,0 +1,324 @@
+/*
+ * Renders OPL register dumps to PCM with opl.c, to check that changes to
+ * the synthesis keep its output bit-exact.
+ *
+ * usage: opl-render [-r rate] [-n iterations] [-g]
+ *        opl-render [-r rate] [-o out.pcm] [-c ref.pcm] file.dro
+ *
+ * Without a file, renders the built-in songs, which are made of random
+ * patches, notes and register writes covering the OPL2, OPL3, 4-op and
+ * percussion modes, and compares the hashes of their PCM with the ones
+ * of the reference synthesis; -g prints the hashes instead, -n renders
+ * them several times and reports the speed. The hashes are for 44100Hz.
+ * The percussion uses rand(), so the ones of the songs with percussion
+ * only hold for glibc.
+ *
+ * With a file, renders a DOSBox raw OPL capture (DRO v2), writes the
+ * stereo S16 samples to out.pcm and/or compares them with ref.pcm.
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "types.h"
+#include "opl.h"
+
+#define MAX_CHUNK 700
+
+struct song {
+  const char *name;
+  unsigned seed;
+  int flags;
+  int seconds;
+  uint64_t hash;
+};
+
+#define S_OPL3 1	/* OPL3 mode, both register sets */
+#define S_4OP 2		/* 4-op channels */
+#define S_PERC 4	/* percussion mode */
+#define S_FUZZ 8	/* random writes to any register */
+
+static const struct song songs[] = {
+  { "opl2", 1, 0, 20, 0x5204bd8e00b8d5ddULL },
+  { "opl2-perc", 2, S_PERC, 20, 0x93f45bb39811b88dULL },
+  { "opl3", 3, S_OPL3, 20, 0x7867b696d449f532ULL },
+  { "opl3-4op", 4, S_OPL3 | S_4OP, 20, 0xb3337297d5e5f041ULL },
+  { "opl3-4op-perc", 5, S_OPL3 | S_4OP | S_PERC, 20, 0xe7fdddc4ee236551ULL },
+  { "fuzz", 6, S_OPL3 | S_4OP | S_PERC | S_FUZZ, 20, 0xfdbe55ba606e7af7ULL },
+};
+
+static int16_t buf[MAX_CHUNK][2];
+
+static unsigned lcg;
+
+static unsigned rnd(unsigned n)
+{
+  lcg = lcg * 1103515245 + 12345;
+  return (lcg >> 8) % n;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  while (len--)
+    h = (h ^ *p++) * 0x100000001b3ULL;
+  return h;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct out {
+  uint64_t hash;
+  long frames;
+  FILE *wr;
+  FILE *ref;
+  long diff;		/* first frame that differs from ref, or -1 */
+};
+
+/* generate nframes, in chunks of the odd sizes adlib.c asks for */
+static void render(struct out *o, long nframes)
+{
+  int16_t ref[MAX_CHUNK][2];
+  int n, i;
+
+  while (nframes > 0) {
+    n = 1 + rnd(MAX_CHUNK);
+    if (n > nframes)
+      n = nframes;
+    opl_getsample(&buf[0][0], n);
+    o->hash = fnv1a(o->hash, buf, n * sizeof(buf[0]));
+    if (o->wr)
+      fwrite(buf, sizeof(buf[0]), n, o->wr);
+    if (o->ref && o->diff < 0) {
+      if (fread(ref, sizeof(ref[0]), n, o->ref) != n)
+        o->diff = o->frames;
+      for (i = 0; i < n && o->diff < 0; i++) {
+        if (memcmp(ref[i], buf[i], sizeof(buf[i])))
+          o->diff = o->frames + i;
+      }
+    }
+    o->frames += n;
+    nframes -= n;
+  }
+}
+
+static void write_op(unsigned base, unsigned op)
+{
+  static const unsigned char opofs[18] = {
+    0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, 16, 17, 18, 19, 20, 21
+  };
+  unsigned r = base + opofs[op];
+
+  opl_write(0x20 + r, rnd(256));
+  /* mostly audible levels */
+  opl_write(0x40 + r, rnd(4) ? rnd(4) << 6 | rnd(32) : rnd(256));
+  opl_write(0x60 + r, rnd(256));
+  opl_write(0x80 + r, rnd(256));
+  opl_write(0xe0 + r, rnd(8));
+}
+
+/* a random patch on channel ch of the register set base */
+static void write_patch(unsigned base, int ch)
+{
+  int mod = ch / 3 * 6 + ch % 3;
+
+  write_op(base, mod);
+  write_op(base, mod + 3);
+  opl_write(base + 0xc0 + ch, rnd(256));
+}
+
+static void key_on(unsigned base, int ch)
+{
+  opl_write(base + 0xa0 + ch, rnd(256));
+  opl_write(base + 0xb0 + ch, 0x20 | rnd(32));
+}
+
+static void play_song(const struct song *s, int rate, struct out *o)
+{
+  long t, end = (long)s->seconds * rate;
+  unsigned base;
+  int ch, nchan;
+
+  lcg = s->seed;
+  srand(1);
+  opl_init(rate);
+  if (s->flags & S_OPL3)
+    opl_write(0x105, 1);
+  opl_write(0x01, 0x20);
+  nchan = (s->flags & S_OPL3) ? 18 : 9;
+  for (t = 0; t < end; ) {
+    long d = rnd(4) ? rnd(rate / 20) : rnd(rate);
+
+    render(o, d);
+    t += d;
+    ch = rnd(nchan);
+    base = ch >= 9 ? 0x100 : 0;
+    ch %= 9;
+    switch (rnd(8)) {
+    case 0:
+      opl_write(base + 0xb0 + ch, rnd(32));	/* key off */
+      break;
+    case 1:
+      if (s->flags & S_4OP)
+        opl_write(0x104, rnd(64));
+      break;
+    case 2:
+      /* percussion bits, LFO depths */
+      opl_write(0xbd, (s->flags & S_PERC) && rnd(2) ? 0x20 | rnd(256) :
+          rnd(256) & 0xc0);
+      break;
+    case 3:
+      if (s->flags & S_FUZZ) {
+        int i;
+        for (i = rnd(16); i; i--)
+          opl_write(((s->flags & S_OPL3) ? rnd(2) << 8 : 0) | (0x20 +
+              rnd(0xd6)), rnd(256));
+      }
+      break;
+    default:
+      write_patch(base, ch);
+      key_on(base, ch);
+      break;
+    }
+  }
+  render(o, end - o->frames);
+}
+
+/* a DOSBox raw OPL capture, version 2 */
+static int play_dro(const char *name, int rate, struct out *o)
+{
+  unsigned char hdr[26], map[128], ev[2];
+  FILE *f = fopen(name, "rb");
+  unsigned pairs, i, reg, maplen;
+  double delay = 0;
+
+  if (!f) {
+    perror(name);
+    return -1;
+  }
+  if (fread(hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr, "DBRAWOPL", 8) ||
+      hdr[8] != 2 || hdr[9] || hdr[21] || hdr[22] ||
+      (maplen = hdr[25]) > 128 || fread(map, maplen, 1, f) != 1) {
+    fprintf(stderr, "%s: not a DRO v2 file\n", name);
+    fclose(f);
+    return -1;
+  }
+  pairs = hdr[12] | hdr[13] << 8 | hdr[14] << 16 | hdr[15] << 24;
+
+  lcg = 1;
+  srand(1);
+  opl_init(rate);
+  for (i = 0; i < pairs && fread(ev, 2, 1, f) == 1; i++) {
+    if (ev[0] == hdr[23] || ev[0] == hdr[24]) {
+      delay += (ev[0] == hdr[23] ? ev[1] + 1 : (ev[1] + 1) << 8) *
+          (rate / 1000.0);
+      render(o, (long)delay);
+      delay -= (long)delay;
+      continue;
+    }
+    if ((ev[0] & 0x7f) >= maplen)
+      continue;
+    reg = map[ev[0] & 0x7f] | (ev[0] & 0x80 ? 0x100 : 0);
+    opl_write(reg, ev[1]);
+  }
+  fclose(f);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct out o;
+  const char *wr = NULL, *ref = NULL;
+  int rate = 44100, iter = 0, gen = 0, c, i, j, ret = 0;
+  double t;
+
+  while ((c = getopt(argc, argv, "r:n:go:c:")) != -1) {
+    switch (c) {
+    case 'r':
+      rate = atoi(optarg);
+      break;
+    case 'n':
+      iter = atoi(optarg);
+      break;
+    case 'g':
+      gen = 1;
+      break;
+    case 'o':
+      wr = optarg;
+      break;
+    case 'c':
+      ref = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-r rate] [-n iterations] [-g]\n"
+          "       %s [-r rate] [-o out.pcm] [-c ref.pcm] file.dro\n",
+          argv[0], argv[0]);
+      return 2;
+    }
+  }
+
+  if (optind < argc) {
+    memset(&o, 0, sizeof(o));
+    o.hash = 0xcbf29ce484222325ULL;
+    o.diff = -1;
+    if ((wr && !(o.wr = fopen(wr, "wb"))) ||
+        (ref && !(o.ref = fopen(ref, "rb")))) {
+      perror(wr && !o.wr ? wr : ref);
+      return 2;
+    }
+    if (play_dro(argv[optind], rate, &o))
+      return 2;
+    printf("%s: %ld frames, hash %016llx\n", argv[optind], o.frames,
+        (unsigned long long)o.hash);
+    if (o.ref) {
+      int16_t x;
+      if (o.diff < 0 && fread(&x, sizeof(x), 1, o.ref) == 1)
+        o.diff = o.frames;
+      if (o.diff >= 0) {
+        printf("differs from %s at frame %ld\n", ref, o.diff);
+        ret = 1;
+      } else {
+        printf("same as %s\n", ref);
+      }
+      fclose(o.ref);
+    }
+    if (o.wr)
+      fclose(o.wr);
+    return ret;
+  }
+
+  for (i = 0; i < sizeof(songs) / sizeof(songs[0]); i++) {
+    memset(&o, 0, sizeof(o));
+    o.hash = 0xcbf29ce484222325ULL;
+    t = now();
+    for (j = 0; j < (iter ?: 1); j++) {
+      o.hash = 0xcbf29ce484222325ULL;
+      o.frames = 0;
+      play_song(&songs[i], rate, &o);
+    }
+    t = now() - t;
+    printf("%-14s %016llx", songs[i].name, (unsigned long long)o.hash);
+    if (iter)
+      printf(" %7.2f Mframes/s", (double)o.frames * iter / t / 1e6);
+    if (gen || rate != 44100) {
+      printf("\n");
+    } else if (o.hash != songs[i].hash) {
+      printf("  DIFFERS\n");
+      ret = 1;
+    } else {
+      printf("  ok\n");
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,266 @@
+/*
+ * Times every registered remap function on synthetic frames, and checks
+ * that the optimized ones (RFF_OPT_PENTIUM) give the same pixels as the
+ * generic function for the same modes, flags and scale. Every SIMD set
+ * the CPU can run is tried, not only the one remap.c would pick;
+ * -s restricts them to one set.
+ *
+ * usage: remap-bench [-s sse2|avx2] [iterations]
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "remap.h"
+#include "remap_priv.h"
+#include "render.h"
+
+#define SRC_W 320
+#define SRC_H 200
+#define MAX_SCALE 3
+#define MAX_DESC 256
+
+/* what remap.c needs from the rest of dosemu */
+static struct remap_calls *calls;
+
+int register_remapper(struct remap_calls *rc, int prio)
+{
+  if (prio == REMAP_DOSEMU)
+    calls = rc;
+  return 0;
+}
+
+int find_supported_modes(unsigned dst_mode)
+{
+  return 0;
+}
+
+void dirty_all_vga_colors(void)
+{
+}
+
+void error(const char *fmt, ...)
+{
+}
+
+extern RemapFuncDesc *(*remap_list_funcs[])(void);
+
+static const struct {
+  int mode, bytes;
+  const char *name;
+} src_modes[] = {
+  { MODE_PSEUDO_8, 1, "8" },
+  { MODE_TRUE_15, 2, "15" },
+  { MODE_TRUE_16, 2, "16" },
+  { MODE_TRUE_24, 3, "24" },
+  { MODE_TRUE_32, 4, "32" },
+};
+
+static const struct {
+  int mode, bytes;
+  const char *name;
+  ColorSpaceDesc csd;
+} dst_modes[] = {
+  { MODE_TRUE_15, 2, "15", { 15, 0x7c00, 0x3e0, 0x1f, 10, 5, 0, 5, 5, 5, NULL } },
+  { MODE_TRUE_16, 2, "16", { 16, 0xf800, 0x7e0, 0x1f, 11, 5, 0, 5, 6, 5, NULL } },
+  { MODE_TRUE_24, 3, "24", { 24, 0xff0000, 0xff00, 0xff, 16, 8, 0, 8, 8, 8, NULL } },
+  { MODE_TRUE_32, 4, "32", { 32, 0xff0000, 0xff00, 0xff, 16, 8, 0, 8, 8, 8, NULL } },
+};
+
+/* destination sizes tried for the scale flags */
+static const struct {
+  unsigned flag;
+  int w, h;
+} sizes[] = {
+  { RFF_SCALE_1, SRC_W, SRC_H },
+  { RFF_SCALE_2, SRC_W * 2, SRC_H * 2 },
+  { RFF_SCALE_ALL, SRC_W * 2, SRC_H * 2 },
+  { RFF_SCALE_ALL, SRC_W * 3, SRC_H * 3 },
+  { RFF_SCALE_ALL, 640, 480 },
+};
+
+/* results of the generic functions, to compare against */
+static struct {
+  int src, dst, size;
+  unsigned flags;
+  uint64_t hash;
+} ref[MAX_DESC * 5];
+static int nref;
+
+static unsigned char src_img[SRC_W * SRC_H * 4 + 4096];
+static unsigned char dst_img[SRC_W * MAX_SCALE * SRC_H * MAX_SCALE * 4];
+static unsigned pal[256][3];
+
+static uint64_t fnv1a(const unsigned char *p, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (len--)
+    h = (h ^ *p++) * 0x100000001b3ULL;
+  return h;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int lowest(const void *tab, size_t n, size_t stride, int modes)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (*(const int *)((const char *)tab + i * stride) & modes)
+      return i;
+  return -1;
+}
+
+/* run rfd for one mode combination and size; returns 1 if the result
+ * differs from the generic function's */
+static int bench(RemapFuncDesc *rfd, int s, int d, int z, int iter)
+{
+  struct bitmap_desc src = BMP(src_img, SRC_W, SRC_H, SRC_W * src_modes[s].bytes);
+  struct bitmap_desc dst = BMP(dst_img, sizes[z].w, sizes[z].h,
+			       sizes[z].w * dst_modes[d].bytes);
+  unsigned filt = rfd->flags & (RFF_LIN_FILT | RFF_BILIN_FILT);
+  unsigned flags = rfd->flags & ~RFF_OPT_PENTIUM;
+  void *obj;
+  RemapObject *ro;
+  double t;
+  uint64_t h;
+  int i;
+
+  obj = calls->init(dst_modes[d].mode, filt, &dst_modes[d].csd, 100);
+  /* creates the real object for the source mode */
+  calls->remap_rect(obj, src, src_modes[s].mode, 0, 0, SRC_W, SRC_H, dst);
+  ro = *(RemapObject **)obj;
+
+  /* force rfd for this size */
+  ro->func_all = ro->func_1 = ro->func_2 = rfd;
+  ro->state &= ~(ROS_SCALE_ALL | ROS_SCALE_1 | ROS_SCALE_2);
+  if (rfd->flags & RFF_SCALE_ALL)
+    ro->state |= ROS_SCALE_ALL;
+  if (rfd->flags & RFF_SCALE_1)
+    ro->state |= ROS_SCALE_1;
+  if (rfd->flags & RFF_SCALE_2)
+    ro->state |= ROS_SCALE_2;
+  ro->src_resize(ro, SRC_W + 1, SRC_H, src.scan_len);
+  ro->src_resize(ro, SRC_W, SRC_H, src.scan_len);
+  if (ro->remap_func != rfd->func) {
+    calls->done(obj);
+    return 0;
+  }
+  for (i = 0; i < 256; i++)
+    calls->palette_update(obj, i, 8, pal[i][0], pal[i][1], pal[i][2]);
+
+  memset(dst_img, 0, sizeof(dst_img));
+  calls->remap_rect(obj, src, src_modes[s].mode, 0, 0, SRC_W, SRC_H, dst);
+  h = fnv1a(dst_img, dst.height * dst.scan_len);
+
+  t = now();
+  for (i = 0; i < iter; i++)
+    calls->remap_rect(obj, src, src_modes[s].mode, 0, 0, SRC_W, SRC_H, dst);
+  t = now() - t;
+  calls->done(obj);
+
+  printf("%-24s %2s->%-2s %4dx%-4d %8.1f Mpix/s", rfd->func_name,
+	 src_modes[s].name, dst_modes[d].name, dst.width, dst.height,
+	 (double)dst.width * dst.height * iter / t / 1e6);
+
+  if (!(rfd->flags & RFF_OPT_PENTIUM)) {
+    ref[nref].src = s;
+    ref[nref].dst = d;
+    ref[nref].size = z;
+    ref[nref].flags = flags;
+    ref[nref].hash = h;
+    nref++;
+  } else {
+    for (i = 0; i < nref; i++)
+      if (ref[i].src == s && ref[i].dst == d && ref[i].size == z &&
+	  ref[i].flags == flags)
+	break;
+    if (i == nref)
+      printf("  (no generic function)");
+    else if (ref[i].hash != h) {
+      printf("  DIFFERS from generic\n");
+      return 1;
+    } else
+      printf("  same as generic");
+  }
+  printf("\n");
+  return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static const char *simd_sets[] = { "sse2", "avx2" };
+#endif
+
+int main(int argc, char **argv)
+{
+  RemapFuncDesc *descs[MAX_DESC], *rfd;
+  const char *set = NULL;
+  int iter, n = 0, i, j, s, d, z, pass, ret = 0;
+
+  while ((i = getopt(argc, argv, "s:")) != -1) {
+    if (i != 's') {
+      fprintf(stderr, "usage: %s [-s sse2|avx2] [iterations]\n", argv[0]);
+      return 2;
+    }
+    set = optarg;
+  }
+  iter = optind < argc ? atoi(argv[optind]) : 100;
+
+  /* take the lists before remap.c chains them together */
+  for (i = 0; remap_list_funcs[i]; i++) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (remap_list_funcs[i] == remap_simd)
+      continue;
+#endif
+    for (rfd = remap_list_funcs[i](); rfd && n < MAX_DESC; rfd = rfd->next)
+      descs[n++] = rfd;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  for (i = 0; i < sizeof(simd_sets) / sizeof(*simd_sets); i++) {
+    if (set && strcmp(set, simd_sets[i]))
+      continue;
+    rfd = remap_simd_set(simd_sets[i]);
+    printf("%s: %s\n", simd_sets[i], rfd ? "available" : "not supported by this CPU");
+    for (; rfd && n < MAX_DESC; rfd = rfd->next)
+      descs[n++] = rfd;
+  }
+#endif
+
+  srand(1);
+  for (i = 0; i < sizeof(src_img); i++)
+    src_img[i] = rand();
+  for (i = 0; i < 256; i++)
+    for (j = 0; j < 3; j++)
+      pal[i][j] = rand() & 0xff;
+
+  /* generic functions first, so the optimized ones can be compared */
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; i < n; i++) {
+      rfd = descs[i];
+      if (!(rfd->flags & RFF_OPT_PENTIUM) != !pass)
+	continue;
+      s = lowest(src_modes, sizeof(src_modes) / sizeof(*src_modes),
+		 sizeof(*src_modes), rfd->src_mode);
+      if (s < 0)
+	continue;
+      for (d = 0; d < sizeof(dst_modes) / sizeof(*dst_modes); d++) {
+	if (!(rfd->dst_mode & dst_modes[d].mode))
+	  continue;
+	for (z = 0; z < sizeof(sizes) / sizeof(*sizes); z++)
+	  if (rfd->flags & sizes[z].flag)
+	    ret |= bench(rfd, s, d, z, iter);
+      }
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,243 @@
+/*
+ * Times the simx86 interpreter on a real mode integer loop, with the
+ * simulator backend (config.cpusim), where the decoder runs for every
+ * instruction. Reports MIPS from the best of the runs.
+ *
+ * The rest of dosemu is stubbed out below: guest memory is a flat
+ * buffer, and do_read_xxx/do_write_xxx are plain loads and stores, as
+ * on a hit in the soft TLB of dos2linux.c. Protected mode, VGA and I/O
+ * are not exercised.
+ *
+ * usage: interp-bench [runs]
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "emu.h"
+#include "cpu.h"
+#include "memory.h"
+#include "dos2linux.h"
+#include "port.h"
+#include "vgaemu.h"
+#include "utilities.h"
+#include "dosemu_config.h"
+#include "mapping.h"
+#include "cpu-emu.h"
+
+#define CODE_SEG 0x1000
+#define STACK_SEG 0x2000
+#define DATA_SEG 0x3000
+
+/*
+ *	mov	$200,%dx
+ * outer:
+ *	xor	%si,%si
+ *	mov	$0x8000,%di
+ *	mov	$1024,%cx
+ * inner:
+ *	lodsw
+ *	add	%bx,%ax
+ *	xor	$0x5a5a,%ax
+ *	mov	%ax,(%di)
+ *	add	$2,%di
+ *	call	sub1
+ *	adc	%ax,%bx
+ *	loop	inner
+ *	mov	$256,%cx
+ * l32:
+ *	add	%ebx,%eax
+ *	shl	$1,%eax
+ *	mov	%eax,4(%bp,%si)
+ *	inc	%si
+ *	loop	l32
+ *	dec	%dx
+ *	jnz	outer
+ *	int3
+ * sub1:
+ *	push	%ax
+ *	mov	(%bx,%si),%ax
+ *	shr	$1,%ax
+ *	pop	%ax
+ *	ret
+ */
+static const unsigned char guest[] = {
+  0xba, 0xc8, 0x00, 0x31, 0xf6, 0xbf, 0x00, 0x80, 0xb9, 0x00, 0x04, 0xad,
+  0x01, 0xd8, 0x35, 0x5a, 0x5a, 0x89, 0x05, 0x83, 0xc7, 0x02, 0xe8, 0x18,
+  0x00, 0x11, 0xc3, 0xe2, 0xee, 0xb9, 0x00, 0x01, 0x66, 0x01, 0xd8, 0x66,
+  0xd1, 0xe0, 0x66, 0x89, 0x42, 0x04, 0x46, 0xe2, 0xf3, 0x4a, 0x75, 0xd3,
+  0xcc, 0x50, 0x8b, 0x00, 0xd1, 0xe8, 0x58, 0xc3,
+};
+/* instructions executed by one run of guest */
+#define GUEST_INSNS (1 + 200 * (3 + 1024 * 13 + 1 + 256 * 5 + 2) + 1)
+
+/* what simx86 needs from the rest of dosemu */
+struct config_info config;
+vga_type vga;
+__TLS union vm86_union vm86u;
+emu_fpstate vm86_fpu_state __attribute__((aligned(16)));
+fenv_t dosemu_fenv;
+unsigned char *mem_base;
+uintptr_t mem_base_mask = ~(uintptr_t)0;
+unsigned char debug_levels[DEBUG_CLASSES];
+FILE *dbg_fd;
+volatile __thread int fault_cnt;
+volatile int in_vm86;
+unsigned char emu_io_bitmap[65536 / 8];
+char *dosemu_localdir_path = "/tmp";
+int BarrierHits;
+
+uint8_t do_read_byte(dosaddr_t a, sim_pagefault_handler_t h)
+{
+  return mem_base[a];
+}
+
+uint16_t do_read_word(dosaddr_t a, sim_pagefault_handler_t h)
+{
+  uint16_t v;
+  memcpy(&v, mem_base + a, sizeof(v));
+  return v;
+}
+
+uint32_t do_read_dword(dosaddr_t a, sim_pagefault_handler_t h)
+{
+  uint32_t v;
+  memcpy(&v, mem_base + a, sizeof(v));
+  return v;
+}
+
+uint64_t do_read_qword(dosaddr_t a, sim_pagefault_handler_t h)
+{
+  uint64_t v;
+  memcpy(&v, mem_base + a, sizeof(v));
+  return v;
+}
+
+void do_write_byte(dosaddr_t a, uint8_t v, sim_pagefault_handler_t h)
+{
+  mem_base[a] = v;
+}
+
+void do_write_word(dosaddr_t a, uint16_t v, sim_pagefault_handler_t h)
+{
+  memcpy(mem_base + a, &v, sizeof(v));
+}
+
+void do_write_dword(dosaddr_t a, uint32_t v, sim_pagefault_handler_t h)
+{
+  memcpy(mem_base + a, &v, sizeof(v));
+}
+
+void do_write_qword(dosaddr_t a, uint64_t v, sim_pagefault_handler_t h)
+{
+  memcpy(mem_base + a, &v, sizeof(v));
+}
+
+void *dosaddr_to_unixaddr(dosaddr_t a) { return mem_base + a; }
+void *dosaddr_to_unixaddr_run(dosaddr_t a, int len, int w) { return mem_base + a; }
+dosaddr_t physaddr_to_dosaddr(unsigned a, int len) { return a; }
+void invalidate_unprotected_page_cache(dosaddr_t a, int len) {}
+int memcheck_is_rom(dosaddr_t a) { return 0; }
+bool mmio_check(dosaddr_t a) { return 0; }
+int mprotect_mapping(int cap, dosaddr_t t, size_t s, int p) { return 0; }
+void *dlmalloc(size_t n) { return malloc(n); }
+void *dlrealloc(void *p, size_t n) { return realloc(p, n); }
+void dlfree(void *p) { free(p); }
+char *assemble_path(const char *d, const char *f) { return strdup(f); }
+void dosemu_error(const char *fmt, ...) {}
+int log_printf(int f, const char *fmt, ...) { return 0; }
+int dis_8086(unsigned int a, char *b, int c, unsigned int *d, unsigned int e)
+{
+  *b = 0;
+  return 1;
+}
+void __leavedos_main_wrp(int code, int sig, const char *s, int ln) { exit(code); }
+void leavedos_from_sig(int sig) { exit(1); }
+Bit8u port_inb(ioport_t p) { return 0xff; }
+Bit16u port_inw(ioport_t p) { return 0xffff; }
+Bit32u port_ind(ioport_t p) { return 0xffffffff; }
+void port_outb(ioport_t p, Bit8u v) {}
+void port_outw(ioport_t p, Bit16u v) {}
+void port_outd(ioport_t p, Bit32u v) {}
+int VGA_emulate_inb(ioport_t p, void *arg) { return -1; }
+int VGA_emulate_outb(ioport_t p, Bit8u v, void *arg) { return -1; }
+int vga_access(dosaddr_t r, dosaddr_t w) { return 0; }
+int vga_emu_protect_page(unsigned p, int prot) { return 0; }
+int vga_read_access(dosaddr_t m) { return 0; }
+int vga_write_access(dosaddr_t m) { return 0; }
+uint8_t *dpmi_get_ldt_buffer(void) { static uint8_t ldt[65536]; return ldt; }
+int dpmi_is_valid_range(dosaddr_t a, int len) { return 1; }
+int dpmi_read_access(dosaddr_t a) { return 1; }
+int dpmi_write_access(dosaddr_t a) { return 1; }
+int msdos_ldt_access(dosaddr_t cr2) { return 0; }
+void msdos_ldt_write(cpuctx_t *scp, uint32_t op, int len, dosaddr_t cr2) {}
+
+/* not reached by the guest */
+void default_sim_pagefault_handler(dosaddr_t a, int err, uint32_t op, int len) { abort(); }
+int vm86_fault(unsigned trapno, unsigned err, dosaddr_t cr2) { abort(); }
+int vga_emu_fault(dosaddr_t a, unsigned e, cpuctx_t *scp) { abort(); }
+unsigned char vga_read(unsigned a) { abort(); }
+unsigned short vga_read_word(unsigned a) { abort(); }
+unsigned vga_read_dword(unsigned a) { abort(); }
+void vga_write(unsigned a, unsigned char v) { abort(); }
+void vga_write_word(unsigned a, unsigned short v) { abort(); }
+void vga_write_dword(dosaddr_t a, unsigned v) { abort(); }
+void vga_memset(unsigned d, unsigned char v, size_t l) { abort(); }
+void vga_memsetw(unsigned d, unsigned short v, size_t l) { abort(); }
+void vga_memsetl(unsigned d, unsigned v, size_t l) { abort(); }
+void *SEL_ADR(unsigned short sel, unsigned int reg) { abort(); }
+unsigned int GetSegmentBase(unsigned short sel) { abort(); }
+int DPMIValidSelector(unsigned short s) { abort(); }
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  int runs = argc > 1 ? atoi(argv[1]) : 5;
+  double t, best = 0;
+  int i, ret;
+
+  mem_base = mmap(NULL, 0x110000, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem_base == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  memcpy(mem_base + (CODE_SEG << 4), guest, sizeof(guest));
+  config.cpusim = 1;
+  config.cpu_vm = CPUVM_EMU;
+  vm86s.cpu_type = CPU_586;
+  init_emu_cpu();
+
+  for (i = 0; i < runs; i++) {
+    memset(&vm86s.regs, 0, sizeof(vm86s.regs));
+    SREG(cs) = CODE_SEG;
+    SREG(ss) = STACK_SEG;
+    SREG(ds) = SREG(es) = DATA_SEG;
+    REG(esp) = 0xfffe;
+    REG(eflags) = 0x202;
+    t = now();
+    ret = e_vm86();
+    t = now() - t;
+    /* the guest ends with int3 */
+    if (ret != VM86_TRAP + (3 << 8) || LWORD(eip) != sizeof(guest) - 7) {
+      printf("unexpected exit %#x at %04x:%04x\n", ret, SREG(cs), LWORD(eip));
+      return 1;
+    }
+    if (!i || t < best)
+      best = t;
+  }
+  printf("%.1f MIPS, ax=%04x bx=%04x\n", GUEST_INSNS / best / 1e6,
+	 LWORD(eax), LWORD(ebx));
+  return 0;
+}